@@ -612,16 +612,21 @@ static config_var_t option_vars_[] = {
   V(SafeSocks,                   BOOL,     "0"),
   V(ServerDNSAllowBrokenConfig,  BOOL,     "1"),
   V(ServerDNSAllowNonRFC953Hostnames, BOOL,"0"),
+  V(ServerDNSCacheMaxSize,       MEMUNIT,  "32 MB"),
   V(ServerDNSDetectHijacking,    BOOL,     "1"),
+  V(ServerDNSMaxInflight,        UINT,     "256"),
   V(ServerDNSRandomizeCase,      BOOL,     "1"),
   V(ServerDNSResolvConfFile,     STRING,   NULL),
   V(ServerDNSSearchDomains,      BOOL,     "0"),
   V(ServerDNSTestAddresses,      CSV,
       "www.google.com,www.mit.edu,www.yahoo.com,www.slashdot.org"),
+  V(ServerDNSThreads,            UINT,     "0"),
   OBSOLETE("SchedulerLowWaterMark__"),
   OBSOLETE("SchedulerHighWaterMark__"),
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
+  V(KISTSchedShards,             UINT,     "1"),
+  V(KISTSockDiag,                BOOL,     "0"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
@@ -635,6 +640,7 @@ static config_var_t option_vars_[] = {
   V(StrictNodes,                 BOOL,     "0"),
   OBSOLETE("Support022HiddenServices"),
   V(TestSocks,                   BOOL,     "0"),
+  V(ThreadedRelayCrypto,         BOOL,     "0"),
   V(TokenBucketRefillInterval,   MSEC_INTERVAL, "100 msec"),
   OBSOLETE("Tor2webMode"),
   OBSOLETE("Tor2webRendezvousPoints"),
@@ -2404,7 +2410,7 @@ options_act(const or_options_t *old_options)
     dos_init();
   } else if (old_options && public_server_mode(old_options)) {
     /* Going from relay to non relay, clean it up. */
-    dos_free_all();
+    dos_free_mitigations();
   }
 
   /* Load the webpage we're going to serve every time someone asks for '/' on
@@ -3277,6 +3283,12 @@ options_validate_scheduler(or_options_t *options, char **msg)
     return -1;
   }
 
+  if (options->KISTSchedShards > KIST_SCHED_SHARDS_MAX) {
+    tor_asprintf(msg, "KISTSchedShards must not be more than %d",
+                 KIST_SCHED_SHARDS_MAX);
+    return -1;
+  }
+
   return 0;
 }
 
@@ -3599,6 +3611,18 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->ServerDNSThreads > SERVER_DNS_THREADS_MAX) {
+    tor_asprintf(msg, "ServerDNSThreads must not be more than %d",
+                 SERVER_DNS_THREADS_MAX);
+    return -1;
+  }
+
+  if (options->ServerDNSMaxInflight > SERVER_DNS_MAX_INFLIGHT_MAX) {
+    tor_asprintf(msg, "ServerDNSMaxInflight must not be more than %d",
+                 SERVER_DNS_MAX_INFLIGHT_MAX);
+    return -1;
+  }
+
   if (options->PathsNeededToBuildCircuits >= 0.0) {
     if (options->PathsNeededToBuildCircuits < 0.25) {
       log_warn(LD_CONFIG, "PathsNeededToBuildCircuits is too low. Increasing "
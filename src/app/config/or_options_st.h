@@ -389,6 +389,9 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, and we're a relay, do the relay cell cryptography for our
+   * circuits on the cpuworker threads rather than in the main thread. */
+  int ThreadedRelayCrypto;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   struct config_line_t *HidServAuth; /**< List of configuration lines for
@@ -614,6 +617,14 @@ struct or_options_t {
                                 * with weird characters. */
   /** If true, we try resolving hostnames with weird characters. */
   int ServerDNSAllowNonRFC953Hostnames;
+  /** How many threads send the DNS queries of our clients; if 0, we send
+   * them with evdns from the main thread. */
+  int ServerDNSThreads;
+  /** Most DNS queries that each of those threads has in flight at once. */
+  int ServerDNSMaxInflight;
+  /** Most bytes that the cached DNS answers of our clients may take up; if
+   * 0, there is no limit. */
+  uint64_t ServerDNSCacheMaxSize;
 
   /** If true, we try to download extra-info documents (and we serve them,
    * if we are a cache).  For authorities, this is always true. */
@@ -1044,9 +1055,19 @@ struct or_options_t {
    * set to "10 msec" if the consensus doesn't say anything. */
   int KISTSchedRunInterval;
 
+  /** How many shards the KIST scheduler splits its per-socket state into.
+   * Every shard but the first one collects its kernel information on its own
+   * thread. */
+  int KISTSchedShards;
+
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** Bool (default: 0). If set, KIST gets the TCP information of all its
+   * sockets with one netlink sock_diag dump per run, instead of two system
+   * calls per socket. */
+  int KISTSockDiag;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   struct smartlist_t *Schedulers;
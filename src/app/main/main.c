@@ -310,6 +310,7 @@ static void
 dumpmemusage(int severity)
 {
   connection_dump_buffer_mem_stats(severity);
+  buf_dump_freelist_sizes(severity);
   tor_log(severity, LD_GENERAL, "In rephist: %"PRIu64" used by %d Tors.",
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
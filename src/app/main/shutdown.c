@@ -17,8 +17,10 @@
 #include "app/main/main.h"
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
+#include "core/crypto/relay_crypto_pipeline.h"
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop_pubsub.h"
+#include "core/or/cell_pool.h"
 #include "core/or/channeltls.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
@@ -49,6 +51,7 @@
 #include "feature/rend/rendclient.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/rephist.h"
+#include "lib/buf/buffers.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/geoip/geoip.h"
 
@@ -121,12 +124,15 @@ tor_free_all(int postfork)
   rend_service_authorization_free_all();
   rep_hist_free_all();
   circuit_free_all();
+  relay_crypto_pipeline_free_all();
   circpad_machines_free();
   entry_guards_free_all();
   pt_free_all();
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  buf_shrink_freelists(1);
+  cell_pool_free_all();
   connection_edge_free_all();
   scheduler_free_all();
   nodelist_free_all();
@@ -32,6 +32,24 @@ int onion_skin_server_handshake(int type,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t key_out_len,
                       uint8_t *rend_nonce_out);
+/** One onionskin for onion_skin_server_handshake_batch() to answer. */
+typedef struct onion_server_batch_item_t {
+  /** The onionskin that the client sent, and its length. */
+  const uint8_t *onion_skin;
+  size_t onionskin_len;
+  /** Where to write our reply, our key material, and the hidden service
+   * nonce. */
+  uint8_t *reply_out;
+  uint8_t *keys_out;
+  uint8_t *rend_nonce_out;
+  /** Set to the length of the reply on success, or to -1 on failure. */
+  int result;
+} onion_server_batch_item_t;
+
+void onion_skin_server_handshake_batch(int type,
+                      onion_server_batch_item_t *items, int n_items,
+                      const server_onion_keys_t *keys,
+                      size_t keys_out_len);
 int onion_skin_client_handshake(int type,
                       const onion_handshake_state_t *handshake_state,
                       const uint8_t *reply, size_t reply_len,
@@ -134,25 +134,19 @@ onion_skin_ntor_create(const uint8_t *router_id,
                         CURVE25519_PUBKEY_LEN*3 +       \
                         PROTOID_LEN + SERVER_STR_LEN)
 
-/**
- * Perform the server side of an ntor handshake. Given an
- * NTOR_ONIONSKIN_LEN-byte message in <b>onion_skin</b>, our own identity
- * fingerprint as <b>my_node_id</b>, and an associative array mapping public
- * onion keys to curve25519_keypair_t in <b>private_keys</b>, attempt to
- * perform the handshake.  Use <b>junk_keys</b> if present if the handshake
- * indicates an unrecognized public key.  Write an NTOR_REPLY_LEN-byte
- * message to send back to the client into <b>handshake_reply_out</b>, and
- * generate <b>key_out_len</b> bytes of key material in <b>key_out</b>. Return
- * 0 on success, -1 on failure.
- */
-int
-onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
-                                 const di_digest256_map_t *private_keys,
-                                 const curve25519_keypair_t *junk_keys,
-                                 const uint8_t *my_node_id,
-                                 uint8_t *handshake_reply_out,
-                                 uint8_t *key_out,
-                                 size_t key_out_len)
+/** Helper: finish the server side of an ntor handshake for the onionskin
+ * in <b>onion_skin</b>, given the keypair that the client asked for in
+ * <b>keypair_bB</b> and a freshly generated short-lived secret key in
+ * <b>seckey_y</b>.  Arguments and return value are otherwise as for
+ * onion_skin_ntor_server_handshake(). */
+static int
+ntor_server_handshake_impl(const uint8_t *onion_skin,
+                           const curve25519_keypair_t *keypair_bB,
+                           const curve25519_secret_key_t *seckey_y,
+                           const uint8_t *my_node_id,
+                           uint8_t *handshake_reply_out,
+                           uint8_t *key_out,
+                           size_t key_out_len)
 {
   const tweakset_t *T = &proto1_tweaks;
   /* Sensitive stack-allocated material. Kept in an anonymous struct to make
@@ -161,32 +155,17 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
     uint8_t secret_input[SECRET_INPUT_LEN];
     uint8_t auth_input[AUTH_INPUT_LEN];
     curve25519_public_key_t pubkey_X;
-    curve25519_secret_key_t seckey_y;
     curve25519_public_key_t pubkey_Y;
     uint8_t verify[DIGEST256_LEN];
   } s;
   uint8_t *si = s.secret_input, *ai = s.auth_input;
-  const curve25519_keypair_t *keypair_bB;
   int bad;
 
-  /* Decode the onion skin */
-  /* XXXX Does this possible early-return business threaten our security? */
-  if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN))
-    return -1;
-  /* Note that on key-not-found, we go through with this operation anyway,
-   * using "junk_keys". This will result in failed authentication, but won't
-   * leak whether we recognized the key. */
-  keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
-                            (void*)junk_keys);
-  if (!keypair_bB)
-    return -1;
-
   memcpy(s.pubkey_X.public_key, onion_skin+DIGEST_LEN+DIGEST256_LEN,
          CURVE25519_PUBKEY_LEN);
 
-  /* Make y, Y */
-  curve25519_secret_key_generate(&s.seckey_y, 0);
-  curve25519_public_key_generate(&s.pubkey_Y, &s.seckey_y);
+  /* Make Y */
+  curve25519_public_key_generate(&s.pubkey_Y, seckey_y);
 
   /* NOTE: If we ever use a group other than curve25519, or a different
    * representation for its points, we may need to perform different or
@@ -198,7 +177,7 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
    * code will need to be reconsidered carefully. */
 
   /* build secret_input */
-  curve25519_handshake(si, &s.seckey_y, &s.pubkey_X);
+  curve25519_handshake(si, seckey_y, &s.pubkey_X);
   bad = safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
   si += CURVE25519_OUTPUT_LEN;
   curve25519_handshake(si, &keypair_bB->seckey, &s.pubkey_X);
@@ -244,6 +223,107 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
   return bad ? -1 : 0;
 }
 
+/**
+ * Perform the server side of an ntor handshake. Given an
+ * NTOR_ONIONSKIN_LEN-byte message in <b>onion_skin</b>, our own identity
+ * fingerprint as <b>my_node_id</b>, and an associative array mapping public
+ * onion keys to curve25519_keypair_t in <b>private_keys</b>, attempt to
+ * perform the handshake.  Use <b>junk_keys</b> if present if the handshake
+ * indicates an unrecognized public key.  Write an NTOR_REPLY_LEN-byte
+ * message to send back to the client into <b>handshake_reply_out</b>, and
+ * generate <b>key_out_len</b> bytes of key material in <b>key_out</b>. Return
+ * 0 on success, -1 on failure.
+ */
+int
+onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
+                                 const di_digest256_map_t *private_keys,
+                                 const curve25519_keypair_t *junk_keys,
+                                 const uint8_t *my_node_id,
+                                 uint8_t *handshake_reply_out,
+                                 uint8_t *key_out,
+                                 size_t key_out_len)
+{
+  const curve25519_keypair_t *keypair_bB;
+  curve25519_secret_key_t seckey_y;
+  int r;
+
+  /* Decode the onion skin */
+  /* XXXX Does this possible early-return business threaten our security? */
+  if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN))
+    return -1;
+  /* Note that on key-not-found, we go through with this operation anyway,
+   * using "junk_keys". This will result in failed authentication, but won't
+   * leak whether we recognized the key. */
+  keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
+                            (void*)junk_keys);
+  if (!keypair_bB)
+    return -1;
+
+  /* Make y */
+  curve25519_secret_key_generate(&seckey_y, 0);
+
+  r = ntor_server_handshake_impl(onion_skin, keypair_bB, &seckey_y,
+                                 my_node_id, handshake_reply_out,
+                                 key_out, key_out_len);
+  memwipe(&seckey_y, 0, sizeof(seckey_y));
+  return r;
+}
+
+/**
+ * Perform the server side of <b>n_items</b> ntor handshakes at once, as
+ * onion_skin_ntor_server_handshake() would for each of <b>items</b>,
+ * setting each item's result field to 0 on success or -1 on failure.
+ *
+ * This is cheaper than doing them one at a time: we generate all of our
+ * short-lived keys with one call to the RNG, and we only look up the onion
+ * key again when the client asks for a different one than the last client
+ * did.
+ */
+void
+onion_skin_ntor_server_handshake_batch(ntor_server_batch_item_t *items,
+                                       int n_items,
+                                       const di_digest256_map_t *private_keys,
+                                       const curve25519_keypair_t *junk_keys,
+                                       const uint8_t *my_node_id,
+                                       size_t key_out_len)
+{
+  curve25519_secret_key_t *seckeys_y;
+  const curve25519_keypair_t *keypair_bB = NULL;
+  const uint8_t *last_key_id = NULL;
+  int i;
+
+  if (n_items <= 0)
+    return;
+
+  seckeys_y = tor_calloc(n_items, sizeof(curve25519_secret_key_t));
+  curve25519_secret_keys_generate(seckeys_y, n_items);
+
+  for (i = 0; i < n_items; ++i) {
+    ntor_server_batch_item_t *item = &items[i];
+    const uint8_t *key_id = item->onion_skin + DIGEST_LEN;
+    item->result = -1;
+
+    if (tor_memneq(item->onion_skin, my_node_id, DIGEST_LEN))
+      continue;
+    /* The key ID is public, so it's fine to compare it quickly. As above,
+     * we use junk_keys for a key we don't recognize. */
+    if (!last_key_id || fast_memneq(key_id, last_key_id, DIGEST256_LEN)) {
+      keypair_bB = dimap_search(private_keys, key_id, (void*)junk_keys);
+      last_key_id = key_id;
+    }
+    if (!keypair_bB)
+      continue;
+
+    item->result = ntor_server_handshake_impl(item->onion_skin, keypair_bB,
+                                              &seckeys_y[i], my_node_id,
+                                              item->handshake_reply_out,
+                                              item->key_out, key_out_len);
+  }
+
+  memwipe(seckeys_y, 0, n_items * sizeof(curve25519_secret_key_t));
+  tor_free(seckeys_y);
+}
+
 /**
  * Perform the final client side of the ntor handshake, using the state in
  * <b>handshake_state</b> and the server's NTOR_REPLY_LEN-byte reply in
@@ -36,6 +36,26 @@ int onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                            uint8_t *key_out,
                            size_t key_out_len);
 
+/** One handshake for onion_skin_ntor_server_handshake_batch() to do. */
+typedef struct ntor_server_batch_item_t {
+  /** The NTOR_ONIONSKIN_LEN-byte onionskin that the client sent. */
+  const uint8_t *onion_skin;
+  /** Where to write our NTOR_REPLY_LEN-byte reply. */
+  uint8_t *handshake_reply_out;
+  /** Where to write our key material. */
+  uint8_t *key_out;
+  /** Set to 0 if the handshake succeeded, and -1 if it failed. */
+  int result;
+} ntor_server_batch_item_t;
+
+void onion_skin_ntor_server_handshake_batch(
+                           ntor_server_batch_item_t *items,
+                           int n_items,
+                           const struct di_digest256_map_t *private_keys,
+                           const struct curve25519_keypair_t *junk_keypair,
+                           const uint8_t *my_node_id,
+                           size_t key_out_len);
+
 int onion_skin_ntor_client_handshake(
                              const ntor_handshake_state_t *handshake_state,
                              const uint8_t *handshake_reply,
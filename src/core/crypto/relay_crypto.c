@@ -19,22 +19,27 @@
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 
+/* Offsets of the fields of the relay header that we look at for every cell.
+ * They must match relay_header_pack() and relay_header_unpack(); we access
+ * them directly here, since doing a full unpack and repack of the header
+ * twice per cell adds measurably to the cost of the running digest. */
+/** Offset of the "recognized" field in a relay cell's payload. */
+#define RELAY_RECOGNIZED_OFFSET 1
+/** Offset of the "integrity" field in a relay cell's payload. */
+#define RELAY_INTEGRITY_OFFSET 5
+/** Length of the "integrity" field in a relay cell's payload. */
+#define RELAY_INTEGRITY_LEN 4
+
 /** Update digest from the payload of cell. Assign integrity part to
  * cell.
  */
 void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell)
 {
-  char integrity[4];
-  relay_header_t rh;
-
   crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, integrity, 4);
-//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
-//    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+  crypto_digest_get_digest(digest,
+                           (char*)cell->payload + RELAY_INTEGRITY_OFFSET,
+                           RELAY_INTEGRITY_LEN);
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
@@ -47,40 +52,56 @@ static int
 relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
   uint32_t received_integrity, calculated_integrity;
-  relay_header_t rh;
+  uint8_t *integrity = cell->payload + RELAY_INTEGRITY_OFFSET;
   crypto_digest_checkpoint_t backup_digest;
 
   crypto_digest_checkpoint(&backup_digest, digest);
 
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(&received_integrity, rh.integrity, 4);
-  memset(rh.integrity, 0, 4);
-  relay_header_pack(cell->payload, &rh);
-
-//  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
-//    received_integrity[0], received_integrity[1],
-//    received_integrity[2], received_integrity[3]);
+  memcpy(&received_integrity, integrity, RELAY_INTEGRITY_LEN);
+  memset(integrity, 0, RELAY_INTEGRITY_LEN);
 
   crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, (char*) &calculated_integrity, 4);
+  crypto_digest_get_digest(digest, (char*) &calculated_integrity,
+                           RELAY_INTEGRITY_LEN);
 
   int rv = 1;
 
   if (calculated_integrity != received_integrity) {
-//    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
-// (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
     crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
-    memcpy(rh.integrity, &received_integrity, 4);
-    relay_header_pack(cell->payload, &rh);
+    memcpy(integrity, &received_integrity, RELAY_INTEGRITY_LEN);
     rv = 0;
   }
 
-  memwipe(&backup_digest, 0, sizeof(backup_digest));
+  crypto_digest_checkpoint_clear(&backup_digest);
   return rv;
 }
 
+/** Return true iff the "recognized" field of the relay header in
+ * <b>cell</b> is zero, so that the cell might be addressed to us. */
+static inline int
+relay_cell_maybe_recognized(const cell_t *cell)
+{
+  return get_uint16(cell->payload + RELAY_RECOGNIZED_OFFSET) == 0;
+}
+
+/** Check whether <b>cell</b>, which we have just decrypted, is addressed to
+ * us according to the running <b>digest</b>.  If so, set *<b>recognized</b>
+ * to 1.  Otherwise, leave <b>digest</b> and <b>cell</b> unchanged.
+ */
+static void
+relay_check_recognized(crypto_digest_t *digest, cell_t *cell,
+                       char *recognized)
+{
+  if (relay_cell_maybe_recognized(cell)) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(digest, cell)) {
+      *recognized = 1;
+    }
+  }
+}
+
 /** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
  * (in place).
  *
@@ -109,6 +130,59 @@ relay_crypto_record_sendme_digest(relay_crypto_t *crypto)
                            sizeof(crypto->sendme_digest));
 }
 
+/** Apply one layer of cryptography to <b>cell</b> at a relay (not at the
+ * origin of the circuit).
+ *
+ * If <b>digest</b> is NULL, the cell is moving towards the origin: encrypt
+ * it with <b>cipher</b>.  It is never recognized.
+ *
+ * Otherwise, the cell is moving away from the origin: decrypt it with
+ * <b>cipher</b>, and set *<b>recognized</b> to 1 if <b>digest</b> says that
+ * it is for us.
+ *
+ * This function touches nothing but its arguments, so it is safe to call
+ * from a worker thread, provided that nobody else is using <b>cipher</b> or
+ * <b>digest</b> at the same time.
+ */
+void
+relay_crypt_cell_at_relay(crypto_cipher_t *cipher, crypto_digest_t *digest,
+                          cell_t *cell, char *recognized)
+{
+  relay_crypt_one_payload(cipher, cell->payload);
+  if (digest)
+    relay_check_recognized(digest, cell, recognized);
+}
+
+/** Largest number of payloads that relay_crypt_cells_at_relay() hands to
+ * crypto_cipher_crypt_inplace_multi() at once. */
+#define RELAY_CRYPT_BATCH_MAX 64
+
+/** As relay_crypt_cell_at_relay(), but for each of the <b>n_cells</b> cells
+ * in <b>cells</b>, in order, setting <b>recognized</b>[i] for
+ * <b>cells</b>[i].  Since the keystream does not depend on the cells, we
+ * generate it for many cells at once.
+ */
+void
+relay_crypt_cells_at_relay(crypto_cipher_t *cipher, crypto_digest_t *digest,
+                           cell_t **cells, char *recognized, int n_cells)
+{
+  char *payloads[RELAY_CRYPT_BATCH_MAX];
+  int i, j;
+
+  for (i = 0; i < n_cells; i += RELAY_CRYPT_BATCH_MAX) {
+    const int n = MIN(n_cells - i, RELAY_CRYPT_BATCH_MAX);
+    for (j = 0; j < n; ++j)
+      payloads[j] = (char *) cells[i+j]->payload;
+    crypto_cipher_crypt_inplace_multi(cipher, payloads, n,
+                                      CELL_PAYLOAD_SIZE);
+    if (!digest)
+      continue;
+    /* The digest has to see the cells one at a time, in order. */
+    for (j = 0; j < n; ++j)
+      relay_check_recognized(digest, cells[i+j], &recognized[i+j]);
+  }
+}
+
 /** Do the appropriate en/decryptions for <b>cell</b> arriving on
  * <b>circ</b> in direction <b>cell_direction</b>.
  *
@@ -131,8 +205,6 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                    cell_direction_t cell_direction,
                    crypt_path_t **layer_hint, char *recognized)
 {
-  relay_header_t rh;
-
   tor_assert(circ);
   tor_assert(cell);
   tor_assert(recognized);
@@ -155,8 +227,7 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
         /* decrypt one layer */
         cpath_crypt_cell(thishop, cell->payload, true);
 
-        relay_header_unpack(&rh, cell->payload);
-        if (rh.recognized == 0) {
+        if (relay_cell_maybe_recognized(cell)) {
           /* it's possibly recognized. have to check digest to be sure. */
           if (relay_digest_matches(cpath_get_incoming_digest(thishop), cell)) {
             *recognized = 1;
@@ -178,22 +249,14 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
     } else {
       relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
       /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+      relay_crypt_cell_at_relay(crypto->b_crypto, NULL, cell, recognized);
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* We're in the middle. Decrypt one layer. */
     relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
-
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
-    }
+    relay_crypt_cell_at_relay(crypto->f_crypto, crypto->f_digest,
+                              cell, recognized);
   }
   return 0;
 }
@@ -225,15 +288,14 @@ relay_encrypt_cell_outbound(cell_t *cell,
 }
 
 /**
- * Encrypt a cell <b>cell</b> that we are creating, and sending on
- * <b>circuit</b> to the origin.
+ * Set the digest of a cell <b>cell</b> that we are creating, and sending on
+ * <b>or_circ</b> to the origin, but do not encrypt it.
  *
  * The integrity field and recognized field of <b>cell</b>'s relay headers
  * must be set to zero.
  */
 void
-relay_encrypt_cell_inbound(cell_t *cell,
-                           or_circuit_t *or_circ)
+relay_digest_cell_inbound(cell_t *cell, or_circuit_t *or_circ)
 {
   relay_set_digest(or_circ->crypto.b_digest, cell);
 
@@ -242,6 +304,20 @@ relay_encrypt_cell_inbound(cell_t *cell,
   if (sendme_circuit_cell_is_next(TO_CIRCUIT(or_circ)->package_window)) {
     sendme_circuit_record_outbound_cell(or_circ);
   }
+}
+
+/**
+ * Encrypt a cell <b>cell</b> that we are creating, and sending on
+ * <b>circuit</b> to the origin.
+ *
+ * The integrity field and recognized field of <b>cell</b>'s relay headers
+ * must be set to zero.
+ */
+void
+relay_encrypt_cell_inbound(cell_t *cell,
+                           or_circuit_t *or_circ)
+{
+  relay_digest_cell_inbound(cell, or_circ);
 
   /* encrypt one layer */
   relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload);
@@ -19,8 +19,16 @@ int relay_crypto_init(relay_crypto_t *crypto,
 int relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                        cell_direction_t cell_direction,
                        crypt_path_t **layer_hint, char *recognized);
+void relay_crypt_cell_at_relay(crypto_cipher_t *cipher,
+                               crypto_digest_t *digest,
+                               cell_t *cell, char *recognized);
+void relay_crypt_cells_at_relay(crypto_cipher_t *cipher,
+                                crypto_digest_t *digest,
+                                cell_t **cells, char *recognized,
+                                int n_cells);
 void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
+void relay_digest_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
 
 void relay_crypto_clear(relay_crypto_t *crypto);
@@ -0,0 +1,467 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_crypto_pipeline.c
+ * \brief Crypt relay cells for or_circuits in batches on the cpuworker
+ * threads.
+ *
+ * When ThreadedRelayCrypto is set, the relay cells that arrive on an
+ * or_circuit_t, and the ones that we package on it towards the origin, are
+ * not crypted in the main thread.  Instead, circuit_receive_relay_cell() and
+ * circuit_package_relay_cell() pass them to relay_crypto_pipeline_add_cell(),
+ * which appends them to a batch for their circuit and direction.  After each
+ * mainloop iteration, we hand the oldest batch for each circuit and
+ * direction to a worker thread (see cpuworker.c), which crypts all of its
+ * cells at once with relay_crypt_cells_at_relay().  When the reply comes
+ * back, we finish processing those cells in order, with
+ * circuit_receive_decrypted_relay_cell() or append_cell_to_circuit_queue().
+ *
+ * Every cipher and digest is used by only one thread at a time: there is at
+ * most one batch in flight for each circuit and direction, and once any
+ * cell for a direction is in the pipeline, all later cells for that
+ * direction go through the pipeline too.  This also keeps the cells on each
+ * circuit in order.
+ *
+ * Origin circuits never use this code.
+ **/
+
+#define RELAY_CRYPTO_PIPELINE_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/relay.h"
+#include "lib/crypt_ops/crypto_cipher.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/time/compat_time.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/or_circuit_st.h"
+
+/** List of or_circuit_t with cells that we have not yet handed to a worker
+ * thread. */
+static smartlist_t *circuits_to_flush = NULL;
+/** Event to hand those cells to the worker threads once the current mainloop
+ * iteration is done. */
+static mainloop_event_t *flush_event = NULL;
+/** How many cells are in the pipeline, across all circuits? */
+static size_t n_pipelined_cells = 0;
+
+/** Return true iff new relay cells should go through the pipeline whenever
+ * nothing else forces them to. */
+MOCK_IMPL(int,
+relay_crypto_pipeline_is_enabled,(void))
+{
+  return get_options()->ThreadedRelayCrypto && cpuworker_is_running();
+}
+
+/** Return the index of the lane for cells going in <b>direction</b>. */
+static inline int
+lane_idx(cell_direction_t direction)
+{
+  return direction == CELL_DIRECTION_OUT ? 1 : 0;
+}
+
+/** Return true iff <b>lane</b> has any cells in it. */
+static int
+lane_is_busy(const relay_crypto_lane_t *lane)
+{
+  return lane->in_flight != NULL || smartlist_len(lane->queued) > 0;
+}
+
+/** Return true iff the next relay cell that we crypt on <b>circ</b> in
+ * <b>direction</b> should go through the pipeline. */
+int
+relay_crypto_pipeline_should_use(const circuit_t *circ,
+                                 cell_direction_t direction)
+{
+  if (CIRCUIT_IS_ORIGIN(circ))
+    return 0;
+
+  const or_circuit_t *or_circ = CONST_TO_OR_CIRCUIT(circ);
+  if (or_circ->crypto_pipeline &&
+      lane_is_busy(&or_circ->crypto_pipeline->lanes[lane_idx(direction)])) {
+    /* We must keep using the pipeline until it is empty, or we would crypt
+     * cells out of order. */
+    return 1;
+  }
+
+  return relay_crypto_pipeline_is_enabled();
+}
+
+/** Allocate and return a new relay_crypto_job_t for cells on <b>circ</b>
+ * going in <b>direction</b>, with room for <b>n_alloc</b> cells. */
+static relay_crypto_job_t *
+relay_crypto_job_new(or_circuit_t *circ, cell_direction_t direction,
+                     int n_alloc)
+{
+  relay_crypto_job_t *job =
+    tor_malloc_zero(offsetof(relay_crypto_job_t, cells) +
+                    n_alloc * sizeof(pipelined_cell_t));
+  job->circ = circ;
+  job->direction = direction;
+  job->n_alloc = n_alloc;
+  job->inserted_timestamp = monotime_coarse_get_stamp();
+  return job;
+}
+
+#define relay_crypto_job_free(job) \
+  FREE_AND_NULL(relay_crypto_job_t, relay_crypto_job_free_, (job))
+
+/** Release all storage held by <b>job</b>, which must not be on any
+ * workqueue. */
+static void
+relay_crypto_job_free_(relay_crypto_job_t *job)
+{
+  if (!job)
+    return;
+
+  tor_assert(n_pipelined_cells >= (size_t)job->n_cells);
+  n_pipelined_cells -= job->n_cells;
+  if (job->owns_crypto) {
+    crypto_cipher_free(job->cipher);
+    crypto_digest_free(job->digest);
+  }
+  memwipe(job, 0, offsetof(relay_crypto_job_t, cells) +
+          job->n_alloc * sizeof(pipelined_cell_t));
+  tor_free(job);
+}
+
+/** Worker thread function: crypt every cell in a relay_crypto_job_t, as a
+ * single batch. */
+STATIC workqueue_reply_t
+relay_crypto_job_threadfn(void *state_, void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  cell_t *cells[RELAY_CRYPTO_JOB_MAX_CELLS];
+  char recognized[RELAY_CRYPTO_JOB_MAX_CELLS];
+  int i;
+  (void) state_;
+
+  tor_assert(job->n_cells <= RELAY_CRYPTO_JOB_MAX_CELLS);
+  for (i = 0; i < job->n_cells; ++i) {
+    cells[i] = &job->cells[i].cell;
+    recognized[i] = 0;
+  }
+
+  relay_crypt_cells_at_relay(job->cipher, job->digest,
+                             cells, recognized, job->n_cells);
+
+  for (i = 0; i < job->n_cells; ++i)
+    job->cells[i].recognized = recognized[i];
+
+  return WQ_RPL_REPLY;
+}
+
+/** Discard every cell on <b>lane</b> that we have not yet handed to a worker
+ * thread. */
+static void
+lane_clear_queued(relay_crypto_lane_t *lane)
+{
+  SMARTLIST_FOREACH(lane->queued, relay_crypto_job_t *, job,
+                    relay_crypto_job_free(job));
+  smartlist_clear(lane->queued);
+}
+
+/** If no worker thread is crypting cells for <b>circ</b> in
+ * <b>direction</b>, hand it the oldest queued batch for that direction. */
+static void
+launch_next_job(or_circuit_t *circ, cell_direction_t direction)
+{
+  relay_crypto_lane_t *lane =
+    &circ->crypto_pipeline->lanes[lane_idx(direction)];
+  relay_crypto_job_t *job;
+
+  if (lane->in_flight || smartlist_len(lane->queued) == 0)
+    return;
+
+  if (TO_CIRCUIT(circ)->marked_for_close) {
+    /* We'd just throw the cells away once they came back. */
+    lane_clear_queued(lane);
+    return;
+  }
+
+  job = smartlist_get(lane->queued, 0);
+  smartlist_del_keeporder(lane->queued, 0);
+
+  if (direction == CELL_DIRECTION_OUT) {
+    job->cipher = circ->crypto.f_crypto;
+    job->digest = circ->crypto.f_digest;
+  } else {
+    job->cipher = circ->crypto.b_crypto;
+    job->digest = NULL;
+  }
+
+  job->workqueue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                              relay_crypto_job_threadfn,
+                                              relay_crypto_job_replyfn,
+                                              job);
+  if (!job->workqueue_entry) {
+    log_warn(LD_BUG, "Couldn't queue relay crypto work on threadpool");
+    relay_crypto_job_free(job);
+    /* We can't crypt any later cells without these ones. */
+    lane_clear_queued(lane);
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+    return;
+  }
+  lane->in_flight = job;
+}
+
+/** Main thread function: handle the reply for a relay_crypto_job_t by
+ * finishing the processing of each of its cells, in order. */
+STATIC void
+relay_crypto_job_replyfn(void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  or_circuit_t *or_circ = job->circ;
+  const cell_direction_t direction = job->direction;
+  circuit_t *circ;
+  int i;
+
+  if (!or_circ) {
+    /* The circuit was freed while the worker had this job. */
+    relay_crypto_job_free(job);
+    return;
+  }
+
+  circ = TO_CIRCUIT(or_circ);
+  relay_crypto_lane_t *lane =
+    &or_circ->crypto_pipeline->lanes[lane_idx(direction)];
+  tor_assert(lane->in_flight == job);
+  lane->in_flight = NULL;
+  job->workqueue_entry = NULL;
+
+  for (i = 0; i < job->n_cells && !circ->marked_for_close; ++i) {
+    pipelined_cell_t *pc = &job->cells[i];
+    int reason;
+
+    if (pc->packaged) {
+      if (or_circ->p_chan)
+        append_cell_to_circuit_queue(circ, or_circ->p_chan, &pc->cell,
+                                     direction, pc->on_stream);
+      continue;
+    }
+
+    reason = circuit_receive_decrypted_relay_cell(&pc->cell, circ, direction,
+                                                  NULL, pc->recognized);
+    if (reason < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "circuit_receive_decrypted_relay_cell (%s) failed. Closing.",
+             direction == CELL_DIRECTION_OUT ? "forward" : "backward");
+      circuit_mark_for_close(circ, -reason);
+    }
+  }
+
+  relay_crypto_job_free(job);
+  launch_next_job(or_circ, direction);
+}
+
+/** Hand the oldest queued batch of every circuit that's waiting for it to
+ * the worker threads. */
+STATIC void
+relay_crypto_pipeline_flush(void)
+{
+  smartlist_t *circs;
+
+  if (!circuits_to_flush)
+    return;
+
+  circs = circuits_to_flush;
+  circuits_to_flush = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(circs, or_circuit_t *, circ) {
+    circ->crypto_pipeline->flush_scheduled = 0;
+    launch_next_job(circ, CELL_DIRECTION_IN);
+    launch_next_job(circ, CELL_DIRECTION_OUT);
+  } SMARTLIST_FOREACH_END(circ);
+
+  smartlist_free(circs);
+}
+
+/** Mainloop callback: run relay_crypto_pipeline_flush(). */
+static void
+flush_event_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  (void) arg;
+  relay_crypto_pipeline_flush();
+}
+
+/** Make sure that the cells on <b>circ</b> are handed to the worker threads
+ * once the current mainloop iteration is done. */
+static void
+schedule_flush(or_circuit_t *circ)
+{
+  if (circ->crypto_pipeline->flush_scheduled)
+    return;
+
+  if (!circuits_to_flush)
+    circuits_to_flush = smartlist_new();
+  if (!flush_event)
+    flush_event = mainloop_event_postloop_new(flush_event_cb, NULL);
+
+  smartlist_add(circuits_to_flush, circ);
+  circ->crypto_pipeline->flush_scheduled = 1;
+  mainloop_event_activate(flush_event);
+}
+
+/** Add a copy of <b>cell</b>, going in <b>direction</b> on <b>circ</b>, to
+ * the pipeline.  If <b>packaged</b> is true, we built the cell ourselves and
+ * already set its digest; it came from the stream <b>on_stream</b>.
+ * Otherwise, we received it from one of the circuit's channels. */
+void
+relay_crypto_pipeline_add_cell(or_circuit_t *circ, const cell_t *cell,
+                               cell_direction_t direction,
+                               int packaged, streamid_t on_stream)
+{
+  relay_crypto_lane_t *lane;
+  relay_crypto_job_t *job = NULL;
+  int n_queued;
+
+  tor_assert(direction == CELL_DIRECTION_IN ||
+             direction == CELL_DIRECTION_OUT);
+  tor_assert(!packaged || direction == CELL_DIRECTION_IN);
+
+  if (!circ->crypto_pipeline) {
+    circ->crypto_pipeline = tor_malloc_zero(sizeof(relay_crypto_pipeline_t));
+    circ->crypto_pipeline->lanes[0].queued = smartlist_new();
+    circ->crypto_pipeline->lanes[1].queued = smartlist_new();
+  }
+  lane = &circ->crypto_pipeline->lanes[lane_idx(direction)];
+
+  n_queued = smartlist_len(lane->queued);
+  if (n_queued)
+    job = smartlist_get(lane->queued, n_queued - 1);
+
+  if (!job || job->n_cells == RELAY_CRYPTO_JOB_MAX_CELLS) {
+    job = relay_crypto_job_new(circ, direction,
+                               RELAY_CRYPTO_JOB_INITIAL_CELLS);
+    smartlist_add(lane->queued, job);
+  } else if (job->n_cells == job->n_alloc) {
+    int n_alloc = MIN(job->n_alloc * 2, RELAY_CRYPTO_JOB_MAX_CELLS);
+    job = tor_realloc(job, offsetof(relay_crypto_job_t, cells) +
+                      n_alloc * sizeof(pipelined_cell_t));
+    job->n_alloc = n_alloc;
+    smartlist_set(lane->queued, n_queued - 1, job);
+  }
+
+  pipelined_cell_t *pc = &job->cells[job->n_cells++];
+  memcpy(&pc->cell, cell, sizeof(cell_t));
+  pc->on_stream = on_stream;
+  pc->packaged = packaged ? 1 : 0;
+  pc->recognized = 0;
+  ++n_pipelined_cells;
+
+  schedule_flush(circ);
+}
+
+/** Release all pipeline state for <b>circ</b>, which we are about to free.
+ *
+ * If a worker thread is still crypting cells for <b>circ</b>, it keeps using
+ * the circuit's cipher and digest: we take them away from <b>circ</b> and
+ * free them once the reply comes back. */
+void
+relay_crypto_pipeline_circuit_free(or_circuit_t *circ)
+{
+  relay_crypto_pipeline_t *pipe = circ->crypto_pipeline;
+  int i;
+
+  if (!pipe)
+    return;
+
+  if (pipe->flush_scheduled)
+    smartlist_remove(circuits_to_flush, circ);
+
+  for (i = 0; i < 2; ++i) {
+    relay_crypto_lane_t *lane = &pipe->lanes[i];
+    relay_crypto_job_t *job = lane->in_flight;
+
+    lane_clear_queued(lane);
+    smartlist_free(lane->queued);
+
+    if (!job)
+      continue;
+    if (workqueue_entry_cancel(job->workqueue_entry)) {
+      /* No worker had started on it yet. */
+      relay_crypto_job_free(job);
+      continue;
+    }
+    job->circ = NULL;
+    job->owns_crypto = 1;
+    if (job->direction == CELL_DIRECTION_OUT) {
+      circ->crypto.f_crypto = NULL;
+      circ->crypto.f_digest = NULL;
+    } else {
+      circ->crypto.b_crypto = NULL;
+    }
+  }
+
+  tor_free(circ->crypto_pipeline);
+}
+
+/** Return the number of cells that <b>circ</b> has in the pipeline, in
+ * either direction. */
+size_t
+relay_crypto_pipeline_circuit_n_cells(const or_circuit_t *circ)
+{
+  const relay_crypto_pipeline_t *pipe = circ->crypto_pipeline;
+  size_t n = 0;
+  int i;
+
+  if (!pipe)
+    return 0;
+
+  for (i = 0; i < 2; ++i) {
+    const relay_crypto_lane_t *lane = &pipe->lanes[i];
+    if (lane->in_flight)
+      n += lane->in_flight->n_cells;
+    SMARTLIST_FOREACH(lane->queued, const relay_crypto_job_t *, job,
+                      n += job->n_cells);
+  }
+  return n;
+}
+
+/** Return the age of the oldest cell that <b>circ</b> has in the pipeline,
+ * in timestamp units before the coarse timestamp <b>now</b>, or 0 if it has
+ * none. */
+uint32_t
+relay_crypto_pipeline_circuit_max_cell_age(const or_circuit_t *circ,
+                                           uint32_t now)
+{
+  const relay_crypto_pipeline_t *pipe = circ->crypto_pipeline;
+  uint32_t age = 0;
+  int i;
+
+  if (!pipe)
+    return 0;
+
+  for (i = 0; i < 2; ++i) {
+    const relay_crypto_lane_t *lane = &pipe->lanes[i];
+    const relay_crypto_job_t *oldest = lane->in_flight;
+    if (!oldest && smartlist_len(lane->queued))
+      oldest = smartlist_get(lane->queued, 0);
+    if (oldest && now - oldest->inserted_timestamp > age)
+      age = now - oldest->inserted_timestamp;
+  }
+  return age;
+}
+
+/** Return the number of bytes used by cells in the pipeline. */
+size_t
+relay_crypto_pipeline_get_total_allocation(void)
+{
+  return n_pipelined_cells * sizeof(pipelined_cell_t);
+}
+
+/** Release all global storage held by the relay crypto pipeline. Call only
+ * after freeing all circuits. */
+void
+relay_crypto_pipeline_free_all(void)
+{
+  smartlist_free(circuits_to_flush);
+  mainloop_event_free(flush_event);
+}
@@ -0,0 +1,102 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_crypto_pipeline.h
+ * \brief Header file for relay_crypto_pipeline.c.
+ **/
+
+#ifndef TOR_RELAY_CRYPTO_PIPELINE_H
+#define TOR_RELAY_CRYPTO_PIPELINE_H
+
+typedef struct relay_crypto_pipeline_t relay_crypto_pipeline_t;
+
+MOCK_DECL(int, relay_crypto_pipeline_is_enabled, (void));
+int relay_crypto_pipeline_should_use(const circuit_t *circ,
+                                     cell_direction_t direction);
+void relay_crypto_pipeline_add_cell(or_circuit_t *circ, const cell_t *cell,
+                                    cell_direction_t direction,
+                                    int packaged, streamid_t on_stream);
+void relay_crypto_pipeline_circuit_free(or_circuit_t *circ);
+size_t relay_crypto_pipeline_circuit_n_cells(const or_circuit_t *circ);
+uint32_t relay_crypto_pipeline_circuit_max_cell_age(const or_circuit_t *circ,
+                                                    uint32_t now);
+size_t relay_crypto_pipeline_get_total_allocation(void);
+void relay_crypto_pipeline_free_all(void);
+
+#ifdef RELAY_CRYPTO_PIPELINE_PRIVATE
+
+#include "core/or/cell_st.h"
+#include "lib/evloop/workqueue.h"
+
+/** Largest number of cells that we hand to a worker thread in one job. */
+#define RELAY_CRYPTO_JOB_MAX_CELLS 64
+/** Number of cells that we allocate room for in a new job. */
+#define RELAY_CRYPTO_JOB_INITIAL_CELLS 4
+
+/** A relay cell waiting for a worker thread to crypt it. */
+typedef struct pipelined_cell_t {
+  /** The cell itself. */
+  cell_t cell;
+  /** If we packaged this cell, the stream that it came from (or 0). */
+  streamid_t on_stream;
+  /** True iff we packaged this cell ourselves, rather than receiving it from
+   * one of the circuit's channels. */
+  unsigned int packaged : 1;
+  /** Set by the worker thread: true iff the cell is addressed to us. */
+  char recognized;
+} pipelined_cell_t;
+
+/** A batch of cells for a worker thread to crypt, all for the same circuit
+ * and direction, in the order that we got them. */
+typedef struct relay_crypto_job_t {
+  /** The circuit that these cells belong to, or NULL if the circuit was freed
+   * while a worker thread was processing this job. */
+  or_circuit_t *circ;
+  /** Which way are these cells going? */
+  cell_direction_t direction;
+  /** The cipher to crypt the cells with.  Set when we hand the job to a
+   * worker thread. */
+  crypto_cipher_t *cipher;
+  /** For CELL_DIRECTION_OUT, the running digest to recognize cells with.
+   * Set when we hand the job to a worker thread. */
+  crypto_digest_t *digest;
+  /** True iff this job (and not circ) owns cipher and digest. */
+  unsigned int owns_crypto : 1;
+  /** The workqueue entry for this job, if a worker thread has it. */
+  workqueue_entry_t *workqueue_entry;
+  /** Time (in timestamp units) when we added the first cell to this job. */
+  uint32_t inserted_timestamp;
+  /** Number of cells in this job. */
+  int n_cells;
+  /** Number of cells that we have allocated room for in <b>cells</b>. */
+  int n_alloc;
+  /** The cells themselves. */
+  pipelined_cell_t cells[FLEXIBLE_ARRAY_MEMBER];
+} relay_crypto_job_t;
+
+/** The pipeline state for one direction of a circuit. */
+typedef struct relay_crypto_lane_t {
+  /** Jobs that we have not yet handed to a worker thread, oldest first.
+   * Only the last of these can still get more cells. */
+  smartlist_t *queued;
+  /** The job that a worker thread is processing, if any. */
+  relay_crypto_job_t *in_flight;
+} relay_crypto_lane_t;
+
+/** The pipeline state for an or_circuit_t. */
+struct relay_crypto_pipeline_t {
+  /** Lanes for cells going towards (0) and away from (1) the origin. */
+  relay_crypto_lane_t lanes[2];
+  /** True iff this circuit is waiting in circuits_to_flush. */
+  unsigned int flush_scheduled : 1;
+};
+
+STATIC void relay_crypto_pipeline_flush(void);
+STATIC workqueue_reply_t relay_crypto_job_threadfn(void *state_,
+                                                   void *work_);
+STATIC void relay_crypto_job_replyfn(void *work_);
+
+#endif /* defined(RELAY_CRYPTO_PIPELINE_PRIVATE) */
+
+#endif /* !defined(TOR_RELAY_CRYPTO_PIPELINE_H) */
@@ -4365,6 +4365,33 @@ connection_dir_buf_add(const char *string, size_t len,
   connection_buf_add(string, len, TO_CONN(dir_conn));
 }
 
+/**
+ * As connection_buf_add(), but don't copy the <b>len</b> bytes at
+ * <b>data</b> onto <b>conn</b>'s outbuf if we can avoid it: instead,
+ * reference them until they are flushed, and then call
+ * <b>release_fn</b>(<b>release_arg</b>).  See buf_add_borrowed() for the
+ * details.  We call <b>release_fn</b> exactly once, even on failure.
+ */
+void
+connection_buf_add_borrowed(const char *data, size_t len,
+                            connection_t *conn,
+                            void (*release_fn)(void *), void *release_arg)
+{
+  int r;
+  if (!len || !connection_may_write_to_buf(conn)) {
+    release_fn(release_arg);
+    return;
+  }
+
+  CONN_LOG_PROTECT(conn, r = buf_add_borrowed(conn->outbuf, data, len,
+                                              release_fn, release_arg));
+  if (r < 0) {
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  connection_write_to_buf_commit(conn, len);
+}
+
 void
 connection_buf_add_compress(const char *string, size_t len,
                             dir_connection_t *conn, int done)
@@ -233,6 +233,10 @@ connection_buf_add(const char *string, size_t len, connection_t *conn)
 {
   connection_write_to_buf_impl_(string, len, conn, 0);
 }
+void connection_buf_add_borrowed(const char *data, size_t len,
+                                 connection_t *conn,
+                                 void (*release_fn)(void *),
+                                 void *release_arg);
 void connection_buf_add_compress(const char *string, size_t len,
                                  dir_connection_t *conn, int done);
 void connection_buf_add_buf(connection_t *conn, struct buf_t *buf);
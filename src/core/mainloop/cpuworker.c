@@ -14,9 +14,11 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and for relay cell cryptography in relay_crypto_pipeline.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitbuild.h"
@@ -35,8 +37,6 @@
 
 #include "core/or/or_circuit_st.h"
 
-static void queue_pending_tasks(void);
-
 typedef struct worker_state_s {
   int generation;
   server_onion_keys_t *onion_keys;
@@ -75,6 +75,8 @@ static threadpool_t *threadpool = NULL;
 
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
+/** Number of threads in threadpool. */
+static int n_worker_threads = 1;
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
@@ -93,6 +95,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    n_worker_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -108,6 +111,14 @@ cpu_init(void)
   max_pending_tasks = get_num_cpus(get_options()) * 64;
 }
 
+/** Return true iff we have started the cpuworker threads, and can hand them
+ * work with cpuworker_queue_work(). */
+int
+cpuworker_is_running(void)
+{
+  return threadpool != NULL;
+}
+
 /** Magic numbers to make sure our cpuworker_requests don't grow any
  * mis-framing bugs. */
 #define CPUWORKER_REQUEST_MAGIC 0xda4afeed
@@ -168,6 +179,34 @@ typedef struct cpuworker_job_u {
   } u;
 } cpuworker_job_t;
 
+/** Largest number of onionskins that we hand to a worker thread at once. */
+#define CPUWORKER_MAX_BATCH 16
+
+/** A set of onionskins, all of the same handshake type, for a single worker
+ * thread to answer at once.  When the onion queue is long, batching saves
+ * us a trip through the work queue and the reply queue for every onionskin,
+ * and lets onion_skin_server_handshake_batch() share some work among them.
+ *
+ * The circuits of every job in the batch have the batch's
+ * workqueue_entry_t as their workqueue_entry. */
+typedef struct cpuworker_batch_t {
+  /** The handshake type of every job in this batch. */
+  uint16_t handshake_type;
+  /** Number of elements used in jobs. */
+  int n_jobs;
+  /** The jobs themselves. */
+  cpuworker_job_t *jobs[CPUWORKER_MAX_BATCH];
+} cpuworker_batch_t;
+
+/** Return a new empty batch for onionskins of type <b>handshake_type</b>. */
+static cpuworker_batch_t *
+cpuworker_batch_new(uint16_t handshake_type)
+{
+  cpuworker_batch_t *batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+  batch->handshake_type = handshake_type;
+  return batch;
+}
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -307,11 +346,11 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle the reply from the worker threads for a single onionskin in
+ * <b>job</b>, and free <b>job</b>. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_handle_reply(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -393,6 +432,19 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
+}
+
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
+{
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    cpuworker_onion_handshake_handle_reply(batch->jobs[i]);
+  tor_free(batch);
+
   queue_pending_tasks();
 }
 
@@ -401,90 +453,247 @@ static workqueue_reply_t
 cpuworker_onion_handshake_threadfn(void *state_, void *work_)
 {
   worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
+  cpuworker_batch_t *batch = work_;
+  const int n_jobs = batch->n_jobs;
 
   /* variables for onion processing */
   server_onion_keys_t *onion_keys = state->onion_keys;
-  cpuworker_request_t req;
-  cpuworker_reply_t rpl;
-
-  memcpy(&req, &job->u.request, sizeof(req));
+  cpuworker_request_t *req = tor_calloc(n_jobs, sizeof(cpuworker_request_t));
+  cpuworker_reply_t *rpl = tor_calloc(n_jobs, sizeof(cpuworker_reply_t));
+  onion_server_batch_item_t *items =
+    tor_calloc(n_jobs, sizeof(onion_server_batch_item_t));
 
-  tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
-  memset(&rpl, 0, sizeof(rpl));
-
-  const create_cell_t *cc = &req.create_cell;
-  created_cell_t *cell_out = &rpl.created_cell;
   struct timeval tv_start = {0,0}, tv_end;
-  int n;
-  rpl.timed = req.timed;
-  rpl.started_at = req.started_at;
-  rpl.handshake_type = cc->handshake_type;
-  if (req.timed)
-    tor_gettimeofday(&tv_start);
-  n = onion_skin_server_handshake(cc->handshake_type,
-                                  cc->onionskin, cc->handshake_len,
-                                  onion_keys,
-                                  cell_out->reply,
-                                  rpl.keys, CPATH_KEY_MATERIAL_LEN,
-                                  rpl.rend_auth_material);
-  if (n < 0) {
-    /* failure */
-    log_debug(LD_OR,"onion_skin_server_handshake failed.");
-    memset(&rpl, 0, sizeof(rpl));
-    rpl.success = 0;
-  } else {
-    /* success */
-    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-    cell_out->handshake_len = n;
-    switch (cc->cell_type) {
-    case CELL_CREATE:
-      cell_out->cell_type = CELL_CREATED; break;
-    case CELL_CREATE2:
-      cell_out->cell_type = CELL_CREATED2; break;
-    case CELL_CREATE_FAST:
-      cell_out->cell_type = CELL_CREATED_FAST; break;
-    default:
-      tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
-    }
-    rpl.success = 1;
+  uint32_t n_usec = 0;
+  int timed = 0;
+  int i;
+
+  for (i = 0; i < n_jobs; ++i) {
+    memcpy(&req[i], &batch->jobs[i]->u.request, sizeof(req[i]));
+    tor_assert(req[i].magic == CPUWORKER_REQUEST_MAGIC);
+    /* All the onionskins in a batch have the same handshake type. */
+    tor_assert(req[i].create_cell.handshake_type == batch->handshake_type);
+    timed |= req[i].timed;
+
+    items[i].onion_skin = req[i].create_cell.onionskin;
+    items[i].onionskin_len = req[i].create_cell.handshake_len;
+    items[i].reply_out = rpl[i].created_cell.reply;
+    items[i].keys_out = rpl[i].keys;
+    items[i].rend_nonce_out = rpl[i].rend_auth_material;
   }
-  rpl.magic = CPUWORKER_REPLY_MAGIC;
-  if (req.timed) {
+
+  if (timed)
+    tor_gettimeofday(&tv_start);
+  onion_skin_server_handshake_batch(batch->handshake_type, items, n_jobs,
+                                    onion_keys, CPATH_KEY_MATERIAL_LEN);
+  if (timed) {
+    /* Every onionskin in the batch gets an equal share of the time, so that
+     * estimated_usec_for_onionskins() sees what batching saves us. */
     struct timeval tv_diff;
     int64_t usec;
     tor_gettimeofday(&tv_end);
     timersub(&tv_end, &tv_start, &tv_diff);
     usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
-    if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-      rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+    if (usec < 0 || usec / n_jobs > MAX_BELIEVABLE_ONIONSKIN_DELAY)
+      n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
     else
-      rpl.n_usec = (uint32_t) usec;
+      n_usec = (uint32_t) (usec / n_jobs);
   }
 
-  memcpy(&job->u.reply, &rpl, sizeof(rpl));
+  for (i = 0; i < n_jobs; ++i) {
+    const create_cell_t *cc = &req[i].create_cell;
+    created_cell_t *cell_out = &rpl[i].created_cell;
+    int n = items[i].result;
+    if (n < 0) {
+      /* failure */
+      log_debug(LD_OR,"onion_skin_server_handshake failed.");
+      memset(&rpl[i], 0, sizeof(rpl[i]));
+      rpl[i].success = 0;
+    } else {
+      /* success */
+      log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+      cell_out->handshake_len = n;
+      switch (cc->cell_type) {
+      case CELL_CREATE:
+        cell_out->cell_type = CELL_CREATED; break;
+      case CELL_CREATE2:
+        cell_out->cell_type = CELL_CREATED2; break;
+      case CELL_CREATE_FAST:
+        cell_out->cell_type = CELL_CREATED_FAST; break;
+      default:
+        tor_assert(0);
+        return WQ_RPL_SHUTDOWN;
+      }
+      rpl[i].success = 1;
+    }
+    rpl[i].timed = req[i].timed;
+    rpl[i].started_at = req[i].started_at;
+    rpl[i].handshake_type = cc->handshake_type;
+    rpl[i].magic = CPUWORKER_REPLY_MAGIC;
+    if (req[i].timed)
+      rpl[i].n_usec = n_usec;
+
+    memcpy(&batch->jobs[i]->u.reply, &rpl[i], sizeof(rpl[i]));
+  }
 
-  memwipe(&req, 0, sizeof(req));
-  memwipe(&rpl, 0, sizeof(req));
+  memwipe(req, 0, n_jobs * sizeof(cpuworker_request_t));
+  memwipe(rpl, 0, n_jobs * sizeof(cpuworker_reply_t));
+  tor_free(req);
+  tor_free(rpl);
+  tor_free(items);
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
+/** Make a new job for the worker threads to answer <b>onionskin</b> for the
+ * circuit <b>circ</b>, and count it in total_pending_tasks.  Take ownership
+ * of <b>onionskin</b>.  Return the job, or NULL on failure.
+ */
+static cpuworker_job_t *
+cpuworker_job_new(or_circuit_t *circ, create_cell_t *onionskin)
+{
+  cpuworker_job_t *job;
+  cpuworker_request_t req;
+  int should_time;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return NULL;
+  }
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (should_time)
+    tor_gettimeofday(&req.started_at);
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->circ = circ;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+
+  ++total_pending_tasks;
+  return job;
+}
+
+/** Hand <b>batch</b> to the worker threads.  Return 0 on success, or -1 on
+ * failure; on failure, the caller still owns the batch. */
+static int
+cpuworker_queue_batch(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  tor_assert(batch->n_jobs > 0);
+  queue_entry = threadpool_queue_work_priority(threadpool,
+                                      WQ_PRI_HIGH,
+                                      cpuworker_onion_handshake_threadfn,
+                                      cpuworker_onion_handshake_replyfn,
+                                      batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    return -1;
+  }
+
+  log_debug(LD_OR, "Queued batch %p of %d onionskins (qe=%p)",
+            batch, batch->n_jobs, queue_entry);
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    batch->jobs[i]->circ->workqueue_entry = queue_entry;
+
+  return 0;
+}
+
+/** Release <b>job</b>, which the worker threads haven't seen, along with
+ * its share of total_pending_tasks. */
 static void
+cpuworker_job_free_unprocessed(cpuworker_job_t *job)
+{
+  memwipe(job, 0xe0, sizeof(*job));
+  tor_free(job);
+  tor_assert(total_pending_tasks > 0);
+  --total_pending_tasks;
+}
+
+/** Give up on every onionskin in <b>batch</b>, which we couldn't hand to
+ * the worker threads, closing their circuits.  Free <b>batch</b>. */
+static void
+cpuworker_batch_fail(cpuworker_batch_t *batch)
+{
+  int i;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    or_circuit_t *circ = batch->jobs[i]->circ;
+    circ->workqueue_entry = NULL;
+    cpuworker_job_free_unprocessed(batch->jobs[i]);
+    if (!TO_CIRCUIT(circ)->marked_for_close)
+      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+  }
+  tor_free(batch);
+}
+
+/** Return the number of onionskins of type <b>handshake_type</b> that we
+ * should put in each batch, now that we're taking onionskins from the
+ * onion queue. */
+static int
+cpuworker_batch_size(uint16_t handshake_type)
+{
+  /* Split the waiting onionskins evenly among the threads, so that we don't
+   * make any thread do the work of another that could be idle. */
+  int n = onion_num_pending(handshake_type) / n_worker_threads;
+  return CLAMP(1, n, CPUWORKER_MAX_BATCH);
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers. */
+STATIC void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  /* The batch we're filling for each handshake type, and how big we want
+   * each one to get. */
+  cpuworker_batch_t *batches[MAX_ONION_HANDSHAKE_TYPE+1];
+  int batch_size[MAX_ONION_HANDSHAKE_TYPE+1];
+  int type;
+
+  memset(batches, 0, sizeof(batches));
+  for (type = 0; type <= MAX_ONION_HANDSHAKE_TYPE; ++type)
+    batch_size[type] = cpuworker_batch_size(type);
 
   while (total_pending_tasks < max_pending_tasks) {
+    cpuworker_job_t *job;
     circ = onion_next_task(&onionskin);
 
     if (!circ)
-      return;
+      break;
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
+    type = onionskin->handshake_type;
+    if (!(job = cpuworker_job_new(circ, onionskin))) {
       log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+      continue;
+    }
+
+    if (!batches[type])
+      batches[type] = cpuworker_batch_new(type);
+    batches[type]->jobs[batches[type]->n_jobs++] = job;
+    if (batches[type]->n_jobs == batch_size[type]) {
+      if (cpuworker_queue_batch(batches[type]) < 0)
+        cpuworker_batch_fail(batches[type]);
+      batches[type] = NULL;
+    }
+  }
+
+  for (type = 0; type <= MAX_ONION_HANDSHAKE_TYPE; ++type) {
+    if (batches[type] && cpuworker_queue_batch(batches[type]) < 0)
+      cpuworker_batch_fail(batches[type]);
   }
 }
 
@@ -513,10 +722,8 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
+  cpuworker_batch_t *batch;
   cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
 
   tor_assert(threadpool);
 
@@ -535,42 +742,19 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
+  /* We have idle workers, so there's nothing to batch this with. */
+  batch = cpuworker_batch_new(onionskin->handshake_type);
+  if (!(job = cpuworker_job_new(circ, onionskin))) {
+    tor_free(batch);
     return -1;
   }
+  batch->jobs[batch->n_jobs++] = job;
 
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
+  if (cpuworker_queue_batch(batch) < 0) {
+    cpuworker_job_free_unprocessed(job);
+    tor_free(batch);
+    return -1;
+  }
 
   return 0;
 }
@@ -580,18 +764,28 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
+  cpuworker_batch_t *batch;
+  int i;
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
+  batch = workqueue_entry_cancel(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled.  Take this circuit's job out of the batch,
+     * and give the rest back to the workers. */
+    for (i = 0; i < batch->n_jobs; ++i) {
+      if (batch->jobs[i]->circ == circ)
+        break;
+    }
+    tor_assert(i < batch->n_jobs);
+    cpuworker_job_free_unprocessed(batch->jobs[i]);
+    batch->jobs[i] = batch->jobs[--batch->n_jobs];
     circ->workqueue_entry = NULL;
+
+    if (batch->n_jobs == 0)
+      tor_free(batch);
+    else if (cpuworker_queue_batch(batch) < 0)
+      cpuworker_batch_fail(batch);
   }
+  /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
 }
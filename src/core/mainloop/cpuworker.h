@@ -13,6 +13,7 @@
 #define TOR_CPUWORKER_H
 
 void cpu_init(void);
+int cpuworker_is_running(void);
 void cpuworkers_rotate_keyinfo(void);
 struct workqueue_entry_s;
 enum workqueue_reply_t;
@@ -33,5 +34,9 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+#ifdef CPUWORKER_PRIVATE
+STATIC void queue_pending_tasks(void);
+#endif /* defined(CPUWORKER_PRIVATE) */
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
@@ -1356,6 +1356,7 @@ CALLBACK(reset_padding_counts);
 CALLBACK(retry_listeners);
 CALLBACK(rotate_x509_certificate);
 CALLBACK(save_state);
+CALLBACK(shrink_buffer_freelists);
 CALLBACK(write_stats_file);
 CALLBACK(control_per_second_events);
 CALLBACK(second_elapsed);
@@ -1374,6 +1375,7 @@ STATIC periodic_event_item_t mainloop_periodic_events[] = {
   CALLBACK(add_entropy, ALL, 0),
   CALLBACK(heartbeat, ALL, 0),
   CALLBACK(reset_padding_counts, ALL, 0),
+  CALLBACK(shrink_buffer_freelists, ALL, 0),
 
   /* This is a legacy catch-all callback that runs once per second if
    * we are online and active. */
@@ -1999,6 +2001,20 @@ clean_caches_callback(time_t now, const or_options_t *options)
   return CLEAN_CACHES_INTERVAL;
 }
 
+/**
+ * Periodic callback: give back to the allocator any buffer chunks that have
+ * sat unused on the freelists since the last time we ran.
+ */
+static int
+shrink_buffer_freelists_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  buf_shrink_freelists(0);
+#define SHRINK_BUFFER_FREELISTS_INTERVAL 60
+  return SHRINK_BUFFER_FREELISTS_INTERVAL;
+}
+
 /**
  * Periodic callback: Clean the cache of failed hidden service lookups
  * frequently.
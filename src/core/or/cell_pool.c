@@ -0,0 +1,267 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_pool.c
+ * \brief Slab allocator for packed cells.
+ *
+ * Every cell that we queue on a circuit lives in a packed_cell_t for a
+ * short while, which makes these the most frequently allocated objects in
+ * Tor.  Rather than asking malloc for each one, we carve them out of slabs
+ * of CELLS_PER_SLAB cells apiece.
+ *
+ * The pool keeps lists of its partly used slabs and of its empty ones; full
+ * slabs are on neither.  We hand out cells from the partly used slabs first,
+ * starting with the one that was full most recently, so that the others get
+ * a chance to drain.  We only keep a few empty slabs
+ * around for the next burst of traffic.  When cell_queues_check_size()
+ * notices memory pressure, it calls cell_pool_trim() to give all the empty
+ * slabs back to the allocator.
+ *
+ * Cells are only allocated and freed from the main thread.
+ **/
+
+#define CELL_POOL_PRIVATE
+#include "core/or/or.h"
+#include "core/or/cell_pool.h"
+
+/** Slabs with some cells in use and some free, most recently filled
+ * first. */
+static cell_slab_t *used_slabs = NULL;
+/** Slabs with no cells in use. */
+static cell_slab_t *empty_slabs = NULL;
+/** Every slab in the pool, in no particular order. */
+static smartlist_t *all_slabs = NULL;
+/** Statistics for the pool. */
+static cell_pool_stats_t pool_stats;
+
+/** Remove <b>slab</b> from the list whose head is *<b>list</b>. */
+static inline void
+slab_list_remove(cell_slab_t **list, cell_slab_t *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+/** Add <b>slab</b> to the front of the list whose head is *<b>list</b>. */
+static inline void
+slab_list_push(cell_slab_t **list, cell_slab_t *slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+/** Return the pooled_cell_t that holds <b>cell</b>. */
+static inline pooled_cell_t *
+pooled_cell_from_cell(packed_cell_t *cell)
+{
+  return (pooled_cell_t *)(((char *)cell) - offsetof(pooled_cell_t, u));
+}
+
+/** Release the storage held by <b>slab</b>, which must not be on the list
+ * of used or empty slabs. */
+static void
+cell_slab_free(cell_slab_t *slab)
+{
+  tor_assert(slab->n_allocated == 0);
+  smartlist_del(all_slabs, slab->all_slabs_idx);
+  if (slab->all_slabs_idx < smartlist_len(all_slabs)) {
+    cell_slab_t *moved = smartlist_get(all_slabs, slab->all_slabs_idx);
+    moved->all_slabs_idx = slab->all_slabs_idx;
+  }
+  ++pool_stats.n_slabs_freed;
+  tor_free(slab);
+}
+
+/** Return a new packed cell.  Its body is not initialized. */
+packed_cell_t *
+cell_pool_alloc(void)
+{
+  cell_slab_t *slab;
+  pooled_cell_t *item;
+
+  if (used_slabs) {
+    slab = used_slabs;
+  } else if (empty_slabs) {
+    slab = empty_slabs;
+    slab_list_remove(&empty_slabs, slab);
+    --pool_stats.n_empty;
+    slab_list_push(&used_slabs, slab);
+    ++pool_stats.n_used;
+  } else {
+    /* Leave the cells themselves uninitialized: we set up each one when we
+     * first hand it out. */
+    slab = tor_malloc(sizeof(cell_slab_t));
+    slab->first_free = NULL;
+    slab->n_allocated = 0;
+    slab->next_unused = 0;
+    if (!all_slabs)
+      all_slabs = smartlist_new();
+    slab->all_slabs_idx = smartlist_len(all_slabs);
+    smartlist_add(all_slabs, slab);
+    slab_list_push(&used_slabs, slab);
+    ++pool_stats.n_used;
+    ++pool_stats.n_slabs_allocated;
+    pool_stats.peak_slabs =
+      MAX(pool_stats.peak_slabs, (int)(pool_stats.n_slabs_allocated -
+                                       pool_stats.n_slabs_freed));
+  }
+
+  if (slab->first_free) {
+    item = slab->first_free;
+    slab->first_free = item->u.next_free;
+  } else {
+    tor_assert(slab->next_unused < CELLS_PER_SLAB);
+    item = &slab->cells[slab->next_unused++];
+    item->slab = slab;
+  }
+
+  if (++slab->n_allocated == CELLS_PER_SLAB) {
+    /* Full slabs aren't on any list until we free one of their cells. */
+    slab_list_remove(&used_slabs, slab);
+    --pool_stats.n_used;
+    ++pool_stats.n_full;
+  }
+
+  /* Every cell gets filled in by cell_pack(), which writes the whole body,
+   * so we only need to clear the other fields. */
+  TOR_SIMPLEQ_NEXT(&item->u.cell, next) = NULL;
+  item->u.cell.inserted_timestamp = 0;
+  return &item->u.cell;
+}
+
+/** Give <b>cell</b>, which must have come from cell_pool_alloc(), back to
+ * the pool. */
+void
+cell_pool_free(packed_cell_t *cell)
+{
+  pooled_cell_t *item;
+  cell_slab_t *slab;
+  if (!cell)
+    return;
+
+  item = pooled_cell_from_cell(cell);
+  slab = item->slab;
+  tor_assert(slab->n_allocated > 0);
+  tor_assert(item >= slab->cells && item < slab->cells + CELLS_PER_SLAB);
+
+  item->u.next_free = slab->first_free;
+  slab->first_free = item;
+
+  if (slab->n_allocated-- == CELLS_PER_SLAB) {
+    /* This slab was full; it is now almost full, so we want to fill it up
+     * again before we touch the others. */
+    --pool_stats.n_full;
+    slab_list_push(&used_slabs, slab);
+    ++pool_stats.n_used;
+  }
+  if (slab->n_allocated == 0) {
+    slab_list_remove(&used_slabs, slab);
+    --pool_stats.n_used;
+    if (pool_stats.n_empty < CELL_POOL_MAX_EMPTY_SLABS) {
+      /* Forget the free cells, so that the slab gets used in order. */
+      slab->first_free = NULL;
+      slab->next_unused = 0;
+      slab_list_push(&empty_slabs, slab);
+      ++pool_stats.n_empty;
+    } else {
+      cell_slab_free(slab);
+    }
+  }
+}
+
+/** Return the number of bytes that each cell takes up in the pool, not
+ * counting the slab headers. */
+size_t
+cell_pool_item_size(void)
+{
+  return sizeof(pooled_cell_t);
+}
+
+/** Free all but <b>n_empty_to_keep</b> of the empty slabs in the pool.
+ * Return the number of bytes freed. */
+size_t
+cell_pool_trim(int n_empty_to_keep)
+{
+  size_t freed = 0;
+  while (pool_stats.n_empty > n_empty_to_keep) {
+    cell_slab_t *slab = empty_slabs;
+    slab_list_remove(&empty_slabs, slab);
+    --pool_stats.n_empty;
+    cell_slab_free(slab);
+    freed += sizeof(cell_slab_t);
+  }
+  return freed;
+}
+
+/** Return the total number of bytes allocated for slabs in the pool. */
+size_t
+cell_pool_get_total_allocation(void)
+{
+  return (size_t)(pool_stats.n_slabs_allocated - pool_stats.n_slabs_freed) *
+    sizeof(cell_slab_t);
+}
+
+/** Log the state of the cell pool at log level <b>severity</b>. */
+void
+cell_pool_log_status(int severity)
+{
+  /* How many partly used slabs are at most 1/4 full, at most 1/2 full, at
+   * most 3/4 full, and more than that? */
+  int n_by_quarter[4] = { 0, 0, 0, 0 };
+  uint64_t n_cells = 0;
+  const cell_slab_t *slab;
+
+  for (slab = used_slabs; slab; slab = slab->next) {
+    int q = (slab->n_allocated * 4 - 1) / CELLS_PER_SLAB;
+    ++n_by_quarter[q];
+    n_cells += slab->n_allocated;
+  }
+  n_cells += ((uint64_t)pool_stats.n_full) * CELLS_PER_SLAB;
+
+  tor_log(severity, LD_MM,
+          "Cell pool: %"TOR_PRIuSZ" bytes in %d slabs of %d cells "
+          "(%d full, %d partly used, %d empty); %"PRIu64" cells in use. "
+          "At most %d slabs at once; %"PRIu64" slabs allocated and "
+          "%"PRIu64" freed in total.",
+          cell_pool_get_total_allocation(),
+          pool_stats.n_full + pool_stats.n_used + pool_stats.n_empty,
+          CELLS_PER_SLAB,
+          pool_stats.n_full, pool_stats.n_used, pool_stats.n_empty,
+          n_cells, pool_stats.peak_slabs,
+          pool_stats.n_slabs_allocated, pool_stats.n_slabs_freed);
+  tor_log(severity, LD_MM,
+          "Cell pool: partly used slabs by occupancy: %d up to 25%%, "
+          "%d up to 50%%, %d up to 75%%, %d above 75%%.",
+          n_by_quarter[0], n_by_quarter[1], n_by_quarter[2], n_by_quarter[3]);
+}
+
+/** Release all storage held by the cell pool.  Any cells still allocated
+ * from the pool become invalid. */
+void
+cell_pool_free_all(void)
+{
+  if (all_slabs) {
+    SMARTLIST_FOREACH(all_slabs, cell_slab_t *, slab, tor_free(slab));
+    smartlist_free(all_slabs);
+  }
+  used_slabs = empty_slabs = NULL;
+  memset(&pool_stats, 0, sizeof(pool_stats));
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the statistics for the cell pool. */
+STATIC const cell_pool_stats_t *
+cell_pool_get_stats(void)
+{
+  return &pool_stats;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
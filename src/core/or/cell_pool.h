@@ -0,0 +1,82 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_pool.h
+ * \brief Header file for cell_pool.c.
+ **/
+
+#ifndef TOR_CELL_POOL_H
+#define TOR_CELL_POOL_H
+
+packed_cell_t *cell_pool_alloc(void);
+void cell_pool_free(packed_cell_t *cell);
+size_t cell_pool_item_size(void);
+size_t cell_pool_trim(int n_empty_to_keep);
+size_t cell_pool_get_total_allocation(void);
+void cell_pool_log_status(int severity);
+void cell_pool_free_all(void);
+
+#ifdef CELL_POOL_PRIVATE
+
+#include "core/or/cell_queue_st.h"
+
+/** How many cells fit in each slab? */
+#define CELLS_PER_SLAB 62
+/** How many empty slabs do we keep around for later use, when we're not
+ * under memory pressure? */
+#define CELL_POOL_MAX_EMPTY_SLABS 8
+
+typedef struct cell_slab_t cell_slab_t;
+
+/** A packed cell, as stored in a slab. */
+typedef struct pooled_cell_t {
+  /** The slab that holds this cell. */
+  cell_slab_t *slab;
+  union {
+    /** The cell itself, when it is in use. */
+    packed_cell_t cell;
+    /** The next free cell in the same slab, when it is not. */
+    struct pooled_cell_t *next_free;
+  } u;
+} pooled_cell_t;
+
+/** A block of memory holding CELLS_PER_SLAB cells. */
+struct cell_slab_t {
+  /** Next and previous slabs on the pool's list of used or empty slabs. */
+  cell_slab_t *next, *prev;
+  /** Index of this slab in the pool's list of all slabs. */
+  int all_slabs_idx;
+  /** First cell in this slab that was freed and not yet reused. */
+  pooled_cell_t *first_free;
+  /** How many cells of this slab are in use? */
+  int n_allocated;
+  /** Index of the first cell in this slab that has never been used. */
+  int next_unused;
+  /** The cells themselves. */
+  pooled_cell_t cells[CELLS_PER_SLAB];
+};
+
+/** Statistics about the pool, for logging and for the unit tests. */
+typedef struct cell_pool_stats_t {
+  /** Number of slabs with every cell in use. */
+  int n_full;
+  /** Number of slabs with some cells in use. */
+  int n_used;
+  /** Number of slabs with no cells in use. */
+  int n_empty;
+  /** Largest number of slabs that we have had at once. */
+  int peak_slabs;
+  /** Number of slabs that we have allocated ever. */
+  uint64_t n_slabs_allocated;
+  /** Number of slabs that we have freed ever. */
+  uint64_t n_slabs_freed;
+} cell_pool_stats_t;
+
+#ifdef TOR_UNIT_TESTS
+STATIC const cell_pool_stats_t *cell_pool_get_stats(void);
+#endif /* defined(TOR_UNIT_TESTS) */
+
+#endif /* defined(CELL_POOL_PRIVATE) */
+
+#endif /* !defined(TOR_CELL_POOL_H) */
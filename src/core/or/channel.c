@@ -82,6 +82,7 @@
 #include "lib/evloop/timers.h"
 #include "lib/time/compat_time.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/cell_queue_st.h"
 
 /* Global lists of channels */
@@ -916,6 +917,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_table(chan);
+
   tor_free(chan);
 }
 
@@ -987,6 +990,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_table(chan);
+
   tor_free(chan);
 }
 
@@ -1110,6 +1115,26 @@ channel_set_cell_handlers(channel_t *chan,
   chan->var_cell_handler = var_cell_handler;
 }
 
+/**
+ * Set the handler for runs of fixed-length cells on a channel.
+ *
+ * This handler is optional; channel_process_cells() uses it to hand the
+ * upper layer many cells at once, so that it can share work between them.
+ */
+void
+channel_set_cells_handler(channel_t *chan,
+                          channel_cells_handler_fn_ptr cells_handler)
+{
+  tor_assert(chan);
+  tor_assert(CHANNEL_CAN_HANDLE_CELLS(chan));
+
+  log_debug(LD_CHANNEL,
+           "Setting cells_handler callback for channel %p to %p",
+           chan, cells_handler);
+
+  chan->cells_handler = cells_handler;
+}
+
 /*
  * On closing channels
  *
@@ -1994,6 +2019,46 @@ channel_process_cell(channel_t *chan, cell_t *cell)
   chan->cell_handler(chan, cell);
 }
 
+/**
+ * Process the <b>n_cells</b> cells in <b>cells</b>, which arrived in that
+ * order on the given channel.
+ *
+ * This is the same as calling channel_process_cell() on each of them, except
+ * that the upper layer gets them all at once if it has a cells_handler.
+ */
+void
+channel_process_cells(channel_t *chan, cell_t *cells, int n_cells)
+{
+  int i;
+
+  tor_assert(chan);
+  tor_assert(CHANNEL_IS_CLOSING(chan) || CHANNEL_IS_MAINT(chan) ||
+             CHANNEL_IS_OPEN(chan));
+  tor_assert(cells || n_cells == 0);
+
+  /* Nothing we can do if we have no registered cell handlers */
+  if (!chan->cell_handler || n_cells <= 0)
+    return;
+
+  /* Timestamp for receiving */
+  channel_timestamp_recv(chan);
+  /* Update received counter. */
+  chan->n_cells_recved += n_cells;
+  chan->n_bytes_recved +=
+    (uint64_t) n_cells * get_cell_network_size(chan->wide_circ_ids);
+
+  log_debug(LD_CHANNEL,
+            "Processing %d incoming cells for channel %p (global ID "
+            "%"PRIu64 ")", n_cells, chan,
+            (chan->global_identifier));
+  if (chan->cells_handler) {
+    chan->cells_handler(chan, cells, n_cells);
+  } else {
+    for (i = 0; i < n_cells; ++i)
+      chan->cell_handler(chan, &cells[i]);
+  }
+}
+
 /** If <b>packed_cell</b> on <b>chan</b> is a destroy cell, then set
  * *<b>circid_out</b> to its circuit ID, and return true.  Otherwise, return
  * false. */
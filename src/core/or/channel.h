@@ -23,6 +23,7 @@ struct tor_timer_t;
 typedef void (*channel_listener_fn_ptr)(channel_listener_t *, channel_t *);
 typedef void (*channel_cell_handler_fn_ptr)(channel_t *, cell_t *);
 typedef void (*channel_var_cell_handler_fn_ptr)(channel_t *, var_cell_t *);
+typedef void (*channel_cells_handler_fn_ptr)(channel_t *, cell_t *, int);
 
 /**
  * This enum is used by channelpadding to decide when to pad channels.
@@ -321,6 +322,9 @@ struct channel_s {
   /** Registered handlers for incoming cells */
   channel_cell_handler_fn_ptr cell_handler;
   channel_var_cell_handler_fn_ptr var_cell_handler;
+  /** Optional handler for a run of fixed-length cells that arrived
+   * together; if it is NULL, we pass them to cell_handler one by one. */
+  channel_cells_handler_fn_ptr cells_handler;
 
   /* Methods implemented by the lower layer */
 
@@ -415,6 +419,15 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /**
+   * Open-addressing table from circuit ID to this channel's entries in the
+   * chan,circid map of circuitlist.c, so that finding the circuit for an
+   * incoming cell doesn't need a lookup in the global map.  Only used in
+   * circuitlist.c.
+   */
+  struct chan_circid_slot_t *circid_table;
+  unsigned int circid_table_capacity, circid_table_n;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -439,6 +452,10 @@ struct channel_s {
    */
   unsigned int is_local:1;
 
+  /** Hash of the remote address in the DoS address table, or 0 if we haven't
+   * computed it yet. */
+  uint32_t dos_addr_hash;
+
   /** Have we logged a warning about circID exhaustion on this channel?
    * If so, when? */
   ratelim_t last_warned_circ_ids_exhausted;
@@ -548,6 +565,8 @@ void channel_set_cell_handlers(channel_t *chan,
                                channel_cell_handler_fn_ptr cell_handler,
                                channel_var_cell_handler_fn_ptr
                                  var_cell_handler);
+void channel_set_cells_handler(channel_t *chan,
+                               channel_cells_handler_fn_ptr cells_handler);
 
 /* Clean up closed channels and channel listeners periodically; these are
  * called from run_scheduled_events() in main.c.
@@ -633,6 +652,7 @@ void channel_listener_queue_incoming(channel_listener_t *listener,
 
 /* Incoming cell handling */
 void channel_process_cell(channel_t *chan, cell_t *cell);
+void channel_process_cells(channel_t *chan, cell_t *cells, int n_cells);
 
 /* Request from lower layer for more cells if available */
 MOCK_DECL(ssize_t, channel_flush_some_cells,
@@ -1140,6 +1140,45 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/**
+ * Handle <b>n_cells</b> incoming cells on a channel_tls_t.
+ *
+ * This is the same as calling channel_tls_handle_cell() on each cell of
+ * <b>cells</b> in order, except that once the connection is open, we pass
+ * every run of relay cells up to the channel_t layer at once, so that the
+ * upper layers can share work between them.
+ */
+void
+channel_tls_handle_cells(cell_t *cells, int n_cells, or_connection_t *conn)
+{
+  channel_tls_t *chan;
+  int i = 0, j;
+
+  tor_assert(cells || n_cells == 0);
+  tor_assert(conn);
+
+  while (i < n_cells) {
+    chan = conn->chan;
+    if (!chan || conn->base_.marked_for_close ||
+        TO_CONN(conn)->state != OR_CONN_STATE_OPEN ||
+        cells[i].command != CELL_RELAY) {
+      channel_tls_handle_cell(&cells[i++], conn);
+      continue;
+    }
+
+    for (j = i; j < n_cells && cells[j].command == CELL_RELAY; ++j) {
+      rep_hist_padding_count_read(PADDING_TYPE_TOTAL);
+      if (TLS_CHAN_TO_BASE(chan)->padding_enabled)
+        rep_hist_padding_count_read(PADDING_TYPE_ENABLED_TOTAL);
+    }
+    /* We note that we're on the internet whenever we read a cell. */
+    entry_guards_note_internet_connectivity(get_guard_selection_info());
+
+    channel_process_cells(TLS_CHAN_TO_BASE(chan), &cells[i], j - i);
+    i = j;
+  }
+}
+
 /**
  * Handle an incoming variable-length cell on a channel_tls_t.
  *
@@ -68,6 +68,9 @@ struct circuit_t {
 
   /** Queue of cells waiting to be transmitted on n_chan */
   cell_queue_t n_chan_cells;
+  /** Slot of this circuit's entry in n_chan's circuitmux. This is only a
+   * hint for circuitmux.c, which checks it before using it. */
+  int n_mux_slot;
 
   /**
    * The hop to which we want to extend this circuit.  Should be NULL if
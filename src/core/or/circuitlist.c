@@ -86,6 +86,7 @@
 #include "core/or/policies.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
 #include "feature/rend/rendclient.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/stats/predict_ports.h"
@@ -172,8 +173,9 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
+/** A map from channel and circuit ID to circuit.  Every entry is also in the
+ * circuit ID table of its channel, which is what we search when a cell
+ * arrives; the global map owns the entries and lets us find them all. */
 typedef struct chan_circid_circuit_map_t {
   HT_ENTRY(chan_circid_circuit_map_t) node;
   channel_t *chan;
@@ -181,6 +183,9 @@ typedef struct chan_circid_circuit_map_t {
   circuit_t *circuit;
   /* For debugging 12184: when was this placeholder item added? */
   time_t made_placeholder_at;
+  /* True iff this entry is in the circuit ID table of chan. Entries can
+   * outlive their channel, but never while they are in its table. */
+  unsigned int in_chan_table : 1;
 } chan_circid_circuit_map_t;
 
 /** Helper for hash tables: compare the channel and circuit ID for a and
@@ -218,6 +223,155 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
+/** One slot in the circuit ID table of a channel. A slot is empty iff its
+ * <b>ent</b> is NULL. */
+typedef struct chan_circid_slot_t {
+  circid_t circ_id;
+  chan_circid_circuit_map_t *ent;
+} chan_circid_slot_t;
+
+/** Smallest nonzero size of the circuit ID table of a channel. */
+#define CHAN_CIRCID_TABLE_MIN_CAPACITY 16
+
+/** Helper: return the preferred slot for <b>circ_id</b> in a circuit ID
+ * table with <b>capacity</b> slots. */
+static inline unsigned
+chan_circid_table_slot(circid_t circ_id, unsigned capacity)
+{
+  /* Our peers pick some of these IDs, so use a keyed hash. */
+  return (unsigned) siphash24g(&circ_id, sizeof(circ_id)) & (capacity - 1);
+}
+
+/** Return the entry of the chan,circid map for <b>circ_id</b> on
+ * <b>chan</b>, or NULL if there is none.
+ *
+ * Every channel keeps the entries of the map that belong to it in its own
+ * small open-addressing table, so that we don't need to search the global
+ * map (and miss the cache) for every cell we receive. */
+static chan_circid_circuit_map_t *
+chan_circid_table_get(const channel_t *chan, circid_t circ_id)
+{
+  const chan_circid_slot_t *table = chan->circid_table;
+  unsigned mask, i;
+
+  if (!table)
+    return NULL;
+
+  mask = chan->circid_table_capacity - 1;
+  for (i = chan_circid_table_slot(circ_id, chan->circid_table_capacity);
+       table[i].ent; i = (i + 1) & mask) {
+    if (table[i].circ_id == circ_id)
+      return table[i].ent;
+  }
+  return NULL;
+}
+
+/** Replace the circuit ID table of <b>chan</b> with one of <b>capacity</b>
+ * slots, holding the same entries. */
+static void
+chan_circid_table_resize(channel_t *chan, unsigned capacity)
+{
+  chan_circid_slot_t *old_table = chan->circid_table;
+  unsigned old_capacity = chan->circid_table_capacity;
+  unsigned i, j;
+
+  tor_assert(capacity > chan->circid_table_n * 2);
+
+  chan->circid_table = tor_calloc(capacity, sizeof(chan_circid_slot_t));
+  chan->circid_table_capacity = capacity;
+  for (i = 0; i < old_capacity; ++i) {
+    if (!old_table[i].ent)
+      continue;
+    for (j = chan_circid_table_slot(old_table[i].circ_id, capacity);
+         chan->circid_table[j].ent; j = (j + 1) & (capacity - 1))
+      ;
+    chan->circid_table[j] = old_table[i];
+  }
+  tor_free(old_table);
+}
+
+/** Make <b>ent</b> the entry for its circuit ID in the circuit ID table of
+ * its channel, replacing any entry we had for that ID. */
+static void
+chan_circid_table_set(chan_circid_circuit_map_t *ent)
+{
+  channel_t *chan = ent->chan;
+  unsigned mask, i;
+
+  if ((chan->circid_table_n + 1) * 2 > chan->circid_table_capacity) {
+    chan_circid_table_resize(chan,
+                             chan->circid_table_capacity ?
+                               chan->circid_table_capacity * 2 :
+                               CHAN_CIRCID_TABLE_MIN_CAPACITY);
+  }
+
+  mask = chan->circid_table_capacity - 1;
+  for (i = chan_circid_table_slot(ent->circ_id, chan->circid_table_capacity);
+       chan->circid_table[i].ent; i = (i + 1) & mask) {
+    if (chan->circid_table[i].circ_id == ent->circ_id) {
+      chan->circid_table[i].ent->in_chan_table = 0;
+      chan->circid_table[i].ent = ent;
+      ent->in_chan_table = 1;
+      return;
+    }
+  }
+  chan->circid_table[i].circ_id = ent->circ_id;
+  chan->circid_table[i].ent = ent;
+  ent->in_chan_table = 1;
+  ++chan->circid_table_n;
+}
+
+/** Remove <b>ent</b> from the circuit ID table of its channel, if it is
+ * there. This never looks at the channel of an entry that isn't in a
+ * table, so it is safe to call after the channel is gone. */
+static void
+chan_circid_table_remove(chan_circid_circuit_map_t *ent)
+{
+  channel_t *chan;
+  chan_circid_slot_t *table;
+  unsigned mask, i, j, home;
+
+  if (!ent->in_chan_table)
+    return;
+  chan = ent->chan;
+  table = chan->circid_table;
+  ent->in_chan_table = 0;
+
+  mask = chan->circid_table_capacity - 1;
+  for (i = chan_circid_table_slot(ent->circ_id, chan->circid_table_capacity);
+       table[i].ent != ent; i = (i + 1) & mask) {
+    tor_assert(table[i].ent);
+  }
+
+  /* Shift back the entries after the hole that would not be found any
+   * more, so that we never need tombstones. */
+  for (j = (i + 1) & mask; table[j].ent; j = (j + 1) & mask) {
+    home = chan_circid_table_slot(table[j].circ_id,
+                                  chan->circid_table_capacity);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i].ent = NULL;
+  table[i].circ_id = 0;
+  --chan->circid_table_n;
+}
+
+/** Release the circuit ID table of <b>chan</b>.  The entries themselves
+ * belong to the global chan,circid map. */
+void
+channel_free_circid_table(channel_t *chan)
+{
+  unsigned i;
+  for (i = 0; i < chan->circid_table_capacity; ++i) {
+    if (chan->circid_table[i].ent)
+      chan->circid_table[i].ent->in_chan_table = 0;
+  }
+  tor_free(chan->circid_table);
+  chan->circid_table_capacity = chan->circid_table_n = 0;
+}
+
 /** The most recently returned entry from circuit_get_by_circid_chan;
  * used to improve performance when many cells arrive in a row from the
  * same circuit.
@@ -281,6 +435,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     search.chan = old_chan;
     found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
     if (found) {
+      chan_circid_table_remove(found);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -314,6 +469,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->circuit = circ;
     HT_INSERT(chan_circid_map, &chan_circid_map, found);
   }
+  chan_circid_table_set(found);
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -366,6 +522,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     /* It's already marked. */
     if (!ent->made_placeholder_at)
       ent->made_placeholder_at = approx_time();
+    chan_circid_table_set(ent);
   } else {
     ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
     ent->chan = chan;
@@ -373,6 +530,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
     HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_table_set(ent);
   }
 }
 
@@ -390,6 +548,8 @@ channel_mark_circid_usable(channel_t *chan, circid_t id)
   search.chan = chan;
   search.circ_id = id;
   ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  if (ent)
+    chan_circid_table_remove(ent);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
@@ -1196,6 +1356,9 @@ circuit_free_(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
+    /* Do this before clearing the crypto state: a worker thread might still
+     * be using it. */
+    relay_crypto_pipeline_circuit_free(ocirc);
     relay_crypto_clear(&ocirc->crypto);
 
     if (ocirc->rend_splice) {
@@ -1332,6 +1495,7 @@ circuit_free_all(void)
       next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
 
       tor_assert(c->circuit == NULL);
+      chan_circid_table_remove(c);
       tor_free(c);
     }
   }
@@ -1443,7 +1607,6 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
   if (_last_circid_chan_ent &&
@@ -1451,9 +1614,7 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
       chan == _last_circid_chan_ent->chan) {
     found = _last_circid_chan_ent;
   } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_table_get(chan, circ_id);
     _last_circid_chan_ent = found;
   }
   if (found && found->circuit) {
@@ -1552,14 +1713,9 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_table_get(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -2492,7 +2648,8 @@ marked_circuit_free_stream_bytes(circuit_t *c)
   }
 }
 
-/** Return the number of cells used by the circuit <b>c</b>'s cell queues. */
+/** Return the number of cells used by the circuit <b>c</b>'s cell queues,
+ * including the cells that it has waiting in the relay crypto pipeline. */
 STATIC size_t
 n_cells_in_circ_queues(const circuit_t *c)
 {
@@ -2500,6 +2657,7 @@ n_cells_in_circ_queues(const circuit_t *c)
   if (! CIRCUIT_IS_ORIGIN(c)) {
     circuit_t *cc = (circuit_t *) c;
     n += TO_OR_CIRCUIT(cc)->p_chan_cells.n;
+    n += relay_crypto_pipeline_circuit_n_cells(TO_OR_CIRCUIT(cc));
   }
   return n;
 }
@@ -2519,7 +2677,8 @@ circuit_alloc_in_half_streams(const circuit_t *c)
 }
 
 /**
- * Return the age of the oldest cell queued on <b>c</b>, in timestamp units.
+ * Return the age of the oldest cell queued on <b>c</b>, in timestamp units,
+ * counting the cells that it has waiting in the relay crypto pipeline.
  * Return 0 if there are no cells queued on c.  Requires that <b>now</b> be
  * the current coarse timestamp.
  *
@@ -2537,11 +2696,15 @@ circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
+    uint32_t age2;
     if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
-      uint32_t age2 = now - cell->inserted_timestamp;
+      age2 = now - cell->inserted_timestamp;
       if (age2 > age)
-        return age2;
+        age = age2;
     }
+    age2 = relay_crypto_pipeline_circuit_max_cell_age(orcirc, now);
+    if (age2 > age)
+      age = age2;
   }
   return age;
 }
@@ -2771,6 +2934,9 @@ circuits_handle_oom(size_t current_allocation)
 
  done_recovering_mem:
 
+  /* Don't let the buffers that we just freed linger on the freelists. */
+  buf_shrink_freelists(1);
+
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
              "connections.",
@@ -118,6 +118,18 @@ struct circuitmux_s {
    */
   chanid_circid_muxinfo_map_t *chanid_circid_map;
 
+  /*
+   * Dense array of the entries of chanid_circid_map, indexed by the slot
+   * number each entry keeps. Every circuit remembers the slot of its entry
+   * for each direction, so that we can usually find it without a hash table
+   * lookup. Unused slots are NULL; their numbers are kept in free_slots so
+   * that we can reuse them.
+   */
+  chanid_circid_muxinfo_t **slots;
+  int n_slots, slots_capacity;
+  int *free_slots;
+  int n_free_slots;
+
   /** List of queued destroy cells */
   destroy_cell_queue_t destroy_cell_queue;
   /** Boolean: True iff the last cell to circuitmux_get_first_active_circuit
@@ -170,6 +182,8 @@ struct chanid_circid_muxinfo_t {
   HT_ENTRY(chanid_circid_muxinfo_t) node;
   uint64_t chan_id;
   circid_t circ_id;
+  /* Index of this entry in the slots array of its circuitmux_t */
+  int slot;
   circuit_muxinfo_t muxinfo;
 };
 
@@ -184,6 +198,9 @@ static inline unsigned int
 chanid_circid_entry_hash(chanid_circid_muxinfo_t *a);
 static chanid_circid_muxinfo_t *
 circuitmux_find_map_entry(circuitmux_t *cmux, circuit_t *circ);
+static chanid_circid_muxinfo_t *
+circuitmux_lookup_entry(circuitmux_t *cmux, uint64_t chan_id,
+                        circid_t circ_id, int *slot_hint);
 static void
 circuitmux_make_circuit_active(circuitmux_t *cmux, circuit_t *circ);
 static void
@@ -231,6 +248,60 @@ HT_GENERATE2(chanid_circid_muxinfo_map, chanid_circid_muxinfo_t, node,
              chanid_circid_entry_hash, chanid_circid_entries_eq, 0.6,
              tor_reallocarray_, tor_free_)
 
+/**
+ * Helper: return a pointer to the slot hint <b>circ</b> keeps for its
+ * circuitmux entry in <b>direction</b>.
+ */
+
+static inline int *
+circuit_mux_slot_ptr(circuit_t *circ, cell_direction_t direction)
+{
+  if (direction == CELL_DIRECTION_OUT)
+    return &circ->n_mux_slot;
+  else
+    return &TO_OR_CIRCUIT(circ)->p_mux_slot;
+}
+
+/**
+ * Give the map entry <b>ent</b> a slot in the dense slots array of
+ * <b>cmux</b>, reusing a free one if we have any.
+ */
+
+static void
+circuitmux_add_slot(circuitmux_t *cmux, chanid_circid_muxinfo_t *ent)
+{
+  if (cmux->n_free_slots > 0) {
+    ent->slot = cmux->free_slots[--cmux->n_free_slots];
+  } else {
+    if (cmux->n_slots == cmux->slots_capacity) {
+      cmux->slots_capacity = cmux->slots_capacity ?
+        cmux->slots_capacity * 2 : 16;
+      cmux->slots = tor_reallocarray(cmux->slots, cmux->slots_capacity,
+                                     sizeof(*cmux->slots));
+      cmux->free_slots = tor_reallocarray(cmux->free_slots,
+                                          cmux->slots_capacity,
+                                          sizeof(*cmux->free_slots));
+    }
+    ent->slot = cmux->n_slots++;
+  }
+  cmux->slots[ent->slot] = ent;
+}
+
+/**
+ * Release the slot of the map entry <b>ent</b> in <b>cmux</b>.
+ */
+
+static void
+circuitmux_remove_slot(circuitmux_t *cmux, chanid_circid_muxinfo_t *ent)
+{
+  tor_assert(ent->slot >= 0 && ent->slot < cmux->n_slots);
+  tor_assert(cmux->slots[ent->slot] == ent);
+
+  cmux->slots[ent->slot] = NULL;
+  cmux->free_slots[cmux->n_free_slots++] = ent->slot;
+  ent->slot = -1;
+}
+
 /*
  * Circuitmux alloc/free functions
  */
@@ -357,6 +428,9 @@ circuitmux_detach_all_circuits(circuitmux_t *cmux, smartlist_t *detached_out)
     tor_free(to_remove);
   }
 
+  /* Every entry is gone, so every slot is free again */
+  cmux->n_slots = cmux->n_free_slots = 0;
+
   cmux->n_circuits = 0;
   cmux->n_active_circuits = 0;
   cmux->n_cells = 0;
@@ -409,6 +483,8 @@ circuitmux_free_(circuitmux_t *cmux)
     HT_CLEAR(chanid_circid_muxinfo_map, cmux->chanid_circid_map);
     tor_free(cmux->chanid_circid_map);
   }
+  tor_free(cmux->slots);
+  tor_free(cmux->free_slots);
 
   /*
    * We're throwing away some destroys; log the counter and
@@ -620,7 +696,7 @@ circuitmux_attached_circuit_direction(circuitmux_t *cmux, circuit_t *circ)
 static chanid_circid_muxinfo_t *
 circuitmux_find_map_entry(circuitmux_t *cmux, circuit_t *circ)
 {
-  chanid_circid_muxinfo_t search, *hashent = NULL;
+  chanid_circid_muxinfo_t *hashent = NULL;
 
   /* Sanity-check parameters */
   tor_assert(cmux);
@@ -630,12 +706,8 @@ circuitmux_find_map_entry(circuitmux_t *cmux, circuit_t *circ)
   /* Check if we have n_chan */
   if (circ->n_chan) {
     /* Okay, let's see if it's attached for n_chan/n_circ_id */
-    search.chan_id = circ->n_chan->global_identifier;
-    search.circ_id = circ->n_circ_id;
-
-    /* Query */
-    hashent = HT_FIND(chanid_circid_muxinfo_map, cmux->chanid_circid_map,
-                      &search);
+    hashent = circuitmux_lookup_entry(cmux, circ->n_chan->global_identifier,
+                                      circ->n_circ_id, &circ->n_mux_slot);
   }
 
   /* Found something? */
@@ -648,13 +720,14 @@ circuitmux_find_map_entry(circuitmux_t *cmux, circuit_t *circ)
   } else {
     /* Not there, have we got a p_chan/p_circ_id to try? */
     if (circ->magic == OR_CIRCUIT_MAGIC) {
-      search.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
       /* Check for p_chan */
-      if (TO_OR_CIRCUIT(circ)->p_chan) {
-        search.chan_id = TO_OR_CIRCUIT(circ)->p_chan->global_identifier;
+      if (or_circ->p_chan) {
         /* Okay, search for that */
-        hashent = HT_FIND(chanid_circid_muxinfo_map, cmux->chanid_circid_map,
-                          &search);
+        hashent = circuitmux_lookup_entry(cmux,
+                                          or_circ->p_chan->global_identifier,
+                                          or_circ->p_circ_id,
+                                          &or_circ->p_mux_slot);
         /* Find anything? */
         if (hashent) {
           /* Assert that the direction makes sense before we return it */
@@ -668,6 +741,40 @@ circuitmux_find_map_entry(circuitmux_t *cmux, circuit_t *circ)
   return hashent;
 }
 
+/**
+ * Find the entry in the cmux's map for the (<b>chan_id</b>, <b>circ_id</b>)
+ * pair, or return NULL if there is none.
+ *
+ * We try the slot *<b>slot_hint</b> first, which saves us the hash table
+ * lookup when the circuit's hint is still right; the hint can be stale or
+ * belong to another circuitmux, so we only trust it if the entry there has
+ * the right key. If we had to search the map, we update the hint.
+ */
+
+static chanid_circid_muxinfo_t *
+circuitmux_lookup_entry(circuitmux_t *cmux, uint64_t chan_id,
+                        circid_t circ_id, int *slot_hint)
+{
+  chanid_circid_muxinfo_t search, *hashent = NULL;
+  int slot = *slot_hint;
+
+  if (slot >= 0 && slot < cmux->n_slots) {
+    hashent = cmux->slots[slot];
+    if (hashent && hashent->chan_id == chan_id &&
+        hashent->circ_id == circ_id)
+      return hashent;
+  }
+
+  search.chan_id = chan_id;
+  search.circ_id = circ_id;
+  hashent = HT_FIND(chanid_circid_muxinfo_map, cmux->chanid_circid_map,
+                    &search);
+  if (hashent)
+    *slot_hint = hashent->slot;
+
+  return hashent;
+}
+
 /**
  * Query whether a circuit is attached to a circuitmux
  */
@@ -782,8 +889,9 @@ circuitmux_attach_circuit,(circuitmux_t *cmux, circuit_t *circ,
   channel_t *chan = NULL;
   uint64_t channel_id;
   circid_t circ_id;
-  chanid_circid_muxinfo_t search, *hashent = NULL;
+  chanid_circid_muxinfo_t *hashent = NULL;
   unsigned int cell_count;
+  int *slot_hint;
 
   tor_assert(cmux);
   tor_assert(circ);
@@ -815,10 +923,8 @@ circuitmux_attach_circuit,(circuitmux_t *cmux, circuit_t *circ,
   channel_id = chan->global_identifier;
 
   /* See if we already have this one */
-  search.chan_id = channel_id;
-  search.circ_id = circ_id;
-  hashent = HT_FIND(chanid_circid_muxinfo_map, cmux->chanid_circid_map,
-                    &search);
+  slot_hint = circuit_mux_slot_ptr(circ, direction);
+  hashent = circuitmux_lookup_entry(cmux, channel_id, circ_id, slot_hint);
 
   if (hashent) {
     /*
@@ -881,6 +987,8 @@ circuitmux_attach_circuit,(circuitmux_t *cmux, circuit_t *circ,
     }
     HT_INSERT(chanid_circid_muxinfo_map, cmux->chanid_circid_map,
               hashent);
+    circuitmux_add_slot(cmux, hashent);
+    *slot_hint = hashent->slot;
 
     /* Update counters */
     ++(cmux->n_circuits);
@@ -900,7 +1008,7 @@ circuitmux_attach_circuit,(circuitmux_t *cmux, circuit_t *circ,
 MOCK_IMPL(void,
 circuitmux_detach_circuit,(circuitmux_t *cmux, circuit_t *circ))
 {
-  chanid_circid_muxinfo_t search, *hashent = NULL;
+  chanid_circid_muxinfo_t *hashent = NULL;
   /*
    * Use this to keep track of whether we found it for n_chan or
    * p_chan for consistency checking.
@@ -916,22 +1024,20 @@ circuitmux_detach_circuit,(circuitmux_t *cmux, circuit_t *circ))
 
   /* See if we have it for n_chan/n_circ_id */
   if (circ->n_chan) {
-    search.chan_id = circ->n_chan->global_identifier;
-    search.circ_id = circ->n_circ_id;
-    hashent = HT_FIND(chanid_circid_muxinfo_map, cmux->chanid_circid_map,
-                        &search);
+    hashent = circuitmux_lookup_entry(cmux, circ->n_chan->global_identifier,
+                                      circ->n_circ_id, &circ->n_mux_slot);
     last_searched_direction = CELL_DIRECTION_OUT;
   }
 
   /* Got one? If not, see if it's an or_circuit_t and try p_chan/p_circ_id */
   if (!hashent) {
     if (circ->magic == OR_CIRCUIT_MAGIC) {
-      search.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
-      if (TO_OR_CIRCUIT(circ)->p_chan) {
-        search.chan_id = TO_OR_CIRCUIT(circ)->p_chan->global_identifier;
-        hashent = HT_FIND(chanid_circid_muxinfo_map,
-                            cmux->chanid_circid_map,
-                            &search);
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+      if (or_circ->p_chan) {
+        hashent = circuitmux_lookup_entry(cmux,
+                                          or_circ->p_chan->global_identifier,
+                                          or_circ->p_circ_id,
+                                          &or_circ->p_mux_slot);
         last_searched_direction = CELL_DIRECTION_IN;
       }
     }
@@ -972,6 +1078,7 @@ circuitmux_detach_circuit,(circuitmux_t *cmux, circuit_t *circ))
 
     /* Now remove it from the map */
     HT_REMOVE(chanid_circid_muxinfo_map, cmux->chanid_circid_map, hashent);
+    circuitmux_remove_slot(cmux, hashent);
 
     /* Free the hash entry */
     tor_free(hashent);
@@ -19,8 +19,13 @@
  * cell: that would be horribly inefficient.  Instead, we we keep the cell
  * count on all circuits on the same circuitmux scaled relative to a single
  * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * that has elapsed since the tick.  We only re-scale the circuits on the
+ * circuitmux once that weight gets big enough that we could lose precision
+ * or overflow double, which with the usual halflife is every half hour or so.
+ *
+ * The active circuits of a circuitmux are kept in a 4-ary min-heap stored
+ * in a single array, with each cell count copied next to its cell_ewma_t so
+ * that sifting the heap doesn't have to look at the circuits themselves.
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -58,9 +63,23 @@
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
 
+/** How much (as a power of two) we let the weight of a new cell grow with
+ * respect to the tick the circuitmux's cell counts are scaled to before we
+ * rescale them all. */
+#define EWMA_MAX_RESCALE_LOG2 64
+/** Never wait more than this many ticks between rescales, so that tick
+ * differences always fit in an int. */
+#define EWMA_MAX_RESCALE_INTERVAL (1u<<20)
+
+/** Number of children of each node of the active circuit heap. */
+#define EWMA_HEAP_ARITY 4
+/** Initial number of slots of the active circuit heap. */
+#define EWMA_HEAP_INITIAL_CAPACITY 16
+
 /*** EWMA structures ***/
 
 typedef struct cell_ewma_s cell_ewma_t;
+typedef struct ewma_heap_ent_s ewma_heap_ent_t;
 typedef struct ewma_policy_data_s ewma_policy_data_t;
 typedef struct ewma_policy_circ_data_s ewma_policy_circ_data_t;
 
@@ -88,21 +107,38 @@ struct cell_ewma_s {
   int heap_index;
 };
 
+/**
+ * One slot of the active circuit heap.  The cell count is a copy of
+ * ewma->cell_count, kept here so that heap operations only touch the heap
+ * array.
+ */
+struct ewma_heap_ent_s {
+  /** The cell count of <b>ewma</b>. */
+  double cell_count;
+  /** The cell_ewma_t of the active circuit in this slot. */
+  cell_ewma_t *ewma;
+};
+
 struct ewma_policy_data_s {
   circuitmux_policy_data_t base_;
 
   /**
    * Priority queue of cell_ewma_t for circuits with queued cells waiting
    * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
+   * as an EWMA_HEAP_ARITY-ary min-heap according to EWMA.  This was
+   * formerly in channel_t, and in or_connection_t before that.
    */
-  smartlist_t *active_circuit_pqueue;
+  ewma_heap_ent_t *active_circuit_heap;
+  /** Number of circuits in active_circuit_heap. */
+  int n_active_circuits;
+  /** Number of slots allocated in active_circuit_heap. */
+  int active_circuit_heap_capacity;
 
   /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
+   * The tick on which the cell_ewma_ts in active_circuit_heap last had
+   * their ewma values rescaled.  Their cell counts are all scaled relative
+   * to this tick.  This was formerly in channel_t, and in or_connection_t
+   * before that.
    */
   unsigned int active_circuit_pqueue_last_recalibrated;
 };
@@ -170,14 +206,14 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
+static int compare_cell_ewma_counts(double c1, double c2);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
+static void ewma_heap_sift_down(ewma_policy_data_t *pol, int idx);
 
 /*** Circuitmux policy methods ***/
 
@@ -224,6 +260,10 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  */
 static double ewma_scale_factor = 0.1;
 
+/** How many ticks may pass before we rescale the cell counts of the active
+ * circuits of a circuitmux.  See EWMA_MAX_RESCALE_LOG2. */
+static unsigned ewma_rescale_interval = 1;
+
 /*** EWMA circuitmux_policy_t method table ***/
 
 circuitmux_policy_t ewma_policy = {
@@ -273,7 +313,9 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
+  pol->active_circuit_heap_capacity = EWMA_HEAP_INITIAL_CAPACITY;
+  pol->active_circuit_heap = tor_calloc(pol->active_circuit_heap_capacity,
+                                        sizeof(ewma_heap_ent_t));
   pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
 
   return TO_CMUX_POL_DATA(pol);
@@ -294,7 +336,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuit_heap);
   tor_free(pol);
 }
 
@@ -367,7 +409,7 @@ ewma_free_circ_data(circuitmux_t *cmux,
 
 /**
  * Handle circuit activation; this inserts the circuit's cell_ewma into
- * the active_circuits_pqueue.
+ * the active circuit heap.
  */
 
 static void
@@ -392,7 +434,7 @@ ewma_notify_circ_active(circuitmux_t *cmux,
 
 /**
  * Handle circuit deactivation; this removes the circuit's cell_ewma from
- * the active_circuits_pqueue.
+ * the active circuit heap.
  */
 
 static void
@@ -432,7 +474,7 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   ewma_policy_circ_data_t *cdata = NULL;
   unsigned int tick;
   double fractional_tick, ewma_increment;
-  cell_ewma_t *cell_ewma, *tmp;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -446,13 +488,19 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   /* Rescale the EWMAs if needed */
   tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
+  if (tick - pol->active_circuit_pqueue_last_recalibrated >=
+      ewma_rescale_interval) {
     scale_active_circuits(pol, tick);
   }
 
-  /* How much do we adjust the cell count in cell_ewma by? */
+  /* How much do we adjust the cell count in cell_ewma by?  The counts are
+   * scaled relative to the tick of the last rescale, so a cell sent now
+   * weighs more the longer ago that was. */
   ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
+    ((double)(n_cells)) *
+    pow(ewma_scale_factor,
+        -((int)(tick - pol->active_circuit_pqueue_last_recalibrated) +
+          fractional_tick));
 
   /* Do the adjustment */
   cell_ewma = &(cdata->cell_ewma);
@@ -460,11 +508,12 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Its count only went up, so let it sink to its new place.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  tor_assert(pol->n_active_circuits > 0);
+  tor_assert(pol->active_circuit_heap[0].ewma == cell_ewma);
+  pol->active_circuit_heap[0].cell_count = cell_ewma->cell_count;
+  ewma_heap_sift_down(pol, 0);
 }
 
 /**
@@ -486,9 +535,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
+  if (pol->n_active_circuits > 0) {
     /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+    cell_ewma = pol->active_circuit_heap[0].ewma;
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -505,7 +554,7 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
 {
   ewma_policy_data_t *p1 = NULL, *p2 = NULL;
-  cell_ewma_t *ce1 = NULL, *ce2 = NULL;
+  const ewma_heap_ent_t *ce1 = NULL, *ce2 = NULL;
 
   tor_assert(cmux_1);
   tor_assert(pol_data_1);
@@ -517,18 +566,26 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
   if (p1 != p2) {
     /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
+    if (p1->n_active_circuits > 0) {
+      ce1 = &p1->active_circuit_heap[0];
     }
 
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
+    if (p2->n_active_circuits > 0) {
+      ce2 = &p2->active_circuit_heap[0];
     }
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      /* Pick whichever one has the better best circuit, once both counts
+       * are scaled relative to the same tick. */
+      double count1 = ce1->cell_count;
+      if (p1->active_circuit_pqueue_last_recalibrated !=
+          p2->active_circuit_pqueue_last_recalibrated) {
+        count1 *= get_scale_factor(
+                            p1->active_circuit_pqueue_last_recalibrated,
+                            p2->active_circuit_pqueue_last_recalibrated);
+      }
+      return compare_cell_ewma_counts(count1, ce2->cell_count);
     } else {
       if (ce1 != NULL ) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -547,15 +604,13 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   }
 }
 
-/** Helper for sorting cell_ewma_t values in their priority queue. */
+/** Helper for ordering cell_ewma_t values by cell count. */
 static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
+compare_cell_ewma_counts(double c1, double c2)
 {
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
-  if (e1->cell_count < e2->cell_count)
+  if (c1 < c2)
     return -1;
-  else if (e1->cell_count > e2->cell_count)
+  else if (c1 > c2)
     return 1;
   else
     return 0;
@@ -717,6 +772,11 @@ cmux_ewma_set_options(const or_options_t *options,
   halflife /= EWMA_TICK_LEN;
   /* compute per-tick scale factor. */
   ewma_scale_factor = exp( LOG_ONEHALF / halflife );
+  /* Weights grow by a factor of 2 every halflife, so we can wait
+   * EWMA_MAX_RESCALE_LOG2 halflives before rescaling. */
+  ewma_rescale_interval = (unsigned)
+    CLAMP(1.0, floor(EWMA_MAX_RESCALE_LOG2 * halflife),
+          (double) EWMA_MAX_RESCALE_INTERVAL);
   log_info(LD_OR,
            "Enabled cell_ewma algorithm because of value in %s; "
            "scale factor is %f per %d seconds",
@@ -752,7 +812,7 @@ scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
   double factor;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  tor_assert(pol->active_circuit_heap);
 
   factor =
     get_scale_factor(
@@ -760,24 +820,81 @@ scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
       cur_tick);
   /** Ordinarily it isn't okay to change the value of an element in a heap,
    * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
+  for (int i = 0; i < pol->n_active_circuits; ++i) {
+    ewma_heap_ent_t *ent = &pol->active_circuit_heap[i];
+    tor_assert(ent->ewma->last_adjusted_tick ==
                pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
+    ent->cell_count *= factor;
+    ent->ewma->cell_count = ent->cell_count;
+    ent->ewma->last_adjusted_tick = cur_tick;
+  }
   pol->active_circuit_pqueue_last_recalibrated = cur_tick;
 }
 
+/** Put <b>ent</b> in slot <b>idx</b> of <b>pol</b>'s active circuit heap,
+ * and tell its cell_ewma_t where it is. */
+static inline void
+ewma_heap_set(ewma_policy_data_t *pol, int idx, const ewma_heap_ent_t *ent)
+{
+  pol->active_circuit_heap[idx] = *ent;
+  ent->ewma->heap_index = idx;
+}
+
+/** Move the entry in slot <b>idx</b> of <b>pol</b>'s active circuit heap
+ * up until its parent has a lower or equal cell count. */
+static void
+ewma_heap_sift_up(ewma_policy_data_t *pol, int idx)
+{
+  ewma_heap_ent_t *heap = pol->active_circuit_heap;
+  const ewma_heap_ent_t ent = heap[idx];
+
+  while (idx > 0) {
+    const int parent = (idx - 1) / EWMA_HEAP_ARITY;
+    if (heap[parent].cell_count <= ent.cell_count)
+      break;
+    ewma_heap_set(pol, idx, &heap[parent]);
+    idx = parent;
+  }
+  ewma_heap_set(pol, idx, &ent);
+}
+
+/** Move the entry in slot <b>idx</b> of <b>pol</b>'s active circuit heap
+ * down until none of its children has a lower cell count. */
+static void
+ewma_heap_sift_down(ewma_policy_data_t *pol, int idx)
+{
+  ewma_heap_ent_t *heap = pol->active_circuit_heap;
+  const int n = pol->n_active_circuits;
+  const ewma_heap_ent_t ent = heap[idx];
+
+  for (;;) {
+    const int first_child = idx * EWMA_HEAP_ARITY + 1;
+    const int end_child = MIN(first_child + EWMA_HEAP_ARITY, n);
+    int best = -1;
+    double best_count = ent.cell_count;
+    for (int child = first_child; child < end_child; ++child) {
+      if (heap[child].cell_count < best_count) {
+        best = child;
+        best_count = heap[child].cell_count;
+      }
+    }
+    if (best < 0)
+      break;
+    ewma_heap_set(pol, idx, &heap[best]);
+    idx = best;
+  }
+  ewma_heap_set(pol, idx, &ent);
+}
+
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
  * <b>pol</b>'s priority queue of active circuits */
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_heap_ent_t ent;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  tor_assert(pol->active_circuit_heap);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
@@ -785,38 +902,44 @@ add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
       ewma,
       pol->active_circuit_pqueue_last_recalibrated);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       offsetof(cell_ewma_t, heap_index),
-                       ewma);
+  if (pol->n_active_circuits == pol->active_circuit_heap_capacity) {
+    pol->active_circuit_heap_capacity *= 2;
+    pol->active_circuit_heap =
+      tor_reallocarray(pol->active_circuit_heap,
+                       pol->active_circuit_heap_capacity,
+                       sizeof(ewma_heap_ent_t));
+  }
+  ent.cell_count = ewma->cell_count;
+  ent.ewma = ewma;
+  ewma_heap_set(pol, pol->n_active_circuits++, &ent);
+  ewma_heap_sift_up(pol, pol->n_active_circuits - 1);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  int idx;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  tor_assert(pol->active_circuit_heap);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          offsetof(cell_ewma_t, heap_index),
-                          ewma);
-}
-
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
-
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
+  idx = ewma->heap_index;
+  tor_assert(idx < pol->n_active_circuits);
+  tor_assert(pol->active_circuit_heap[idx].ewma == ewma);
+  ewma->heap_index = -1;
+
+  /* Fill the hole with the last entry, which can belong either above or
+   * below it. */
+  if (idx != --pol->n_active_circuits) {
+    cell_ewma_t *moved = pol->active_circuit_heap[pol->n_active_circuits].ewma;
+    ewma_heap_set(pol, idx, &pol->active_circuit_heap[pol->n_active_circuits]);
+    ewma_heap_sift_up(pol, idx);
+    if (moved->heap_index == idx)
+      ewma_heap_sift_down(pol, idx);
+  }
 }
 
 /**
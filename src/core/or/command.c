@@ -39,6 +39,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/crypto/onion_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
 #include "core/mainloop/connection.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/or/channel.h"
@@ -80,6 +81,8 @@ static void command_handle_incoming_channel(channel_listener_t *listener,
 static void command_process_create_cell(cell_t *cell, channel_t *chan);
 static void command_process_created_cell(cell_t *cell, channel_t *chan);
 static void command_process_relay_cell(cell_t *cell, channel_t *chan);
+static void command_process_relay_cells(cell_t *cells, int n_cells,
+                                        channel_t *chan);
 static void command_process_destroy_cell(cell_t *cell, channel_t *chan);
 
 /** Convert the cell <b>command</b> into a lower-case, human-readable
@@ -217,6 +220,41 @@ command_process_cell(channel_t *chan, cell_t *cell)
   }
 }
 
+/** Return true iff <b>cell</b> is a relay cell that may share its crypto
+ * with the relay cells around it for the same circuit. */
+static inline int
+cell_can_join_relay_run(const cell_t *cell, circid_t circ_id)
+{
+  /* We leave RELAY_EARLY cells to command_process_relay_cell(), since each
+   * of them can close the circuit. */
+  return cell->command == CELL_RELAY && cell->circ_id == circ_id;
+}
+
+/** Process the <b>n_cells</b> cells in <b>cells</b>, which arrived in that
+ * order on <b>chan</b>.  This has the same effect as calling
+ * command_process_cell() on each of them, but consecutive relay cells for
+ * the same circuit share one circuit lookup and one crypto batch.
+ */
+void
+command_process_cells(channel_t *chan, cell_t *cells, int n_cells)
+{
+  int i = 0, j;
+
+  while (i < n_cells) {
+    if (cells[i].command != CELL_RELAY) {
+      command_process_cell(chan, &cells[i++]);
+      continue;
+    }
+    for (j = i + 1; j < n_cells; ++j) {
+      if (!cell_can_join_relay_run(&cells[j], cells[i].circ_id))
+        break;
+    }
+    stats_n_relay_cells_processed += j - i;
+    command_process_relay_cells(&cells[i], j - i, chan);
+    i = j;
+  }
+}
+
 /** Process an incoming var_cell from a channel; in the current protocol all
  * the var_cells are handshake-related and handled below the channel layer,
  * so this just logs a warning and drops the cell.
@@ -611,6 +649,73 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
   }
 }
 
+/** Process <b>n_cells</b> CELL_RELAY cells for the same circuit that just
+ * arrived in that order on <b>chan</b>, as command_process_relay_cell()
+ * would.  When they are for an or_circuit_t whose crypto we do in the main
+ * thread, look the circuit up once and crypt them all at once.
+ */
+static void
+command_process_relay_cells(cell_t *cells, int n_cells, channel_t *chan)
+{
+  const or_options_t *options = get_options();
+  circuit_t *circ;
+  int reason, direction, n_received = 0, i;
+
+  if (n_cells > 1)
+    circ = circuit_get_by_circid_channel(cells[0].circ_id, chan);
+  else
+    circ = NULL;
+
+  if (!circ || CIRCUIT_IS_ORIGIN(circ) ||
+      circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING) {
+    /* Nothing to share: take the usual path, which also takes care of all
+     * the errors. */
+    for (i = 0; i < n_cells; ++i)
+      command_process_relay_cell(&cells[i], chan);
+    return;
+  }
+
+  if (chan == TO_OR_CIRCUIT(circ)->p_chan &&
+      cells[0].circ_id == TO_OR_CIRCUIT(circ)->p_circ_id)
+    direction = CELL_DIRECTION_OUT;
+  else
+    direction = CELL_DIRECTION_IN;
+
+  if (relay_crypto_pipeline_should_use(circ, direction)) {
+    /* The pipeline batches them already. */
+    for (i = 0; i < n_cells; ++i)
+      command_process_relay_cell(&cells[i], chan);
+    return;
+  }
+
+  reason = circuit_receive_relay_cells(cells, n_cells, circ, direction,
+                                       &n_received);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cells "
+           "(%s) failed. Closing.",
+           direction==CELL_DIRECTION_OUT?"forward":"backward");
+    circuit_mark_for_close(circ, -reason);
+  }
+
+  /* If this is a cell in an RP circuit, count it as part of the
+     hidden service stats */
+  if (options->HiddenServiceStatistics &&
+      TO_OR_CIRCUIT(circ)->circuit_carries_hs_traffic_stats) {
+    for (i = 0; i < n_received; ++i)
+      rep_hist_seen_new_rp_cell();
+  }
+
+  /* If the circuit got closed on the way, we drop the rest of the cells,
+   * just as command_process_relay_cell() would have. */
+  if (n_received < n_cells) {
+    log_debug(LD_OR,
+              "circuit %u on connection from %s closed. Dropping %d cells.",
+              (unsigned)cells[0].circ_id,
+              channel_get_canonical_remote_descr(chan),
+              n_cells - n_received);
+  }
+}
+
 /** Process a 'destroy' <b>cell</b> that just arrived from
  * <b>chan</b>. Find the circ that it refers to (if any).
  *
@@ -687,6 +792,7 @@ command_setup_channel(channel_t *chan)
   channel_set_cell_handlers(chan,
                             command_process_cell,
                             command_process_var_cell);
+  channel_set_cells_handler(chan, command_process_cells);
 }
 
 /** Given a listener, install the right handler to process incoming
@@ -2365,10 +2365,17 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** Largest number of fixed-length cells that we take off an OR
+ * connection's inbuf before we hand them to the channel layer. */
+#define OR_CELL_BATCH_MAX 16
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
- * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * Loop: while inbuf contains a cell, pull it off the inbuf and unpack it.
+ * Hand variable-length cells to channel_tls_handle_var_cell() right away,
+ * and fixed-length cells to channel_tls_handle_cells() in batches of up to
+ * OR_CELL_BATCH_MAX, so that they can share work.  Cells are always
+ * handled in the order they arrived.
  *
  * Always return 0.
  */
@@ -2376,6 +2383,8 @@ static int
 connection_or_process_cells_from_inbuf(or_connection_t *conn)
 {
   var_cell_t *var_cell;
+  cell_t cells[OR_CELL_BATCH_MAX];
+  int n_cells = 0;
 
   /*
    * Note on memory management for incoming cells: below the channel layer,
@@ -2397,6 +2406,11 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+      /* Handle the cells that came before this one first.  This one might
+       * change how we read the ones after it, so handle it right away. */
+      channel_tls_handle_cells(cells, n_cells, conn);
+      n_cells = 0;
+
       if (!var_cell)
         return 0; /* not yet. */
 
@@ -2411,10 +2425,11 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       const int wide_circ_ids = conn->wide_circ_ids;
       size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
       char buf[CELL_MAX_NETWORK_SIZE];
-      cell_t cell;
       if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+          < cell_network_size) { /* whole response available? */
+        channel_tls_handle_cells(cells, n_cells, conn);
         return 0; /* not yet */
+      }
 
       /* Touch the channel's active timestamp if there is one */
       if (conn->chan)
@@ -2425,9 +2440,12 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
 
       /* retrieve cell info from buf (create the host-order struct from the
        * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
+      cell_unpack(&cells[n_cells++], buf, wide_circ_ids);
 
-      channel_tls_handle_cell(&cell, conn);
+      if (n_cells == OR_CELL_BATCH_MAX) {
+        channel_tls_handle_cells(cells, n_cells, conn);
+        n_cells = 0;
+      }
     }
   }
 }
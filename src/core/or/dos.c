@@ -18,8 +18,8 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/relay/routermode.h"
-#include "feature/stats/geoip_stats.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/ctime/di_ops.h"
 
 #include "core/or/dos.h"
 
@@ -207,6 +207,244 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_defense_type = get_param_conn_defense_type(ns);
 }
 
+/*
+ * DoS address table.
+ *
+ * Per-address statistics for the mitigations above live in an open-addressed
+ * table of fixed-size entries, independent of the geoip client history. The
+ * table grows up to dos_addrmap_max_capacity slots; past that, a CLOCK hand
+ * evicts an address that hasn't been looked up since the hand last passed
+ * it. Addresses with open connections or an active defense are never
+ * evicted, so that no count goes out of sync and no marked client escapes.
+ */
+
+/* The table, its number of slots (zero or a power of two), the number of
+ * used slots, and the position of the eviction hand. */
+static dos_addr_entry_t *dos_addrmap = NULL;
+static unsigned int dos_addrmap_capacity = 0;
+static unsigned int dos_addrmap_count = 0;
+static unsigned int dos_addrmap_hand = 0;
+
+/* Largest number of slots the table may have. */
+STATIC unsigned int dos_addrmap_max_capacity = DOS_ADDRMAP_MAX_CAPACITY;
+
+/* Return the hash that the DoS address table uses for addr. It is never 0,
+ * so that callers can cache it in a zero-initialized field. */
+STATIC uint32_t
+dos_addr_hash(const tor_addr_t *addr)
+{
+  uint32_t hash = (uint32_t) tor_addr_hash(addr);
+  return hash ? hash : 1;
+}
+
+/* Fill in the family and address bytes of an entry for addr, as they are
+ * compared in the table. Return 0 on success, or -1 if addr is neither an
+ * IPv4 nor an IPv6 address. */
+static int
+dos_addr_key(const tor_addr_t *addr, uint8_t *family_out,
+             uint8_t *bytes_out)
+{
+  memset(bytes_out, 0, DOS_ADDR_KEY_LEN);
+  switch (tor_addr_family(addr)) {
+  case AF_INET: {
+    const uint32_t a = tor_addr_to_ipv4n(addr);
+    memcpy(bytes_out, &a, sizeof(a));
+    *family_out = 4;
+    return 0;
+  }
+  case AF_INET6:
+    memcpy(bytes_out, tor_addr_to_in6_addr8(addr), DOS_ADDR_KEY_LEN);
+    *family_out = 6;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+/* Return the slot of the table at which an entry of the given hash belongs
+ * if nothing else is in its way. */
+static inline unsigned int
+dos_addrmap_home(uint32_t hash)
+{
+  return hash & (dos_addrmap_capacity - 1);
+}
+
+/* Put a copy of ent in the first free slot from its home slot on. There must
+ * be a free slot. */
+static void
+dos_addrmap_place(const dos_addr_entry_t *ent)
+{
+  unsigned int i = dos_addrmap_home(ent->hash);
+  while (dos_addrmap[i].hash)
+    i = (i + 1) & (dos_addrmap_capacity - 1);
+  dos_addrmap[i] = *ent;
+}
+
+/* Resize the table to capacity slots, keeping all its entries. */
+static void
+dos_addrmap_resize(unsigned int capacity)
+{
+  dos_addr_entry_t *old = dos_addrmap;
+  const unsigned int old_capacity = dos_addrmap_capacity;
+
+  dos_addrmap = tor_calloc(capacity, sizeof(dos_addr_entry_t));
+  dos_addrmap_capacity = capacity;
+  dos_addrmap_hand = 0;
+  for (unsigned int i = 0; i < old_capacity; ++i) {
+    if (old[i].hash)
+      dos_addrmap_place(&old[i]);
+  }
+  tor_free(old);
+}
+
+/* Remove the entry at slot idx, moving back any entries after it that would
+ * otherwise become unreachable, as linear probing requires. */
+static void
+dos_addrmap_remove(unsigned int idx)
+{
+  const unsigned int mask = dos_addrmap_capacity - 1;
+  unsigned int hole = idx, j = idx;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!dos_addrmap[j].hash)
+      break;
+    /* The entry at j can fill the hole unless its home slot lies
+     * cyclically in (hole, j]. */
+    const unsigned int home = dos_addrmap_home(dos_addrmap[j].hash);
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      dos_addrmap[hole] = dos_addrmap[j];
+      hole = j;
+    }
+  }
+  memset(&dos_addrmap[hole], 0, sizeof(dos_addr_entry_t));
+  --dos_addrmap_count;
+}
+
+/* Return true iff the entry ent must stay in the table at time now. */
+static inline int
+dos_addr_entry_is_pinned(const dos_addr_entry_t *ent, time_t now)
+{
+  return ent->stats.concurrent_count > 0 ||
+         ent->stats.cc_stats.marked_until_ts >= now;
+}
+
+/* Move the CLOCK hand until it finds an entry to evict, and evict it. Return
+ * 0 on success, or -1 if every entry is pinned. */
+static int
+dos_addrmap_evict_one(void)
+{
+  const unsigned int mask = dos_addrmap_capacity - 1;
+  const time_t now = approx_time();
+
+  /* After one turn, every entry that isn't pinned has lost its referenced
+   * bit; so two turns are enough to find one, if there is any. */
+  for (unsigned int steps = 0; steps < 2 * dos_addrmap_capacity; ++steps) {
+    const unsigned int i = dos_addrmap_hand;
+    dos_addr_entry_t *ent = &dos_addrmap[i];
+    dos_addrmap_hand = (i + 1) & mask;
+    if (!ent->hash || dos_addr_entry_is_pinned(ent, now))
+      continue;
+    if (ent->referenced) {
+      ent->referenced = 0;
+      continue;
+    }
+    dos_addrmap_remove(i);
+    /* Another entry may have moved into this slot: look at it next. */
+    dos_addrmap_hand = i;
+    return 0;
+  }
+  return -1;
+}
+
+/* Return the DoS statistics of addr, whose hash is the one given by
+ * dos_addr_hash(). If we have none and create is true, add a new entry for
+ * addr to the table, evicting another one if the table is full. Return NULL
+ * if there is no entry for addr and we could not, or were not asked to, add
+ * one. */
+STATIC dos_client_stats_t *
+dos_addrmap_lookup(const tor_addr_t *addr, uint32_t hash, int create)
+{
+  uint8_t family, bytes[DOS_ADDR_KEY_LEN];
+  unsigned int i;
+
+  tor_assert(hash);
+  if (dos_addr_key(addr, &family, bytes) < 0)
+    return NULL;
+
+  if (dos_addrmap) {
+    for (i = dos_addrmap_home(hash); dos_addrmap[i].hash;
+         i = (i + 1) & (dos_addrmap_capacity - 1)) {
+      dos_addr_entry_t *ent = &dos_addrmap[i];
+      if (ent->hash == hash && ent->family == family &&
+          fast_memeq(ent->addr, bytes, DOS_ADDR_KEY_LEN)) {
+        ent->referenced = 1;
+        return &ent->stats;
+      }
+    }
+  }
+  if (!create)
+    return NULL;
+
+  /* Keep the table at most three quarters full. */
+  if ((dos_addrmap_count + 1) * 4 > dos_addrmap_capacity * 3) {
+    if (dos_addrmap_capacity < dos_addrmap_max_capacity) {
+      dos_addrmap_resize(dos_addrmap_capacity ?
+                         dos_addrmap_capacity * 2 :
+                         MIN(DOS_ADDRMAP_MIN_CAPACITY,
+                             dos_addrmap_max_capacity));
+    } else if (dos_addrmap_evict_one() < 0) {
+      log_fn(LOG_INFO, LD_DOS, "DoS address table is full of addresses in "
+             "use; not tracking another one.");
+      return NULL;
+    }
+  }
+
+  for (i = dos_addrmap_home(hash); dos_addrmap[i].hash;
+       i = (i + 1) & (dos_addrmap_capacity - 1))
+    ;
+  dos_addr_entry_t *ent = &dos_addrmap[i];
+  ent->hash = hash;
+  ent->family = family;
+  ent->referenced = 1;
+  memcpy(ent->addr, bytes, DOS_ADDR_KEY_LEN);
+  ++dos_addrmap_count;
+  return &ent->stats;
+}
+
+/* Return the number of addresses in the DoS address table. */
+STATIC unsigned int
+dos_addrmap_size(void)
+{
+  return dos_addrmap_count;
+}
+
+/* Free the DoS address table. */
+static void
+dos_addrmap_free_all(void)
+{
+  tor_free(dos_addrmap);
+  dos_addrmap_capacity = dos_addrmap_count = dos_addrmap_hand = 0;
+}
+
+/* Return the DoS statistics of the address of chan, and set addr_out to
+ * that address. If we have none, add them if create is true. Return NULL if
+ * the channel has no address or we have no statistics for it. The hash of
+ * the address is cached in the channel, since we need it for every CREATE
+ * cell. */
+static dos_client_stats_t *
+dos_channel_get_stats(channel_t *chan, tor_addr_t *addr_out, int create)
+{
+  /* Without an IP address, nothing can work. */
+  if (!channel_get_addr_if_possible(chan, addr_out)) {
+    return NULL;
+  }
+  if (!chan->dos_addr_hash) {
+    chan->dos_addr_hash = dos_addr_hash(addr_out);
+  }
+  return dos_addrmap_lookup(addr_out, chan->dos_addr_hash, create);
+}
+
 /* Free everything for the circuit creation DoS mitigation subsystem. */
 static void
 cc_free_all(void)
@@ -370,8 +608,7 @@ cc_channel_addr_is_marked(channel_t *chan)
 {
   time_t now;
   tor_addr_t addr;
-  clientmap_entry_t *entry;
-  cc_client_stats_t *stats = NULL;
+  dos_client_stats_t *stats = NULL;
 
   if (chan == NULL) {
     goto end;
@@ -380,24 +617,13 @@ cc_channel_addr_is_marked(channel_t *chan)
   if (!channel_is_client(chan)) {
     goto end;
   }
-  /* Without an IP address, nothing can work. */
-  if (!channel_get_addr_if_possible(chan, &addr)) {
-    goto end;
-  }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
-    goto end;
-  }
+  /* An address that never created a circuit can't be marked. */
+  stats = dos_channel_get_stats(chan, &addr, 0);
   now = approx_time();
-  stats = &entry->dos_stats.cc_stats;
 
  end:
-  return stats && stats->marked_until_ts >= now;
+  return stats && stats->cc_stats.marked_until_ts >= now;
 }
 
 /* Concurrent connection private API. */
@@ -438,7 +664,7 @@ void
 dos_cc_new_create_cell(channel_t *chan)
 {
   tor_addr_t addr;
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(chan);
 
@@ -451,17 +677,10 @@ dos_cc_new_create_cell(channel_t *chan)
   if (!channel_is_client(chan)) {
     goto end;
   }
-  /* Without an IP address, nothing can work. */
-  if (!channel_get_addr_if_possible(chan, &addr)) {
-    goto end;
-  }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+  stats = dos_channel_get_stats(chan, &addr, 1);
+  if (stats == NULL) {
+    /* No address, or the table is full of addresses in use. */
     goto end;
   }
 
@@ -472,26 +691,26 @@ dos_cc_new_create_cell(channel_t *chan)
 
   /* First of all, we'll try to refill the circuit bucket opportunistically
    * before we assess. */
-  cc_stats_refill_bucket(&entry->dos_stats.cc_stats, &addr);
+  cc_stats_refill_bucket(&stats->cc_stats, &addr);
 
   /* Take a token out of the circuit bucket if we are above 0 so we don't
    * underflow the bucket. */
-  if (entry->dos_stats.cc_stats.circuit_bucket > 0) {
-    entry->dos_stats.cc_stats.circuit_bucket--;
+  if (stats->cc_stats.circuit_bucket > 0) {
+    stats->cc_stats.circuit_bucket--;
   }
 
   /* This is the detection. Assess at every CREATE cell if the client should
    * get marked as malicious. This should be kept as fast as possible. */
-  if (cc_has_exhausted_circuits(&entry->dos_stats)) {
+  if (cc_has_exhausted_circuits(stats)) {
     /* If this is the first time we mark this entry, log it a info level.
      * Under heavy DDoS, logging each time we mark would results in lots and
      * lots of logs. */
-    if (entry->dos_stats.cc_stats.marked_until_ts == 0) {
+    if (stats->cc_stats.marked_until_ts == 0) {
       log_debug(LD_DOS, "Detected circuit creation DoS by address: %s",
                 fmt_addr(&addr));
       cc_num_marked_addrs++;
     }
-    cc_mark_client(&entry->dos_stats.cc_stats);
+    cc_mark_client(&stats->cc_stats);
   }
 
  end:
@@ -531,7 +750,7 @@ dos_cc_get_defense_type(channel_t *chan)
 dos_conn_defense_type_t
 dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(addr);
 
@@ -540,15 +759,15 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
+  /* We are only interested in addresses that we already track. */
+  stats = dos_addrmap_lookup(addr, dos_addr_hash(addr), 0);
+  if (stats == NULL) {
     goto end;
   }
 
   /* Need to be above the maximum concurrent connection count to trigger a
    * defense. */
-  if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
+  if (stats->concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
     return dos_conn_defense_type;
   }
@@ -559,41 +778,6 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 
 /* General API */
 
-/* Take any appropriate actions for the given geoip entry that is about to get
- * freed. This is called for every entry that is being freed.
- *
- * This function will clear out the connection tracked flag if the concurrent
- * count of the entry is above 0 so if those connections end up being seen by
- * this subsystem, we won't try to decrement the counter for a new geoip entry
- * that might have been added after this call for the same address. */
-void
-dos_geoip_entry_about_to_free(const clientmap_entry_t *geoip_ent)
-{
-  tor_assert(geoip_ent);
-
-  /* The count is down to 0 meaning no connections right now, we can safely
-   * clear the geoip entry from the cache. */
-  if (geoip_ent->dos_stats.concurrent_count == 0) {
-    goto end;
-  }
-
-  /* For each connection matching the geoip entry address, we'll clear the
-   * tracked flag because the entry is about to get removed from the geoip
-   * cache. We do not try to decrement if the flag is not set. */
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
-    if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      if (!tor_addr_compare(&geoip_ent->addr, &or_conn->real_addr,
-                            CMP_EXACT)) {
-        or_conn->tracked_for_dos_mitigation = 0;
-      }
-    }
-  } SMARTLIST_FOREACH_END(conn);
-
- end:
-  return;
-}
-
 /* Note down that we've just refused a single hop client. This increments a
  * counter later used for the heartbeat. */
 void
@@ -638,8 +822,10 @@ dos_log_heartbeat(void)
   if (dos_cc_enabled) {
     tor_asprintf(&cc_msg,
                  " %" PRIu64 " circuits rejected,"
-                 " %" PRIu32 " marked addresses.",
-                 cc_num_rejected_cells, cc_num_marked_addrs);
+                 " %" PRIu32 " marked addresses,"
+                 " %u addresses tracked.",
+                 cc_num_rejected_cells, cc_num_marked_addrs,
+                 dos_addrmap_size());
   }
 
   if (dos_conn_enabled) {
@@ -673,7 +859,7 @@ dos_log_heartbeat(void)
 void
 dos_new_client_conn(or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(or_conn);
 
@@ -691,20 +877,17 @@ dos_new_client_conn(or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (BUG(entry == NULL)) {
-    /* Should never happen because we note down the address in the geoip
-     * cache before this is called. */
+  or_conn->dos_addr_hash = dos_addr_hash(&or_conn->real_addr);
+  stats = dos_addrmap_lookup(&or_conn->real_addr, or_conn->dos_addr_hash, 1);
+  if (stats == NULL) {
+    /* The table is full of addresses in use: leave this one untracked. */
     goto end;
   }
 
-  entry->dos_stats.concurrent_count++;
+  stats->concurrent_count++;
   or_conn->tracked_for_dos_mitigation = 1;
   log_debug(LD_DOS, "Client address %s has now %u concurrent connections.",
-            fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            fmt_addr(&or_conn->real_addr), stats->concurrent_count);
 
  end:
   return;
@@ -714,7 +897,7 @@ dos_new_client_conn(or_connection_t *or_conn)
 void
 dos_close_client_conn(const or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(or_conn);
 
@@ -725,27 +908,24 @@ dos_close_client_conn(const or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* This can happen because we can close a connection before the channel
-     * got to be noted down in the geoip cache. */
+  /* Entries with connections are never evicted, and the table is only freed
+   * on shutdown, so this can't fail. */
+  stats = dos_addrmap_lookup(&or_conn->real_addr, or_conn->dos_addr_hash, 0);
+  if (BUG(stats == NULL)) {
     goto end;
   }
 
   /* Extra super duper safety. Going below 0 means an underflow which could
    * lead to most likely a false positive. In theory, this should never happen
    * but lets be extra safe. */
-  if (BUG(entry->dos_stats.concurrent_count == 0)) {
+  if (BUG(stats->concurrent_count == 0)) {
     goto end;
   }
 
-  entry->dos_stats.concurrent_count--;
+  stats->concurrent_count--;
   log_debug(LD_DOS, "Client address %s has lost a connection. Concurrent "
                     "connections are now at %u",
-            fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            fmt_addr(&or_conn->real_addr), stats->concurrent_count);
 
  end:
   return;
@@ -779,9 +959,12 @@ dos_enabled(void)
   return dos_is_enabled();
 }
 
-/* Free everything from the Denial of Service subsystem. */
+/* Free the mitigation subsystems, when we stop being a public relay. The
+ * address table stays: open connections still hold counts in it, which they
+ * will give back when they close, and which we need to be right if we
+ * become a public relay again. */
 void
-dos_free_all(void)
+dos_free_mitigations(void)
 {
   /* Free the circuit creation mitigation subsystem. It is safe to do this
    * even if it wasn't initialized. */
@@ -792,6 +975,15 @@ dos_free_all(void)
   conn_free_all();
 }
 
+/* Free everything from the Denial of Service subsystem. Only call this on
+ * shutdown, once no connection is left to use the address table. */
+void
+dos_free_all(void)
+{
+  dos_free_mitigations();
+  dos_addrmap_free_all();
+}
+
 /* Initialize the Denial of Service subsystem. */
 void
 dos_init(void)
@@ -29,8 +29,8 @@ typedef struct cc_client_stats_t {
 } cc_client_stats_t;
 
 /* This object is a top level object that contains everything related to the
- * per-IP client DoS mitigation. Because it is per-IP, it is used in the geoip
- * clientmap_entry_t object. */
+ * per-IP client DoS mitigation. Because it is per-IP, it is kept in the DoS
+ * address table, one per client address. */
 typedef struct dos_client_stats_t {
   /* Concurrent connection count from the specific address. 2^32 is most
    * likely way too big for the amount of allowed file descriptors. */
@@ -43,15 +43,12 @@ typedef struct dos_client_stats_t {
 
 /* General API. */
 
-/* Stub. */
-struct clientmap_entry_t;
-
 void dos_init(void);
 void dos_free_all(void);
+void dos_free_mitigations(void);
 void dos_consensus_has_changed(const networkstatus_t *ns);
 int dos_enabled(void);
 void dos_log_heartbeat(void);
-void dos_geoip_entry_about_to_free(const struct clientmap_entry_t *geoip_ent);
 
 void dos_new_client_conn(or_connection_t *or_conn);
 void dos_close_client_conn(const or_connection_t *or_conn);
@@ -119,6 +116,39 @@ dos_conn_defense_type_t dos_conn_addr_get_defense_type(const tor_addr_t *addr);
 
 #ifdef DOS_PRIVATE
 
+/* Number of slots the DoS address table starts with. */
+#define DOS_ADDRMAP_MIN_CAPACITY 1024
+/* Most slots the DoS address table may have; it holds at most three quarters
+ * as many addresses. This must be a power of two. */
+#define DOS_ADDRMAP_MAX_CAPACITY (1 << 18)
+/* Length of the address bytes of a DoS address table entry. */
+#define DOS_ADDR_KEY_LEN 16
+
+/* One slot of the DoS address table. Entries have a fixed size, and are
+ * looked up by linear probing from the hash of their address. */
+typedef struct dos_addr_entry_t {
+  /* Hash of the address, as returned by dos_addr_hash(), or 0 if this slot
+   * is empty. */
+  uint32_t hash;
+  /* 4 or 6, for an IPv4 or IPv6 address. */
+  uint8_t family;
+  /* Set when the entry is looked up, and cleared when the eviction hand
+   * passes it. */
+  uint8_t referenced;
+  /* The address, in network order. IPv4 addresses use the first 4 bytes. */
+  uint8_t addr[DOS_ADDR_KEY_LEN];
+  /* DoS statistics for this address. */
+  dos_client_stats_t stats;
+} dos_addr_entry_t;
+
+STATIC uint32_t dos_addr_hash(const tor_addr_t *addr);
+STATIC dos_client_stats_t *dos_addrmap_lookup(const tor_addr_t *addr,
+                                              uint32_t hash, int create);
+STATIC unsigned int dos_addrmap_size(void);
+#ifdef TOR_UNIT_TESTS
+extern unsigned int dos_addrmap_max_capacity;
+#endif
+
 STATIC uint32_t get_param_conn_max_concurrent_count(
                                               const networkstatus_t *ns);
 STATIC uint32_t get_param_cc_circuit_burst(const networkstatus_t *ns);
@@ -26,11 +26,19 @@ struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_s *workqueue_entry;
+  /** Relay cells on this circuit whose cryptography is being done by the
+   * cpuworker threads, or that are waiting for it to be done.  NULL if we
+   * have never used ThreadedRelayCrypto on this circuit.  Used only in
+   * relay_crypto_pipeline.c */
+  struct relay_crypto_pipeline_t *crypto_pipeline;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
   /** Queue of cells waiting to be transmitted on p_conn. */
   cell_queue_t p_chan_cells;
+  /** Slot of this circuit's entry in p_chan's circuitmux. This is only a
+   * hint for circuitmux.c, which checks it before using it. */
+  int p_mux_slot;
   /** The channel that is previous in this circuit. */
   channel_t *p_chan;
   /** Linked list of Exit streams associated with this circuit. */
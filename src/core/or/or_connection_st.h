@@ -64,12 +64,16 @@ struct or_connection_t {
    * control_event_bootstrap_problem. */
   unsigned int have_noted_bootstrap_problem:1;
   /** True iff this is a client connection and its address has been put in the
-   * geoip cache and handled by the DoS mitigation subsystem. We use this to
-   * insure we have a coherent count of concurrent connection. */
+   * DoS address table and handled by the DoS mitigation subsystem. We use
+   * this to insure we have a coherent count of concurrent connection. */
   unsigned int tracked_for_dos_mitigation : 1;
   /** True iff this connection is using a pluggable transport */
   unsigned int is_pt : 1;
 
+  /** Hash of real_addr in the DoS address table; set once the connection
+   * is tracked for DoS mitigation. */
+  uint32_t dos_addr_hash;
+
   uint16_t link_proto; /**< What protocol version are we using? 0 for
                         * "none negotiated yet." */
   uint16_t idle_timeout; /**< How long can this connection sit with no
@@ -50,6 +50,7 @@
 #include "feature/client/addressmap.h"
 #include "lib/err/backtrace.h"
 #include "lib/buf/buffers.h"
+#include "core/or/cell_pool.h"
 #include "core/or/channel.h"
 #include "feature/client/circpathbias.h"
 #include "core/or/circuitbuild.h"
@@ -76,6 +77,7 @@
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/describe.h"
@@ -223,10 +225,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -235,6 +235,14 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (relay_crypto_pipeline_should_use(circ, cell_direction)) {
+    /* A worker thread will do the crypto; we'll pick up where we left off
+     * in circuit_receive_decrypted_relay_cell() once it's done. */
+    relay_crypto_pipeline_add_cell(TO_OR_CIRCUIT(circ), cell, cell_direction,
+                                   0, 0);
+    return 0;
+  }
+
   if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
       < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -242,6 +250,93 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_decrypted_relay_cell(cell, circ, cell_direction,
+                                              layer_hint, recognized);
+}
+
+/** Largest number of cells that circuit_receive_relay_cells() crypts at
+ * once. */
+#define RECEIVE_RELAY_CELLS_BATCH 32
+
+/** Receive the <b>n_cells</b> relay cells in <b>cells</b>, which arrived in
+ * that order on the or_circuit_t <b>circ</b> in direction
+ * <b>cell_direction</b>, as circuit_receive_relay_cell() would one after
+ * another.  Since the crypto of one cell never depends on how we handled the
+ * ones before it, we crypt them in batches first.  The caller must make sure
+ * that <b>circ</b> doesn't use the crypto pipeline.
+ *
+ * We stop early if a cell fails or if the circuit gets marked for close.
+ * Set *<b>n_received_out</b> to the number of cells we handled, including
+ * the one that failed, and return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_relay_cells(cell_t *cells, int n_cells, circuit_t *circ,
+                            cell_direction_t cell_direction,
+                            int *n_received_out)
+{
+  cell_t *batch[RECEIVE_RELAY_CELLS_BATCH];
+  char recognized[RECEIVE_RELAY_CELLS_BATCH];
+  relay_crypto_t *crypto;
+  int i, j, n, reason;
+
+  tor_assert(cells);
+  tor_assert(circ);
+  tor_assert(n_received_out);
+  tor_assert(cell_direction == CELL_DIRECTION_OUT ||
+             cell_direction == CELL_DIRECTION_IN);
+  tor_assert(!relay_crypto_pipeline_should_use(circ, cell_direction));
+
+  crypto = &TO_OR_CIRCUIT(circ)->crypto;
+  *n_received_out = 0;
+
+  for (i = 0; i < n_cells; i += n) {
+    if (circ->marked_for_close)
+      return 0;
+
+    n = MIN(n_cells - i, RECEIVE_RELAY_CELLS_BATCH);
+    for (j = 0; j < n; ++j) {
+      batch[j] = &cells[i+j];
+      recognized[j] = 0;
+    }
+    /* As in relay_decrypt_cell(): we only check for recognized cells going
+     * away from the origin. */
+    if (cell_direction == CELL_DIRECTION_OUT)
+      relay_crypt_cells_at_relay(crypto->f_crypto, crypto->f_digest,
+                                 batch, recognized, n);
+    else
+      relay_crypt_cells_at_relay(crypto->b_crypto, NULL,
+                                 batch, recognized, n);
+
+    for (j = 0; j < n; ++j) {
+      ++*n_received_out;
+      reason = circuit_receive_decrypted_relay_cell(batch[j], circ,
+                                                    cell_direction,
+                                                    NULL, recognized[j]);
+      if (reason < 0)
+        return reason;
+      if (circ->marked_for_close)
+        return 0;
+    }
+  }
+
+  return 0;
+}
+
+/** Finish receiving a relay <b>cell</b> on <b>circ</b>, once it has been
+ * crypted as described in circuit_receive_relay_cell().  <b>layer_hint</b>
+ * and <b>recognized</b> are as set by relay_decrypt_cell().
+ *
+ * Return -<b>reason</b> on failure.
+ */
+MOCK_IMPL(int,
+circuit_receive_decrypted_relay_cell,(cell_t *cell, circuit_t *circ,
+                                      cell_direction_t cell_direction,
+                                      crypt_path_t *layer_hint,
+                                      char recognized))
+{
+  channel_t *chan = NULL;
+  int reason;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -401,6 +496,13 @@ circuit_package_relay_cell, (cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (relay_crypto_pipeline_should_use(circ, cell_direction)) {
+      relay_digest_cell_inbound(cell, or_circ);
+      ++stats_n_relay_cells_relayed;
+      relay_crypto_pipeline_add_cell(or_circ, cell, cell_direction,
+                                     1, on_stream);
+      return 0;
+    }
     relay_encrypt_cell_inbound(cell, or_circ);
     chan = or_circ->p_chan;
   }
@@ -2392,15 +2494,16 @@ static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
   --total_cells_allocated;
-  tor_free(cell);
+  cell_pool_free(cell);
 }
 
-/** Allocate and return a new packed_cell_t. */
+/** Allocate and return a new packed_cell_t.  Its body is uninitialized:
+ * fill it in with cell_pack(). */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  return cell_pool_alloc();
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2429,6 +2532,7 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  cell_pool_log_status(severity);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2572,7 +2676,7 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
 size_t
 packed_cell_mem_cost(void)
 {
-  return sizeof(packed_cell_t);
+  return cell_pool_item_size();
 }
 
 /* DOCDOC */
@@ -2603,11 +2707,18 @@ cell_queues_check_size(void)
   const size_t geoip_client_cache_total =
     geoip_client_cache_total_allocation();
   alloc += geoip_client_cache_total;
+  alloc += relay_crypto_pipeline_get_total_allocation();
   const size_t dns_cache_total = dns_cache_total_allocation();
   alloc += dns_cache_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
+    /* Empty cell slabs are just waiting for the next burst of traffic; we
+     * don't need them now. */
+    cell_pool_trim(0);
     if (alloc >= get_options()->MaxMemInQueues) {
+      /* Unused buffer chunks don't count towards MaxMemInQueues, but they
+       * are the cheapest memory to give back. */
+      buf_shrink_freelists(1);
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
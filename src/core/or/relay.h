@@ -19,6 +19,12 @@ extern uint64_t stats_n_circ_max_cell_reached;
 void relay_consensus_has_changed(const networkstatus_t *ns);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_relay_cells(cell_t *cells, int n_cells, circuit_t *circ,
+                                cell_direction_t cell_direction,
+                                int *n_received_out);
+MOCK_DECL(int, circuit_receive_decrypted_relay_cell,
+          (cell_t *cell, circuit_t *circ, cell_direction_t cell_direction,
+           crypt_path_t *layer_hint, char recognized));
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
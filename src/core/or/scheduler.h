@@ -107,6 +107,8 @@ typedef struct scheduler_s {
 #define KIST_SCHED_RUN_INTERVAL_MIN 0
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
+/* Maximum number of shards the KIST per-socket state can be split into. */
+#define KIST_SCHED_SHARDS_MAX 64
 
 /*****************************************************************************
  * Globally visible scheduler functions
@@ -185,6 +187,10 @@ typedef struct socket_table_ent_s {
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* Inode of the socket, used to match sock_diag answers. 0 if unknown. */
+  uint64_t inode;
+  /* True iff the TCP info above was just filled from a sock_diag dump. */
+  unsigned int have_diag_info : 1;
 } socket_table_ent_t;
 
 typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_s) outbuf_table_t;
@@ -199,11 +205,19 @@ void scheduler_kist_set_full_mode(void);
 void scheduler_kist_set_lite_mode(void);
 scheduler_t *get_kist_scheduler(void);
 int kist_scheduler_run_interval(void);
+int kist_scheduler_n_shards(void);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
 #endif /* TOR_UNIT_TESTS */
 
+/*********************************
+ * Defined in scheduler_kist_diag.c
+ *********************************/
+
+int kist_sock_diag_update(socket_table_ent_t **ents, int n_ents);
+void kist_sock_diag_free_all(void);
+
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
 
 /*********************************
@@ -14,12 +14,16 @@
 #define SCHEDULER_PRIVATE_
 #include "core/or/scheduler.h"
 #include "lib/math/fp.h"
+#include "lib/thread/threads.h"
 
 #include "core/or/or_connection_st.h"
 
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 #ifdef HAVE_KIST_SUPPORT
 /* Kernel interface needed for KIST. */
@@ -48,8 +52,6 @@ socket_table_ent_eq(const socket_table_ent_t *a, const socket_table_ent_t *b)
 
 typedef HT_HEAD(socket_table_s, socket_table_ent_s) socket_table_t;
 
-static socket_table_t socket_table = HT_INITIALIZER();
-
 HT_PROTOTYPE(socket_table_s, socket_table_ent_s, node, socket_table_ent_hash,
              socket_table_ent_eq)
 HT_GENERATE2(socket_table_s, socket_table_ent_s, node, socket_table_ent_hash,
@@ -82,6 +84,60 @@ HT_PROTOTYPE(outbuf_table_s, outbuf_table_ent_s, node, outbuf_table_ent_hash,
 HT_GENERATE2(outbuf_table_s, outbuf_table_ent_s, node, outbuf_table_ent_hash,
              outbuf_table_ent_eq, 0.6, tor_reallocarray, tor_free_)
 
+/* KIST shards. The socket state is split into kist_n_shards shards, keyed by
+ * channel global identifier. At the start of each run, every shard refreshes
+ * the kernel information of its own pending channels; shard 0 does so on the
+ * main thread and every other shard on its own helper thread. All the rest of
+ * a scheduling run (flushing cells and writing to the kernel) touches state
+ * that only the main thread may touch, so it stays on the main thread. */
+
+typedef struct kist_shard_t {
+  /* Per-socket information of the channels that hash to this shard. */
+  socket_table_t socket_table;
+  /* Channels of this shard whose socket information needs to be refreshed
+   * during the current run. */
+  smartlist_t *pending;
+  /* Set during a run if the kernel told us that it doesn't support KIST
+   * anymore. The main thread applies it to kist_no_kernel_support once every
+   * shard is done. */
+  unsigned int no_kernel_support : 1;
+} kist_shard_t;
+
+/* Array of kist_n_shards shards, or NULL if we don't have any yet. */
+static kist_shard_t *kist_shards = NULL;
+static int kist_n_shards = 0;
+
+/* State shared between the main thread and the shard helper threads. Helper
+ * thread i (1 <= i < KIST_SCHED_SHARDS_MAX) works on shard i. Like the
+ * cpuworker threads, helper threads are never joined: once spawned, they stay
+ * blocked on <b>cond_work</b> until there is a new generation to handle. */
+static struct {
+  /* Protects every other field of this structure. */
+  tor_mutex_t lock;
+  /* Signaled by the main thread when a new generation starts. */
+  tor_cond_t cond_work;
+  /* Signaled by the last helper thread to finish a generation. */
+  tor_cond_t cond_done;
+  /* Number of helper threads we have spawned. */
+  int n_threads;
+  /* Number of shards that take part in the current generation. */
+  int n_active;
+  /* Number of helper threads that still have work in this generation. */
+  int n_running;
+  /* Incremented every time the main thread hands out work. */
+  unsigned generation;
+  /* True iff the lock and conditions have been initialized. */
+  unsigned initialized : 1;
+} kist_shard_pool;
+
+/* Per-thread state of a shard helper thread. */
+typedef struct kist_shard_thread_t {
+  /* Index of the shard this thread works on. */
+  int idx;
+  /* Last generation this thread has handled. */
+  unsigned generation;
+} kist_shard_thread_t;
+
 /*****************************************************************************
  * Other internal data
  *****************************************************************************/
@@ -108,6 +164,15 @@ static unsigned int kist_no_kernel_support = 0;
 static unsigned int kist_lite_mode = 1;
 #endif /* defined(HAVE_KIST_SUPPORT) */
 
+#ifdef HAVE_KIST_SOCK_DIAG
+/* Indicate if we should get the kernel information of all our sockets with
+ * one sock_diag dump per run (KISTSockDiag option). */
+static unsigned int kist_use_sock_diag = 0;
+/* Indicate if sock_diag failed us. In that case, we stick to one
+ * getsockopt() and ioctl() per socket until the options are reloaded. */
+static unsigned int kist_no_sock_diag_support = 0;
+#endif /* defined(HAVE_KIST_SOCK_DIAG) */
+
 /*****************************************************************************
  * Internally called function implementations
  *****************************************************************************/
@@ -157,12 +222,41 @@ free_socket_info_by_ent(socket_table_ent_t *ent, void *data)
   return 1; /* So HT_FOREACH_FN will remove the element */
 }
 
-/* Clean up socket_table. Probably because the KIST sched impl is going away */
+/* Clean up every shard's socket_table and release the shards. Probably
+ * because the KIST sched impl is going away or the number of shards changed.
+ * Entries are created again at the next scheduling run. */
 static void
 free_all_socket_info(void)
 {
-  HT_FOREACH_FN(socket_table_s, &socket_table, free_socket_info_by_ent, NULL);
-  HT_CLEAR(socket_table_s, &socket_table);
+  for (int i = 0; i < kist_n_shards; ++i) {
+    kist_shard_t *shard = &kist_shards[i];
+    HT_FOREACH_FN(socket_table_s, &shard->socket_table,
+                  free_socket_info_by_ent, NULL);
+    HT_CLEAR(socket_table_s, &shard->socket_table);
+    smartlist_free(shard->pending);
+  }
+  tor_free(kist_shards);
+  kist_n_shards = 0;
+}
+
+/* Return the shard that holds the socket information of chan. The shards
+ * must have been set up. */
+static kist_shard_t *
+kist_shard_for_chan(const channel_t *chan)
+{
+  tor_assert(kist_shards);
+  return &kist_shards[chan->global_identifier % kist_n_shards];
+}
+
+/* Return the socket table that holds the socket information of chan, or
+ * NULL if the shards have not been set up. */
+static socket_table_t *
+socket_table_for_chan(const channel_t *chan)
+{
+  if (!kist_shards) {
+    return NULL;
+  }
+  return &kist_shard_for_chan(chan)->socket_table;
 }
 
 static socket_table_ent_t *
@@ -179,6 +273,8 @@ static void
 free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
+  if (!table)
+    return;
   ent = socket_table_search(table, chan);
   if (!ent)
     return;
@@ -188,13 +284,14 @@ free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
   free_socket_info_by_ent(ent, NULL);
 }
 
+static void update_socket_limit(socket_table_ent_t *ent);
+
 /* Perform system calls for the given socket in order to calculate kist's
- * per-socket limit as documented in the function body. */
+ * per-socket limit as documented in update_socket_limit(). */
 MOCK_IMPL(void,
 update_socket_info_impl, (socket_table_ent_t *ent))
 {
 #ifdef HAVE_KIST_SUPPORT
-  int64_t tcp_space, extra_space;
   tor_assert(ent);
   tor_assert(ent->chan);
   const tor_socket_t sock =
@@ -212,29 +309,51 @@ update_socket_info_impl, (socket_table_ent_t *ent))
       /* Oops, this option is not provided by the kernel, we'll have to
        * disable KIST entirely. This can happen if tor was built on a machine
        * with the support previously or if the kernel was updated and lost the
-       * support. */
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
-      kist_no_kernel_support = 1;
+       * support. We might be on a shard helper thread, so we only tell our
+       * shard; see kist_shards_apply_no_kernel_support(). */
+      kist_shard_for_chan(ent->chan)->no_kernel_support = 1;
     }
     goto fallback;
   }
   if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
     if (errno == EINVAL) {
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
       /* Same reason as the above. */
-      kist_no_kernel_support = 1;
+      kist_shard_for_chan(ent->chan)->no_kernel_support = 1;
     }
     goto fallback;
   }
   ent->cwnd = tcp.tcpi_snd_cwnd;
   ent->unacked = tcp.tcpi_unacked;
   ent->mss = tcp.tcpi_snd_mss;
+  update_socket_limit(ent);
+  return;
+
+#else /* !(defined(HAVE_KIST_SUPPORT)) */
+  goto fallback;
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
+ fallback:
+  /* If all of a sudden we don't have kist support, we just zero out all the
+   * variables for this socket since we don't know what they should be. We
+   * also allow the socket to write as much as it can from the estimated
+   * number of cells the lower layer can accept, effectively returning it to
+   * Vanilla scheduler behavior. */
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  /* This function calls the specialized channel object (currently channeltls)
+   * and ask how many cells it can write on the outbuf which we then multiply
+   * by the size of the cells for this channel. The cast is because this
+   * function requires a non-const channel object, meh. */
+  ent->limit = channel_num_cells_writeable((channel_t *) ent->chan) *
+               (get_cell_network_size(ent->chan->wide_circ_ids) +
+                TLS_PER_CELL_OVERHEAD);
+}
+
+/* Given the kernel TCP information in ent, calculate kist's per-socket
+ * limit as documented in the function body. */
+static void
+update_socket_limit(socket_table_ent_t *ent)
+{
+  int64_t tcp_space, extra_space;
 
   /* In order to reduce outbound kernel queuing delays and thus improve Tor's
    * ability to prioritize circuits, KIST wants to set a socket write limit
@@ -296,26 +415,6 @@ update_socket_info_impl, (socket_table_ent_t *ent))
      * And we know this will always be positive, since we checked above. */
     ent->limit = (uint64_t)tcp_space + (uint64_t)extra_space;
   }
-  return;
-
-#else /* !(defined(HAVE_KIST_SUPPORT)) */
-  goto fallback;
-#endif /* defined(HAVE_KIST_SUPPORT) */
-
- fallback:
-  /* If all of a sudden we don't have kist support, we just zero out all the
-   * variables for this socket since we don't know what they should be. We
-   * also allow the socket to write as much as it can from the estimated
-   * number of cells the lower layer can accept, effectively returning it to
-   * Vanilla scheduler behavior. */
-  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
-  /* This function calls the specialized channel object (currently channeltls)
-   * and ask how many cells it can write on the outbuf which we then multiply
-   * by the size of the cells for this channel. The cast is because this
-   * function requires a non-const channel object, meh. */
-  ent->limit = channel_num_cells_writeable((channel_t *) ent->chan) *
-               (get_cell_network_size(ent->chan->wide_circ_ids) +
-                TLS_PER_CELL_OVERHEAD);
 }
 
 /* Given a socket that isn't in the table, add it.
@@ -408,7 +507,13 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
-  update_socket_info_impl(ent);
+  if (ent->have_diag_info) {
+    /* A sock_diag dump already gave us the kernel information. */
+    ent->have_diag_info = 0;
+    update_socket_limit(ent);
+  } else {
+    update_socket_info_impl(ent);
+  }
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -432,6 +537,220 @@ update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
   ent->written += bytes;
 }
 
+/* Refresh the kernel information of every pending channel of shard. This
+ * is called from the shard's own thread, so it must only touch the shard,
+ * its entries and read-only state of its channels. */
+static void
+kist_shard_update_socket_info(kist_shard_t *shard)
+{
+  SMARTLIST_FOREACH(shard->pending, const channel_t *, pchan,
+                    update_socket_info(&shard->socket_table, pchan));
+  smartlist_clear(shard->pending);
+}
+
+/* Main function of a shard helper thread: wait for a new generation, refresh
+ * the socket information of our shard if it takes part in it, and tell the
+ * main thread when we are done. */
+static void
+kist_shard_thread_main(void *arg)
+{
+  kist_shard_thread_t *thread = arg;
+
+  tor_mutex_acquire(&kist_shard_pool.lock);
+  for (;;) {
+    while (thread->generation == kist_shard_pool.generation) {
+      tor_cond_wait(&kist_shard_pool.cond_work, &kist_shard_pool.lock, NULL);
+    }
+    thread->generation = kist_shard_pool.generation;
+    if (thread->idx >= kist_shard_pool.n_active) {
+      continue;
+    }
+    tor_mutex_release(&kist_shard_pool.lock);
+    kist_shard_update_socket_info(&kist_shards[thread->idx]);
+    tor_mutex_acquire(&kist_shard_pool.lock);
+    if (--kist_shard_pool.n_running == 0) {
+      tor_cond_signal_one(&kist_shard_pool.cond_done);
+    }
+  }
+}
+
+/* Make sure we have a helper thread for every shard but the first one of
+ * n_shards. Return the number of shards we can actually use, which is less
+ * than n_shards only if we failed to spawn a thread. */
+static int
+kist_shard_pool_spawn_threads(int n_shards)
+{
+  if (!kist_shard_pool.initialized) {
+    tor_mutex_init_for_cond(&kist_shard_pool.lock);
+    tor_cond_init(&kist_shard_pool.cond_work);
+    tor_cond_init(&kist_shard_pool.cond_done);
+    kist_shard_pool.initialized = 1;
+  }
+
+  tor_mutex_acquire(&kist_shard_pool.lock);
+  while (kist_shard_pool.n_threads < n_shards - 1) {
+    kist_shard_thread_t *thread = tor_malloc_zero(sizeof(*thread));
+    thread->idx = kist_shard_pool.n_threads + 1;
+    thread->generation = kist_shard_pool.generation;
+    if (spawn_func(kist_shard_thread_main, thread) < 0) {
+      log_warn(LD_SCHED, "Can't launch KIST shard thread. Using %d shards "
+               "instead of %d.", kist_shard_pool.n_threads + 1, n_shards);
+      tor_free(thread);
+      break;
+    }
+    ++kist_shard_pool.n_threads;
+  }
+  n_shards = MIN(n_shards, kist_shard_pool.n_threads + 1);
+  tor_mutex_release(&kist_shard_pool.lock);
+  return n_shards;
+}
+
+/* Split the socket state into n_shards shards, spawning helper threads as
+ * needed. Does nothing if we already use that many shards. */
+static void
+kist_set_n_shards(int n_shards)
+{
+  n_shards = CLAMP(1, n_shards, KIST_SCHED_SHARDS_MAX);
+  if (n_shards > 1) {
+    n_shards = kist_shard_pool_spawn_threads(n_shards);
+  }
+  if (n_shards == kist_n_shards) {
+    return;
+  }
+  if (kist_n_shards) {
+    log_info(LD_SCHED, "Scheduler KIST changing its number of shards from %d "
+             "to %d", kist_n_shards, n_shards);
+  }
+
+  free_all_socket_info();
+  kist_shards = tor_calloc(n_shards, sizeof(kist_shard_t));
+  for (int i = 0; i < n_shards; ++i) {
+    HT_INIT(socket_table_s, &kist_shards[i].socket_table);
+    kist_shards[i].pending = smartlist_new();
+  }
+  kist_n_shards = n_shards;
+}
+
+#ifdef HAVE_KIST_SOCK_DIAG
+/* Return the inode of chan's socket, or 0 if we can't tell. */
+static uint64_t
+channel_socket_inode(const channel_t *chan)
+{
+  struct stat st;
+  or_connection_t *conn = BASE_CHAN_TO_TLS((channel_t *) chan)->conn;
+
+  if (!conn || !SOCKET_OK(TO_CONN(conn)->s)) {
+    return 0;
+  }
+  if (fstat(TO_CONN(conn)->s, &st) < 0) {
+    return 0;
+  }
+  return (uint64_t) st.st_ino;
+}
+
+/* Get the kernel information of every pending channel with sock_diag. The
+ * entries we can't fill that way are updated one socket at a time later. */
+static void
+kist_sock_diag_update_pending(smartlist_t *pending)
+{
+  socket_table_ent_t **ents;
+  int n_ents = 0, n_filled;
+
+  if (!kist_use_sock_diag || kist_no_sock_diag_support ||
+      kist_lite_mode || kist_no_kernel_support) {
+    return;
+  }
+
+  ents = tor_calloc(smartlist_len(pending), sizeof(socket_table_ent_t *));
+  SMARTLIST_FOREACH_BEGIN(pending, const channel_t *, pchan) {
+    socket_table_ent_t *ent =
+      socket_table_search(&kist_shard_for_chan(pchan)->socket_table, pchan);
+    if (BUG(!ent)) {
+      continue;
+    }
+    if (!ent->inode) {
+      ent->inode = channel_socket_inode(pchan);
+    }
+    ents[n_ents++] = ent;
+  } SMARTLIST_FOREACH_END(pchan);
+
+  n_filled = kist_sock_diag_update(ents, n_ents);
+  if (n_filled < 0) {
+    log_notice(LD_SCHED, "Unable to get TCP information through sock_diag. "
+               "KIST will ask the kernel about each socket instead.");
+    kist_no_sock_diag_support = 1;
+  } else {
+    log_debug(LD_SCHED, "sock_diag gave us TCP information for %d of %d "
+              "sockets", n_filled, n_ents);
+  }
+  tor_free(ents);
+}
+#endif /* defined(HAVE_KIST_SOCK_DIAG) */
+
+/* Called from the main thread once every shard is done refreshing its
+ * socket information: if any shard found out that the kernel doesn't
+ * support KIST anymore, fall back to the naive approach from now on. */
+static void
+kist_shards_apply_no_kernel_support(void)
+{
+  for (int i = 0; i < kist_n_shards; ++i) {
+    kist_shard_t *shard = &kist_shards[i];
+    if (!shard->no_kernel_support) {
+      continue;
+    }
+    shard->no_kernel_support = 0;
+#ifdef HAVE_KIST_SUPPORT
+    if (!kist_no_kernel_support) {
+      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
+                           "for KIST anymore. We will fallback to the naive "
+                           "approach. Remove KIST from the Schedulers list "
+                           "to disable.");
+      kist_no_kernel_support = 1;
+    }
+#endif /* defined(HAVE_KIST_SUPPORT) */
+  }
+}
+
+/* Refresh the kernel information of every pending channel, one shard per
+ * thread. Return once every shard is done. */
+static void
+kist_update_all_socket_info(smartlist_t *pending)
+{
+  SMARTLIST_FOREACH_BEGIN(pending, const channel_t *, pchan) {
+    kist_shard_t *shard = kist_shard_for_chan(pchan);
+    init_socket_info(&shard->socket_table, pchan);
+    smartlist_add(shard->pending, (void *) pchan);
+  } SMARTLIST_FOREACH_END(pchan);
+
+#ifdef HAVE_KIST_SOCK_DIAG
+  kist_sock_diag_update_pending(pending);
+#endif
+
+  if (kist_n_shards == 1) {
+    kist_shard_update_socket_info(&kist_shards[0]);
+    kist_shards_apply_no_kernel_support();
+    return;
+  }
+
+  tor_mutex_acquire(&kist_shard_pool.lock);
+  kist_shard_pool.n_active = kist_n_shards;
+  kist_shard_pool.n_running = kist_n_shards - 1;
+  ++kist_shard_pool.generation;
+  tor_cond_signal_all(&kist_shard_pool.cond_work);
+  tor_mutex_release(&kist_shard_pool.lock);
+
+  /* The main thread takes care of shard 0 in the meantime. */
+  kist_shard_update_socket_info(&kist_shards[0]);
+
+  tor_mutex_acquire(&kist_shard_pool.lock);
+  while (kist_shard_pool.n_running > 0) {
+    tor_cond_wait(&kist_shard_pool.cond_done, &kist_shard_pool.lock, NULL);
+  }
+  tor_mutex_release(&kist_shard_pool.lock);
+
+  kist_shards_apply_no_kernel_support();
+}
+
 /*
  * A naive KIST impl would write every single cell all the way to the kernel.
  * That would take a lot of system calls. A less bad KIST impl would write a
@@ -477,13 +796,14 @@ static void
 kist_free_all(void)
 {
   free_all_socket_info();
+  kist_sock_diag_free_all();
 }
 
 /* Function of the scheduler interface: on_channel_free() */
 static void
 kist_on_channel_free_fn(const channel_t *chan)
 {
-  free_socket_info_by_chan(&socket_table, chan);
+  free_socket_info_by_chan(socket_table_for_chan(chan), chan);
 }
 
 /* Function of the scheduler interface: on_new_consensus() */
@@ -498,6 +818,11 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  kist_set_n_shards(get_options()->KISTSchedShards);
+#ifdef HAVE_KIST_SOCK_DIAG
+  kist_use_sock_diag = get_options()->KISTSockDiag;
+  kist_no_sock_diag_support = 0;
+#endif
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
@@ -570,6 +895,7 @@ kist_scheduler_run(void)
 {
   /* Define variables */
   channel_t *chan = NULL; // current working channel
+  socket_table_t *table = NULL; // socket table of the working channel
   /* The last distinct chan served in a sched loop. */
   channel_t *prev_chan = NULL;
   int flush_result; // temporarily store results from flush calls
@@ -580,10 +906,7 @@ kist_scheduler_run(void)
   outbuf_table_t outbuf_table = HT_INITIALIZER();
 
   /* For each pending channel, collect new kernel information */
-  SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
-      init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
-  } SMARTLIST_FOREACH_END(pchan);
+  kist_update_all_socket_info(cp);
 
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
             smartlist_len(cp));
@@ -599,6 +922,7 @@ kist_scheduler_run(void)
        */
       continue;
     }
+    table = &kist_shard_for_chan(chan)->socket_table;
     outbuf_table_add(&outbuf_table, chan);
 
     /* if we have switched to a new channel, consider writing the previous
@@ -615,7 +939,7 @@ kist_scheduler_run(void)
     }
 
     /* Only flush and write if the per-socket limit hasn't been hit */
-    if (socket_can_write(&socket_table, chan)) {
+    if (socket_can_write(table, chan)) {
       /* flush to channel queue/outbuf */
       flush_result = (int)channel_flush_some_cells(chan, 1); // 1 for num cells
       /* XXX: While flushing cells, it is possible that the connection write
@@ -632,7 +956,7 @@ kist_scheduler_run(void)
       }
       /* flush_result has the # cells flushed */
       if (flush_result > 0) {
-        update_socket_written(&socket_table, chan, flush_result *
+        update_socket_written(table, chan, flush_result *
                               (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD));
       } else {
         /* XXX: This can happen because tor sometimes does flush in an
@@ -656,7 +980,7 @@ kist_scheduler_run(void)
     /* Decide what to do with the channel now */
 
     if (!channel_more_to_flush(chan) &&
-        !socket_can_write(&socket_table, chan)) {
+        !socket_can_write(table, chan)) {
 
       /* Case 1: no more cells to send, and cannot write */
 
@@ -681,7 +1005,7 @@ kist_scheduler_run(void)
       /* Case 2: no more cells to send, but still open for writes */
 
       scheduler_set_channel_state(chan, SCHED_CHAN_WAITING_FOR_CELLS);
-    } else if (!socket_can_write(&socket_table, chan)) {
+    } else if (!socket_can_write(table, chan)) {
 
       /* Case 3: cells to send, but cannot write */
 
@@ -793,6 +1117,14 @@ kist_scheduler_run_interval(void)
                                  KIST_SCHED_RUN_INTERVAL_MAX);
 }
 
+/* Return the number of shards the KIST per-socket state is split into, or 0
+ * if the KIST scheduler isn't set up. */
+int
+kist_scheduler_n_shards(void)
+{
+  return kist_n_shards;
+}
+
 /* Set KISTLite mode that is KIST without kernel support. */
 void
 scheduler_kist_set_lite_mode(void)
@@ -0,0 +1,336 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler_kist_diag.c
+ * \brief Collect the TCP information KIST needs for many sockets at once,
+ *   with a netlink sock_diag dump.
+ *
+ * The default way for KIST to learn about a socket is one getsockopt() and
+ * one ioctl() per pending channel, every scheduling run. Instead, this module
+ * asks the kernel for the tcp_info of every established TCP socket of the
+ * host in one netlink dump per address family, and matches the answers with
+ * our socket table entries by socket inode. Entries we can't find in the dump
+ * are left alone so that the caller can use the per-socket path for them.
+ *
+ * We run in the main thread on every scheduler run, so the netlink socket is
+ * non-blocking: if the kernel doesn't have the whole dump ready for us, we
+ * stop reading, and the entries we didn't get to use the per-socket path.
+ *
+ * This lives in its own file because it needs the kernel's own struct
+ * tcp_info from linux/tcp.h, which conflicts with the libc one from
+ * netinet/tcp.h that scheduler_kist.c uses.
+ **/
+
+#define SCHEDULER_KIST_PRIVATE
+
+#include "core/or/or.h"
+#define SCHEDULER_PRIVATE_
+#include "core/or/scheduler.h"
+#include "lib/cc/ctassert.h"
+#include "lib/net/socket.h"
+#include "lib/sandbox/sandbox.h"
+
+#ifdef HAVE_KIST_SOCK_DIAG
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+
+/* TCP states we ask the kernel about. We only ever schedule established
+ * connections, but the peer might have closed its side already. These values
+ * come from the kernel's include/net/tcp_states.h. */
+#define KIST_TCP_ESTABLISHED 1
+#define KIST_TCP_CLOSE_WAIT 8
+#define KIST_SOCK_DIAG_STATES \
+  ((1 << KIST_TCP_ESTABLISHED) | (1 << KIST_TCP_CLOSE_WAIT))
+
+/* Size of the buffer we read the netlink dump into. The kernel fills it with
+ * as many answers as fit, so bigger means fewer recv() calls. */
+#define KIST_SOCK_DIAG_BUF_LEN (32*1024)
+
+/* Smallest tcp_info the kernel can give us that still has every field we
+ * use. Kernels older than 4.6 don't report tcpi_notsent_bytes. */
+#define KIST_TCP_INFO_MIN_LEN \
+  (offsetof(struct tcp_info, tcpi_notsent_bytes) + \
+   sizeof(((struct tcp_info *) NULL)->tcpi_notsent_bytes))
+
+/* Flags for the type of our netlink socket. The sandbox only allows the
+ * ones in SANDBOX_SOCKET_TYPE_FLAGS, so check that we stay within them. */
+#define KIST_SOCK_DIAG_TYPE_FLAGS (SOCK_CLOEXEC|SOCK_NONBLOCK)
+CTASSERT((KIST_SOCK_DIAG_TYPE_FLAGS & ~SANDBOX_SOCKET_TYPE_FLAGS) == 0);
+
+/* Our netlink socket, opened the first time we need it. */
+static tor_socket_t sock_diag_fd = TOR_INVALID_SOCKET;
+
+/* Compare two socket table entries by socket inode, for qsort() and
+ * bsearch(). */
+static int
+compare_ents_by_inode_(const void *a_, const void *b_)
+{
+  const socket_table_ent_t *a = *(socket_table_ent_t * const *) a_;
+  const socket_table_ent_t *b = *(socket_table_ent_t * const *) b_;
+  if (a->inode < b->inode)
+    return -1;
+  else if (a->inode > b->inode)
+    return 1;
+  else
+    return 0;
+}
+
+/* Return the entry of ents whose socket has the given inode, or NULL if
+ * there is none. ents must be sorted by inode. */
+static socket_table_ent_t *
+find_ent_by_inode(socket_table_ent_t **ents, int n_ents, uint64_t inode)
+{
+  socket_table_ent_t search, *searchp = &search, **found;
+  search.inode = inode;
+  found = bsearch(&searchp, ents, n_ents, sizeof(socket_table_ent_t *),
+                  compare_ents_by_inode_);
+  return found ? *found : NULL;
+}
+
+/* Open our non-blocking netlink socket if we haven't yet. Return 0 on
+ * success, -1 on failure. */
+static int
+sock_diag_open(void)
+{
+  struct sockaddr_nl addr;
+
+  if (SOCKET_OK(sock_diag_fd)) {
+    return 0;
+  }
+  sock_diag_fd = tor_open_socket_with_extensions(AF_NETLINK, SOCK_RAW,
+                       NETLINK_SOCK_DIAG,
+                       (KIST_SOCK_DIAG_TYPE_FLAGS & SOCK_CLOEXEC) != 0,
+                       (KIST_SOCK_DIAG_TYPE_FLAGS & SOCK_NONBLOCK) != 0);
+  if (!SOCKET_OK(sock_diag_fd)) {
+    log_info(LD_SCHED, "Unable to open a sock_diag netlink socket: %s",
+             tor_socket_strerror(tor_socket_errno(-1)));
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(sock_diag_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    log_info(LD_SCHED, "Unable to bind our sock_diag netlink socket: %s",
+             tor_socket_strerror(tor_socket_errno(sock_diag_fd)));
+    tor_close_socket(sock_diag_fd);
+    sock_diag_fd = TOR_INVALID_SOCKET;
+    return -1;
+  }
+  return 0;
+}
+
+/* Fill the TCP information of the entry of ents that matches the sock_diag
+ * answer msg, if any. Return 1 if we filled an entry, 0 if the answer isn't
+ * about one of our sockets, and -1 if the kernel doesn't give us what we
+ * need. */
+static int
+handle_diag_msg(const struct nlmsghdr *nlh, socket_table_ent_t **ents,
+                int n_ents)
+{
+  const struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+  const struct rtattr *attr;
+  socket_table_ent_t *ent;
+  int attr_len;
+
+  if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*msg)) || msg->idiag_inode == 0) {
+    return 0;
+  }
+  ent = find_ent_by_inode(ents, n_ents, msg->idiag_inode);
+  if (!ent) {
+    return 0;
+  }
+
+  attr = (const struct rtattr *) (msg + 1);
+  attr_len = (int) (nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg)));
+  for (; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+    if (attr->rta_type != INET_DIAG_INFO) {
+      continue;
+    }
+    if (RTA_PAYLOAD(attr) < KIST_TCP_INFO_MIN_LEN) {
+      return -1;
+    }
+    /* The payload is only 4-byte aligned, so copy it out. */
+    struct tcp_info tcp;
+    memset(&tcp, 0, sizeof(tcp));
+    memcpy(&tcp, RTA_DATA(attr), MIN(RTA_PAYLOAD(attr), sizeof(tcp)));
+    ent->cwnd = tcp.tcpi_snd_cwnd;
+    ent->unacked = tcp.tcpi_unacked;
+    ent->mss = tcp.tcpi_snd_mss;
+    ent->notsent = tcp.tcpi_notsent_bytes;
+    if (!ent->have_diag_info) {
+      ent->have_diag_info = 1;
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+/* Dump the TCP sockets of the given address family, and fill the entries of
+ * ents that we find. Return the number of entries filled, or -1 if we can't
+ * use sock_diag. If the kernel didn't have the whole dump ready, set
+ * *incomplete_out to 1 and return the number of entries filled so far. */
+static int
+sock_diag_dump_family(uint8_t family, socket_table_ent_t **ents, int n_ents,
+                      int *incomplete_out)
+{
+  struct {
+    struct nlmsghdr nlh;
+    struct inet_diag_req_v2 req;
+  } request;
+  struct sockaddr_nl addr;
+  char *buf = NULL;
+  int n_filled = 0;
+
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = sizeof(request);
+  request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.req.sdiag_family = family;
+  request.req.sdiag_protocol = IPPROTO_TCP;
+  request.req.idiag_states = KIST_SOCK_DIAG_STATES;
+  request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (sendto(sock_diag_fd, &request, sizeof(request), 0,
+             (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    if (ERRNO_IS_EAGAIN(tor_socket_errno(sock_diag_fd))) {
+      *incomplete_out = 1;
+      return 0;
+    }
+    log_info(LD_SCHED, "Unable to send a sock_diag request: %s",
+             tor_socket_strerror(tor_socket_errno(sock_diag_fd)));
+    return -1;
+  }
+
+  buf = tor_malloc(KIST_SOCK_DIAG_BUF_LEN);
+  for (;;) {
+    ssize_t n_read = recv(sock_diag_fd, buf, KIST_SOCK_DIAG_BUF_LEN, 0);
+    if (n_read < 0) {
+      int e = tor_socket_errno(sock_diag_fd);
+      if (e == EINTR)
+        continue;
+      if (ERRNO_IS_EAGAIN(e)) {
+        /* Don't wait for the rest of the dump. */
+        *incomplete_out = 1;
+        goto done;
+      }
+      log_info(LD_SCHED, "Unable to read a sock_diag answer: %s",
+               tor_socket_strerror(tor_socket_errno(sock_diag_fd)));
+      goto err;
+    }
+    if (n_read == 0) {
+      goto err;
+    }
+
+    const struct nlmsghdr *nlh = (const struct nlmsghdr *) buf;
+    int len = (int) n_read;
+    for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        goto done;
+      }
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        log_info(LD_SCHED, "The kernel refused our sock_diag request.");
+        goto err;
+      }
+      if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY) {
+        continue;
+      }
+      int r = handle_diag_msg(nlh, ents, n_ents);
+      if (r < 0) {
+        log_info(LD_SCHED, "The kernel's sock_diag tcp_info is too short "
+                 "for KIST.");
+        goto err;
+      }
+      n_filled += r;
+    }
+  }
+
+ done:
+  tor_free(buf);
+  return n_filled;
+ err:
+  tor_free(buf);
+  return -1;
+}
+
+/* Fill the TCP information (cwnd, unacked, mss and notsent) of the n_ents
+ * socket table entries in ents from one sock_diag dump per address family,
+ * and set have_diag_info on every entry we filled. Entries must have their
+ * inode set; entries with inode 0 are never filled. ents gets reordered.
+ *
+ * If a dump isn't complete when we read it, we skip the rest of it, and
+ * the entries we didn't fill are left for the caller's per-socket path.
+ *
+ * Return the number of entries filled, or -1 if we can't use sock_diag at
+ * all, in which case the caller should stop trying. */
+int
+kist_sock_diag_update(socket_table_ent_t **ents, int n_ents)
+{
+  int n_filled = 0, incomplete = 0;
+
+  tor_assert(ents || n_ents == 0);
+
+  if (sock_diag_open() < 0) {
+    return -1;
+  }
+  if (n_ents == 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < n_ents; ++i) {
+    ents[i]->have_diag_info = 0;
+  }
+  qsort(ents, n_ents, sizeof(socket_table_ent_t *), compare_ents_by_inode_);
+
+  for (int i = 0; i < 2 && n_filled < n_ents; ++i) {
+    int r = sock_diag_dump_family(i ? AF_INET6 : AF_INET, ents, n_ents,
+                                  &incomplete);
+    if (r < 0) {
+      kist_sock_diag_free_all();
+      return -1;
+    }
+    n_filled += r;
+    if (incomplete) {
+      /* Close the socket, so that the rest of this dump doesn't get mixed
+       * up with the next one. We reopen it on the next run. */
+      log_debug(LD_SCHED, "The sock_diag dump wasn't ready; asking about the "
+                "remaining sockets one at a time.");
+      kist_sock_diag_free_all();
+      break;
+    }
+  }
+  return n_filled;
+}
+
+/* Release everything this module holds. */
+void
+kist_sock_diag_free_all(void)
+{
+  if (SOCKET_OK(sock_diag_fd)) {
+    tor_close_socket(sock_diag_fd);
+    sock_diag_fd = TOR_INVALID_SOCKET;
+  }
+}
+
+#else /* !defined(HAVE_KIST_SOCK_DIAG) */
+
+int
+kist_sock_diag_update(socket_table_ent_t **ents, int n_ents)
+{
+  (void) ents;
+  (void) n_ents;
+  return -1;
+}
+
+void
+kist_sock_diag_free_all(void)
+{
+}
+
+#endif /* defined(HAVE_KIST_SOCK_DIAG) */
@@ -43,6 +43,7 @@
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
+#include "feature/relay/dns.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
 #include "feature/relay/selftest.h"
@@ -1469,6 +1470,16 @@ static const getinfo_item_t getinfo_items[] = {
          "Information about and from the ns consensus."),
   ITEM("network-status", dir,
        "Brief summary of router status (v1 directory format)"),
+  PREFIX("dns/cache/", dns, NULL),
+  DOC("dns/cache/entries", "Number of entries in the exit DNS cache."),
+  DOC("dns/cache/bytes", "Approximate size in bytes of the exit DNS cache."),
+  DOC("dns/cache/hits", "Streams that found an answer in the DNS cache."),
+  DOC("dns/cache/misses",
+      "Streams that had to wait for a DNS answer."),
+  DOC("dns/cache/evictions",
+      "DNS answers forgotten to stay under ServerDNSCacheMaxSize."),
+  DOC("dns/cache/prefetches",
+      "Popular DNS answers refreshed before they expired."),
   ITEM("network-liveness", liveness,
        "Current opinion on whether the network is live"),
   ITEM("circuit-status", events, "List of current circuits originating here."),
@@ -494,6 +494,25 @@ spooled_resource_free_(spooled_resource_t *spooled)
 /** When spooling data from a cached_dir_t object, we always add
  * at least this much. */
 #define DIRSERV_CACHED_DIR_CHUNK_SIZE 8192
+/** When spooling data from a cached_dir_t or consensus_cache_entry_t object
+ * onto an outbuf without copying it, we add this much at a time. */
+#define DIRSERV_BORROWED_CHUNK_SIZE 65536
+
+/** Helper: release the reference to a cached_dir_t that an outbuf held
+ * while it was borrowing the cached_dir_t's body. */
+static void
+spooled_cached_dir_release(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
+/** Helper: release the reference to a consensus_cache_entry_t that an outbuf
+ * held while it was borrowing the entry's body. */
+static void
+spooled_cache_entry_release(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
 
 /** Return an compression ratio for compressing objects from <b>source</b>.
  */
@@ -619,10 +638,28 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     remaining = total_len - spooled->cached_dir_offset;
     if (BUG(remaining < 0))
       return SRFS_ERR;
-    ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
-
-    connection_dir_buf_add(ptr + spooled->cached_dir_offset,
-                           bytes, conn, 0);
+    ssize_t bytes;
+
+    if (conn->compress_state == NULL) {
+      /* We're sending the body as it is, so the outbuf can refer to it
+       * directly, as long as it holds a reference to keep it around. */
+      bytes = (ssize_t) MIN(DIRSERV_BORROWED_CHUNK_SIZE, remaining);
+      if (cached) {
+        ++cached->refcnt;
+        connection_buf_add_borrowed(ptr + spooled->cached_dir_offset, bytes,
+                                    TO_CONN(conn),
+                                    spooled_cached_dir_release, cached);
+      } else {
+        consensus_cache_entry_incref(cce);
+        connection_buf_add_borrowed(ptr + spooled->cached_dir_offset, bytes,
+                                    TO_CONN(conn),
+                                    spooled_cache_entry_release, cce);
+      }
+    } else {
+      bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
+      connection_dir_buf_add(ptr + spooled->cached_dir_offset,
+                             bytes, conn, 0);
+    }
 
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
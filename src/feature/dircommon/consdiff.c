@@ -29,6 +29,11 @@
  * time near-linear. This is explained in more detail in the gen_ed_diff
  * comments.
  *
+ * Before it computes the LCS of a large pair of slices, calc_section_changes
+ * gives every line in them a number, so that lines with the same contents get
+ * the same number. The LCS computation then compares numbers instead of
+ * strings.
+ *
  * The allocation strategy tries to save time and memory by avoiding needless
  * copies.  Instead of actually splitting the inputs into separate strings, we
  * allocate cdline_t objects, each of which represents a line in the original
@@ -41,8 +46,12 @@
 #include "core/or/or.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
+#include "lib/crypt_ops/crypto_digest.h"
 #include "feature/dirparse/ns_parse.h"
 
+#include "ext/siphash.h"
+#include "ht.h"
+
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
 
@@ -52,6 +61,8 @@ static char *consensus_join_lines(const smartlist_t *inp);
 STATIC int
 lines_eq(const cdline_t *a, const cdline_t *b)
 {
+  if (a->id && b->id)
+    return a->id == b->id;
   return a->len == b->len && fast_memeq(a->s, b->s, a->len);
 }
 
@@ -61,7 +72,7 @@ line_str_eq(const cdline_t *a, const char *b)
 {
   const size_t len = strlen(b);
   tor_assert(len <= UINT32_MAX);
-  cdline_t bline = { b, (uint32_t)len };
+  cdline_t bline = { b, (uint32_t)len, 0 };
   return lines_eq(a, &bline);
 }
 
@@ -85,6 +96,7 @@ cdline_linecpy(memarea_t *area, const char *s)
   cdline_t *line = memarea_alloc(area, sizeof(cdline_t));
   line->s = ss;
   line->len = (uint32_t)len;
+  line->id = 0;
   return line;
 }
 
@@ -131,6 +143,82 @@ consensus_digest_eq,(const uint8_t *d1,
   return fast_memeq(d1, d2, DIGEST256_LEN);
 }
 
+/** An entry in the table that assign_line_ids uses to find the id of the
+ * lines it has already seen. */
+typedef struct line_id_ent_t {
+  HT_ENTRY(line_id_ent_t) node;
+  /** The first line we saw with these contents. */
+  const cdline_t *line;
+} line_id_ent_t;
+
+/** Helper for the line id table: return true iff two entries have lines
+ * with the same contents. */
+static inline int
+line_id_ents_eq(const line_id_ent_t *a, const line_id_ent_t *b)
+{
+  return a->line->len == b->line->len &&
+    fast_memeq(a->line->s, b->line->s, a->line->len);
+}
+
+/** Helper for the line id table: hash the contents of the line of an
+ * entry. */
+static inline unsigned
+line_id_ent_hash(const line_id_ent_t *ent)
+{
+  return (unsigned) siphash24g(ent->line->s, ent->line->len);
+}
+
+HT_HEAD(line_id_map, line_id_ent_t);
+HT_PROTOTYPE(line_id_map, line_id_ent_t, node, line_id_ent_hash,
+             line_id_ents_eq)
+HT_GENERATE2(line_id_map, line_id_ent_t, node, line_id_ent_hash,
+             line_id_ents_eq, 0.6, tor_reallocarray_, tor_free_)
+
+/** Set the id of every line in <b>slice1</b> and <b>slice2</b>, so that two
+ * lines have the same id exactly when they have the same contents. Ids start
+ * at 1. Use <b>area</b> for temporary storage.
+ *
+ * The lines are modified even though the lists are const; call
+ * clear_line_ids on both slices when done with the ids. */
+STATIC void
+assign_line_ids(const smartlist_slice_t *slice1,
+                const smartlist_slice_t *slice2, memarea_t *area)
+{
+  struct line_id_map map = HT_INITIALIZER();
+  const smartlist_slice_t *slices[2] = { slice1, slice2 };
+  uint32_t next_id = 1;
+
+  for (int i = 0; i < 2; ++i) {
+    const smartlist_slice_t *slice = slices[i];
+    for (int j = slice->offset; j < slice->offset + slice->len; ++j) {
+      cdline_t *line = smartlist_get(slice->list, j);
+      line_id_ent_t search, *ent;
+      search.line = line;
+      ent = HT_FIND(line_id_map, &map, &search);
+      if (ent) {
+        line->id = ent->line->id;
+      } else {
+        line->id = next_id++;
+        ent = memarea_alloc(area, sizeof(line_id_ent_t));
+        ent->line = line;
+        HT_INSERT(line_id_map, &map, ent);
+      }
+    }
+  }
+  /* The entries themselves live in the memarea. */
+  HT_CLEAR(line_id_map, &map);
+}
+
+/** Reset the id of every line in <b>slice</b>, as set by assign_line_ids. */
+STATIC void
+clear_line_ids(const smartlist_slice_t *slice)
+{
+  for (int j = slice->offset; j < slice->offset + slice->len; ++j) {
+    cdline_t *line = smartlist_get(slice->list, j);
+    line->id = 0;
+  }
+}
+
 /** Create (allocate) a new slice from a smartlist. Assumes that the start
  * and the end indexes are within the bounds of the initial smartlist. The end
  * element is not part of the resulting slice. If end is -1, the slice is to
@@ -174,6 +262,26 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
 
   tor_assert(direction == 1 || direction == -1);
 
+  /* If every line of slice2 has an id, copy the ids in the order we visit
+   * them, so that the inner loop below only compares integers. */
+  uint32_t *ids2 = NULL;
+  int sj = slice2->offset;
+  if (direction == -1) {
+    sj += (slice2->len-1);
+  }
+  if (slice2->len &&
+      ((const cdline_t *)smartlist_get(slice2->list, sj))->id) {
+    ids2 = tor_malloc(sizeof(uint32_t) * slice2->len);
+    for (int j = 0; j < slice2->len; ++j, sj+=direction) {
+      const cdline_t *line2 = smartlist_get(slice2->list, sj);
+      if (!line2->id) {
+        tor_free(ids2);
+        break;
+      }
+      ids2[j] = line2->id;
+    }
+  }
+
   int si = slice1->offset;
   if (direction == -1) {
     si += (slice1->len-1);
@@ -185,7 +293,19 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
     /* Store the last results. */
     memcpy(prev, result, a_size);
 
-    int sj = slice2->offset;
+    if (ids2 && line1->id) {
+      const uint32_t id1 = line1->id;
+      for (int j = 0; j < slice2->len; ++j) {
+        if (id1 == ids2[j]) {
+          result[j + 1] = prev[j] + 1;
+        } else {
+          result[j + 1] = MAX(result[j], prev[j + 1]);
+        }
+      }
+      continue;
+    }
+
+    sj = slice2->offset;
     if (direction == -1) {
       sj += (slice2->len-1);
     }
@@ -202,6 +322,7 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
       }
     }
   }
+  tor_free(ids2);
   tor_free(prev);
   return result;
 }
@@ -533,7 +654,32 @@ typedef struct router_id_iterator_t {
 /**
  * Initializer for a router_id_iterator_t.
  */
-#define ROUTER_ID_ITERATOR_INIT { { NULL, 0 }, { NULL, 0 } }
+#define ROUTER_ID_ITERATOR_INIT { { NULL, 0, 0 }, { NULL, 0, 0 } }
+
+/** Smallest number of line pairs for which calc_section_changes numbers the
+ * lines before it computes the LCS. */
+#define LINE_IDS_MIN_CELLS (1024)
+
+/** Like calc_changes, for a pair of slices of the two consensuses that
+ * gen_ed_diff has to compare line by line. If the slices are large enough,
+ * number their lines first so that the LCS computation compares integers;
+ * most sections are a single router entry of a few lines, for which that
+ * wouldn't pay off. Use <b>area</b> for temporary storage. */
+static void
+calc_section_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
+                     bitarray_t *changed1, bitarray_t *changed2,
+                     memarea_t *area)
+{
+  const int use_ids =
+    (uint64_t)slice1->len * slice2->len >= LINE_IDS_MIN_CELLS;
+  if (use_ids)
+    assign_line_ids(slice1, slice2, area);
+  calc_changes(slice1, slice2, changed1, changed2);
+  if (use_ids) {
+    clear_line_ids(slice1);
+    clear_line_ids(slice2);
+  }
+}
 
 /** Given an index *<b>idxp</b> into the consensus at <b>cons</b>, advance
  * the index to the next router line ("r ...") in the consensus, or to
@@ -735,7 +881,7 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+    calc_section_changes(cons1_sl, cons2_sl, changed1, changed2, area);
     tor_free(cons1_sl);
     tor_free(cons2_sl);
     start1 = i1, start2 = i2;
@@ -846,20 +992,35 @@ get_linenum(const char **s, int *num_out)
   }
 }
 
-/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the consensus
- * and return a new consensus, also as a line-based smartlist. Will return
- * NULL if the ed diff is not properly formatted.
- *
- * All cdline_t objects in the resulting object are references to lines
- * in one of the inputs; nothing is copied.
- */
-STATIC smartlist_t *
-apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
-              int diff_starting_line)
+/** One command of an ed diff, as parsed by parse_ed_diff. */
+typedef struct ed_cmd_t {
+  /** The first and last lines of the base consensus that the command applies
+   * to. For an 'a' command, both are the line to add lines after. */
+  int start;
+  int end;
+  /** 'a', 'c' or 'd'. */
+  char action;
+  /** For 'a' and 'c' commands, the index in the diff of the first line to
+   * add, and the number of lines to add. */
+  int added_idx;
+  int n_added;
+} ed_cmd_t;
+
+/** Parse the ed diff in <b>diff</b>, starting at <b>diff_starting_line</b>,
+ * for a base consensus with <b>n_lines1</b> lines. On success, return a newly
+ * allocated array of its commands, in the order they appear in the diff (that
+ * is, from the end of the base consensus to its start), and set
+ * *<b>n_cmds_out</b> to their number. Return NULL if the ed diff is not
+ * properly formatted. */
+static ed_cmd_t *
+parse_ed_diff(const smartlist_t *diff, int diff_starting_line, int n_lines1,
+              int *n_cmds_out)
 {
   int diff_len = smartlist_len(diff);
-  int j = smartlist_len(cons1);
-  smartlist_t *cons2 = smartlist_new();
+  int j = n_lines1;
+  int n_cmds = 0;
+  ed_cmd_t *cmds =
+    tor_calloc(MAX(diff_len - diff_starting_line, 1), sizeof(ed_cmd_t));
 
   for (int i=diff_starting_line; i<diff_len; ++i) {
     const cdline_t *diff_cdline = smartlist_get(diff, i);
@@ -888,7 +1049,7 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
       ++ptr;
       if (*ptr == '$') {
         end_was_eof = 1;
-        end = smartlist_len(cons1);
+        end = n_lines1;
         ++ptr;
       } else if (get_linenum(&ptr, &end) < 0) {
         log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
@@ -951,22 +1112,14 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
       goto error_cleanup;
     }
 
-    /* Add unchanged lines. */
-    for (; j && j > end; --j) {
-      cdline_t *cons_line = smartlist_get(cons1, j-1);
-      smartlist_add(cons2, cons_line);
-    }
+    ed_cmd_t *cmd = &cmds[n_cmds++];
+    cmd->start = start;
+    cmd->end = end;
+    cmd->action = action;
 
-    /* Ignore removed lines. */
-    if (action == 'c' || action == 'd') {
-      while (--j >= start) {
-        /* Skip line */
-      }
-    }
+    /* The next command must not touch any line before this one does. */
+    j = (action == 'a') ? end : start - 1;
 
-    /* Add new lines in reverse order, since it will all be reversed at the
-     * end.
-     */
     if (action == 'a' || action == 'c') {
       int added_end = i;
 
@@ -982,19 +1135,66 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
         }
       }
 
-      int added_i = i-1;
-
       /* It would make no sense to add zero new lines. */
-      if (added_i == added_end) {
+      if (i-1 == added_end) {
         log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
             "it has an ed command that tries to insert zero lines.");
         goto error_cleanup;
       }
 
-      while (added_i > added_end) {
-        cdline_t *added_line = smartlist_get(diff, added_i--);
-        smartlist_add(cons2, added_line);
-      }
+      cmd->added_idx = added_end + 1;
+      cmd->n_added = i - 1 - added_end;
+    }
+  }
+
+  *n_cmds_out = n_cmds;
+  return cmds;
+
+ error_cleanup:
+  tor_free(cmds);
+  return NULL;
+}
+
+/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the consensus
+ * and return a new consensus, also as a line-based smartlist. Will return
+ * NULL if the ed diff is not properly formatted.
+ *
+ * All cdline_t objects in the resulting object are references to lines
+ * in one of the inputs; nothing is copied.
+ */
+STATIC smartlist_t *
+apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
+              int diff_starting_line)
+{
+  int n_cmds = 0;
+  int j = smartlist_len(cons1);
+  ed_cmd_t *cmds = parse_ed_diff(diff, diff_starting_line, j, &n_cmds);
+  if (!cmds)
+    return NULL;
+
+  smartlist_t *cons2 = smartlist_new();
+
+  for (int k = 0; k < n_cmds; ++k) {
+    const ed_cmd_t *cmd = &cmds[k];
+
+    /* Add unchanged lines. */
+    for (; j && j > cmd->end; --j) {
+      cdline_t *cons_line = smartlist_get(cons1, j-1);
+      smartlist_add(cons2, cons_line);
+    }
+
+    /* Ignore removed lines. */
+    if (cmd->action == 'c' || cmd->action == 'd') {
+      j = cmd->start - 1;
+    }
+
+    /* Add new lines in reverse order, since it will all be reversed at the
+     * end.
+     */
+    for (int i = cmd->added_idx + cmd->n_added - 1; i >= cmd->added_idx;
+         --i) {
+      cdline_t *added_line = smartlist_get(diff, i);
+      smartlist_add(cons2, added_line);
     }
   }
 
@@ -1006,13 +1206,117 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
 
   /* Reverse the whole thing since we did it from the end. */
   smartlist_reverse(cons2);
+  tor_free(cmds);
   return cons2;
+}
 
- error_cleanup:
+/** Return a pointer to the start of the line that comes <b>n</b> lines after
+ * the one at <b>s</b>, in a consensus that ends at <b>eos</b>. The consensus
+ * must have that many newline-terminated lines. */
+static const char *
+skip_lines(const char *s, const char *eos, int n)
+{
+  for (; n > 0; --n) {
+    const char *eol = memchr(s, '\n', eos - s);
+    tor_assert(eol);
+    s = eol + 1;
+  }
+  return s;
+}
 
-  smartlist_free(cons2);
+/** Append the <b>len</b> bytes at <b>s</b> to the output at *<b>outp</b>,
+ * advance *<b>outp</b>, and add them to <b>digest</b>. */
+static inline void
+ed_output_append(char **outp, const char *s, size_t len,
+                 crypto_digest_t *digest)
+{
+  memcpy(*outp, s, len);
+  crypto_digest_add_bytes(digest, *outp, len);
+  *outp += len;
+}
 
-  return NULL;
+/** Apply the ed diff, starting at <b>diff_starting_line</b>, to the
+ * <b>cons1_len</b>-byte consensus at <b>cons1</b>, and return the new
+ * consensus as a newly allocated NUL-terminated string. If
+ * <b>digest_out</b> is not NULL, store the SHA3-256 digest of the new
+ * consensus in it. Will return NULL if the consensus is not made of
+ * newline-terminated lines, or if the ed diff is not properly formatted.
+ *
+ * Unlike apply_ed_diff, we never split the base consensus into lines: we read
+ * it once, from start to end, and copy each run of unchanged lines straight
+ * into the output, whose size we bound in advance. So the only large
+ * allocation is the new consensus itself.
+ */
+STATIC char *
+apply_ed_diff_to_string(const char *cons1, size_t cons1_len,
+                        const smartlist_t *diff, int diff_starting_line,
+                        uint8_t *digest_out)
+{
+  int n_cmds = 0;
+  const int n_lines1 = consensus_count_lines(cons1, cons1_len);
+  if (n_lines1 < 0) {
+    log_warn(LD_CONSDIFF, "Could not apply consensus diff because "
+             "the base consensus is not made of lines.");
+    return NULL;
+  }
+  ed_cmd_t *cmds = parse_ed_diff(diff, diff_starting_line, n_lines1, &n_cmds);
+  if (!cmds)
+    return NULL;
+
+  /* Deleting lines only makes the output shorter. */
+  size_t max_len = cons1_len + 1;
+  for (int k = 0; k < n_cmds; ++k) {
+    for (int i = 0; i < cmds[k].n_added; ++i) {
+      const cdline_t *line = smartlist_get(diff, cmds[k].added_idx + i);
+      max_len += line->len + 1;
+    }
+  }
+
+  char *result = tor_malloc(max_len);
+  char *out = result;
+  crypto_digest_t *digest = crypto_digest256_new(DIGEST_SHA3_256);
+  const char *eos = cons1 + cons1_len;
+  const char *s = cons1;
+  int cur = 1; /* The number of the line at s. */
+
+  /* The commands go from the end of the consensus to its start. */
+  for (int k = n_cmds - 1; k >= 0; --k) {
+    const ed_cmd_t *cmd = &cmds[k];
+    const int keep_through = (cmd->action == 'a') ? cmd->start
+                                                  : cmd->start - 1;
+
+    /* Copy the unchanged lines up to the command. */
+    if (keep_through >= cur) {
+      const char *next = skip_lines(s, eos, keep_through - cur + 1);
+      ed_output_append(&out, s, next - s, digest);
+      s = next;
+      cur = keep_through + 1;
+    }
+
+    /* Skip removed lines. */
+    if (cmd->action == 'c' || cmd->action == 'd') {
+      s = skip_lines(s, eos, cmd->end - cur + 1);
+      cur = cmd->end + 1;
+    }
+
+    /* Add new lines. */
+    for (int i = 0; i < cmd->n_added; ++i) {
+      const cdline_t *line = smartlist_get(diff, cmd->added_idx + i);
+      ed_output_append(&out, line->s, line->len, digest);
+      ed_output_append(&out, "\n", 1, digest);
+    }
+  }
+
+  /* Copy the remaining unchanged lines. */
+  ed_output_append(&out, s, eos - s, digest);
+  *out++ = '\0';
+  tor_assert(out <= result + max_len);
+
+  if (digest_out)
+    crypto_digest_get_digest(digest, (char *)digest_out, DIGEST256_LEN);
+  crypto_digest_free(digest);
+  tor_free(cmds);
+  return result;
 }
 
 /** Generate a consensus diff as a smartlist from two given consensuses, also
@@ -1181,23 +1485,19 @@ consdiff_get_digests(const smartlist_t *diff,
   return 1;
 }
 
-/** Apply the consensus diff to the given consensus and return a new
- * consensus, also as a line-based smartlist. Will return NULL if the diff
- * could not be applied. Neither the consensus nor the diff are modified in
- * any way, so it's up to the caller to free their resources.
- */
-char *
-consdiff_apply_diff(const smartlist_t *cons1,
-                    const smartlist_t *diff,
-                    const consensus_digest_t *digests1)
+/** Check that the consensus diff <b>diff</b> is meant for a base consensus
+ * with the digests in <b>digests1</b>, and store the digest that the
+ * resulting consensus should have in <b>e_cons2_hash_out</b>, which must have
+ * room for DIGEST256_LEN bytes. Return 0 on success, -1 on failure. */
+static int
+consdiff_check_base_digest(const smartlist_t *diff,
+                           const consensus_digest_t *digests1,
+                           char *e_cons2_hash_out)
 {
-  smartlist_t *cons2 = NULL;
-  char *cons2_str = NULL;
   char e_cons1_hash[DIGEST256_LEN];
-  char e_cons2_hash[DIGEST256_LEN];
 
-  if (consdiff_get_digests(diff, e_cons1_hash, e_cons2_hash) != 0) {
-    goto error_cleanup;
+  if (consdiff_get_digests(diff, e_cons1_hash, e_cons2_hash_out) != 0) {
+    return -1;
   }
 
   /* See that the consensus that was given to us matches its hash. */
@@ -1214,32 +1514,21 @@ consdiff_apply_diff(const smartlist_t *cons1,
                   e_cons1_hash, DIGEST256_LEN);
     log_warn(LD_CONSDIFF, "Expected: %s; found: %s",
              hex_digest1, e_hex_digest1);
-    goto error_cleanup;
-  }
-
-  /* Grab the ed diff and calculate the resulting consensus. */
-  /* Skip the first two lines. */
-  cons2 = apply_ed_diff(cons1, diff, 2);
-
-  /* ed diff could not be applied - reason already logged by apply_ed_diff. */
-  if (!cons2) {
-    goto error_cleanup;
-  }
-
-  cons2_str = consensus_join_lines(cons2);
-
-  consensus_digest_t cons2_digests;
-  if (consensus_compute_digest(cons2_str, strlen(cons2_str),
-                               &cons2_digests) < 0) {
-    /* LCOV_EXCL_START -- digest can't fail */
-    log_warn(LD_CONSDIFF, "Could not compute digests of the consensus "
-        "resulting from applying a consensus diff.");
-    goto error_cleanup;
-    /* LCOV_EXCL_STOP */
+    return -1;
   }
+  return 0;
+}
 
+/** Return 0 if the consensus that we got by applying a diff has the digests
+ * in <b>cons2_digests</b>, and these match the digest <b>e_cons2_hash</b>
+ * that the diff says we should get. Otherwise log a warning and return
+ * -1. */
+static int
+consdiff_check_result_digest(const consensus_digest_t *cons2_digests,
+                             const char *e_cons2_hash)
+{
   /* See that the resulting consensus matches its hash. */
-  if (!consensus_digest_eq(cons2_digests.sha3_256,
+  if (!consensus_digest_eq(cons2_digests->sha3_256,
                            (const uint8_t*)e_cons2_hash)) {
     log_warn(LD_CONSDIFF, "Refusing to apply consensus diff because "
         "the resulting consensus doesn't match the digest as found in "
@@ -1247,22 +1536,47 @@ consdiff_apply_diff(const smartlist_t *cons1,
     char hex_digest2[HEX_DIGEST256_LEN+1];
     char e_hex_digest2[HEX_DIGEST256_LEN+1];
     base16_encode(hex_digest2, HEX_DIGEST256_LEN+1,
-        (const char *)cons2_digests.sha3_256, DIGEST256_LEN);
+        (const char *)cons2_digests->sha3_256, DIGEST256_LEN);
     base16_encode(e_hex_digest2, HEX_DIGEST256_LEN+1,
         e_cons2_hash, DIGEST256_LEN);
     log_warn(LD_CONSDIFF, "Expected: %s; found: %s",
              hex_digest2, e_hex_digest2);
-    goto error_cleanup;
+    return -1;
   }
+  return 0;
+}
 
-  goto done;
+/** Apply the consensus diff to the <b>cons1_len</b>-byte consensus at
+ * <b>cons1</b>, whose digests are <b>digests1</b>, and return the new
+ * consensus. Will return NULL if the diff could not be applied. Neither the
+ * consensus nor the diff are modified in any way, so it's up to the caller to
+ * free their resources.
+ */
+STATIC char *
+consdiff_apply_diff(const char *cons1, size_t cons1_len,
+                    const smartlist_t *diff,
+                    const consensus_digest_t *digests1)
+{
+  char *cons2_str = NULL;
+  char e_cons2_hash[DIGEST256_LEN];
+  consensus_digest_t cons2_digests;
 
- error_cleanup:
-  tor_free(cons2_str); /* Sets it to NULL */
+  if (consdiff_check_base_digest(diff, digests1, e_cons2_hash) < 0) {
+    return NULL;
+  }
 
- done:
-  if (cons2) {
-    smartlist_free(cons2);
+  /* Grab the ed diff and calculate the resulting consensus, and its digest
+   * as we go. Skip the first two lines. */
+  cons2_str = apply_ed_diff_to_string(cons1, cons1_len, diff, 2,
+                                      cons2_digests.sha3_256);
+
+  /* ed diff could not be applied - reason already logged. */
+  if (!cons2_str) {
+    return NULL;
+  }
+
+  if (consdiff_check_result_digest(&cons2_digests, e_cons2_hash) < 0) {
+    tor_free(cons2_str);
   }
 
   return cons2_str;
@@ -1303,12 +1617,42 @@ consensus_split_lines(smartlist_t *out,
     cdline_t *line = memarea_alloc(area, sizeof(cdline_t));
     line->s = s;
     line->len = (uint32_t)(eol - s);
+    line->id = 0;
     smartlist_add(out, line);
     s = eol+1;
   }
   return 0;
 }
 
+/**
+ * Helper: Return the number of NL-terminated lines in <b>s</b>, or -1 if
+ * consensus_split_lines would reject <b>s</b>.
+ */
+STATIC int
+consensus_count_lines(const char *s, size_t len)
+{
+  const char *end_of_str = s + len;
+  int n = 0;
+
+  while (s < end_of_str) {
+    const char *eol = memchr(s, '\n', end_of_str - s);
+    if (!eol) {
+      /* File doesn't end with newline. */
+      return -1;
+    }
+    if (eol - s > CONSENSUS_LINE_MAX_LEN) {
+      /* Line is far too long. */
+      return -1;
+    }
+    if (n == INT_MAX) {
+      return -1;
+    }
+    ++n;
+    s = eol+1;
+  }
+  return n;
+}
+
 /** Given a list of cdline_t, return a newly allocated string containing
  * all of the lines, terminated with NL, concatenated.
  *
@@ -1374,7 +1718,10 @@ consensus_diff_generate(const char *cons1, size_t cons1len,
 
 /** Given a consensus document and a diff, try to apply the diff to the
  * consensus.  On success return a newly allocated string containing the new
- * consensus.  On failure, return NULL. */
+ * consensus.  On failure, return NULL.
+ *
+ * The consensus is read in place, in a single pass, so that the only large
+ * allocation we make is the new consensus. */
 char *
 consensus_diff_apply(const char *consensus,
                      size_t consensus_len,
@@ -1382,7 +1729,7 @@ consensus_diff_apply(const char *consensus,
                      size_t diff_len)
 {
   consensus_digest_t d1;
-  smartlist_t *lines1 = NULL, *lines2 = NULL;
+  smartlist_t *lines2 = NULL;
   int r1;
   char *result = NULL;
   memarea_t *area = memarea_new();
@@ -1391,17 +1738,13 @@ consensus_diff_apply(const char *consensus,
   if (BUG(r1 < 0))
     goto done;
 
-  lines1 = smartlist_new();
   lines2 = smartlist_new();
-  if (consensus_split_lines(lines1, consensus, consensus_len, area) < 0)
-    goto done;
   if (consensus_split_lines(lines2, diff, diff_len, area) < 0)
     goto done;
 
-  result = consdiff_apply_diff(lines1, lines2, &d1);
+  result = consdiff_apply_diff(consensus, consensus_len, lines2, &d1);
 
  done:
-  smartlist_free(lines1);
   smartlist_free(lines2);
   memarea_drop_all(area);
 
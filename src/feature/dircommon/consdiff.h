@@ -25,6 +25,11 @@ struct memarea_t;
 typedef struct cdline_t {
   const char *s;
   uint32_t len;
+  /** While gen_ed_diff computes the LCS of a large section: a number that
+   * is the same for any two lines of the section with the same contents, so
+   * that we can compare lines without looking at their contents. Otherwise
+   * 0. */
+  uint32_t id;
 } cdline_t;
 
 typedef struct consensus_digest_t {
@@ -36,7 +41,7 @@ STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
                                       struct memarea_t *area);
-STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
+STATIC char *consdiff_apply_diff(const char *cons1, size_t cons1_len,
                                  const smartlist_t *diff,
                                  const consensus_digest_t *digests1);
 STATIC int consdiff_get_digests(const smartlist_t *diff,
@@ -61,6 +66,9 @@ STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
+STATIC char *apply_ed_diff_to_string(const char *cons1, size_t cons1_len,
+                                     const smartlist_t *diff, int start_line,
+                                     uint8_t *digest_out);
 STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
@@ -78,6 +86,11 @@ STATIC int smartlist_slice_string_pos(const smartlist_slice_t *slice,
 STATIC void set_changed(bitarray_t *changed1, bitarray_t *changed2,
                         const smartlist_slice_t *slice1,
                         const smartlist_slice_t *slice2);
+STATIC void assign_line_ids(const smartlist_slice_t *slice1,
+                            const smartlist_slice_t *slice2,
+                            struct memarea_t *area);
+STATIC void clear_line_ids(const smartlist_slice_t *slice);
+STATIC int consensus_count_lines(const char *s, size_t len);
 STATIC int consensus_split_lines(smartlist_t *out,
                                  const char *s, size_t len,
                                  struct memarea_t *area);
@@ -169,6 +169,133 @@ static token_rule_t extrainfo_token_table[] = {
 static int router_add_exit_policy(routerinfo_t *router,directory_token_t *tok);
 static smartlist_t *find_all_exitpolicy(smartlist_t *s);
 
+/** The ed25519 signatures carried by a single router descriptor or
+ * extra-info document.  router_parse_list_from_string() holds these back
+ * while it parses a whole list of documents, so that it can check all of
+ * their signatures in a single batch verification. */
+typedef struct desc_ed_sigs_t {
+  /** Number of signatures in <b>check</b>. */
+  int n_check;
+  /** The signatures themselves.  The first one is on the signing key
+   * certificate, and the last one is on <b>d256</b>.  For routers, the one
+   * in between is on the ntor-onion-key crosscert. */
+  ed25519_checkable_t check[3];
+  /** The ntor-onion-key crosscert, if any; check[1] points into it. */
+  tor_cert_t *ntor_cc_cert;
+  /** The ntor onion key in ed25519 form; check[1] points to it. */
+  ed25519_public_key_t ntor_cc_pk;
+  /** Digest of the ed25519-signed part of the document. */
+  uint8_t d256[DIGEST256_LEN];
+
+  /* Bookkeeping for router_parse_list_from_string(): */
+  /** The routerinfo_t or extrainfo_t that these signatures are on. */
+  void *elt;
+  /** The start of the document, so we can dump it if a signature is bad. */
+  const char *body;
+  /** True iff <b>raw_digest</b> is set. */
+  int have_raw_digest;
+  /** The SHA1 digest of the document. */
+  char raw_digest[DIGEST_LEN];
+} desc_ed_sigs_t;
+
+/** Release all storage held in <b>sigs</b>. */
+static void
+desc_ed_sigs_free_(desc_ed_sigs_t *sigs)
+{
+  if (!sigs)
+    return;
+  tor_cert_free(sigs->ntor_cc_cert);
+  tor_free(sigs);
+}
+#define desc_ed_sigs_free(sigs) \
+  FREE_AND_NULL(desc_ed_sigs_t, desc_ed_sigs_free_, (sigs))
+
+/** Check every signature on every member of <b>sigs_list</b>, a list of
+ * desc_ed_sigs_t, with a single call to ed25519_checksig_batch(), so that
+ * the batch verifier can amortize its work over the whole list.  Remove
+ * every document with a bad signature from <b>dest</b> and free it, and add
+ * its digest to <b>invalid_digests_out</b> if that is provided.  The
+ * documents are extrainfo_t if <b>is_extrainfo</b> is set, and routerinfo_t
+ * otherwise. */
+static void
+desc_ed_sigs_check_list(const smartlist_t *sigs_list, smartlist_t *dest,
+                        int is_extrainfo, smartlist_t *invalid_digests_out)
+{
+  int n_check = 0, idx = 0;
+  ed25519_checkable_t *check;
+  int *check_ok;
+
+  SMARTLIST_FOREACH(sigs_list, const desc_ed_sigs_t *, sigs,
+                    n_check += sigs->n_check);
+  if (n_check == 0)
+    return;
+
+  check = tor_calloc(n_check, sizeof(ed25519_checkable_t));
+  check_ok = tor_calloc(n_check, sizeof(int));
+  SMARTLIST_FOREACH(sigs_list, const desc_ed_sigs_t *, sigs, {
+    memcpy(&check[idx], sigs->check,
+           sizeof(ed25519_checkable_t) * sigs->n_check);
+    idx += sigs->n_check;
+  });
+
+  if (ed25519_checksig_batch(check_ok, check, n_check) == 0)
+    goto done;
+
+  idx = 0;
+  SMARTLIST_FOREACH_BEGIN(sigs_list, desc_ed_sigs_t *, sigs) {
+    int i, bad = 0;
+    for (i = 0; i < sigs->n_check; ++i) {
+      if (!check_ok[idx++])
+        bad = 1;
+    }
+    if (!bad)
+      continue;
+
+    log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+    smartlist_remove_keeporder(dest, sigs->elt);
+    if (is_extrainfo) {
+      extrainfo_t *ei = sigs->elt;
+      dump_desc(sigs->body, "extra-info descriptor");
+      extrainfo_free(ei);
+    } else {
+      routerinfo_t *ri = sigs->elt;
+      dump_desc(sigs->body, "router descriptor");
+      routerinfo_free(ri);
+    }
+    sigs->elt = NULL;
+    if (sigs->have_raw_digest && invalid_digests_out) {
+      smartlist_add(invalid_digests_out,
+                    tor_memdup(sigs->raw_digest, DIGEST_LEN));
+    }
+  } SMARTLIST_FOREACH_END(sigs);
+
+ done:
+  tor_free(check);
+  tor_free(check_ok);
+}
+
+/** Check all the signatures in <b>sigs</b> right away.  Return 0 if they
+ * are all valid, and -1 otherwise. */
+static int
+desc_ed_sigs_check(const desc_ed_sigs_t *sigs)
+{
+  if (ed25519_checksig_batch(NULL, sigs->check, sigs->n_check) < 0) {
+    log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+    return -1;
+  }
+  return 0;
+}
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                         int cache_copy, int allow_annotations,
+                                         const char *prepend_annotations,
+                                         int *can_dl_again_out,
+                                         desc_ed_sigs_t **sigs_out);
+static extrainfo_t *extrainfo_parse_entry_impl(const char *s, const char *end,
+                            int cache_copy, struct digest_ri_map_t *routermap,
+                            int *can_dl_again_out,
+                            desc_ed_sigs_t **sigs_out);
+
 /** Set <b>digest</b> to the SHA-1 digest of the hash of the first router in
  * <b>s</b>. Return 0 on success, -1 on failure.
  */
@@ -237,6 +364,9 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
  * isn't SAVED_NOWHERE, remember the offset of each descriptor.
  *
+ * The ed25519 signatures on all the entries are checked together, in one
+ * batch, after everything has been parsed.
+ *
  * Returns 0 on success and -1 on failure.  Adds a digest to
  * <b>invalid_digests_out</b> for every entry that was unparseable or
  * invalid. (This may cause duplicate entries.)
@@ -256,6 +386,7 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  smartlist_t *pending_sigs = smartlist_new();
 
   tor_assert(s);
   tor_assert(*s);
@@ -271,6 +402,7 @@ router_parse_list_from_string(const char **s, const char *eos,
     char raw_digest[DIGEST_LEN];
     int have_raw_digest = 0;
     int dl_again = 0;
+    desc_ed_sigs_t *sigs = NULL;
     if (find_start_of_next_router_or_extrainfo(s, eos, &have_extrainfo) < 0)
       break;
 
@@ -288,19 +420,19 @@ router_parse_list_from_string(const char **s, const char *eos,
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
       have_raw_digest = router_get_extrainfo_hash(*s, end-*s, raw_digest) == 0;
-      extrainfo = extrainfo_parse_entry_from_string(*s, end,
+      extrainfo = extrainfo_parse_entry_impl(*s, end,
                                        saved_location != SAVED_IN_CACHE,
-                                       rl->identity_map, &dl_again);
+                                       rl->identity_map, &dl_again, &sigs);
       if (extrainfo) {
         signed_desc = &extrainfo->cache_info;
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again, &sigs);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -321,10 +453,24 @@ router_parse_list_from_string(const char **s, const char *eos,
       signed_desc->saved_location = saved_location;
       signed_desc->saved_offset = *s - start;
     }
+    if (sigs) {
+      sigs->elt = elt;
+      sigs->body = *s;
+      sigs->have_raw_digest = have_raw_digest;
+      memcpy(sigs->raw_digest, raw_digest, DIGEST_LEN);
+      smartlist_add(pending_sigs, sigs);
+    }
     *s = end;
     smartlist_add(dest, elt);
   }
 
+  /* Check the ed25519 signatures on everything we parsed, all at once. */
+  desc_ed_sigs_check_list(pending_sigs, dest, want_extrainfo,
+                          invalid_digests_out);
+  SMARTLIST_FOREACH(pending_sigs, desc_ed_sigs_t *, sigs,
+                    desc_ed_sigs_free(sigs));
+  smartlist_free(pending_sigs);
+
   return 0;
 }
 
@@ -391,6 +537,21 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out, NULL);
+}
+
+/** Helper: as router_parse_entry_from_string().  But if <b>sigs_out</b> is
+ * provided, do not check the ed25519 signatures on the descriptor: instead,
+ * set *<b>sigs_out</b> to a newly allocated desc_ed_sigs_t holding them (or
+ * to NULL if the descriptor has none), for the caller to check later. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        desc_ed_sigs_t **sigs_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -402,6 +563,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   int ok = 1;
   memarea_t *area = NULL;
   tor_cert_t *ntor_cc_cert = NULL;
+  desc_ed_sigs_t *sigs = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -666,7 +828,6 @@ router_parse_entry_from_string(const char *s, const char *end,
       }
       int ntor_cc_sign_bit = !strcmp(cc_ntor_tok->args[0], "1");
 
-      uint8_t d256[DIGEST256_LEN];
       const char *signed_start, *signed_end;
       tor_cert_t *cert = tor_cert_parse(
                        (const uint8_t*)ed_cert_tok->object_body,
@@ -713,8 +874,10 @@ router_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
 
-      ed25519_public_key_t ntor_cc_pk;
-      if (ed25519_public_key_from_curve25519_public_key(&ntor_cc_pk,
+      sigs = tor_malloc_zero(sizeof(desc_ed_sigs_t));
+      sigs->ntor_cc_cert = ntor_cc_cert;
+      ntor_cc_cert = NULL;
+      if (ed25519_public_key_from_curve25519_public_key(&sigs->ntor_cc_pk,
                                             router->onion_curve25519_pkey,
                                             ntor_cc_sign_bit)<0) {
         log_warn(LD_DIR, "Error converting onion key to ed25519");
@@ -732,18 +895,17 @@ router_parse_entry_from_string(const char *s, const char *end,
       crypto_digest_add_bytes(d, ED_DESC_SIGNATURE_PREFIX,
         strlen(ED_DESC_SIGNATURE_PREFIX));
       crypto_digest_add_bytes(d, signed_start, signed_end-signed_start);
-      crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
+      crypto_digest_get_digest(d, (char*)sigs->d256, sizeof(sigs->d256));
       crypto_digest_free(d);
 
-      ed25519_checkable_t check[3];
-      int check_ok[3];
+      ed25519_checkable_t *check = sigs->check;
       time_t expires = TIME_MAX;
       if (tor_cert_get_checkable_sig(&check[0], cert, NULL, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for cert.");
         goto err;
       }
-      if (tor_cert_get_checkable_sig(&check[1],
-                               ntor_cc_cert, &ntor_cc_pk, &expires) < 0) {
+      if (tor_cert_get_checkable_sig(&check[1], sigs->ntor_cc_cert,
+                                     &sigs->ntor_cc_pk, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for ntor_cc_cert.");
         goto err;
       }
@@ -754,13 +916,12 @@ router_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
       check[2].pubkey = &cert->signed_key;
-      check[2].msg = d256;
+      check[2].msg = sigs->d256;
       check[2].len = DIGEST256_LEN;
+      sigs->n_check = 3;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
-        log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+      if (!sigs_out && desc_ed_sigs_check(sigs) < 0)
         goto err;
-      }
 
       rsa_pubkey = router_get_rsa_onion_pkey(router->onion_pkey,
                                              router->onion_pkey_len);
@@ -920,6 +1081,10 @@ router_parse_entry_from_string(const char *s, const char *end,
   if (!router->platform) {
     router->platform = tor_strdup("<unknown>");
   }
+  if (sigs_out) {
+    *sigs_out = sigs;
+    sigs = NULL;
+  }
   goto done;
 
  err:
@@ -929,6 +1094,7 @@ router_parse_entry_from_string(const char *s, const char *end,
  done:
   crypto_pk_free(rsa_pubkey);
   tor_cert_free(ntor_cc_cert);
+  desc_ed_sigs_free(sigs);
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(tokens);
@@ -958,6 +1124,20 @@ extrainfo_t *
 extrainfo_parse_entry_from_string(const char *s, const char *end,
                             int cache_copy, struct digest_ri_map_t *routermap,
                             int *can_dl_again_out)
+{
+  return extrainfo_parse_entry_impl(s, end, cache_copy, routermap,
+                                    can_dl_again_out, NULL);
+}
+
+/** Helper: as extrainfo_parse_entry_from_string().  But if <b>sigs_out</b>
+ * is provided, do not check the ed25519 signatures on the document: instead,
+ * set *<b>sigs_out</b> to a newly allocated desc_ed_sigs_t holding them (or
+ * to NULL if the document has none), for the caller to check later. */
+static extrainfo_t *
+extrainfo_parse_entry_impl(const char *s, const char *end,
+                           int cache_copy, struct digest_ri_map_t *routermap,
+                           int *can_dl_again_out,
+                           desc_ed_sigs_t **sigs_out)
 {
   extrainfo_t *extrainfo = NULL;
   char digest[128];
@@ -967,6 +1147,7 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
   routerinfo_t *router = NULL;
   memarea_t *area = NULL;
   const char *s_dup = s;
+  desc_ed_sigs_t *sigs = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -1061,7 +1242,6 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
 
-      uint8_t d256[DIGEST256_LEN];
       const char *signed_start, *signed_end;
       tor_cert_t *cert = tor_cert_parse(
                        (const uint8_t*)ed_cert_tok->object_body,
@@ -1090,11 +1270,11 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
       crypto_digest_add_bytes(d, ED_DESC_SIGNATURE_PREFIX,
         strlen(ED_DESC_SIGNATURE_PREFIX));
       crypto_digest_add_bytes(d, signed_start, signed_end-signed_start);
-      crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
+      sigs = tor_malloc_zero(sizeof(desc_ed_sigs_t));
+      crypto_digest_get_digest(d, (char*)sigs->d256, sizeof(sigs->d256));
       crypto_digest_free(d);
 
-      ed25519_checkable_t check[2];
-      int check_ok[2];
+      ed25519_checkable_t *check = sigs->check;
       if (tor_cert_get_checkable_sig(&check[0], cert, NULL, NULL) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for cert.");
         goto err;
@@ -1106,13 +1286,12 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
       check[1].pubkey = &cert->signed_key;
-      check[1].msg = d256;
+      check[1].msg = sigs->d256;
       check[1].len = DIGEST256_LEN;
+      sigs->n_check = 2;
 
-      if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
-        log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+      if (!sigs_out && desc_ed_sigs_check(sigs) < 0)
         goto err;
-      }
       /* We don't check the certificate expiration time: checking that it
        * matches the cert in the router descriptor is adequate. */
     }
@@ -1148,12 +1327,17 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
     extrainfo->pending_sig_len = tok->object_size;
   }
 
+  if (sigs_out) {
+    *sigs_out = sigs;
+    sigs = NULL;
+  }
   goto done;
  err:
   dump_desc(s_dup, "extra-info descriptor");
   extrainfo_free(extrainfo);
   extrainfo = NULL;
  done:
+  desc_ed_sigs_free(sigs);
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(tokens);
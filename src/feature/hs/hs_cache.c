@@ -32,12 +32,38 @@ static int cached_client_descriptor_has_expired(time_t now,
 /* Directory descriptor cache. Map indexed by blinded key. */
 static digest256map_t *hs_cache_v3_dir;
 
+/* Every entry of the directory cache, ordered by expiry time. This lets us
+ * expire descriptors without looking at the ones that are still fresh. */
+static smartlist_t *hs_cache_v3_dir_expiry;
+
+/* Every entry of the directory cache, least recently stored or fetched
+ * first. This is the order in which the OOM handler evicts them. */
+static TOR_TAILQ_HEAD(hs_cache_dir_lru_t, hs_cache_dir_descriptor_t)
+  hs_cache_v3_dir_lru = TOR_TAILQ_HEAD_INITIALIZER(hs_cache_v3_dir_lru);
+
+/* Comparison function for the expiry priority queue: order entries by
+ * expiry time, soonest first. */
+static int
+compare_dir_desc_expiry_(const void *a_, const void *b_)
+{
+  const hs_cache_dir_descriptor_t *a = a_, *b = b_;
+  if (a->expire_ts < b->expire_ts)
+    return -1;
+  else if (a->expire_ts > b->expire_ts)
+    return 1;
+  return 0;
+}
+
 /* Remove a given descriptor from our cache. */
 static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_remove(hs_cache_v3_dir, desc->key);
+  smartlist_pqueue_remove(hs_cache_v3_dir_expiry, compare_dir_desc_expiry_,
+                          offsetof(hs_cache_dir_descriptor_t, heap_idx),
+                          desc);
+  TOR_TAILQ_REMOVE(&hs_cache_v3_dir_lru, desc, lru_next);
 }
 
 /* Store a given descriptor in our cache. */
@@ -46,6 +72,21 @@ store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_set(hs_cache_v3_dir, desc->key, desc);
+  smartlist_pqueue_add(hs_cache_v3_dir_expiry, compare_dir_desc_expiry_,
+                       offsetof(hs_cache_dir_descriptor_t, heap_idx),
+                       desc);
+  TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_lru, desc, lru_next);
+}
+
+/* Note that the given descriptor has just been used, moving it to the back
+ * of the OOM eviction order. */
+static void
+touch_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc, time_t now)
+{
+  tor_assert(desc);
+  desc->last_used_ts = now;
+  TOR_TAILQ_REMOVE(&hs_cache_v3_dir_lru, desc, lru_next);
+  TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_lru, desc, lru_next);
 }
 
 /* Query our cache and return the entry or NULL if not found. */
@@ -59,15 +100,11 @@ lookup_v3_desc_as_dir(const uint8_t *key)
 #define cache_dir_desc_free(val) \
   FREE_AND_NULL(hs_cache_dir_descriptor_t, cache_dir_desc_free_, (val))
 
-/* Free a directory descriptor object. */
+/* Free a directory descriptor object. Its encoded descriptor is allocated
+ * along with it, so this is a single free. */
 static void
 cache_dir_desc_free_(hs_cache_dir_descriptor_t *desc)
 {
-  if (desc == NULL) {
-    return;
-  }
-  hs_desc_plaintext_data_free(desc->plaintext_data);
-  tor_free(desc->encoded_desc);
   tor_free(desc);
 }
 
@@ -81,40 +118,72 @@ cache_dir_desc_free_void(void *ptr)
 
 /* Create a new directory cache descriptor object from a encoded descriptor.
  * On success, return the heap-allocated cache object, otherwise return NULL if
- * we can't decode the descriptor. */
+ * we can't decode the descriptor.
+ *
+ * We only keep what the directory needs from the decoded plaintext data, and
+ * put the encoded descriptor in the same allocation as the object itself. */
 static hs_cache_dir_descriptor_t *
 cache_dir_desc_new(const char *desc)
 {
-  hs_cache_dir_descriptor_t *dir_desc;
+  hs_cache_dir_descriptor_t *dir_desc = NULL;
+  hs_desc_plaintext_data_t *plaintext_data;
+  size_t encoded_len;
 
   tor_assert(desc);
 
-  dir_desc = tor_malloc_zero(sizeof(hs_cache_dir_descriptor_t));
-  dir_desc->plaintext_data =
-    tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
-  dir_desc->encoded_desc = tor_strdup(desc);
-
-  if (hs_desc_decode_plaintext(desc, dir_desc->plaintext_data) < 0) {
+  plaintext_data = tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
+  if (hs_desc_decode_plaintext(desc, plaintext_data) < 0) {
     log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
-    goto err;
+    goto done;
   }
 
+  encoded_len = strlen(desc);
+  dir_desc = tor_malloc_zero(offsetof(hs_cache_dir_descriptor_t,
+                                      encoded_desc) + encoded_len + 1);
+  memcpy(dir_desc->encoded_desc, desc, encoded_len + 1);
+  dir_desc->encoded_len = encoded_len;
+
   /* The blinded pubkey is the indexed key. */
-  dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
+  memcpy(dir_desc->key, plaintext_data->blinded_pubkey.pubkey,
+         sizeof(dir_desc->key));
+  dir_desc->version = plaintext_data->version;
+  dir_desc->revision_counter = plaintext_data->revision_counter;
   dir_desc->created_ts = time(NULL);
-  return dir_desc;
+  dir_desc->expire_ts = dir_desc->created_ts + plaintext_data->lifetime_sec;
+  dir_desc->last_used_ts = approx_time();
+  dir_desc->heap_idx = -1;
 
- err:
-  cache_dir_desc_free(dir_desc);
-  return NULL;
+ done:
+  hs_desc_plaintext_data_free(plaintext_data);
+  return dir_desc;
 }
 
-/* Return the size of a cache entry in bytes. */
+/* Return the size of a cache entry in bytes. This is exactly the size of
+ * the one allocation that holds the entry and its encoded descriptor. */
 static size_t
 cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
 {
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
+  return offsetof(hs_cache_dir_descriptor_t, encoded_desc) +
+    entry->encoded_len + 1;
+}
+
+/* Remove the given entry from the directory cache, free it, and return the
+ * number of bytes this released. */
+static size_t
+cache_dir_desc_evict(hs_cache_dir_descriptor_t *entry)
+{
+  size_t entry_size = cache_get_dir_entry_size(entry);
+  char key_b64[BASE64_DIGEST256_LEN + 1];
+
+  digest256_to_base64(key_b64, (const char *) entry->key);
+  log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
+           safe_str_client(key_b64));
+
+  remove_v3_desc_as_dir(entry);
+  cache_dir_desc_free(entry);
+  /* Update our cache entry allocation size for the OOM. */
+  rend_cache_decrement_allocation(entry_size);
+  return entry_size;
 }
 
 /* Try to store a valid version 3 descriptor in the directory cache. Return 0
@@ -134,13 +203,12 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
   if (cache_entry != NULL) {
     /* Only replace descriptor if revision-counter is greater than the one
      * in our cache */
-    if (cache_entry->plaintext_data->revision_counter >=
-        desc->plaintext_data->revision_counter) {
+    if (cache_entry->revision_counter >= desc->revision_counter) {
       log_info(LD_REND, "Descriptor revision counter in our cache is "
                "greater or equal than the one we received (%d/%d). "
                "Rejecting!",
-               (int)cache_entry->plaintext_data->revision_counter,
-               (int)desc->plaintext_data->revision_counter);
+               (int)cache_entry->revision_counter,
+               (int)desc->revision_counter);
       goto err;
     }
     /* We now know that the descriptor we just received is a new one so
@@ -177,7 +245,7 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
 {
   int found = 0;
   ed25519_public_key_t blinded_key;
-  const hs_cache_dir_descriptor_t *entry;
+  hs_cache_dir_descriptor_t *entry;
 
   tor_assert(query);
 
@@ -191,6 +259,7 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   entry = lookup_v3_desc_as_dir(blinded_key.pubkey);
   if (entry != NULL) {
     found = 1;
+    touch_v3_desc_as_dir(entry, approx_time());
     if (desc_out) {
       *desc_out = entry->encoded_desc;
     }
@@ -202,14 +271,17 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   return -1;
 }
 
-/* Clean the v3 cache by removing any entry that has expired using the
- * <b>global_cutoff</b> value. If <b>global_cutoff</b> is 0, the cleaning
- * process will use the lifetime found in the plaintext data section. Return
- * the number of bytes cleaned. */
+/* Clean the v3 cache by removing any entry that has expired at time
+ * <b>now</b>, according to the lifetime found in its plaintext data section.
+ * If <b>global_cutoff</b> is not 0, also remove every entry that hasn't been
+ * stored or fetched since that time. Return the number of bytes cleaned.
+ *
+ * Both kinds of removal only look at the entries they remove. */
 STATIC size_t
 cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
 {
   size_t bytes_removed = 0;
+  hs_cache_dir_descriptor_t *entry;
 
   /* Code flow error if this ever happens. */
   tor_assert(global_cutoff >= 0);
@@ -218,36 +290,26 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
     return 0;
   }
 
-  DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
-                              hs_cache_dir_descriptor_t *, entry) {
-    size_t entry_size;
-    time_t cutoff = global_cutoff;
-    if (!cutoff) {
-      /* Cutoff is the lifetime of the entry found in the descriptor. */
-      cutoff = now - entry->plaintext_data->lifetime_sec;
+  while (smartlist_len(hs_cache_v3_dir_expiry)) {
+    entry = smartlist_get(hs_cache_v3_dir_expiry, 0);
+    /* If the entry's lifetime hasn't run out, neither has that of any
+     * other entry. */
+    if (entry->expire_ts > now) {
+      break;
     }
+    bytes_removed += cache_dir_desc_evict(entry);
+  }
 
-    /* If the entry has been created _after_ the cutoff, not expired so
-     * continue to the next entry in our v3 cache. */
-    if (entry->created_ts > cutoff) {
-      continue;
+  if (global_cutoff) {
+    while ((entry = TOR_TAILQ_FIRST(&hs_cache_v3_dir_lru))) {
+      /* If the entry has been used _after_ the cutoff, so has every entry
+       * behind it. */
+      if (entry->last_used_ts > global_cutoff) {
+        break;
+      }
+      bytes_removed += cache_dir_desc_evict(entry);
     }
-    /* Here, our entry has expired, remove and free. */
-    MAP_DEL_CURRENT(key);
-    entry_size = cache_get_dir_entry_size(entry);
-    bytes_removed += entry_size;
-    /* Entry is not in the cache anymore, destroy it. */
-    cache_dir_desc_free(entry);
-    /* Update our cache entry allocation size for the OOM. */
-    rend_cache_decrement_allocation(entry_size);
-    /* Logging. */
-    {
-      char key_b64[BASE64_DIGEST256_LEN + 1];
-      digest256_to_base64(key_b64, (const char *) key);
-      log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
-               safe_str_client(key_b64));
-    }
-  } DIGEST256MAP_FOREACH_END;
+  }
 
   return bytes_removed;
 }
@@ -272,7 +334,7 @@ hs_cache_store_as_dir(const char *desc)
   /* Call the right function against the descriptor version. At this point,
    * we are sure that the descriptor's version is supported else the
    * decoding would have failed. */
-  switch (dir_desc->plaintext_data->version) {
+  switch (dir_desc->version) {
   case HS_VERSION_THREE:
   default:
     if (cache_store_v3_as_dir(dir_desc) < 0) {
@@ -909,11 +971,14 @@ hs_cache_handle_oom(time_t now, size_t min_remove_bytes)
    *
    *   1) Deallocate all entries from v2 cache that are older than K hours.
    *      1.1) If the amount of remove bytes has been reached, stop.
-   *   2) Deallocate all entries from v3 cache that are older than K hours
+   *   2) Deallocate all entries from v3 cache that haven't been stored or
+   *      fetched in the last K hours, least recently used first.
    *      2.1) If the amount of remove bytes has been reached, stop.
    *   3) Set K = K - RendPostPeriod and repeat process until K is < 0.
    *
-   * This ends up being O(Kn).
+   * This ends up being O(Kn) for the v2 cache. The v3 cache keeps its
+   * entries in least recently used order, so step 2 only ever looks at the
+   * entries it removes.
    */
 
   /* Set K to the oldest expected age in seconds which is the maximum
@@ -962,6 +1027,8 @@ hs_cache_init(void)
   /* Calling this twice is very wrong code flow. */
   tor_assert(!hs_cache_v3_dir);
   hs_cache_v3_dir = digest256map_new();
+  hs_cache_v3_dir_expiry = smartlist_new();
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_lru);
 
   tor_assert(!hs_cache_v3_client);
   hs_cache_v3_client = digest256map_new();
@@ -976,6 +1043,8 @@ hs_cache_free_all(void)
 {
   digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_void);
   hs_cache_v3_dir = NULL;
+  smartlist_free(hs_cache_v3_dir_expiry);
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_lru);
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_void);
   hs_cache_v3_client = NULL;
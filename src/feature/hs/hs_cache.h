@@ -15,6 +15,7 @@
 #include "feature/hs/hs_descriptor.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/torcert.h"
+#include "ext/tor_queue.h"
 
 struct ed25519_public_key_t;
 
@@ -48,19 +49,37 @@ typedef struct hs_cache_client_intro_state_t {
 typedef struct hs_cache_dir_descriptor_t {
   /* This object is indexed using the blinded pubkey located in the plaintext
    * data which is populated only once the descriptor has been successfully
-   * decoded and validated. This simply points to that pubkey. */
-  const uint8_t *key;
+   * decoded and validated. */
+  uint8_t key[ED25519_PUBKEY_LEN];
 
-  /* When does this entry has been created. Used to expire entries. */
+  /* When does this entry has been created. */
   time_t created_ts;
 
-  /* Descriptor plaintext information. Obviously, we can't decrypt the
-   * encrypted part of the descriptor. */
-  hs_desc_plaintext_data_t *plaintext_data;
+  /* When does this entry expire: its creation time plus the lifetime found
+   * in the descriptor plaintext data. */
+  time_t expire_ts;
+
+  /* When was this entry last stored or fetched. Used by the OOM handler to
+   * evict the least recently used entries first. */
+  time_t last_used_ts;
+
+  /* The only values we need from the descriptor plaintext information.
+   * Obviously, we can't decrypt the encrypted part of the descriptor. */
+  uint32_t version;
+  uint64_t revision_counter;
+
+  /* Index of this entry in the expiry priority queue, or -1. */
+  int heap_idx;
+
+  /* Next and previous entries in least recently used order. */
+  TOR_TAILQ_ENTRY(hs_cache_dir_descriptor_t) lru_next;
+
+  /* Length of encoded_desc, not counting its NUL. */
+  size_t encoded_len;
 
   /* Encoded descriptor which is basically in text form. It's a NUL terminated
-   * string thus safe to strlen(). */
-  char *encoded_desc;
+   * string thus safe to strlen(). It is allocated along with this object. */
+  char encoded_desc[FLEXIBLE_ARRAY_MEMBER];
 } hs_cache_dir_descriptor_t;
 
 /* Public API */
@@ -23,6 +23,137 @@
 
 #include "core/or/or.h"
 #include "feature/hs_common/replaycache.h"
+#include "lib/crypt_ops/crypto_rand.h"
+
+/*
+ * A replay cache remembers a 64-bit keyed hash of each buffer it sees, with
+ * the time it was last seen. Its key is random, so nobody can make two
+ * buffers collide on purpose; two different buffers are mistaken for each
+ * other with probability 2^-64 per pair.
+ *
+ * Entries are kept in a ring of generations, each a small open-addressed
+ * hash set. New entries go in the current generation. Every generation span,
+ * the oldest generation is emptied all at once and becomes the current one,
+ * so expiring entries never means walking the cache. Entries live for at
+ * least the horizon, and for at most one generation span more; the time we
+ * keep with each entry tells us exactly whether it is still within the
+ * horizon.
+ *
+ * To bound the memory a flood of new items can take, a generation holds at
+ * most REPLAYCACHE_MAX_GENERATION_ENTRIES entries. Once the current one is
+ * full, we move on to the next generation right away. The price is that
+ * during such a flood, we forget items sooner than the horizon: we then
+ * remember only the last (n_generations - 1) full generations' worth.
+ */
+
+/** Empty the generation g, and release its storage. */
+static void
+replaycache_generation_clear(replaycache_generation_t *g)
+{
+  tor_free(g->entries);
+  g->capacity = g->count = 0;
+}
+
+/** Return the entry for fingerprint in g, or NULL if there is none. */
+static replaycache_entry_t *
+replaycache_generation_find(const replaycache_generation_t *g,
+                            uint64_t fingerprint)
+{
+  unsigned int i;
+
+  if (!g->count)
+    return NULL;
+  for (i = fingerprint & (g->capacity - 1); g->entries[i].fingerprint;
+       i = (i + 1) & (g->capacity - 1)) {
+    if (g->entries[i].fingerprint == fingerprint)
+      return &g->entries[i];
+  }
+  return NULL;
+}
+
+/** Add an entry for fingerprint, seen at <b>seen</b>, to g, which must not
+ * have one already. */
+static void
+replaycache_generation_add(replaycache_generation_t *g, uint64_t fingerprint,
+                           time_t seen)
+{
+  unsigned int i;
+
+  /* Keep the set at most three quarters full. */
+  if ((g->count + 1) * 4 > g->capacity * 3) {
+    replaycache_generation_t old = *g;
+    g->capacity = old.capacity ? old.capacity * 2 : 64;
+    g->entries = tor_calloc(g->capacity, sizeof(replaycache_entry_t));
+    g->count = 0;
+    for (i = 0; i < old.capacity; ++i) {
+      if (old.entries[i].fingerprint)
+        replaycache_generation_add(g, old.entries[i].fingerprint,
+                                   old.entries[i].seen);
+    }
+    tor_free(old.entries);
+  }
+
+  for (i = fingerprint & (g->capacity - 1); g->entries[i].fingerprint;
+       i = (i + 1) & (g->capacity - 1))
+    ;
+  g->entries[i].fingerprint = fingerprint;
+  g->entries[i].seen = seen;
+  ++g->count;
+}
+
+/** Bring the generations of r up to date for the time present, emptying
+ * every generation whose span is over. */
+static void
+replaycache_rotate(time_t present, replaycache_t *r)
+{
+  time_t n_spans;
+
+  if (!r->generation_span)
+    return;
+  if (r->current_start == 0 || present < r->current_start) {
+    /* First use, or the clock jumped back: start counting from now. */
+    r->current_start = present;
+    return;
+  }
+
+  n_spans = (present - r->current_start) / r->generation_span;
+  if (n_spans <= 0)
+    return;
+  if (n_spans >= r->n_generations) {
+    for (int i = 0; i < r->n_generations; ++i)
+      replaycache_generation_clear(&r->generations[i]);
+    r->current_start = present;
+    return;
+  }
+  for (time_t i = 0; i < n_spans; ++i) {
+    r->current = (r->current + 1) % r->n_generations;
+    replaycache_generation_clear(&r->generations[r->current]);
+  }
+  r->current_start += n_spans * r->generation_span;
+}
+
+/** Move r on to its next generation, emptying it, whether or not the span
+ * of the current one is over. */
+static void
+replaycache_advance(time_t present, replaycache_t *r)
+{
+  r->current = (r->current + 1) % r->n_generations;
+  replaycache_generation_clear(&r->generations[r->current]);
+  if (r->generation_span)
+    r->current_start = present;
+}
+
+/** Add an entry for fingerprint, seen at <b>present</b>, to the current
+ * generation of r, which must not have one already. */
+static void
+replaycache_add_current(time_t present, replaycache_t *r,
+                        uint64_t fingerprint)
+{
+  if (r->generations[r->current].count >= REPLAYCACHE_MAX_GENERATION_ENTRIES)
+    replaycache_advance(present, r);
+  replaycache_generation_add(&r->generations[r->current], fingerprint,
+                             present);
+}
 
 /** Free the replaycache r and all of its entries.
  */
@@ -34,7 +165,8 @@ replaycache_free_(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  for (int i = 0; i < REPLAYCACHE_MAX_GENERATIONS; ++i)
+    replaycache_generation_clear(&r->generations[i]);
 
   tor_free(r);
 }
@@ -60,11 +192,26 @@ replaycache_new(time_t horizon, time_t interval)
     interval = 0;
   }
 
-  r = tor_malloc(sizeof(*r));
+  r = tor_malloc_zero(sizeof(*r));
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
-  r->digests_seen = digest256map_new();
+  crypto_rand((char *) &r->key, sizeof(r->key));
+
+  /* Every scrub interval, drop a generation; we need enough of them that
+   * entries live for the whole horizon. */
+  if (horizon == 0) {
+    r->n_generations = REPLAYCACHE_NOEXPIRE_GENERATIONS;
+    r->generation_span = 0;
+  } else {
+    time_t span = interval;
+    if (span == 0)
+      span = CEIL_DIV(horizon, REPLAYCACHE_DEFAULT_GENERATIONS - 1);
+    if (CEIL_DIV(horizon, span) + 1 > REPLAYCACHE_MAX_GENERATIONS)
+      span = CEIL_DIV(horizon, REPLAYCACHE_MAX_GENERATIONS - 1);
+    r->generation_span = span;
+    r->n_generations = (int) CEIL_DIV(horizon, span) + 1;
+  }
 
  err:
   return r;
@@ -78,8 +225,9 @@ replaycache_add_and_test_internal(
     time_t *elapsed)
 {
   int rv = 0;
-  uint8_t digest[DIGEST256_LEN];
-  time_t *access_time;
+  uint64_t fingerprint;
+  replaycache_entry_t *ent = NULL;
+  int i, gen = 0;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -88,25 +236,33 @@ replaycache_add_and_test_internal(
     goto done;
   }
 
-  /* compute digest */
-  crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
+  /* Drop whatever generations are over before we look. */
+  replaycache_rotate(present, r);
+
+  /* compute fingerprint; 0 marks an empty slot */
+  fingerprint = siphash24(data, len, &r->key);
+  if (!fingerprint)
+    fingerprint = 1;
 
-  /* check map */
-  access_time = digest256map_get(r->digests_seen, digest);
+  /* look for it, newest generation first, since it has the latest time */
+  for (i = 0; i < r->n_generations && !ent; ++i) {
+    gen = (r->current - i + r->n_generations) % r->n_generations;
+    ent = replaycache_generation_find(&r->generations[gen], fingerprint);
+  }
 
   /* seen before? */
-  if (access_time != NULL) {
+  if (ent != NULL) {
     /*
      * If it's far enough in the past, no hit.  If the horizon is zero, we
      * never expire.
      */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
+    if (ent->seen >= present - r->horizon || r->horizon == 0) {
       /* replay cache hit, return 1 */
       rv = 1;
       /* If we want to output an elapsed time, do so */
       if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
+        if (present >= ent->seen) {
+          *elapsed = present - ent->seen;
         } else {
           /* We shouldn't really be seeing hits from the future, but... */
           *elapsed = 0;
@@ -114,21 +270,20 @@ replaycache_add_and_test_internal(
       }
     }
     /*
-     * If it's ahead of the cached time, update
+     * If it's ahead of the cached time, update; an entry in an older
+     * generation moves to the current one, so that it lives on.
      */
-    if (*access_time < present) {
-      *access_time = present;
+    if (ent->seen < present) {
+      if (gen == r->current)
+        ent->seen = present;
+      else
+        replaycache_add_current(present, r, fingerprint);
     }
   } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = tor_malloc(sizeof(*access_time));
-    *access_time = present;
-    digest256map_set(r->digests_seen, digest, access_time);
+    /* No, so no hit and remember it with the current time */
+    replaycache_add_current(present, r, fingerprint);
   }
 
-  /* now scrub the cache if it's time */
-  replaycache_scrub_if_needed_internal(present, r);
-
  done:
   return rv;
 }
@@ -138,45 +293,34 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digest256map_iter_t *itr = NULL;
-  const uint8_t *digest;
-  void *valp;
-  time_t *access_time;
-
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
   }
 
-  /* scrub time yet? (scrubbed == 0 indicates never scrubbed before) */
-  if (present - r->scrubbed < r->scrub_interval && r->scrubbed > 0) return;
-
-  /* if we're never expiring, don't bother scrubbing */
-  if (r->horizon == 0) return;
-
-  /* okay, scrub time */
-  itr = digest256map_iter_init(r->digests_seen);
-  while (!digest256map_iter_done(itr)) {
-    digest256map_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digest256map_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      tor_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digest256map_iter_next(r->digests_seen, itr);
-    }
-  }
+  /* Dropping the generations that are over costs nothing when there are
+   * none, so there is no need to wait for the scrub interval. */
+  replaycache_rotate(present, r);
 
   /* update scrubbed timestamp */
   if (present > r->scrubbed) r->scrubbed = present;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Return the number of entries in r, including any entry that has moved to
+ * a newer generation but is still in an older one. */
+STATIC size_t
+replaycache_size(const replaycache_t *r)
+{
+  size_t n = 0;
+  for (int i = 0; i < r->n_generations; ++i)
+    n += r->generations[i].count;
+  return n;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Test the buffer of length len point to by data against the replay cache r;
  * the digest of the buffer will be added to the cache at the current time,
  * and the function will return 1 if it was already seen within the cache's
@@ -11,8 +11,43 @@
 
 typedef struct replaycache_t replaycache_t;
 
+/* Largest number of entries in one generation. When the current generation
+ * is this full, we move on to the next one before its span is over. This
+ * bounds a replay cache to about 8MB per generation. */
+#define REPLAYCACHE_MAX_GENERATION_ENTRIES (1<<18)
+
 #ifdef REPLAYCACHE_PRIVATE
 
+#include "ext/siphash.h"
+
+/* Number of generations a replay cache keeps when it isn't told how often to
+ * scrub itself. */
+#define REPLAYCACHE_DEFAULT_GENERATIONS 4
+/* Largest number of generations a replay cache keeps. */
+#define REPLAYCACHE_MAX_GENERATIONS 16
+/* Number of generations of a replay cache that never expires anything by
+ * age. */
+#define REPLAYCACHE_NOEXPIRE_GENERATIONS 2
+
+/* An entry of a replay cache generation */
+typedef struct replaycache_entry_t {
+  /* Keyed hash of the data, or 0 if the slot is empty */
+  uint64_t fingerprint;
+  /* When the data was last seen */
+  time_t seen;
+} replaycache_entry_t;
+
+/* One generation of a replay cache: an open-addressed set of the data seen
+ * during one generation span. */
+typedef struct replaycache_generation_t {
+  /* Slots; there are capacity of them, and capacity is zero or a power of
+   * two */
+  replaycache_entry_t *entries;
+  unsigned int capacity;
+  /* Number of slots in use */
+  unsigned int count;
+} replaycache_generation_t;
+
 struct replaycache_t {
   /* Scrub interval */
   time_t scrub_interval;
@@ -23,10 +58,20 @@ struct replaycache_t {
    * (don't return true on digests in the cache but older than this)
    */
   time_t horizon;
+  /* Key for the fingerprints of the data we see */
+  struct sipkey key;
   /*
-   * Digest map: keys are digests, values are times the digest was last seen
+   * Generations: data goes in generations[current], which started at
+   * current_start; every generation_span seconds, or sooner if the current
+   * generation is full, the oldest generation is emptied and becomes the
+   * current one. A generation_span of 0 means that we never expire anything
+   * by age, only when a generation fills up.
    */
-  digest256map_t *digests_seen;
+  replaycache_generation_t generations[REPLAYCACHE_MAX_GENERATIONS];
+  int n_generations;
+  int current;
+  time_t current_start;
+  time_t generation_span;
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -52,6 +97,9 @@ STATIC int replaycache_add_and_test_internal(
     time_t *elapsed);
 STATIC void replaycache_scrub_if_needed_internal(
     time_t present, replaycache_t *r);
+#ifdef TOR_UNIT_TESTS
+STATIC size_t replaycache_size(const replaycache_t *r);
+#endif /* defined(TOR_UNIT_TESTS) */
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
 
@@ -45,6 +45,11 @@
  * resolve, by calling connection_exit_connect() if the client sent a
  * RELAY_BEGIN cell, and by calling send_resolved_cell() or
  * send_hostname_cell() if the client sent a RELAY_RESOLVE cell.
+ *
+ * We send the queries of our clients through a dns_backend_t. By default,
+ * that's evdns, in the main thread; if ServerDNSThreads is set, it's the
+ * resolver threads of dns_threaded.c. Either way, the answers come back
+ * through evdns_callback().
  **/
 
 #define DNS_PRIVATE
@@ -61,6 +66,7 @@
 #include "core/or/relay.h"
 #include "feature/control/control_events.h"
 #include "feature/relay/dns.h"
+#include "feature/relay/dns_threaded.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
@@ -86,6 +92,20 @@
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
 
+static void configure_dns_backend(const or_options_t *options);
+static int evdns_backend_launch(uint8_t query_type, const char *address,
+                                const tor_addr_t *ptr_address,
+                                dns_answer_fn_t cb, void *arg);
+
+/** Sends queries with <b>the_evdns_base</b>, in the main thread. */
+static const dns_backend_t evdns_backend = {
+  "evdns",
+  evdns_backend_launch,
+};
+
+/** The backend we send the queries of our clients with. */
+static const dns_backend_t *the_dns_backend = &evdns_backend;
+
 /** Have we currently configured nameservers with eventdns? */
 static int nameservers_configured = 0;
 /** Did our most recent attempt to configure nameservers with eventdns fail? */
@@ -98,17 +118,16 @@ static char *resolv_conf_fname = NULL;
 static time_t resolv_conf_mtime = 0;
 
 static void purge_expired_resolves(time_t now);
-static void dns_found_answer(const char *address, uint8_t query_type,
-                             int dns_answer,
-                             const tor_addr_t *addr,
-                             const char *hostname,
-                             uint32_t ttl);
 static void add_wildcarded_test_address(const char *address);
 static int configure_nameservers(int force);
 static int answer_is_wildcarded(const char *ip);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
 static void make_pending_resolve_cached(cached_resolve_t *cached);
+static void dns_cache_clock_remove(cached_resolve_t *resolve);
+static int cached_resolve_is_inflight(const cached_resolve_t *resolve,
+                                      uint8_t query_type);
+static void finish_prefetch(cached_resolve_t *prefetch);
 
 #ifdef DEBUG_DNS_CACHE
 static void assert_cache_ok_(void);
@@ -256,6 +275,8 @@ dns_reset(void)
     if (configure_nameservers(0) < 0) {
       return -1;
     }
+    /* Our nameservers might not have changed, but our options did. */
+    configure_dns_backend(options);
   }
   return 0;
 }
@@ -316,10 +337,44 @@ compare_cached_resolves_by_expiry_(const void *_a, const void *_b)
     return 1;
 }
 
+/** Helper: free_cached_resolve_() with a void* argument, for strmap_free. */
+static void
+free_cached_resolve_void_(void *r)
+{
+  free_cached_resolve_(r);
+}
+
 /** Priority queue of cached_resolve_t objects to let us know when they
  * will expire. */
 static smartlist_t *cached_resolve_pqueue = NULL;
 
+/** Every CACHED cached_resolve_t, in no particular order: the ring that the
+ * hand of our CLOCK replacement policy goes around. */
+static smartlist_t *cached_resolve_clock = NULL;
+/** Index in cached_resolve_clock of the next entry that the CLOCK hand will
+ * look at. */
+static int clock_hand = 0;
+/** Total size in bytes of the entries in cached_resolve_clock. */
+static size_t dns_cache_bytes = 0;
+
+/** Map from address to a PENDING cached_resolve_t that isn't in the cache:
+ * we are using it to refresh the cached answer for that address before it
+ * expires. */
+static strmap_t *prefetch_map = NULL;
+
+/** @name DNS cache statistics, for GETINFO dns/cache/.
+ *
+ * @{ */
+/** How many streams found a cached answer. */
+static uint64_t dns_cache_n_hits = 0;
+/** How many streams had to wait for a resolve. */
+static uint64_t dns_cache_n_misses = 0;
+/** How many answers did we evict to stay under ServerDNSCacheMaxSize? */
+static uint64_t dns_cache_n_evictions = 0;
+/** How many popular answers did we refresh before they expired? */
+static uint64_t dns_cache_n_prefetches = 0;
+/**@}*/
+
 static void
 cached_resolve_add_answer(cached_resolve_t *resolve,
                           int query_type,
@@ -395,12 +450,107 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Return the number of bytes that <b>resolve</b> takes up. */
+STATIC size_t
+cached_resolve_size(const cached_resolve_t *resolve)
+{
+  size_t sz = sizeof(cached_resolve_t);
+  if (resolve->res_status_hostname == RES_STATUS_DONE_OK &&
+      resolve->result_ptr.hostname)
+    sz += strlen(resolve->result_ptr.hostname) + 1;
+  return sz;
+}
+
+/** Add the CACHED entry <b>resolve</b> to the CLOCK ring. */
+static void
+dns_cache_clock_add(cached_resolve_t *resolve)
+{
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  if (!cached_resolve_clock)
+    cached_resolve_clock = smartlist_new();
+  resolve->clock_idx = smartlist_len(cached_resolve_clock);
+  smartlist_add(cached_resolve_clock, resolve);
+  dns_cache_bytes += cached_resolve_size(resolve);
+}
+
+/** Remove <b>resolve</b> from the CLOCK ring, if it is there. */
+static void
+dns_cache_clock_remove(cached_resolve_t *resolve)
+{
+  const int idx = resolve->clock_idx;
+
+  if (!cached_resolve_clock || idx < 0 ||
+      idx >= smartlist_len(cached_resolve_clock) ||
+      smartlist_get(cached_resolve_clock, idx) != resolve)
+    return;
+  /* This moves the last entry of the ring into our slot. */
+  smartlist_del(cached_resolve_clock, idx);
+  if (idx < smartlist_len(cached_resolve_clock)) {
+    cached_resolve_t *moved = smartlist_get(cached_resolve_clock, idx);
+    moved->clock_idx = idx;
+  }
+  resolve->clock_idx = -1;
+  dns_cache_bytes -= cached_resolve_size(resolve);
+}
+
+/** Remove the CACHED entry <b>resolve</b> from the cache, the expiry queue
+ * and the CLOCK ring, and free it. */
+static void
+dns_cache_remove_entry(cached_resolve_t *resolve)
+{
+  cached_resolve_t *removed;
+
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  tor_assert(removed == resolve);
+  if (resolve->minheap_idx >= 0)
+    smartlist_pqueue_remove(cached_resolve_pqueue,
+                            compare_cached_resolves_by_expiry_,
+                            offsetof(cached_resolve_t, minheap_idx),
+                            resolve);
+  dns_cache_clock_remove(resolve);
+  free_cached_resolve_(resolve);
+}
+
+/** If our cached answers take up more than ServerDNSCacheMaxSize, evict
+ * some of them until they don't.  We pick them with the CLOCK algorithm:
+ * an answer that a stream used since the hand last passed over it gets a
+ * second chance. */
+STATIC void
+dns_cache_enforce_limit(void)
+{
+  const uint64_t limit = get_options()->ServerDNSCacheMaxSize;
+  cached_resolve_t *resolve;
+
+  if (!limit || !cached_resolve_clock)
+    return;
+
+  while (dns_cache_bytes > limit && smartlist_len(cached_resolve_clock)) {
+    if (clock_hand >= smartlist_len(cached_resolve_clock))
+      clock_hand = 0;
+    resolve = smartlist_get(cached_resolve_clock, clock_hand);
+    if (resolve->referenced) {
+      resolve->referenced = 0;
+      ++clock_hand;
+      continue;
+    }
+    log_debug(LD_EXIT, "Evicting the cached answer for %s to keep the DNS "
+              "cache under ServerDNSCacheMaxSize.",
+              escaped_safe_str(resolve->address));
+    /* The hand stays put: another entry takes this one's slot. */
+    dns_cache_remove_entry(resolve);
+    ++dns_cache_n_evictions;
+  }
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
 {
   cached_resolve_t **ptr, **next, *item;
   assert_cache_ok();
+  dns_threaded_free_all();
+  the_dns_backend = &evdns_backend;
   if (cached_resolve_pqueue) {
     SMARTLIST_FOREACH(cached_resolve_pqueue, cached_resolve_t *, res,
       {
@@ -416,6 +566,14 @@ dns_free_all(void)
   HT_CLEAR(cache_map, &cache_root);
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
+  smartlist_free(cached_resolve_clock);
+  cached_resolve_clock = NULL;
+  clock_hand = 0;
+  dns_cache_bytes = 0;
+  strmap_free(prefetch_map, free_cached_resolve_void_);
+  prefetch_map = NULL;
+  dns_cache_n_hits = dns_cache_n_misses = 0;
+  dns_cache_n_evictions = dns_cache_n_prefetches = 0;
   tor_free(resolv_conf_fname);
 }
 
@@ -451,6 +609,7 @@ purge_expired_resolves(time_t now)
                 escaped_safe_str(resolve->address),
                 (unsigned long)resolve->expire);
       tor_assert(!resolve->pending_connections);
+      dns_cache_clock_remove(resolve);
     } else {
       tor_assert(resolve->state == CACHE_STATE_DONE);
       tor_assert(!resolve->pending_connections);
@@ -805,6 +964,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
         pending_connection->next = resolve->pending_connections;
         resolve->pending_connections = pending_connection;
         *made_connection_pending_out = 1;
+        ++dns_cache_n_misses;
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") waiting "
                   "for pending DNS resolve of %s", exitconn->base_.s,
                   escaped_safe_str(exitconn->base_.address));
@@ -816,6 +976,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(resolve->address));
 
         *resolve_out = resolve;
+        dns_cache_note_hit(resolve, now);
 
         return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
       case CACHE_STATE_DONE:
@@ -830,7 +991,9 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
   resolve->minheap_idx = -1;
+  resolve->clock_idx = -1;
   strlcpy(resolve->address, exitconn->base_.address, sizeof(resolve->address));
+  ++dns_cache_n_misses;
 
   /* add this connection to the pending list */
   pending_connection = tor_malloc_zero(sizeof(pending_connection_t));
@@ -1153,7 +1316,7 @@ is_test_address(const char *address)
  * got one; <b>hostname</b> is a hostname fora PTR request if we got one, and
  * <b>ttl</b> is the time-to-live of this answer, in seconds.)
  */
-static void
+STATIC void
 dns_found_answer(const char *address, uint8_t query_type,
                  int dns_answer,
                  const tor_addr_t *addr,
@@ -1164,6 +1327,18 @@ dns_found_answer(const char *address, uint8_t query_type,
 
   assert_cache_ok();
 
+  /* If we are refreshing this address and are still waiting for this kind
+   * of answer, the answer is for the refresh. */
+  if (prefetch_map &&
+      (resolve = strmap_get(prefetch_map, address)) &&
+      cached_resolve_is_inflight(resolve, query_type)) {
+    cached_resolve_add_answer(resolve, query_type, dns_answer,
+                              addr, hostname, ttl);
+    if (cached_resolve_have_all_answers(resolve))
+      finish_prefetch(resolve);
+    return;
+  }
+
   strlcpy(search.address, address, sizeof(search.address));
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
@@ -1312,7 +1487,6 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
   {
     cached_resolve_t *new_resolve = tor_memdup(resolve,
                                                sizeof(cached_resolve_t));
-    uint32_t ttl = UINT32_MAX;
     new_resolve->expire = 0; /* So that set_expiry won't croak. */
     if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
       new_resolve->result_ptr.hostname =
@@ -1323,27 +1497,163 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
     assert_resolve_ok(new_resolve);
     HT_INSERT(cache_map, &cache_root, new_resolve);
 
-    if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv4 < ttl)
-      ttl = resolve->ttl_ipv4;
+    set_expiry(new_resolve,
+               time(NULL) + cached_resolve_get_cache_time(new_resolve));
+    dns_cache_clock_add(new_resolve);
+  }
+
+  dns_cache_enforce_limit();
+  assert_cache_ok();
+}
+
+/** Return how many seconds we should keep the answers of <b>resolve</b>,
+ * which has all its answers, in the cache.
+ *
+ * Addresses and permanent failures get the smallest of their TTLs, clipped
+ * like the TTLs we tell clients. Transient failures, like timeouts, only
+ * get DNS_TRANSIENT_ERR_CACHE_TIME: one lost packet shouldn't break a name
+ * for MIN_DNS_TTL_AT_EXIT seconds. */
+STATIC uint32_t
+cached_resolve_get_cache_time(const cached_resolve_t *resolve)
+{
+  uint32_t ttl = UINT32_MAX;
+  int all_transient = 1;
+
+#define CHECK_ANSWER(status, err, answer_ttl)                   \
+  STMT_BEGIN                                                    \
+    if ((status) == RES_STATUS_DONE_OK ||                       \
+        (status) == RES_STATUS_DONE_ERR) {                      \
+      if ((status) == RES_STATUS_DONE_OK ||                     \
+          !evdns_err_is_transient(err))                         \
+        all_transient = 0;                                      \
+      if ((answer_ttl) < ttl)                                   \
+        ttl = (answer_ttl);                                     \
+    }                                                           \
+  STMT_END
+
+  CHECK_ANSWER(resolve->res_status_ipv4, resolve->result_ipv4.err_ipv4,
+               resolve->ttl_ipv4);
+  CHECK_ANSWER(resolve->res_status_ipv6, resolve->result_ipv6.err_ipv6,
+               resolve->ttl_ipv6);
+  CHECK_ANSWER(resolve->res_status_hostname,
+               resolve->result_ptr.err_hostname, resolve->ttl_hostname);
+#undef CHECK_ANSWER
+
+  if (ttl != UINT32_MAX && all_transient)
+    return DNS_TRANSIENT_ERR_CACHE_TIME;
+  return dns_clip_ttl(ttl);
+}
+
+/** Return true iff we are still waiting for the <b>query_type</b> answer
+ * of <b>resolve</b>. */
+static int
+cached_resolve_is_inflight(const cached_resolve_t *resolve,
+                           uint8_t query_type)
+{
+  switch (query_type) {
+    case DNS_IPv4_A:
+      return resolve->res_status_ipv4 == RES_STATUS_INFLIGHT;
+    case DNS_IPv6_AAAA:
+      return resolve->res_status_ipv6 == RES_STATUS_INFLIGHT;
+    case DNS_PTR:
+      return resolve->res_status_hostname == RES_STATUS_INFLIGHT;
+    default:
+      return 0;
+  }
+}
+
+/** Return true iff <b>resolve</b> got an address or a hostname. */
+static int
+cached_resolve_has_answer(const cached_resolve_t *resolve)
+{
+  return (resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+          resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+          resolve->res_status_hostname == RES_STATUS_DONE_OK);
+}
+
+/** Start resolving the address of the CACHED entry <b>resolve</b> again, so
+ * that we have a fresh answer for it before it expires. */
+static void
+launch_prefetch(cached_resolve_t *resolve)
+{
+  cached_resolve_t *prefetch;
+
+  /* Only try once per cached answer, even if we can't launch anything. */
+  resolve->is_prefetching = 1;
+
+  prefetch = tor_malloc_zero(sizeof(cached_resolve_t));
+  prefetch->magic = CACHED_RESOLVE_MAGIC;
+  prefetch->state = CACHE_STATE_PENDING;
+  prefetch->minheap_idx = -1;
+  prefetch->clock_idx = -1;
+  strlcpy(prefetch->address, resolve->address, sizeof(prefetch->address));
+
+  log_debug(LD_EXIT, "Refreshing the popular cached answer for %s.",
+            escaped_safe_str(resolve->address));
+  launch_resolve(prefetch);
+  if (cached_resolve_have_all_answers(prefetch)) {
+    /* Nothing is in flight; the cached answer will just expire. */
+    free_cached_resolve_(prefetch);
+    return;
+  }
+  if (!prefetch_map)
+    prefetch_map = strmap_new();
+  free_cached_resolve_(strmap_set(prefetch_map, prefetch->address, prefetch));
+  ++dns_cache_n_prefetches;
+}
 
-    if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv6 < ttl)
-      ttl = resolve->ttl_ipv6;
+/** Called when <b>prefetch</b>, a resolve we launched to refresh a cached
+ * answer, has all its answers. If it found something, cache it in place of
+ * the old answer; otherwise, leave the old answer until it expires. */
+static void
+finish_prefetch(cached_resolve_t *prefetch)
+{
+  cached_resolve_t *old;
 
-    if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
-         resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_hostname < ttl)
-      ttl = resolve->ttl_hostname;
+  strmap_remove(prefetch_map, prefetch->address);
+  old = HT_FIND(cache_map, &cache_root, prefetch);
 
-    set_expiry(new_resolve, time(NULL) + dns_clip_ttl(ttl));
+  /* If the old answer expired and a stream is waiting for a new resolve,
+   * that resolve will get its own answers. */
+  if (!cached_resolve_has_answer(prefetch) ||
+      (old && old->state != CACHE_STATE_CACHED)) {
+    free_cached_resolve_(prefetch);
+    return;
   }
 
+  if (old)
+    dns_cache_remove_entry(old);
+  prefetch->state = CACHE_STATE_CACHED;
+  /* It was popular enough to prefetch: give it a second chance. */
+  prefetch->referenced = 1;
+  assert_resolve_ok(prefetch);
+  HT_INSERT(cache_map, &cache_root, prefetch);
+  set_expiry(prefetch,
+             time(NULL) + cached_resolve_get_cache_time(prefetch));
+  dns_cache_clock_add(prefetch);
+
+  dns_cache_enforce_limit();
   assert_cache_ok();
 }
 
+/** Note that a stream is using the CACHED entry <b>resolve</b> at
+ * <b>now</b>. If the entry is popular and about to expire, start resolving
+ * its address again, so that its streams never have to wait. */
+STATIC void
+dns_cache_note_hit(cached_resolve_t *resolve, time_t now)
+{
+  ++dns_cache_n_hits;
+  resolve->referenced = 1;
+  if (resolve->n_hits < UINT16_MAX)
+    ++resolve->n_hits;
+
+  if (resolve->n_hits >= DNS_PREFETCH_MIN_HITS &&
+      !resolve->is_prefetching &&
+      resolve->expire - now <= DNS_PREFETCH_WINDOW &&
+      cached_resolve_has_answer(resolve))
+    launch_prefetch(resolve);
+}
+
 /** Eventdns helper: return true iff the eventdns result <b>err</b> is
  * a transient failure. */
 static int
@@ -1396,6 +1706,68 @@ configured_nameserver_address(const size_t idx)
 }
 #endif
 
+/** Pick the backend that we send the queries of our clients with, according
+ * to <b>options</b>. If we use resolver threads, have them send their
+ * queries to the nameservers of <b>the_evdns_base</b>, which must be
+ * configured. */
+static void
+configure_dns_backend(const or_options_t *options)
+{
+  dns_threaded_config_t cfg;
+  const dns_backend_t *old_backend = the_dns_backend;
+
+  the_dns_backend = &evdns_backend;
+  if (!options->ServerDNSThreads)
+    goto done;
+  if (options->ServerDNSSearchDomains) {
+    log_notice(LD_EXIT, "Resolver threads don't support search domains; "
+               "ignoring ServerDNSThreads since ServerDNSSearchDomains is "
+               "set.");
+    goto done;
+  }
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.n_threads = options->ServerDNSThreads;
+  cfg.max_inflight = MAX(1, options->ServerDNSMaxInflight);
+  /* The same timeouts that we give evdns in configure_nameservers(). */
+  cfg.timeout_msec = 5000;
+  cfg.max_attempts = 3;
+  cfg.randomize_case = options->ServerDNSRandomizeCase;
+#ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
+  {
+    int i, n = evdns_base_count_nameservers(the_evdns_base);
+    for (i = 0; i < n && cfg.n_nameservers < DNS_THREADED_MAX_NAMESERVERS;
+         ++i) {
+      struct sockaddr_storage ss;
+      tor_addr_port_t *ns = &cfg.nameservers[cfg.n_nameservers];
+      if (evdns_base_get_nameserver_addr(the_evdns_base, i,
+                                         (struct sockaddr *) &ss,
+                                         sizeof(ss)) <= 0 ||
+          tor_addr_from_sockaddr(&ns->addr, (struct sockaddr *) &ss,
+                                 &ns->port) < 0)
+        continue;
+      ++cfg.n_nameservers;
+    }
+  }
+#endif /* defined(HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR) */
+  if (cfg.n_nameservers == 0) {
+    log_warn(LD_EXIT, "Unable to tell our resolver threads about our "
+             "nameservers; using evdns instead.");
+    goto done;
+  }
+  if (dns_threaded_configure(&cfg) < 0) {
+    log_warn(LD_EXIT, "Unable to use resolver threads; using evdns "
+             "instead.");
+    goto done;
+  }
+  the_dns_backend = dns_threaded_get_backend();
+
+ done:
+  if (the_dns_backend != old_backend)
+    log_notice(LD_EXIT, "Sending the DNS queries of our clients with %s.",
+               the_dns_backend->name);
+}
+
 /** Configure eventdns nameservers if force is true, or if the configuration
  * has changed since the last time we called this function, or if we failed on
  * our last attempt.  On Unix, this reads from /etc/resolv.conf or
@@ -1546,6 +1918,7 @@ configure_nameservers(int force)
 
 #undef SET
 
+  configure_dns_backend(options);
   dns_servers_relaunch_checks();
 
   nameservers_configured = 1;
@@ -1681,42 +2054,37 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
   tor_free(arg_);
 }
 
-/** Start a single DNS resolve for <b>address</b> (if <b>query_type</b> is
- * DNS_IPv4_A or DNS_IPv6_AAAA) <b>ptr_address</b> (if <b>query_type</b> is
- * DNS_PTR). Return 0 if we launched the request, -1 otherwise. */
+/** Implements dns_backend_t.launch for evdns: start a single evdns request
+ * in the main thread. */
 static int
-launch_one_resolve(const char *address, uint8_t query_type,
-                   const tor_addr_t *ptr_address)
+evdns_backend_launch(uint8_t query_type, const char *address,
+                     const tor_addr_t *ptr_address,
+                     dns_answer_fn_t cb, void *arg)
 {
   const int options = get_options()->ServerDNSSearchDomains ? 0
     : DNS_QUERY_NO_SEARCH;
-  const size_t addr_len = strlen(address);
   struct evdns_request *req = 0;
-  char *addr = tor_malloc(addr_len + 2);
-  addr[0] = (char) query_type;
-  memcpy(addr+1, address, addr_len + 1);
 
   switch (query_type) {
   case DNS_IPv4_A:
     req = evdns_base_resolve_ipv4(the_evdns_base,
-                                  address, options, evdns_callback, addr);
+                                  address, options, cb, arg);
     break;
   case DNS_IPv6_AAAA:
     req = evdns_base_resolve_ipv6(the_evdns_base,
-                                  address, options, evdns_callback, addr);
-    ++n_ipv6_requests_made;
+                                  address, options, cb, arg);
     break;
   case DNS_PTR:
     if (tor_addr_family(ptr_address) == AF_INET)
       req = evdns_base_resolve_reverse(the_evdns_base,
                                        tor_addr_to_in(ptr_address),
                                        DNS_QUERY_NO_SEARCH,
-                                       evdns_callback, addr);
+                                       cb, arg);
     else if (tor_addr_family(ptr_address) == AF_INET6)
       req = evdns_base_resolve_reverse_ipv6(the_evdns_base,
                                             tor_addr_to_in6(ptr_address),
                                             DNS_QUERY_NO_SEARCH,
-                                            evdns_callback, addr);
+                                            cb, arg);
     else
       log_warn(LD_BUG, "Called with PTR query and unexpected address family");
     break;
@@ -1725,7 +2093,27 @@ launch_one_resolve(const char *address, uint8_t query_type,
     break;
   }
 
-  if (req) {
+  return req ? 0 : -1;
+}
+
+/** Start a single DNS resolve for <b>address</b> (if <b>query_type</b> is
+ * DNS_IPv4_A or DNS_IPv6_AAAA) <b>ptr_address</b> (if <b>query_type</b> is
+ * DNS_PTR), with our current backend. Return 0 if we launched the request,
+ * -1 otherwise. */
+static int
+launch_one_resolve(const char *address, uint8_t query_type,
+                   const tor_addr_t *ptr_address)
+{
+  const size_t addr_len = strlen(address);
+  char *addr = tor_malloc(addr_len + 2);
+  addr[0] = (char) query_type;
+  memcpy(addr+1, address, addr_len + 1);
+
+  if (query_type == DNS_IPv6_AAAA)
+    ++n_ipv6_requests_made;
+
+  if (the_dns_backend->launch(query_type, address, ptr_address,
+                              evdns_callback, addr) == 0) {
     return 0;
   } else {
     tor_free(addr);
@@ -2143,7 +2531,14 @@ dns_cache_entry_count(void)
 size_t
 dns_cache_total_allocation(void)
 {
-  return sizeof(struct cached_resolve_t) * dns_cache_entry_count() +
+  const int n_cached =
+    cached_resolve_clock ? smartlist_len(cached_resolve_clock) : 0;
+  const int n_prefetching = prefetch_map ? strmap_size(prefetch_map) : 0;
+  /* Everything in the hash table that isn't a cached answer is pending. */
+  const int n_pending = MAX(dns_cache_entry_count() - n_cached, 0);
+
+  return dns_cache_bytes +
+         sizeof(struct cached_resolve_t) * (n_pending + n_prefetching) +
          HT_MEM_USAGE(&cache_root);
 }
 
@@ -2155,9 +2550,7 @@ dump_dns_mem_usage(int severity)
   int hash_count = dns_cache_entry_count();
   size_t hash_mem = dns_cache_total_allocation();
 
-  /* Print out the count and estimated size of our &cache_root.  It undercounts
-     hostnames in cached reverse resolves.
-   */
+  /* Print out the count and estimated size of our &cache_root. */
   tor_log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
   tor_log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
@@ -2193,6 +2586,33 @@ dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
   return total_bytes_removed;
 }
 
+/** Implementation helper for GETINFO: answers queries about the DNS cache
+ * of our exit. */
+int
+getinfo_helper_dns(control_connection_t *conn,
+                   const char *question, char **answer,
+                   const char **errmsg)
+{
+  (void) conn;
+  (void) errmsg;
+  if (!strcmp(question, "dns/cache/entries")) {
+    tor_asprintf(answer, "%d", dns_cache_entry_count());
+  } else if (!strcmp(question, "dns/cache/bytes")) {
+    tor_asprintf(answer, "%"TOR_PRIuSZ, dns_cache_total_allocation());
+  } else if (!strcmp(question, "dns/cache/hits")) {
+    tor_asprintf(answer, "%"PRIu64, dns_cache_n_hits);
+  } else if (!strcmp(question, "dns/cache/misses")) {
+    tor_asprintf(answer, "%"PRIu64, dns_cache_n_misses);
+  } else if (!strcmp(question, "dns/cache/evictions")) {
+    tor_asprintf(answer, "%"PRIu64, dns_cache_n_evictions);
+  } else if (!strcmp(question, "dns/cache/prefetches")) {
+    tor_asprintf(answer, "%"PRIu64, dns_cache_n_prefetches);
+  } else {
+    *answer = NULL;
+  }
+  return 0;
+}
+
 #ifdef DEBUG_DNS_CACHE
 /** Exit with an assertion if the DNS cache is corrupt. */
 static void
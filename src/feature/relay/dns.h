@@ -23,6 +23,41 @@
 /** How long do we cache/tell clients to cache DNS records when no TTL is
  * known? */
 #define DEFAULT_DNS_TTL (30*60)
+/** How long do we cache a resolve whose every answer is a transient failure,
+ * like a timeout? */
+#define DNS_TRANSIENT_ERR_CACHE_TIME 10
+/** How many seconds before a popular cached answer expires do we resolve its
+ * address again? */
+#define DNS_PREFETCH_WINDOW 30
+/** How many streams must use a cached answer before we think that it is
+ * popular enough to resolve again before it expires? */
+#define DNS_PREFETCH_MIN_HITS 3
+
+/** Highest value for ServerDNSThreads. */
+#define SERVER_DNS_THREADS_MAX 16
+/** Highest value for ServerDNSMaxInflight. */
+#define SERVER_DNS_MAX_INFLIGHT_MAX 4096
+
+/** Function that a DNS backend calls, from the main thread, with the answer
+ * to a query. The arguments are those of an evdns callback: <b>addresses</b>
+ * holds <b>count</b> IPv4 addresses in network order, IPv6 addresses, or
+ * hostnames, depending on <b>type</b>. */
+typedef void (*dns_answer_fn_t)(int result, char type, int count, int ttl,
+                                void *addresses, void *arg);
+
+/** A way for dns.c to send the DNS queries of its clients. */
+typedef struct dns_backend_t {
+  /** Name of the backend, for log messages. */
+  const char *name;
+  /** Start a query of type <b>query_type</b> (DNS_IPv4_A, DNS_IPv6_AAAA or
+   * DNS_PTR) about <b>name</b>, which is a hostname, or the in-addr.arpa or
+   * ip6.arpa name of <b>ptr_address</b> for DNS_PTR. Return 0 if we launched
+   * the query, in which case <b>cb</b> gets called exactly once with
+   * <b>arg</b>, and -1 otherwise. */
+  int (*launch)(uint8_t query_type, const char *name,
+                const tor_addr_t *ptr_address,
+                dns_answer_fn_t cb, void *arg);
+} dns_backend_t;
 
 int dns_init(void);
 int has_dns_init_failed(void);
@@ -41,6 +76,9 @@ void dns_reset_correctness_checks(void);
 size_t dns_cache_total_allocation(void);
 void dump_dns_mem_usage(int severity);
 size_t dns_cache_handle_oom(time_t now, size_t min_remove_bytes);
+int getinfo_helper_dns(control_connection_t *conn,
+                       const char *question, char **answer,
+                       const char **errmsg);
 
 #ifdef DNS_PRIVATE
 #include "feature/relay/dns_structs.h"
@@ -63,6 +101,17 @@ const char *hostname));
 cached_resolve_t *dns_get_cache_entry(cached_resolve_t *query);
 void dns_insert_cache_entry(cached_resolve_t *new_entry);
 
+STATIC void dns_found_answer(const char *address, uint8_t query_type,
+                             int dns_answer,
+                             const tor_addr_t *addr,
+                             const char *hostname,
+                             uint32_t ttl);
+STATIC size_t cached_resolve_size(const cached_resolve_t *resolve);
+STATIC uint32_t cached_resolve_get_cache_time(
+                                     const cached_resolve_t *resolve);
+STATIC void dns_cache_enforce_limit(void);
+STATIC void dns_cache_note_hit(cached_resolve_t *resolve, time_t now);
+
 MOCK_DECL(STATIC int,
 set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
                                 const cached_resolve_t *resolve,
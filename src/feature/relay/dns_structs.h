@@ -96,6 +96,23 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+
+  /** @name Cache replacement fields
+   *
+   * Used only while this entry is CACHED.
+   *
+   * @{ */
+  /** Position of this element in the CLOCK ring of cached answers. */
+  int clock_idx;
+  /** True iff a stream used this answer since the CLOCK hand last passed
+   * over it. */
+  unsigned int referenced : 1;
+  /** True iff we are already resolving this address again to refresh this
+   * answer before it expires. */
+  unsigned int is_prefetching : 1;
+  /** How many streams used this answer so far; saturates at UINT16_MAX. */
+  uint16_t n_hits;
+  /**@}*/
 } cached_resolve_t;
 
 #endif /* !defined(TOR_DNS_STRUCTS_H) */
@@ -0,0 +1,966 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dns_threaded.c
+ * \brief A DNS backend for dns.c that sends queries from its own threads.
+ *
+ * By default, dns.c sends all the queries of its clients with libevent's
+ * evdns, from the main thread. On a busy exit, that means that every query
+ * waits for the main loop before it is sent, resent, or answered, and that
+ * the main thread spends its time on DNS packets.
+ *
+ * This backend hands each query to one of a few resolver threads instead.
+ * Every resolver thread has its own UDP socket for each nameserver, keeps up
+ * to a configurable number of queries in flight at once, and resends those
+ * that time out. Finished queries go on a reply queue, and the main thread
+ * hands them to dns.c, in the same form as evdns answers, from
+ * dns_threaded_process_replies().
+ *
+ * We don't read resolv.conf ourselves: dns.c gives us the nameservers that
+ * evdns found there. We don't know about search domains, hosts files or
+ * DNS over TCP either; dns.c keeps using evdns when it needs those.
+ **/
+
+#define DNS_THREADED_PRIVATE
+
+#include "core/or/or.h"
+#include "feature/relay/dns.h"
+#include "feature/relay/dns_threaded.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/net/alertsock.h"
+#include "lib/net/socket.h"
+#include "lib/string/compat_ctype.h"
+#include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
+
+#include <event2/event.h>
+#include <event2/dns.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+#ifndef DNS_ERR_NODATA
+/* Older versions of libevent report answers without records as errors of
+ * this type too. */
+#define DNS_ERR_NODATA DNS_ERR_UNKNOWN
+#endif
+
+/* Sizes and values from RFC 1035. */
+#define DNS_HEADER_LEN 12
+#define DNS_MAX_NAME_LEN 255
+#define DNS_MAX_LABEL_LEN 63
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_OPCODE_MASK 0x7800
+#define DNS_RCODE_MASK 0x000f
+#define DNS_CLASS_IN 1
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_AAAA 28
+
+/** Largest query we ever send. */
+#define DNS_MAX_QUERY_LEN (DNS_HEADER_LEN + DNS_MAX_NAME_LEN + 1 + 4)
+/** Largest answer we read. We don't ask for EDNS, so servers shouldn't send
+ * more than 512 bytes, but we don't need to enforce that. */
+#define DNS_MAX_REPLY_LEN 4096
+/** Most compression pointers we follow in a single name. */
+#define DNS_MAX_POINTERS 32
+/** Longest a resolver thread sleeps, in msec, so that it notices
+ * configuration changes even when it has nothing to do. */
+#define RESOLVER_THREAD_MAX_SLEEP_MSEC 1000
+
+/** A resolver thread, and the queries that it owns. */
+typedef struct dns_resolver_thread_t {
+  /** Protects <b>incoming</b>. */
+  tor_mutex_t lock;
+  /** Queries from the main thread that we haven't taken yet. */
+  smartlist_t *incoming;
+  /** Used by the main thread to wake us up when it gives us queries. */
+  alert_sockets_t alert;
+
+  /* Only the thread itself touches the fields below. */
+  /** Queries we have taken from <b>incoming</b> but have had no room to
+   * send yet, oldest first. */
+  smartlist_t *waiting;
+  /** Queries we have sent, and that haven't been answered yet. */
+  smartlist_t *inflight;
+  /** A UDP socket connected to each of our nameservers. */
+  tor_socket_t sockets[DNS_THREADED_MAX_NAMESERVERS];
+  /** How many of <b>sockets</b> we use. */
+  int n_sockets;
+  /** Index of the nameserver we send the next new query to. */
+  int next_nameserver;
+} dns_resolver_thread_t;
+
+/** Protects <b>config</b>, <b>config_generation</b>, <b>shutting_down</b>,
+ * <b>n_running_threads</b> and <b>replies</b>. */
+static tor_mutex_t state_lock;
+/** Signaled when a resolver thread exits. */
+static tor_cond_t state_cond;
+/** Our current configuration. */
+static dns_threaded_config_t config;
+/** Incremented every time <b>config</b> changes, so that the resolver
+ * threads know to pick up the new one. */
+static unsigned int config_generation = 0;
+/** True iff the resolver threads should exit. */
+static int shutting_down = 0;
+/** How many resolver threads haven't exited yet. */
+static int n_running_threads = 0;
+/** Finished queries that the main thread hasn't handled yet. */
+static smartlist_t *replies = NULL;
+/** Used by the resolver threads to wake up the main thread when
+ * <b>replies</b> stops being empty. */
+static alert_sockets_t reply_alert;
+/** Event that runs dns_threaded_process_replies() from the main loop. */
+static struct event *reply_event = NULL;
+
+/** Our resolver threads. Only the main thread touches this array. */
+static dns_resolver_thread_t **threads = NULL;
+/** How many entries <b>threads</b> has. */
+static int n_threads = 0;
+/** Index of the thread we give the next query to. */
+static int next_thread = 0;
+
+/** Release all storage held by <b>q</b>. */
+STATIC void
+dns_threaded_query_free_(dns_threaded_query_t *q)
+{
+  if (!q)
+    return;
+  tor_free(q->name);
+  tor_free(q->hostname);
+  tor_free(q);
+}
+
+/** Return the DNS record type we ask for in queries of type
+ * <b>query_type</b>, or 0 if we don't know that query type. */
+static uint16_t
+query_type_to_qtype(uint8_t query_type)
+{
+  switch (query_type) {
+    case DNS_IPv4_A: return DNS_TYPE_A;
+    case DNS_IPv6_AAAA: return DNS_TYPE_AAAA;
+    case DNS_PTR: return DNS_TYPE_PTR;
+    default: return 0;
+  }
+}
+
+/** Write into <b>out</b>, which holds <b>out_len</b> bytes, a recursive
+ * query with transaction ID <b>id</b> for the records of type <b>qtype</b>
+ * of <b>name</b>. Return the length of the query, or -1 if <b>name</b> is
+ * not a valid DNS name or if <b>out</b> is too small. */
+STATIC int
+dns_threaded_encode_query(uint8_t *out, size_t out_len, uint16_t id,
+                          const char *name, uint16_t qtype)
+{
+  size_t name_len = strlen(name), pos = DNS_HEADER_LEN;
+  const char *label = name, *end = name + name_len;
+
+  /* We don't ask about the root. */
+  if (name_len && name[name_len-1] == '.')
+    --end;
+  if (end == name || (size_t)(end - name) + 2 > DNS_MAX_NAME_LEN + 1)
+    return -1;
+  if (out_len < DNS_HEADER_LEN + (size_t)(end - name) + 2 + 4)
+    return -1;
+
+  memset(out, 0, DNS_HEADER_LEN);
+  set_uint16(out, htons(id));
+  set_uint16(out + 2, htons(DNS_FLAG_RD));
+  set_uint16(out + 4, htons(1)); /* One question. */
+
+  while (label < end) {
+    const char *dot = memchr(label, '.', end - label);
+    size_t label_len = (dot ? dot : end) - label;
+    if (label_len == 0 || label_len > DNS_MAX_LABEL_LEN)
+      return -1;
+    out[pos++] = (uint8_t) label_len;
+    memcpy(out + pos, label, label_len);
+    pos += label_len;
+    label += label_len + (dot ? 1 : 0);
+    if (dot && label == end) /* Empty last label. */
+      return -1;
+  }
+  out[pos++] = 0;
+
+  set_uint16(out + pos, htons(qtype));
+  set_uint16(out + pos + 2, htons(DNS_CLASS_IN));
+  return (int)(pos + 4);
+}
+
+/** Read the possibly compressed name that starts at *<b>offset</b> in the
+ * DNS message <b>msg</b> of <b>msg_len</b> bytes, and move *<b>offset</b>
+ * past it. Unless <b>out</b> is NULL, write the name there, dot-separated
+ * and NUL-terminated; <b>out</b> holds <b>out_len</b> bytes. Return 0 on
+ * success, and -1 if the name is malformed or doesn't fit in <b>out</b>. */
+STATIC int
+dns_threaded_read_name(const uint8_t *msg, size_t msg_len, size_t *offset,
+                       char *out, size_t out_len)
+{
+  size_t pos = *offset, n_out = 0;
+  int n_pointers = 0;
+
+  if (out && out_len == 0)
+    return -1;
+
+  for (;;) {
+    uint8_t label_len;
+    if (pos >= msg_len)
+      return -1;
+    label_len = msg[pos];
+    if ((label_len & 0xc0) == 0xc0) {
+      /* A pointer to the rest of the name. */
+      if (pos + 1 >= msg_len || ++n_pointers > DNS_MAX_POINTERS)
+        return -1;
+      if (n_pointers == 1)
+        *offset = pos + 2;
+      pos = ((size_t)(label_len & 0x3f) << 8) | msg[pos + 1];
+      continue;
+    }
+    if (label_len & 0xc0)
+      return -1;
+    ++pos;
+    if (label_len == 0)
+      break;
+    if (pos + label_len > msg_len || memchr(msg + pos, 0, label_len))
+      return -1;
+    if (out) {
+      if (n_out + label_len + 2 > out_len)
+        return -1;
+      if (n_out)
+        out[n_out++] = '.';
+      memcpy(out + n_out, msg + pos, label_len);
+      n_out += label_len;
+    }
+    pos += label_len;
+  }
+
+  if (n_pointers == 0)
+    *offset = pos;
+  if (out)
+    out[n_out] = '\0';
+  return 0;
+}
+
+/** Return the negative caching TTL of RFC 2308 for the DNS message
+ * <b>msg</b> of <b>msg_len</b> bytes, which says that a name or its records
+ * don't exist: the smaller of the TTL and the MINIMUM field of the SOA
+ * record in its authority section. <b>offset</b> is where the
+ * <b>n_skip</b> resource records before the authority section start.
+ * Return 0 if there is no such SOA record. */
+static int
+reply_get_negative_ttl(const uint8_t *msg, size_t msg_len, size_t offset,
+                       int n_skip)
+{
+  const int n_authority = ntohs(get_uint16(msg + 8));
+  int i;
+
+  for (i = 0; i < n_skip + n_authority; ++i) {
+    uint16_t type, rclass, rdlen;
+    uint32_t ttl, minimum;
+    size_t rd_offset;
+    if (dns_threaded_read_name(msg, msg_len, &offset, NULL, 0) < 0 ||
+        offset + 10 > msg_len)
+      return 0;
+    type = ntohs(get_uint16(msg + offset));
+    rclass = ntohs(get_uint16(msg + offset + 2));
+    ttl = ntohl(get_uint32(msg + offset + 4));
+    rdlen = ntohs(get_uint16(msg + offset + 8));
+    offset += 10;
+    if (offset + rdlen > msg_len)
+      return 0;
+    if (i >= n_skip && type == DNS_TYPE_SOA && rclass == DNS_CLASS_IN) {
+      /* MNAME and RNAME, then SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM. */
+      rd_offset = offset;
+      if (dns_threaded_read_name(msg, offset + rdlen, &rd_offset,
+                                 NULL, 0) < 0 ||
+          dns_threaded_read_name(msg, offset + rdlen, &rd_offset,
+                                 NULL, 0) < 0 ||
+          rd_offset + 20 > offset + rdlen)
+        return 0;
+      minimum = ntohl(get_uint32(msg + rd_offset + 16));
+      ttl = MIN(ttl, minimum);
+      return ttl > INT32_MAX ? INT32_MAX : (int) ttl;
+    }
+    offset += rdlen;
+  }
+  return 0;
+}
+
+/** Parse the DNS message <b>msg</b> of <b>msg_len</b> bytes. If it answers
+ * <b>q</b>, set the result, count, ttl and addresses of <b>q</b> and return
+ * 0. Return -1 if it doesn't answer <b>q</b>, or if it is malformed. */
+STATIC int
+dns_threaded_parse_reply(const uint8_t *msg, size_t msg_len,
+                         dns_threaded_query_t *q)
+{
+  char name[DNS_MAX_NAME_LEN + 1];
+  const uint16_t want_qtype = query_type_to_qtype(q->query_type);
+  uint16_t flags, n_answers;
+  uint32_t min_ttl = UINT32_MAX;
+  size_t offset = DNS_HEADER_LEN;
+  int i, count = 0;
+  char *hostname = NULL;
+
+  if (msg_len < DNS_HEADER_LEN)
+    return -1;
+  flags = ntohs(get_uint16(msg + 2));
+  if (ntohs(get_uint16(msg)) != q->id ||
+      !(flags & DNS_FLAG_QR) ||
+      (flags & DNS_OPCODE_MASK) ||
+      ntohs(get_uint16(msg + 4)) != 1)
+    return -1;
+  n_answers = ntohs(get_uint16(msg + 6));
+
+  /* The question must be ours, with the case we asked with if we
+   * randomized it. */
+  if (dns_threaded_read_name(msg, msg_len, &offset, name, sizeof(name)) < 0 ||
+      offset + 4 > msg_len ||
+      ntohs(get_uint16(msg + offset)) != want_qtype ||
+      ntohs(get_uint16(msg + offset + 2)) != DNS_CLASS_IN)
+    return -1;
+  if (q->randomized_case ? strcmp(name, q->name)
+                         : strcasecmp(name, q->name))
+    return -1;
+  offset += 4;
+
+  if (flags & DNS_RCODE_MASK) {
+    /* The first five DNS_ERR_* values are the RCODEs of RFC 1035. */
+    const int rcode = flags & DNS_RCODE_MASK;
+    q->result = rcode <= DNS_ERR_REFUSED ? rcode : DNS_ERR_UNKNOWN;
+    q->count = 0;
+    q->ttl = 0;
+    if (q->result == DNS_ERR_NOTEXIST)
+      q->ttl = reply_get_negative_ttl(msg, msg_len, offset, n_answers);
+    return 0;
+  }
+
+  for (i = 0; i < n_answers; ++i) {
+    uint16_t type, rclass, rdlen;
+    uint32_t ttl;
+    int keep = 0;
+    if (dns_threaded_read_name(msg, msg_len, &offset, NULL, 0) < 0 ||
+        offset + 10 > msg_len)
+      goto err;
+    type = ntohs(get_uint16(msg + offset));
+    rclass = ntohs(get_uint16(msg + offset + 2));
+    ttl = ntohl(get_uint32(msg + offset + 4));
+    rdlen = ntohs(get_uint16(msg + offset + 8));
+    offset += 10;
+    if (offset + rdlen > msg_len)
+      goto err;
+
+    if (rclass == DNS_CLASS_IN && type == want_qtype &&
+        count < DNS_THREADED_MAX_ADDRS) {
+      if (type == DNS_TYPE_A && rdlen == 4) {
+        memcpy(&q->ipv4[count++], msg + offset, 4);
+        keep = 1;
+      } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+        memcpy(&q->ipv6[count++], msg + offset, 16);
+        keep = 1;
+      } else if (type == DNS_TYPE_PTR && !hostname) {
+        size_t rd_offset = offset;
+        if (dns_threaded_read_name(msg, offset + rdlen, &rd_offset,
+                                   name, sizeof(name)) < 0)
+          goto err;
+        hostname = tor_strdup(name);
+        count = 1;
+        keep = 1;
+      }
+    }
+    if (keep && ttl < min_ttl)
+      min_ttl = ttl;
+    offset += rdlen;
+  }
+
+  tor_free(q->hostname);
+  q->hostname = hostname;
+  q->count = count;
+  if (count) {
+    q->result = DNS_ERR_NONE;
+    q->ttl = min_ttl > INT32_MAX ? INT32_MAX : (int) min_ttl;
+  } else {
+    q->result = (flags & DNS_FLAG_TC) ? DNS_ERR_TRUNCATED : DNS_ERR_NODATA;
+    q->ttl = 0;
+    if (q->result == DNS_ERR_NODATA)
+      q->ttl = reply_get_negative_ttl(msg, msg_len, offset, 0);
+  }
+  return 0;
+ err:
+  tor_free(hostname);
+  return -1;
+}
+
+#ifndef _WIN32
+
+/** Close all the sockets of <b>thr</b>. */
+static void
+resolver_thread_close_sockets(dns_resolver_thread_t *thr)
+{
+  int i;
+  for (i = 0; i < thr->n_sockets; ++i) {
+    if (SOCKET_OK(thr->sockets[i]))
+      tor_close_socket(thr->sockets[i]);
+    thr->sockets[i] = TOR_INVALID_SOCKET;
+  }
+  thr->n_sockets = 0;
+}
+
+/** Replace the sockets of <b>thr</b> with new ones, connected to the
+ * nameservers of <b>cfg</b>. */
+static void
+resolver_thread_open_sockets(dns_resolver_thread_t *thr,
+                             const dns_threaded_config_t *cfg)
+{
+  int i;
+  resolver_thread_close_sockets(thr);
+  for (i = 0; i < cfg->n_nameservers; ++i) {
+    const tor_addr_port_t *ns = &cfg->nameservers[i];
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+    tor_socket_t s;
+
+    thr->sockets[i] = TOR_INVALID_SOCKET;
+    ss_len = tor_addr_to_sockaddr(&ns->addr, ns->port,
+                                  (struct sockaddr *) &ss, sizeof(ss));
+    if (ss_len == 0)
+      continue;
+    s = tor_open_socket_nonblocking(tor_addr_family(&ns->addr), SOCK_DGRAM,
+                                    IPPROTO_UDP);
+    if (!SOCKET_OK(s)) {
+      log_warn(LD_EXIT, "Unable to open a socket for DNS queries: %s",
+               tor_socket_strerror(tor_socket_errno(s)));
+      continue;
+    }
+    if (connect(s, (struct sockaddr *) &ss, ss_len) < 0) {
+      log_warn(LD_EXIT, "Unable to connect a socket to nameserver %s: %s",
+               fmt_addrport(&ns->addr, ns->port),
+               tor_socket_strerror(tor_socket_errno(s)));
+      tor_close_socket(s);
+      continue;
+    }
+    thr->sockets[i] = s;
+  }
+  thr->n_sockets = cfg->n_nameservers;
+}
+
+/** Return the query in flight on <b>thr</b> with transaction ID <b>id</b>,
+ * or NULL if there is none. */
+static dns_threaded_query_t *
+resolver_thread_find_query(dns_resolver_thread_t *thr, uint16_t id)
+{
+  SMARTLIST_FOREACH(thr->inflight, dns_threaded_query_t *, q,
+                    if (q->id == id) return q);
+  return NULL;
+}
+
+/** Give <b>q</b> a transaction ID that no other query in flight on
+ * <b>thr</b> has. */
+static void
+resolver_thread_pick_id(dns_resolver_thread_t *thr, dns_threaded_query_t *q)
+{
+  do {
+    crypto_rand((char *) &q->id, sizeof(q->id));
+  } while (resolver_thread_find_query(thr, q->id));
+}
+
+/** Send <b>q</b> from <b>thr</b> to its current nameserver, and set its
+ * deadline. A send that fails counts as an attempt that timed out. */
+static void
+resolver_thread_send(dns_resolver_thread_t *thr,
+                     const dns_threaded_config_t *cfg,
+                     dns_threaded_query_t *q, uint64_t now)
+{
+  uint8_t buf[DNS_MAX_QUERY_LEN];
+  tor_socket_t s;
+  int len;
+
+  ++q->n_attempts;
+  q->deadline_msec = now + cfg->timeout_msec;
+  if (thr->n_sockets == 0)
+    return;
+  q->nameserver_idx %= thr->n_sockets;
+  s = thr->sockets[q->nameserver_idx];
+  len = dns_threaded_encode_query(buf, sizeof(buf), q->id, q->name,
+                                  query_type_to_qtype(q->query_type));
+  if (len < 0 || !SOCKET_OK(s))
+    return;
+  if (send(s, (const char *) buf, len, 0) < 0) {
+    log_debug(LD_EXIT, "Unable to send a DNS query: %s",
+              tor_socket_strerror(tor_socket_errno(s)));
+  }
+}
+
+/** Put the finished queries in <b>finished</b> on the reply queue, wake up
+ * the main thread if it needs to, and clear <b>finished</b>. */
+static void
+resolver_thread_deliver(smartlist_t *finished)
+{
+  int was_empty;
+  if (smartlist_len(finished) == 0)
+    return;
+  tor_mutex_acquire(&state_lock);
+  was_empty = smartlist_len(replies) == 0;
+  smartlist_add_all(replies, finished);
+  tor_mutex_release(&state_lock);
+  if (was_empty)
+    reply_alert.alert_fn(reply_alert.write_fd);
+  smartlist_clear(finished);
+}
+
+/** Take all the queries that the main thread gave <b>thr</b>, and send as
+ * many of them as we have room for in flight. */
+static void
+resolver_thread_take_queries(dns_resolver_thread_t *thr,
+                             const dns_threaded_config_t *cfg, uint64_t now)
+{
+  smartlist_t *rest;
+  int n_send;
+
+  tor_mutex_acquire(&thr->lock);
+  if (smartlist_len(thr->waiting) == 0) {
+    /* Just swap the lists, so that we hold the lock as briefly as we can. */
+    smartlist_t *tmp = thr->waiting;
+    thr->waiting = thr->incoming;
+    thr->incoming = tmp;
+  } else {
+    smartlist_add_all(thr->waiting, thr->incoming);
+    smartlist_clear(thr->incoming);
+  }
+  tor_mutex_release(&thr->lock);
+
+  n_send = MIN(smartlist_len(thr->waiting),
+               cfg->max_inflight - smartlist_len(thr->inflight));
+  if (n_send <= 0)
+    return;
+
+  rest = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(thr->waiting, dns_threaded_query_t *, q) {
+    if (q_sl_idx >= n_send) {
+      smartlist_add(rest, q);
+      continue;
+    }
+    resolver_thread_pick_id(thr, q);
+    q->nameserver_idx = thr->next_nameserver;
+    if (thr->n_sockets)
+      thr->next_nameserver = (thr->next_nameserver + 1) % thr->n_sockets;
+    resolver_thread_send(thr, cfg, q, now);
+    smartlist_add(thr->inflight, q);
+  } SMARTLIST_FOREACH_END(q);
+  smartlist_free(thr->waiting);
+  thr->waiting = rest;
+}
+
+/** Resend or give up on every query in flight on <b>thr</b> whose deadline
+ * has passed, putting the ones we give up on in <b>finished</b>. Return the
+ * earliest deadline of the queries still in flight, or <b>max</b> if it is
+ * earlier. */
+static uint64_t
+resolver_thread_check_timeouts(dns_resolver_thread_t *thr,
+                               const dns_threaded_config_t *cfg,
+                               uint64_t now, uint64_t max,
+                               smartlist_t *finished)
+{
+  uint64_t next = max;
+  SMARTLIST_FOREACH_BEGIN(thr->inflight, dns_threaded_query_t *, q) {
+    if (q->deadline_msec <= now) {
+      if (q->n_attempts >= cfg->max_attempts) {
+        q->result = DNS_ERR_TIMEOUT;
+        smartlist_add(finished, q);
+        SMARTLIST_DEL_CURRENT(thr->inflight, q);
+        continue;
+      }
+      ++q->nameserver_idx;
+      resolver_thread_send(thr, cfg, q, now);
+    }
+    if (q->deadline_msec < next)
+      next = q->deadline_msec;
+  } SMARTLIST_FOREACH_END(q);
+  return next;
+}
+
+/** Read every answer waiting on socket <b>s</b> of <b>thr</b>, and put the
+ * queries they finish in <b>finished</b>. */
+static void
+resolver_thread_read(dns_resolver_thread_t *thr,
+                     const dns_threaded_config_t *cfg, tor_socket_t s,
+                     uint64_t now, smartlist_t *finished)
+{
+  uint8_t buf[DNS_MAX_REPLY_LEN];
+
+  for (;;) {
+    dns_threaded_query_t *q;
+    ssize_t n = recv(s, (char *) buf, sizeof(buf), 0);
+    if (n < 0) {
+      int e = tor_socket_errno(s);
+      if (ERRNO_IS_EAGAIN(e) || e == EINTR)
+        return;
+      /* Probably an ICMP error from the nameserver: the query will time
+       * out and go to the next one. */
+      log_debug(LD_EXIT, "Error reading a DNS answer: %s",
+                tor_socket_strerror(e));
+      return;
+    }
+    if (n < DNS_HEADER_LEN)
+      continue;
+    q = resolver_thread_find_query(thr, ntohs(get_uint16(buf)));
+    if (!q || dns_threaded_parse_reply(buf, n, q) < 0)
+      continue;
+    if ((q->result == DNS_ERR_SERVERFAILED ||
+         q->result == DNS_ERR_REFUSED) &&
+        q->n_attempts < cfg->max_attempts && thr->n_sockets > 1) {
+      /* Maybe another nameserver can do better. */
+      ++q->nameserver_idx;
+      resolver_thread_send(thr, cfg, q, now);
+      continue;
+    }
+    smartlist_remove(thr->inflight, q);
+    smartlist_add(finished, q);
+  }
+}
+
+/** Main function of a resolver thread: send the queries that the main
+ * thread gives us, and hand back their answers, until we're told to stop. */
+static void
+resolver_thread_main(void *arg)
+{
+  dns_resolver_thread_t *thr = arg;
+  dns_threaded_config_t cfg;
+  unsigned int generation = 0;
+  smartlist_t *finished = smartlist_new();
+  struct pollfd fds[DNS_THREADED_MAX_NAMESERVERS + 1];
+
+  /* Until the main thread gives us a configuration, we have no sockets and
+   * no room for queries. */
+  memset(&cfg, 0, sizeof(cfg));
+
+  for (;;) {
+    uint64_t now, next;
+    int i, n_fds, timeout, stop;
+
+    tor_mutex_acquire(&state_lock);
+    stop = shutting_down;
+    if (generation != config_generation) {
+      memcpy(&cfg, &config, sizeof(cfg));
+      generation = config_generation;
+      resolver_thread_open_sockets(thr, &cfg);
+    }
+    tor_mutex_release(&state_lock);
+    if (stop)
+      break;
+
+    now = monotime_absolute_msec();
+    resolver_thread_take_queries(thr, &cfg, now);
+    next = resolver_thread_check_timeouts(thr, &cfg, now,
+                                     now + RESOLVER_THREAD_MAX_SLEEP_MSEC,
+                                     finished);
+    resolver_thread_deliver(finished);
+
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = thr->alert.read_fd;
+    fds[0].events = POLLIN;
+    n_fds = 1;
+    for (i = 0; i < thr->n_sockets; ++i) {
+      fds[n_fds].fd = SOCKET_OK(thr->sockets[i]) ? thr->sockets[i] : -1;
+      fds[n_fds].events = POLLIN;
+      ++n_fds;
+    }
+    timeout = next > now ? (int)(next - now) : 0;
+    if (poll(fds, n_fds, timeout) <= 0)
+      continue;
+
+    if (fds[0].revents)
+      thr->alert.drain_fn(thr->alert.read_fd);
+    now = monotime_absolute_msec();
+    for (i = 1; i < n_fds; ++i) {
+      if (fds[i].revents)
+        resolver_thread_read(thr, &cfg, thr->sockets[i-1], now, finished);
+    }
+    resolver_thread_deliver(finished);
+  }
+
+  /* We're shutting down: hand back everything we have. */
+  tor_mutex_acquire(&thr->lock);
+  smartlist_add_all(finished, thr->incoming);
+  smartlist_clear(thr->incoming);
+  tor_mutex_release(&thr->lock);
+  smartlist_add_all(finished, thr->waiting);
+  smartlist_clear(thr->waiting);
+  smartlist_add_all(finished, thr->inflight);
+  smartlist_clear(thr->inflight);
+  SMARTLIST_FOREACH(finished, dns_threaded_query_t *, q,
+                    q->result = DNS_ERR_SHUTDOWN);
+  resolver_thread_deliver(finished);
+  smartlist_free(finished);
+  resolver_thread_close_sockets(thr);
+
+  tor_mutex_acquire(&state_lock);
+  --n_running_threads;
+  tor_cond_signal_all(&state_cond);
+  tor_mutex_release(&state_lock);
+}
+
+#endif /* !defined(_WIN32) */
+
+/** Release all storage held by the resolver thread <b>thr</b>, which must
+ * have exited. */
+static void
+resolver_thread_free(dns_resolver_thread_t *thr)
+{
+  if (!thr)
+    return;
+  tor_mutex_uninit(&thr->lock);
+  alert_sockets_close(&thr->alert);
+  SMARTLIST_FOREACH(thr->incoming, dns_threaded_query_t *, q,
+                    dns_threaded_query_free(q));
+  smartlist_free(thr->incoming);
+  SMARTLIST_FOREACH(thr->waiting, dns_threaded_query_t *, q,
+                    dns_threaded_query_free(q));
+  smartlist_free(thr->waiting);
+  SMARTLIST_FOREACH(thr->inflight, dns_threaded_query_t *, q,
+                    dns_threaded_query_free(q));
+  smartlist_free(thr->inflight);
+  tor_free(thr);
+}
+
+/** Called from the main loop when a resolver thread has finished some
+ * queries. */
+static void
+reply_event_cb(evutil_socket_t sock, short events, void *arg)
+{
+  (void) sock;
+  (void) events;
+  (void) arg;
+  dns_threaded_process_replies();
+}
+
+/** Start <b>n</b> resolver threads. Return 0 on success, -1 on failure. */
+static int
+start_threads(int n)
+{
+#ifdef _WIN32
+  (void) n;
+  log_warn(LD_EXIT, "Resolver threads are not supported on Windows.");
+  return -1;
+#else
+  int i;
+
+  if (alert_sockets_create(&reply_alert, 0) < 0) {
+    log_warn(LD_EXIT, "Unable to create a socket to wake up the main thread "
+             "with DNS answers.");
+    return -1;
+  }
+  reply_event = tor_event_new(tor_libevent_get_base(), reply_alert.read_fd,
+                              EV_READ|EV_PERSIST, reply_event_cb, NULL);
+  tor_assert(reply_event);
+  event_add(reply_event, NULL);
+  replies = smartlist_new();
+  tor_mutex_init_nonrecursive(&state_lock);
+  tor_cond_init(&state_cond);
+
+  threads = tor_calloc(n, sizeof(dns_resolver_thread_t *));
+  for (i = 0; i < n; ++i) {
+    dns_resolver_thread_t *thr = tor_malloc_zero(sizeof(*thr));
+    tor_mutex_init_nonrecursive(&thr->lock);
+    thr->incoming = smartlist_new();
+    thr->waiting = smartlist_new();
+    thr->inflight = smartlist_new();
+    if (alert_sockets_create(&thr->alert, 0) < 0) {
+      log_warn(LD_EXIT, "Unable to create a socket to wake up a resolver "
+               "thread.");
+      resolver_thread_free(thr);
+      break;
+    }
+    tor_mutex_acquire(&state_lock);
+    ++n_running_threads;
+    tor_mutex_release(&state_lock);
+    if (spawn_func(resolver_thread_main, thr) < 0) {
+      log_warn(LD_EXIT, "Unable to start a resolver thread.");
+      tor_mutex_acquire(&state_lock);
+      --n_running_threads;
+      tor_mutex_release(&state_lock);
+      resolver_thread_free(thr);
+      break;
+    }
+    threads[n_threads++] = thr;
+  }
+
+  if (n_threads == 0) {
+    dns_threaded_free_all();
+    return -1;
+  }
+  log_info(LD_EXIT, "Started %d resolver threads.", n_threads);
+  return 0;
+#endif /* defined(_WIN32) */
+}
+
+/** Start our resolver threads if they aren't running yet, and have them use
+ * the configuration <b>cfg</b>. Return 0 on success, or -1 if we can't send
+ * queries with this configuration. */
+int
+dns_threaded_configure(const dns_threaded_config_t *cfg)
+{
+  tor_assert(cfg);
+
+  if (cfg->n_threads <= 0 || cfg->max_inflight <= 0 ||
+      cfg->max_attempts <= 0 || cfg->timeout_msec <= 0 ||
+      cfg->n_nameservers <= 0 ||
+      cfg->n_nameservers > DNS_THREADED_MAX_NAMESERVERS)
+    return -1;
+
+  if (!threads) {
+    if (start_threads(cfg->n_threads) < 0)
+      return -1;
+  } else if (cfg->n_threads != n_threads) {
+    log_notice(LD_EXIT, "We keep running %d resolver threads; restart Tor "
+               "to use %d instead.", n_threads, cfg->n_threads);
+  }
+
+  tor_mutex_acquire(&state_lock);
+  memcpy(&config, cfg, sizeof(config));
+  ++config_generation;
+  tor_mutex_release(&state_lock);
+  /* Make sure every thread picks up the new configuration soon. */
+  for (int i = 0; i < n_threads; ++i)
+    threads[i]->alert.alert_fn(threads[i]->alert.write_fd);
+  return 0;
+}
+
+/** Implements dns_backend_t.launch for the resolver threads. */
+static int
+dns_threaded_launch(uint8_t query_type, const char *name,
+                    const tor_addr_t *ptr_address,
+                    dns_answer_fn_t cb, void *arg)
+{
+  uint8_t buf[DNS_MAX_QUERY_LEN];
+  const uint16_t qtype = query_type_to_qtype(query_type);
+  dns_resolver_thread_t *thr;
+  dns_threaded_query_t *q;
+  int randomize_case, was_empty;
+
+  (void) ptr_address;
+  if (!threads || !qtype ||
+      dns_threaded_encode_query(buf, sizeof(buf), 0, name, qtype) < 0)
+    return -1;
+
+  tor_mutex_acquire(&state_lock);
+  randomize_case = config.randomize_case;
+  tor_mutex_release(&state_lock);
+
+  q = tor_malloc_zero(sizeof(*q));
+  q->query_type = query_type;
+  q->name = tor_strdup(name);
+  if (strlen(q->name) && q->name[strlen(q->name)-1] == '.')
+    q->name[strlen(q->name)-1] = '\0';
+  if (randomize_case) {
+    size_t i, len = strlen(q->name);
+    uint8_t *bits = tor_malloc(len / 8 + 1);
+    crypto_rand((char *) bits, len / 8 + 1);
+    for (i = 0; i < len; ++i) {
+      if (TOR_ISALPHA(q->name[i]) && (bits[i / 8] & (1u << (i % 8))))
+        q->name[i] ^= 0x20;
+    }
+    tor_free(bits);
+    q->randomized_case = 1;
+  }
+  q->cb = cb;
+  q->arg = arg;
+  q->result = DNS_ERR_UNKNOWN;
+
+  thr = threads[next_thread];
+  next_thread = (next_thread + 1) % n_threads;
+  tor_mutex_acquire(&thr->lock);
+  was_empty = smartlist_len(thr->incoming) == 0;
+  smartlist_add(thr->incoming, q);
+  tor_mutex_release(&thr->lock);
+  if (was_empty)
+    thr->alert.alert_fn(thr->alert.write_fd);
+  return 0;
+}
+
+/** The resolver threads, as a dns_backend_t. */
+static const dns_backend_t threaded_backend = {
+  "resolver threads",
+  dns_threaded_launch,
+};
+
+/** Return the dns_backend_t that sends queries from our resolver threads. */
+const dns_backend_t *
+dns_threaded_get_backend(void)
+{
+  return &threaded_backend;
+}
+
+/** Hand every query that our resolver threads have finished to its
+ * callback. */
+void
+dns_threaded_process_replies(void)
+{
+  smartlist_t *done;
+
+  if (!replies)
+    return;
+
+  reply_alert.drain_fn(reply_alert.read_fd);
+  tor_mutex_acquire(&state_lock);
+  done = replies;
+  replies = smartlist_new();
+  tor_mutex_release(&state_lock);
+
+  SMARTLIST_FOREACH_BEGIN(done, dns_threaded_query_t *, q) {
+    void *addresses = NULL;
+    if (q->query_type == DNS_IPv4_A)
+      addresses = q->ipv4;
+    else if (q->query_type == DNS_IPv6_AAAA)
+      addresses = q->ipv6;
+    else if (q->query_type == DNS_PTR)
+      addresses = &q->hostname;
+    q->cb(q->result, (char) q->query_type, q->count, q->ttl, addresses,
+          q->arg);
+    dns_threaded_query_free(q);
+  } SMARTLIST_FOREACH_END(q);
+  smartlist_free(done);
+}
+
+/** Stop our resolver threads, answer all their queries with
+ * DNS_ERR_SHUTDOWN, and release all storage held by this module. */
+void
+dns_threaded_free_all(void)
+{
+  int i;
+
+  if (!replies)
+    return;
+
+  if (n_threads) {
+    tor_mutex_acquire(&state_lock);
+    shutting_down = 1;
+    tor_mutex_release(&state_lock);
+    for (i = 0; i < n_threads; ++i)
+      threads[i]->alert.alert_fn(threads[i]->alert.write_fd);
+    tor_mutex_acquire(&state_lock);
+    while (n_running_threads > 0)
+      tor_cond_wait(&state_cond, &state_lock, NULL);
+    tor_mutex_release(&state_lock);
+  }
+
+  dns_threaded_process_replies();
+
+  for (i = 0; i < n_threads; ++i)
+    resolver_thread_free(threads[i]);
+  tor_free(threads);
+  n_threads = next_thread = 0;
+
+  tor_event_free(reply_event);
+  alert_sockets_close(&reply_alert);
+  smartlist_free(replies);
+  tor_cond_uninit(&state_cond);
+  tor_mutex_uninit(&state_lock);
+  memset(&config, 0, sizeof(config));
+  shutting_down = 0;
+}
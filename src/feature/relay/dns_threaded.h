@@ -0,0 +1,97 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dns_threaded.h
+ * \brief Header file for dns_threaded.c.
+ **/
+
+#ifndef TOR_DNS_THREADED_H
+#define TOR_DNS_THREADED_H
+
+#include "feature/relay/dns.h"
+#include "lib/net/address.h"
+
+/** Most nameservers that the threaded backend sends queries to. */
+#define DNS_THREADED_MAX_NAMESERVERS 8
+
+/** How the threaded DNS backend should behave. */
+typedef struct dns_threaded_config_t {
+  /** How many resolver threads to run. */
+  int n_threads;
+  /** Most queries that each thread has in flight at once. */
+  int max_inflight;
+  /** How long we wait for an answer before we resend a query. */
+  int timeout_msec;
+  /** How many times we send a query before we give up on it. */
+  int max_attempts;
+  /** If true, use the 0x20 hack: randomize the case of the names we ask
+   * about, and only accept answers that echo it back exactly. */
+  int randomize_case;
+  /** The nameservers to use, tried in turn. */
+  int n_nameservers;
+  tor_addr_port_t nameservers[DNS_THREADED_MAX_NAMESERVERS];
+} dns_threaded_config_t;
+
+int dns_threaded_configure(const dns_threaded_config_t *cfg);
+const dns_backend_t *dns_threaded_get_backend(void);
+void dns_threaded_process_replies(void);
+void dns_threaded_free_all(void);
+
+#ifdef DNS_THREADED_PRIVATE
+
+/** Most addresses of each family that we keep from a single answer. */
+#define DNS_THREADED_MAX_ADDRS 8
+
+/** A DNS query that the threaded backend is working on. */
+typedef struct dns_threaded_query_t {
+  /** What we are asking for: DNS_IPv4_A, DNS_IPv6_AAAA or DNS_PTR. */
+  uint8_t query_type;
+  /** The name we ask about, without any trailing dot, and with its case
+   * randomized if randomized_case is set. */
+  char *name;
+  /** True iff we randomized the case of <b>name</b>. */
+  unsigned int randomized_case : 1;
+  /** Function to call with the answer, and its argument. */
+  dns_answer_fn_t cb;
+  void *arg;
+
+  /* Used by the resolver thread that owns the query. */
+  /** The DNS transaction ID of the query. */
+  uint16_t id;
+  /** How many times have we sent the query so far? */
+  int n_attempts;
+  /** Index of the nameserver we last sent the query to. */
+  int nameserver_idx;
+  /** When do we give up on the current attempt, in msec. */
+  uint64_t deadline_msec;
+
+  /* The answer. */
+  /** DNS_ERR_NONE, or one of the other DNS_ERR_* values. */
+  int result;
+  /** How many addresses (or hostnames) we got. */
+  int count;
+  /** The smallest TTL of the records we kept. */
+  int ttl;
+  /** The IPv4 addresses we got, in network order. */
+  uint32_t ipv4[DNS_THREADED_MAX_ADDRS];
+  /** The IPv6 addresses we got. */
+  struct in6_addr ipv6[DNS_THREADED_MAX_ADDRS];
+  /** The hostname we got for a PTR query. */
+  char *hostname;
+} dns_threaded_query_t;
+
+STATIC int dns_threaded_encode_query(uint8_t *out, size_t out_len,
+                                     uint16_t id, const char *name,
+                                     uint16_t qtype);
+STATIC int dns_threaded_read_name(const uint8_t *msg, size_t msg_len,
+                                  size_t *offset, char *out, size_t out_len);
+STATIC int dns_threaded_parse_reply(const uint8_t *msg, size_t msg_len,
+                                    dns_threaded_query_t *q);
+STATIC void dns_threaded_query_free_(dns_threaded_query_t *q);
+#define dns_threaded_query_free(q) \
+  FREE_AND_NULL(dns_threaded_query_t, dns_threaded_query_free_, (q))
+
+#endif /* defined(DNS_THREADED_PRIVATE) */
+
+#endif /* !defined(TOR_DNS_THREADED_H) */
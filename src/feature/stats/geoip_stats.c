@@ -34,7 +34,6 @@
 #include "app/config/config.h"
 #include "feature/control/control_events.h"
 #include "feature/client/dnsserv.h"
-#include "core/or/dos.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/nodelist/routerlist.h"
@@ -169,9 +168,6 @@ clientmap_entry_free_(clientmap_entry_t *ent)
   if (!ent)
     return;
 
-  /* This entry is about to be freed so pass it to the DoS subsystem to see if
-   * any actions can be taken about it. */
-  dos_geoip_entry_about_to_free(ent);
   geoip_decrement_client_history_cache_size(clientmap_entry_size(ent));
 
   tor_free(ent->transport_name);
@@ -233,12 +229,9 @@ geoip_note_client_seen(geoip_client_action_t action,
   clientmap_entry_t *ent;
 
   if (action == GEOIP_CLIENT_CONNECT) {
-    /* Only remember statistics if the DoS mitigation subsystem is enabled. If
-     * not, only if as entry guard or as bridge. */
-    if (!dos_enabled()) {
-      if (!options->EntryStatistics && !should_record_bridge_info(options)) {
-        return;
-      }
+    /* Only remember statistics as entry guard or as bridge. */
+    if (!options->EntryStatistics && !should_record_bridge_info(options)) {
+      return;
     }
   } else {
     /* Only gather directory-request statistics if configured, and
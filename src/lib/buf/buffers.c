@@ -27,6 +27,8 @@
 #include <stddef.h>
 #include "lib/buf/buffers.h"
 #include "lib/cc/torint.h"
+#include "lib/intmath/bits.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/ctime/di_ops.h"
@@ -68,6 +70,11 @@
  *
  * The major free Unix kernels have handled buffers like this since, like,
  * forever.
+ *
+ * A chunk can also "borrow" its data from memory that the buffer doesn't own,
+ * such as a memory-mapped file that we are sending to the network: see
+ * buf_add_borrowed().  We never write into a borrowed chunk, and we copy its
+ * data into an ordinary chunk if we ever need to rearrange it.
  */
 
 /* Chunk manipulation functions */
@@ -123,24 +130,121 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
+
+/** Every chunk should take up at least this many bytes. */
+#define MIN_CHUNK_ALLOC 256
+/** No chunk should take up more than this many bytes. */
+#define MAX_CHUNK_ALLOC 65536
+
+/** A freelist of unused chunks, all with the same allocation size. */
+typedef struct chunk_freelist_t {
+  /** Never keep more than this many chunks on the freelist. */
+  int high_water;
+  /** When trimming the freelist, never go below this many chunks. */
+  int low_water;
+  /** How many chunks are on the freelist now? */
+  int cur_length;
+  /** What's the smallest value of cur_length since the last time we trimmed
+   * this freelist? */
+  int lowest_length;
+  /** How many chunks of this size have we had to malloc? */
+  uint64_t n_alloc;
+  /** How many chunks of this size have we given back to the allocator? */
+  uint64_t n_free;
+  /** How many chunks of this size have we taken from the freelist? */
+  uint64_t n_hit;
+  /** First chunk on the freelist. */
+  chunk_t *head;
+} chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(hi,lo) { (hi), (lo), 0, 0, 0, 0, 0, NULL }
+/** One freelist for each allocation size that buf_preferred_chunk_size() can
+ * return, from MIN_CHUNK_ALLOC up to MAX_CHUNK_ALLOC.  Each size class can
+ * hold about a megabyte at most. */
+static chunk_freelist_t freelists[] = {
+  FL(1024, 64), /* 256 */
+  FL(1024, 32), /* 512 */
+  FL(512, 32),  /* 1024 */
+  FL(256, 16),  /* 2048 */
+  FL(256, 16),  /* 4096 */
+  FL(128, 8),   /* 8192 */
+  FL(64, 4),    /* 16384 */
+  FL(32, 2),    /* 32768 */
+  FL(16, 1),    /* 65536 */
+};
+#undef FL
+#define N_FREELISTS ARRAY_LENGTH(freelists)
+/** How many times have we allocated a chunk of a size that no freelist
+ * could help with? */
+static uint64_t n_freelist_miss = 0;
+/** Total size of all the chunks on all the freelists. */
+static size_t total_bytes_in_freelists = 0;
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist holds chunks of that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  if (alloc < MIN_CHUNK_ALLOC || alloc > MAX_CHUNK_ALLOC ||
+      (alloc & (alloc - 1)))
+    return NULL;
+  return &freelists[tor_log2(alloc) - tor_log2(MIN_CHUNK_ALLOC)];
+}
+
+/** Return the allocation size of the chunks on <b>freelist</b>. */
+static inline size_t
+freelist_alloc_size(const chunk_freelist_t *freelist)
+{
+  return ((size_t)MIN_CHUNK_ALLOC) << (freelist - freelists);
+}
+
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  chunk_freelist_t *freelist;
+  size_t alloc;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  if (chunk->release_fn)
+    chunk->release_fn(chunk->release_arg);
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->cur_length < freelist->high_water) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+    total_bytes_in_freelists += alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_free;
+    tor_free(chunk);
+  }
 }
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    if (--freelist->cur_length < freelist->lowest_length)
+      freelist->lowest_length = freelist->cur_length;
+    ++freelist->n_hit;
+    total_bytes_in_freelists -= alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_alloc;
+    else
+      ++n_freelist_miss;
+    ch = tor_malloc(alloc);
+  }
   ch->next = NULL;
   ch->datalen = 0;
 #ifdef DEBUG_CHUNK_ALLOC
@@ -149,10 +253,79 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
 
+/** Give back to the allocator the chunks on each freelist that nobody has
+ * needed since the last time we called this function, keeping at least the
+ * freelist's low-water mark.  If <b>free_all</b> is true, empty every
+ * freelist.  Return the number of bytes freed. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  size_t freed = 0;
+  unsigned i;
+  for (i = 0; i < N_FREELISTS; ++i) {
+    chunk_freelist_t *freelist = &freelists[i];
+    const size_t alloc = freelist_alloc_size(freelist);
+    int n_to_keep;
+    if (free_all) {
+      n_to_keep = 0;
+    } else {
+      n_to_keep = MAX(freelist->cur_length - freelist->lowest_length,
+                      freelist->low_water);
+    }
+    if (freelist->cur_length > n_to_keep) {
+      const int orig_length = freelist->cur_length;
+      chunk_t **chp = &freelist->head;
+      chunk_t *chunk;
+      int n;
+      for (n = 0; n < n_to_keep; ++n)
+        chp = &(*chp)->next;
+      chunk = *chp;
+      *chp = NULL;
+      while (chunk) {
+        chunk_t *next = chunk->next;
+        tor_free(chunk);
+        chunk = next;
+        ++freelist->n_free;
+        freed += alloc;
+      }
+      freelist->cur_length = n_to_keep;
+      log_debug(LD_MM, "Trimmed freelist for %d-byte chunks from %d to %d.",
+                (int)alloc, orig_length, n_to_keep);
+    }
+    freelist->lowest_length = freelist->cur_length;
+  }
+  tor_assert(total_bytes_in_freelists >= freed);
+  total_bytes_in_freelists -= freed;
+  return freed;
+}
+
+/** Log the sizes and hit rates of the chunk freelists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  unsigned i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; i < N_FREELISTS; ++i) {
+    const chunk_freelist_t *freelist = &freelists[i];
+    const size_t alloc = freelist_alloc_size(freelist);
+    tor_log(severity, LD_MM,
+            "%"PRIu64" bytes in %d %d-byte chunks [%"PRIu64" misses; "
+            "%"PRIu64" frees; %"PRIu64" hits]",
+            ((uint64_t)freelist->cur_length) * alloc,
+            freelist->cur_length, (int)alloc,
+            freelist->n_alloc, freelist->n_free, freelist->n_hit);
+  }
+  tor_log(severity, LD_MM, "%"PRIu64" allocations in non-freelist sizes",
+          n_freelist_miss);
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -176,11 +349,6 @@ chunk_grow(chunk_t *chunk, size_t sz)
   return chunk;
 }
 
-/** Every chunk should take up at least this many bytes. */
-#define MIN_CHUNK_ALLOC 256
-/** No chunk should take up more than this many bytes. */
-#define MAX_CHUNK_ALLOC 65536
-
 /** Return the allocation size we'd like to use to hold <b>target</b>
  * bytes. */
 size_t
@@ -196,6 +364,28 @@ buf_preferred_chunk_size(size_t target)
   return sz;
 }
 
+/** Replace the borrowed chunk at the head of <b>buf</b> with a new chunk
+ * holding a copy of its data, with room for at least <b>capacity</b>
+ * bytes. */
+static void
+buf_unborrow_head(buf_t *buf, size_t capacity)
+{
+  chunk_t *old = buf->head;
+  chunk_t *ch;
+  tor_assert(old->release_fn);
+  tor_assert(capacity >= old->datalen);
+
+  ch = chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+  memcpy(ch->mem, old->data, old->datalen);
+  ch->datalen = old->datalen;
+  ch->inserted_time = old->inserted_time;
+  ch->next = old->next;
+  if (buf->tail == old)
+    buf->tail = ch;
+  buf->head = ch;
+  buf_chunk_free_unchecked(old);
+}
+
 /** Collapse data from the first N chunks from <b>buf</b> into buf->head,
  * growing it as necessary, until buf->head has the first <b>bytes</b> bytes
  * of data from the buffer, or until buf->head has all the data in <b>buf</b>.
@@ -227,6 +417,11 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
+  if (buf->head->release_fn) {
+    /* We can't grow borrowed memory, so we copy it instead. */
+    buf_unborrow_head(buf, capacity);
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -433,16 +628,24 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
-  total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
-#ifdef DEBUG_CHUNK_ALLOC
-  newch->DBG_alloc = CHUNK_ALLOC_SIZE(in_chunk->memlen);
-#endif
-  newch->next = NULL;
+  if (in_chunk->release_fn) {
+    /* We can't borrow the memory a second time, so we copy it. */
+    chunk_t *ch =
+      chunk_new_with_alloc_size(buf_preferred_chunk_size(in_chunk->datalen));
+    memcpy(ch->mem, in_chunk->data, in_chunk->datalen);
+    ch->datalen = in_chunk->datalen;
+    ch->inserted_time = in_chunk->inserted_time;
+    return ch;
+  }
+  chunk_t *newch =
+    chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(in_chunk->memlen));
   if (in_chunk->data) {
     off_t offset = in_chunk->data - in_chunk->mem;
     newch->data = newch->mem + offset;
+    memcpy(newch->data, in_chunk->data, in_chunk->datalen);
   }
+  newch->datalen = in_chunk->datalen;
+  newch->inserted_time = in_chunk->inserted_time;
   return newch;
 }
 
@@ -510,12 +713,22 @@ buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now)
   }
 }
 
+/** Return the total number of bytes allocated for chunks that are in use
+ * by some buffer. */
 size_t
 buf_get_total_allocation(void)
 {
   return total_bytes_allocated_in_chunks;
 }
 
+/** Return the total number of bytes allocated for chunks that are waiting
+ * on the freelists. */
+size_t
+buf_get_freelist_allocation(void)
+{
+  return total_bytes_in_freelists;
+}
+
 /** Append <b>string_len</b> bytes from <b>string</b> to the end of
  * <b>buf</b>.
  *
@@ -553,6 +766,73 @@ buf_add(buf_t *buf, const char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** Borrowing fewer bytes than this isn't worth a chunk of its own: we copy
+ * them instead. */
+#define MIN_BORROW_LEN 1024
+
+/** Append <b>len</b> bytes from <b>data</b> to the end of <b>buf</b>,
+ * without copying them if we can avoid it.  The caller must keep
+ * <b>data</b> unchanged until <b>buf</b> calls
+ * <b>release_fn</b>(<b>release_arg</b>), which it does exactly once, when
+ * it no longer needs the data. (This may happen before this function
+ * returns.)
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_borrowed(buf_t *buf, const char *data, size_t len,
+                 buf_release_fn_t release_fn, void *release_arg)
+{
+  chunk_t *chunk;
+  tor_assert(release_fn);
+
+  if (len < MIN_BORROW_LEN) {
+    int r = buf_add(buf, data, len);
+    release_fn(release_arg);
+    return r;
+  }
+  check();
+
+  if (BUG(buf->datalen >= INT_MAX) || BUG(buf->datalen >= INT_MAX - len)) {
+    release_fn(release_arg);
+    return -1;
+  }
+
+  if (buf->tail && buf->tail->datalen == 0) {
+    /* Every chunk but the tail must hold some data, so we can't leave an
+     * empty tail in front of the new chunk. */
+    chunk_t *prev = NULL;
+    if (buf->head != buf->tail) {
+      for (prev = buf->head; prev->next != buf->tail; prev = prev->next)
+        ;
+      prev->next = NULL;
+    } else {
+      buf->head = NULL;
+    }
+    buf_chunk_free_unchecked(buf->tail);
+    buf->tail = prev;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *) data;
+  chunk->datalen = len;
+  chunk->release_fn = release_fn;
+  chunk->release_arg = release_arg;
+  chunk->inserted_time = monotime_coarse_get_stamp();
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += len;
+
+  check();
+  tor_assert(buf->datalen < INT_MAX);
+  return (int)buf->datalen;
+}
+
 /** Add a nul-terminated <b>string</b> to <b>buf</b>, not including the
  * terminating NUL. */
 void
@@ -910,8 +1190,16 @@ buf_assert_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
-      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->datalen < INT_MAX);
+      if (ch->release_fn) {
+        /* Borrowed chunks have no memory of their own to check. */
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->data);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
+      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
       if (ch->data == &ch->mem[0]+ch->memlen) {
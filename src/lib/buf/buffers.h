@@ -21,6 +21,10 @@
 
 typedef struct buf_t buf_t;
 
+/** A function to call when a buffer no longer needs memory that it borrowed
+ * with buf_add_borrowed(). */
+typedef void (*buf_release_fn_t)(void *arg);
+
 buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
 size_t buf_get_default_chunk_size(const buf_t *buf);
@@ -35,8 +39,13 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+size_t buf_get_freelist_allocation(void);
+size_t buf_shrink_freelists(int free_all);
+void buf_dump_freelist_sizes(int severity);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
+int buf_add_borrowed(buf_t *buf, const char *data, size_t len,
+                     buf_release_fn_t release_fn, void *release_arg);
 void buf_add_string(buf_t *buf, const char *string);
 void buf_add_printf(buf_t *buf, const char *format, ...)
   CHECK_PRINTF(2, 3);
@@ -77,7 +86,13 @@ typedef struct chunk_t {
 #ifdef DEBUG_CHUNK_ALLOC
   size_t DBG_alloc;
 #endif
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in borrowed memory if <b>release_fn</b> is set. */
+  /** If this chunk's data is borrowed (see buf_add_borrowed()), a function
+   * to call with <b>release_arg</b> once we are done with it.  A borrowed
+   * chunk has no storage of its own: its memlen is 0. */
+  buf_release_fn_t release_fn;
+  void *release_arg; /**< Argument for <b>release_fn</b>. */
   uint32_t inserted_time; /**< Timestamp when this chunk was inserted. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
@@ -106,6 +121,8 @@ chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->release_fn)
+    return 0; /* We can't write into borrowed memory. */
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
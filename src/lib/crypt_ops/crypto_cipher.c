@@ -19,6 +19,7 @@
 #include "lib/log/util_bug.h"
 #include "lib/cc/torint.h"
 #include "lib/crypt_ops/aes.h"
+#include "lib/intmath/cmp.h"
 
 #include <string.h>
 
@@ -128,6 +129,56 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   aes_crypt_inplace(env, buf, len);
 }
 
+/** How much keystream does crypto_cipher_crypt_inplace_multi() generate with
+ * each call to the underlying AES implementation? */
+#define CIPHER_MULTI_KEYSTREAM_LEN 4096
+
+/** Encrypt <b>n_bufs</b> buffers of <b>len</b> bytes each, in place, using
+ * the cipher in <b>env</b>.  The result is the same as calling
+ * crypto_cipher_crypt_inplace() on <b>bufs</b>[0], <b>bufs</b>[1], and so
+ * on, in order; but we generate the keystream for all of them together, so
+ * that the AES implementation can pipeline across buffer boundaries.
+ * Does not check for failure.
+ */
+void
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char **bufs,
+                                  size_t n_bufs, size_t len)
+{
+  uint8_t keystream[CIPHER_MULTI_KEYSTREAM_LEN];
+  size_t buf_idx = 0, buf_pos = 0;
+  size_t remaining;
+
+  tor_assert(len < SIZE_T_CEILING);
+  tor_assert(len == 0 || n_bufs < SIZE_T_CEILING / len);
+
+  remaining = n_bufs * len;
+  while (remaining) {
+    const size_t ks_len = MIN(remaining, sizeof(keystream));
+    size_t ks_pos = 0;
+
+    /* In counter mode, encrypting zeros gives us the keystream itself. */
+    memset(keystream, 0, ks_len);
+    aes_crypt_inplace(env, (char *)keystream, ks_len);
+
+    while (ks_pos < ks_len) {
+      const size_t n = MIN(len - buf_pos, ks_len - ks_pos);
+      uint8_t *b = (uint8_t *)bufs[buf_idx] + buf_pos;
+      size_t i;
+      for (i = 0; i < n; ++i)
+        b[i] ^= keystream[ks_pos + i];
+      ks_pos += n;
+      buf_pos += n;
+      if (buf_pos == len) {
+        ++buf_idx;
+        buf_pos = 0;
+      }
+    }
+    remaining -= ks_len;
+  }
+
+  memwipe(keystream, 0, sizeof(keystream));
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
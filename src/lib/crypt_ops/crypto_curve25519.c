@@ -20,6 +20,7 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#include "lib/cc/ctassert.h"
 #include "lib/ctime/di_ops.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_digest.h"
@@ -171,6 +172,26 @@ curve25519_secret_key_generate(curve25519_secret_key_t *key_out,
   return 0;
 }
 
+/* curve25519_secret_keys_generate() fills an array of these all at once. */
+CTASSERT(sizeof(curve25519_secret_key_t) == CURVE25519_SECKEY_LEN);
+
+/** Generate <b>n_keys</b> new short-lived secret keys in <b>keys_out</b>,
+ * as curve25519_secret_key_generate() would with extra_strong unset, but
+ * with a single call to the RNG. */
+void
+curve25519_secret_keys_generate(curve25519_secret_key_t *keys_out,
+                                size_t n_keys)
+{
+  size_t i;
+  crypto_rand((char*)keys_out, n_keys * CURVE25519_SECKEY_LEN);
+
+  for (i = 0; i < n_keys; ++i) {
+    keys_out[i].secret_key[0] &= 248;
+    keys_out[i].secret_key[31] &= 127;
+    keys_out[i].secret_key[31] |= 64;
+  }
+}
+
 /**
  * Given a secret key in <b>seckey</b>, create the corresponding public
  * key in <b>key_out</b>.
@@ -48,6 +48,8 @@ int curve25519_public_key_is_ok(const curve25519_public_key_t *);
 
 int curve25519_secret_key_generate(curve25519_secret_key_t *key_out,
                                    int extra_strong);
+void curve25519_secret_keys_generate(curve25519_secret_key_t *keys_out,
+                                     size_t n_keys);
 void curve25519_public_key_generate(curve25519_public_key_t *key_out,
                                     const curve25519_secret_key_t *seckey);
 int curve25519_keypair_generate(curve25519_keypair_t *keypair_out,
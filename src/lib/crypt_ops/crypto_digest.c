@@ -39,6 +39,17 @@ crypto_common_digests(common_digests_t *ds_out, const char *m, size_t len)
   return 0;
 }
 
+/** Wipe the state that crypto_digest_checkpoint() saved in
+ * <b>checkpoint</b>.  This is cheaper than wiping the whole structure,
+ * since most digests only use a small part of it. */
+void
+crypto_digest_checkpoint_clear(crypto_digest_checkpoint_t *checkpoint)
+{
+  tor_assert(checkpoint->bytes_used <= sizeof(checkpoint->mem));
+  memwipe(checkpoint->mem, 0, checkpoint->bytes_used);
+  checkpoint->bytes_used = 0;
+}
+
 /** Return the name of an algorithm, as used in directory documents. */
 const char *
 crypto_digest_algorithm_get_name(digest_algorithm_t alg)
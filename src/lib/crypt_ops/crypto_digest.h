@@ -52,9 +52,8 @@ typedef enum {
 /** Structure used to temporarily save the a digest object. Only implemented
  * for SHA1 digest for now. */
 typedef struct crypto_digest_checkpoint_t {
-#ifdef ENABLE_NSS
+  /** How many bytes of <b>mem</b> hold the saved state? */
   unsigned int bytes_used;
-#endif
   uint8_t mem[DIGEST_CHECKPOINT_BYTES];
 } crypto_digest_checkpoint_t;
 
@@ -108,6 +107,7 @@ void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
                               const crypto_digest_t *digest);
 void crypto_digest_restore(crypto_digest_t *digest,
                            const crypto_digest_checkpoint_t *checkpoint);
+void crypto_digest_checkpoint_clear(crypto_digest_checkpoint_t *checkpoint);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
 void crypto_hmac_sha256(char *hmac_out,
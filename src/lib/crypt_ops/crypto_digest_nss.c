@@ -418,6 +418,7 @@ crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
     return;
   }
   memcpy(checkpoint->mem, digest, bytes);
+  checkpoint->bytes_used = (unsigned int) bytes;
 }
 
 /** Restore the state of  <b>digest</b> from <b>checkpoint</b>.
@@ -426,6 +426,7 @@ crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
   const size_t bytes = crypto_digest_alloc_bytes(digest->algorithm);
   tor_assert(bytes <= sizeof(checkpoint->mem));
   memcpy(checkpoint->mem, digest, bytes);
+  checkpoint->bytes_used = (unsigned int) bytes;
 }
 
 /** Restore the state of  <b>digest</b> from <b>checkpoint</b>.
@@ -363,6 +363,10 @@ ed25519_checksig_prefixed(const ed25519_signature_t *signature,
   return retval;
 }
 
+/** The smallest number of signatures for which ed25519-donna's batch
+ * verifier does anything but check them one at a time. */
+#define ED25519_BATCH_MIN 4
+
 /** Validate every signature among those in <b>checkable</b>, which contains
  * exactly <b>n_checkable</b> elements.  If <b>okay_out</b> is non-NULL, set
  * the i'th element of <b>okay_out</b> to 1 if the i'th element of
@@ -378,9 +382,9 @@ ed25519_checksig_batch,(int *okay_out,
   int i, res;
   const ed25519_impl_t *impl = get_ed_impl();
 
-  if (impl->open_batch == NULL) {
-    /* No batch verification implementation available, fake it by checking the
-     * each signature individually.
+  if (impl->open_batch == NULL || n_checkable < ED25519_BATCH_MIN) {
+    /* No batch verification implementation available, or too few signatures
+     * for it to help: fake it by checking the each signature individually.
      */
     res = 0;
     for (i = 0; i < n_checkable; ++i) {
@@ -392,12 +396,7 @@ ed25519_checksig_batch,(int *okay_out,
         okay_out[i] = (r == 0);
     }
   } else {
-    /* ed25519-donna style batch verification available.
-     *
-     * Theoretically, this should only be called if n_checkable >= 3, since
-     * that's the threshold where the batch verification actually kicks in,
-     * but the only difference is a few mallocs/frees.
-     */
+    /* ed25519-donna style batch verification available. */
     const uint8_t **ms;
     size_t *lens;
     const uint8_t **pks;
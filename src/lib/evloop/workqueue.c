@@ -9,13 +9,29 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, each with its own queues of pending work, and a reply queue.
+ * Every piece of work is a workqueue_entry_t, containing data to process and
+ * a function to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * New work goes onto the queue of a randomly chosen worker.  Each worker
+ * takes work from its own queues first; when they are empty, it steals work
+ * from the other workers.  Since every queue has its own lock, the workers
+ * and the main thread seldom have to wait for one another.  The pool keeps
+ * an atomic count of pending work at each priority, so that a worker can
+ * tell which priority to look for without visiting every queue.
+ *
+ * Idle workers wait on a condition variable.  When work arrives, we wake
+ * one of them, unless a wakeup is already on its way; a worker that wakes up
+ * to find more work waiting wakes up the next one.  The workers inform the
+ * main process of completed work by using an alert_sockets_t object, as
+ * implemented in net/alertsock.c.
+ * They only need to do so when the reply queue goes from empty to nonempty:
+ * the main thread handles every reply on the queue each time it wakes up.
+ *
+ * Where we have working C11 atomics, the reply queue is a lock-free stack
+ * onto which the workers push their replies, and which the main thread
+ * takes over all at once.  Otherwise (or if REPLYQUEUE_LOCKED is given),
+ * it's a list protected by a mutex.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -38,6 +54,7 @@
 
 #include "ext/tor_queue.h"
 #include <event2/event.h>
+#include <stdbool.h>
 #include <string.h>
 
 #define WORKQUEUE_PRIORITY_FIRST WQ_PRI_HIGH
@@ -53,15 +70,24 @@ struct threadpool_s {
   struct workerthread_s **threads;
 
   /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
+   * gets signaled when new work arrives while some thread is idle. */
   tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Number of entries pending on the threads' queues with priority
+   * <b>p</b>.  This may briefly count an entry that is not yet on any
+   * queue, but never misses one that is. */
+  atomic_counter_t n_pending[WORKQUEUE_N_PRIORITIES];
+  /** Number of threads that are waiting on condition, or about to.  Only
+   * changed while holding lock. */
+  atomic_counter_t n_idle;
+  /** Nonzero iff we have signaled condition, and no thread has woken up
+   * since.  While this is set, a thread is on its way, and will wake up
+   * another if there is still work for it. */
+  atomic_counter_t waking;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  Only
+   * changed while holding lock. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -73,9 +99,10 @@ struct threadpool_s {
   struct event *reply_event;
   void (*reply_cb)(threadpool_t *);
 
-  /** Number of elements in threads. */
+  /** Number of elements in threads.  Does not change once the threads
+   * are running. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect the update fields and the condition variable. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -96,11 +123,18 @@ struct workqueue_entry_s {
   /** The next workqueue_entry_t that's pending on the same thread or
    * reply queue. */
   TOR_TAILQ_ENTRY(workqueue_entry_s) next_work;
+  /** The next workqueue_entry_t on a lock-free reply queue. */
+  struct workqueue_entry_s *next_reply;
   /** The threadpool to which this workqueue_entry_t was assigned. This field
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The worker thread on whose queue this entry was placed.  The entry
+   * stays on that queue until some thread (not necessarily this one) takes
+   * it, or until it is cancelled. */
+  struct workerthread_s *on_thread;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by on_thread->lock. */
   uint8_t pending;
   /** Priority of this entry. */
   workqueue_priority_bitfield_t priority : WORKQUEUE_PRIORITY_BITS;
@@ -118,6 +152,14 @@ struct replyqueue_s {
   /** Doubly-linked list of answers that the reply queue needs to handle. */
   TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
 
+#ifdef HAVE_WORKING_STDATOMIC
+  /** True iff we use lockfree_answers instead of lock and answers. */
+  bool lockfree;
+  /** Stack of answers that the reply queue needs to handle, most recent
+   * first, linked by their next_reply fields. */
+  _Atomic(workqueue_entry_t *) lockfree_answers;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
 };
@@ -133,8 +175,14 @@ typedef struct workerthread_s {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
+  /** Mutex to protect the work field, and the pending fields of the entries
+   * on it. */
+  tor_mutex_t lock;
+  /** Queues of pending work placed on this thread. The queue with priority
+   * <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
 } workerthread_t;
@@ -192,49 +240,76 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    ent->pending = 0;
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
+    atomic_counter_sub(&ent->on_pool->n_pending[prio], 1);
     workqueue_entry_free(ent);
   }
   return result;
 }
 
-/**DOCDOC
+/** Remove and return the oldest entry with priority <b>prio</b> from the
+ * queues of <b>victim</b>, marking it as non-pending.  Return NULL if
+ * there is none. */
+static workqueue_entry_t *
+worker_thread_take_work(workerthread_t *victim, workqueue_priority_t prio)
+{
+  workqueue_entry_t *work;
+  tor_mutex_acquire(&victim->lock);
+  work = TOR_TAILQ_FIRST(&victim->work[prio]);
+  if (work) {
+    TOR_TAILQ_REMOVE(&victim->work[prio], work, next_work);
+    work->pending = 0;
+  }
+  tor_mutex_release(&victim->lock);
+  return work;
+}
 
-   must hold lock */
-static int
-worker_thread_has_work(workerthread_t *thread)
+/** Remove and return the oldest entry with priority <b>prio</b> from the
+ * queues of any thread in <b>thread</b>'s pool, starting with
+ * <b>thread</b> itself.  Return NULL if there is none. */
+static workqueue_entry_t *
+worker_thread_steal_work(workerthread_t *thread, workqueue_priority_t prio)
 {
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work = NULL;
+  int i;
+  for (i = 0; i < pool->n_threads && !work; ++i) {
+    workerthread_t *victim =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    work = worker_thread_take_work(victim, prio);
   }
-  return thread->generation != thread->in_pool->generation;
+  if (work)
+    atomic_counter_sub(&pool->n_pending[prio], 1);
+  return work;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Extract the next workqueue_entry_t for <b>thread</b>, removing it from
+ * the queue it was on and marking it as non-pending.  We look at our own
+ * queue first, then steal from the other threads in the pool.  Return NULL
+ * if we found nothing to do.
  *
- * The caller must hold the lock. */
+ * The caller may hold the pool's lock, but no thread's lock. */
 static workqueue_entry_t *
 worker_thread_extract_next_work(workerthread_t *thread)
 {
   threadpool_t *pool = thread->in_pool;
-  work_tailq_t *queue = NULL, *this_queue;
-  unsigned i;
+  workqueue_entry_t *work = NULL;
+  int prio = -1;
+  int i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
-    if (!TOR_TAILQ_EMPTY(this_queue)) {
-      queue = this_queue;
+    if (atomic_counter_get(&pool->n_pending[i])) {
+      prio = i;
       if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
                                      thread->lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
@@ -246,15 +321,55 @@ worker_thread_extract_next_work(workerthread_t *thread)
     }
   }
 
-  if (queue == NULL)
+  if (prio < 0)
     return NULL;
 
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
-  TOR_TAILQ_REMOVE(queue, work, next_work);
-  work->pending = 0;
+  work = worker_thread_steal_work(thread, prio);
+
+  /* The count for prio may have included an entry that was about to be
+   * added, or that somebody else took first.  Look for anything else. */
+  for (i = WORKQUEUE_PRIORITY_FIRST;
+       i <= WORKQUEUE_PRIORITY_LAST && !work; ++i) {
+    if (i != prio && atomic_counter_get(&pool->n_pending[i]))
+      work = worker_thread_steal_work(thread, i);
+  }
   return work;
 }
 
+/** If any thread in <b>pool</b> is idle, and we aren't already waking one
+ * up, wake one up. */
+static void
+threadpool_wake_idle_thread(threadpool_t *pool)
+{
+  if (!atomic_counter_get(&pool->n_idle))
+    return;
+  if (atomic_counter_exchange(&pool->waking, 1))
+    return;
+  tor_mutex_acquire(&pool->lock);
+  /* Every thread that counts as idle is now waiting on the condition. */
+  if (atomic_counter_get(&pool->n_idle))
+    tor_cond_signal_one(&pool->condition);
+  else
+    atomic_counter_exchange(&pool->waking, 0);
+  tor_mutex_release(&pool->lock);
+}
+
+/** Run any update that <b>thread</b> hasn't run yet.  Return true iff the
+ * thread should keep running. */
+static int
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  tor_mutex_acquire(&pool->lock);
+  void *arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  workqueue_reply_t (*update_fn)(void*,void*) = pool->update_fn;
+  thread->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg) == WQ_RPL_REPLY;
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -265,36 +380,49 @@ worker_thread_main(void *thread_)
   threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
+  int woke_up = 0;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
+    if (thread->generation != atomic_counter_get(&pool->generation)) {
+      if (!worker_thread_run_update(thread))
+        return;
+      continue;
+    }
+
+    work = worker_thread_extract_next_work(thread);
+    if (!work) {
+      /* TODO: support an idle-function */
 
-        tor_mutex_acquire(&pool->lock);
-        continue;
+      /* Okay. Now, wait till somebody has work for us.  We say that we're
+       * idle before we look for work one last time: anybody who adds work
+       * after we've looked will see that we're idle, and will signal us
+       * once we're waiting, since they need the lock to do so. */
+      tor_mutex_acquire(&pool->lock);
+      atomic_counter_add(&pool->n_idle, 1);
+      if (thread->generation == atomic_counter_get(&pool->generation) &&
+          !(work = worker_thread_extract_next_work(thread))) {
+        if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+          log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+        }
+        atomic_counter_exchange(&pool->waking, 0);
+        woke_up = 1;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
+      atomic_counter_sub(&pool->n_idle, 1);
       tor_mutex_release(&pool->lock);
+    }
+
+    if (work) {
+      if (woke_up) {
+        /* Whoever woke us only woke one thread; if there's more work,
+         * pass the wakeup along. */
+        woke_up = 0;
+        if (atomic_counter_get(&pool->n_pending[WQ_PRI_HIGH]) ||
+            atomic_counter_get(&pool->n_pending[WQ_PRI_MED]) ||
+            atomic_counter_get(&pool->n_pending[WQ_PRI_LOW]))
+          threadpool_wake_idle_thread(pool);
+      }
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
+      /* We run the work function without holding any lock. */
       result = work->fn(thread->state, work->arg);
 
       /* Queue the reply for the main thread. */
@@ -304,16 +432,6 @@ worker_thread_main(void *thread_)
       if (result != WQ_RPL_REPLY) {
         return;
       }
-      tor_mutex_acquire(&pool->lock);
-    }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
-
-    /* TODO: support an idle-function */
-
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
     }
   }
 }
@@ -324,10 +442,25 @@ static void
 queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
   int was_empty;
-  tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
-  tor_mutex_release(&queue->lock);
+#ifdef HAVE_WORKING_STDATOMIC
+  if (queue->lockfree) {
+    workqueue_entry_t *head =
+      atomic_load_explicit(&queue->lockfree_answers, memory_order_relaxed);
+    do {
+      work->next_reply = head;
+    } while (!atomic_compare_exchange_weak_explicit(&queue->lockfree_answers,
+                                                    &head, work,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    was_empty = (head == NULL);
+  } else
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+  {
+    tor_mutex_acquire(&queue->lock);
+    was_empty = TOR_TAILQ_EMPTY(&queue->answers);
+    TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+    tor_mutex_release(&queue->lock);
+  }
 
   if (was_empty) {
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
@@ -336,25 +469,22 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  Don't start it yet. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    tor_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
+  thr->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_init_nonrecursive(&thr->lock);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
   }
 
   return thr;
@@ -393,17 +523,23 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread = pool->threads[
+         crypto_fast_rng_get_uint(get_thread_fast_rng(), pool->n_threads)];
   ent->on_pool = pool;
-  ent->pending = 1;
+  ent->on_thread = thread;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
+  /* Count the entry before we add it, so that no thread can go to sleep
+   * after it has been added but before it has been counted. */
+  atomic_counter_add(&pool->n_pending[prio], 1);
 
-  tor_cond_signal_one(&pool->condition);
+  tor_mutex_acquire(&thread->lock);
+  ent->pending = 1;
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  tor_mutex_release(&thread->lock);
 
-  tor_mutex_release(&pool->lock);
+  /* Any thread that goes idle after this will see our work first. */
+  threadpool_wake_idle_thread(pool);
 
   return ent;
 }
@@ -461,7 +597,7 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
+  atomic_counter_add(&pool->generation, 1);
 
   tor_cond_signal_all(&pool->condition);
 
@@ -489,7 +625,8 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Create and launch <b>n</b> threads for <b>pool</b>, which must not have
+ * any yet. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
@@ -498,11 +635,16 @@ threadpool_start_threads(threadpool_t *pool, int n)
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
+  /* Every thread can steal from every other thread, so we can't change the
+   * set of threads once any of them is running. */
+  if (BUG(pool->n_threads))
+    return -1; // LCOV_EXCL_LINE
+  if (n == 0)
+    n = 1;
+
   tor_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
@@ -513,17 +655,19 @@ threadpool_start_threads(threadpool_t *pool, int n)
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = pool->n_threads;
+    pool->threads[pool->n_threads++] = thr;
+  }
 
-    if (!thr) {
+  for (int i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       tor_mutex_release(&pool->lock);
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
   tor_mutex_release(&pool->lock);
 
@@ -550,8 +694,11 @@ threadpool_new(int n_threads,
   tor_cond_init(&pool->condition);
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
+    atomic_counter_init(&pool->n_pending[i]);
   }
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->waking);
+  atomic_counter_init(&pool->generation);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -581,14 +728,22 @@ threadpool_get_replyqueue(threadpool_t *tp)
 /** Allocate a new reply queue.  Reply queues are used to pass results from
  * worker threads to the main thread.  Since the main thread is running an
  * IO-centric event loop, it needs to get woken up with means other than a
- * condition variable. */
+ * condition variable.
+ *
+ * <b>flags</b> is a combination of ASOCKS_* flags, to choose how we wake up
+ * the main thread, and REPLYQUEUE_LOCKED, to use a mutex-protected queue
+ * even if we could use a lock-free one. */
 replyqueue_t *
-replyqueue_new(uint32_t alertsocks_flags)
+replyqueue_new(uint32_t flags)
 {
   replyqueue_t *rq;
 
   rq = tor_malloc_zero(sizeof(replyqueue_t));
-  if (alert_sockets_create(&rq->alert, alertsocks_flags) < 0) {
+#ifdef HAVE_WORKING_STDATOMIC
+  rq->lockfree = !(flags & REPLYQUEUE_LOCKED);
+  atomic_init(&rq->lockfree_answers, NULL);
+#endif
+  if (alert_sockets_create(&rq->alert, flags & ~REPLYQUEUE_LOCKED) < 0) {
     //LCOV_EXCL_START
     tor_free(rq);
     return NULL;
@@ -638,6 +793,38 @@ threadpool_register_reply_event(threadpool_t *tp,
   return event_add(tp->reply_event, NULL);
 }
 
+#ifdef HAVE_WORKING_STDATOMIC
+/** Helper for replyqueue_process(): handle every reply on the lock-free
+ * reply queue <b>queue</b>, oldest first. */
+static void
+replyqueue_process_lockfree(replyqueue_t *queue)
+{
+  workqueue_entry_t *work;
+  /* Take over the whole stack at once.  Any worker that pushes a reply
+   * after this will find the queue empty, and wake us up again. */
+  while ((work = atomic_exchange_explicit(&queue->lockfree_answers, NULL,
+                                          memory_order_acquire))) {
+    /* The stack is newest-first; reverse it so that we handle replies in
+     * the order that they arrived. */
+    workqueue_entry_t *oldest_first = NULL;
+    while (work) {
+      workqueue_entry_t *next = work->next_reply;
+      work->next_reply = oldest_first;
+      oldest_first = work;
+      work = next;
+    }
+    while (oldest_first) {
+      work = oldest_first;
+      oldest_first = work->next_reply;
+      work->on_pool = NULL;
+
+      work->reply_fn(work->arg);
+      workqueue_entry_free(work);
+    }
+  }
+}
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
+
 /**
  * Process all pending replies on a reply queue. The main thread should call
  * this function every time the socket returned by replyqueue_get_socket() is
@@ -656,6 +843,13 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+#ifdef HAVE_WORKING_STDATOMIC
+  if (queue->lockfree) {
+    replyqueue_process_lockfree(queue);
+    return;
+  }
+#endif
+
   tor_mutex_acquire(&queue->lock);
   while (!TOR_TAILQ_EMPTY(&queue->answers)) {
     /* lock must be held at this point.*/
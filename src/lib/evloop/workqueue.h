@@ -60,7 +60,12 @@ threadpool_t *threadpool_new(int n_threads,
                              void *arg);
 replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
 
-replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
+/** Flag for replyqueue_new(): protect the reply queue with a mutex, even if
+ * we could make it lock-free.  Chosen so as not to overlap with the ASOCKS_*
+ * flags. */
+#define REPLYQUEUE_LOCKED (1u<<16)
+
+replyqueue_t *replyqueue_new(uint32_t flags);
 void replyqueue_process(replyqueue_t *queue);
 
 int threadpool_register_reply_event(threadpool_t *tp,
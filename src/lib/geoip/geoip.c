@@ -22,6 +22,13 @@
  * function.  See the scripts and the README file in src/config for more
  * information about how those files are generated.
  *
+ * Once a file is loaded, we keep its table in a compact binary form (a
+ * geoip_db_t) that needs no pointers: an index on the first 16 bits of an
+ * address into a packed, sorted array of ranges.  geoip_load_file() can also
+ * read that form straight from a binary GeoIP file, as written by the
+ * tor-geoip-compile tool; then the table is mapped into memory rather than
+ * parsed, and is shared by every process that maps the same file.
+ *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
  * for each country.
@@ -29,6 +36,7 @@
 
 #define GEOIP_PRIVATE
 #include "lib/geoip/geoip.h"
+#include "lib/arch/bytes.h"
 #include "lib/container/map.h"
 #include "lib/container/order.h"
 #include "lib/container/smartlist.h"
@@ -36,6 +44,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -74,6 +83,61 @@ static strmap_t *country_idxplus1_by_lc_code = NULL;
  * by their respective ip_low. */
 static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
 
+/* A binary GeoIP file holds the table for one address family. All its
+ * integers are in network order, and all addresses are in network order too,
+ * so that the first two bytes of an address are its first 16 bits. It is
+ * made of:
+ *
+ *   A header of GEOIP_DB_HEADER_LEN bytes:
+ *     GEOIP_DB_MAGIC (8 bytes), the format version (u32), the address family
+ *     (u32: 4 or 6), the number of country codes (u32), the number of ranges
+ *     (u32), the SHA1 digest of the text file that the table was made from
+ *     (20 bytes), and 4 bytes of zeros.
+ *   The country codes, 2 bytes each, padded with zeros to a multiple of 4
+ *     bytes.
+ *   The index, GEOIP_DB_INDEX_LEN u32s: for every value of the first 16 bits
+ *     of an address, the position of the first range whose highest address
+ *     starts with those bits or higher ones; and then the number of ranges.
+ *   The ranges, sorted and disjoint: for each one, its lowest address and its
+ *     highest address.
+ *   The country of each range, as a u16 position in the country codes.
+ *
+ * Every part starts at a multiple of 4 bytes, so that we can read the table
+ * in place.
+ */
+/** Size of the header of a binary GeoIP file. */
+#define GEOIP_DB_HEADER_LEN 48
+/** Version of the binary GeoIP format that we read and write. */
+#define GEOIP_DB_VERSION 1
+/** Number of entries in the index of a binary GeoIP table. */
+#define GEOIP_DB_INDEX_LEN ((1<<16) + 1)
+
+/** A compact, read-only GeoIP table for one address family, in the binary
+ * GeoIP format. */
+typedef struct geoip_db_t {
+  /** The file that we mapped the table from, if any. */
+  tor_mmap_t *map;
+  /** The table, if we built it in memory instead. */
+  char *body;
+  /** The whole table, and its length. */
+  const char *data;
+  size_t len;
+  /** Either AF_INET or AF_INET6. */
+  sa_family_t family;
+  /** Pointers to the index, the ranges, and the countries of the ranges,
+   * inside <b>data</b>. */
+  const uint32_t *index;
+  const uint8_t *ranges;
+  const uint16_t *range_countries;
+  uint32_t n_ranges;
+  /** For every country code of the table, its index in geoip_countries. */
+  country_t *countries;
+  uint32_t n_countries;
+} geoip_db_t;
+
+/** The tables for the GeoIP files that we have loaded, if any. */
+static geoip_db_t *geoip_ipv4_db = NULL, *geoip_ipv6_db = NULL;
+
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
 static char geoip6_digest[DIGEST_LEN];
@@ -105,20 +169,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it if we haven't seen it yet. */
+static intptr_t
+geoip_intern_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -135,6 +193,23 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_intern_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -296,6 +371,315 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Return the number of bytes that each range takes in a binary GeoIP table
+ * for <b>family</b>. */
+static inline size_t
+geoip_db_range_len(sa_family_t family)
+{
+  return family == AF_INET ? 2*4 : 2*sizeof(struct in6_addr);
+}
+
+/** Return the number of bytes that a binary GeoIP table for <b>family</b>
+ * takes if it has <b>n_countries</b> country codes and <b>n_ranges</b>
+ * ranges. */
+static uint64_t
+geoip_db_expected_len(sa_family_t family, uint32_t n_countries,
+                      uint32_t n_ranges)
+{
+  return GEOIP_DB_HEADER_LEN
+    + ((2 * (uint64_t)n_countries + 3) & ~(uint64_t)3)
+    + 4 * (uint64_t)GEOIP_DB_INDEX_LEN
+    + (geoip_db_range_len(family) + 2) * (uint64_t)n_ranges;
+}
+
+/** Return the first 16 bits of the address at <b>addr</b>, which is in
+ * network order. */
+static inline uint32_t
+geoip_db_prefix(const uint8_t *addr)
+{
+  return ((uint32_t)addr[0] << 8) | addr[1];
+}
+
+/** Release all storage held by <b>db</b>. */
+static void
+geoip_db_free_(geoip_db_t *db)
+{
+  if (!db)
+    return;
+  tor_munmap_file(db->map);
+  tor_free(db->body);
+  tor_free(db->countries);
+  tor_free(db);
+}
+#define geoip_db_free(db) FREE_AND_NULL(geoip_db_t, geoip_db_free_, (db))
+
+/** Check the binary GeoIP table of <b>len</b> bytes at <b>data</b>, and
+ * return a new geoip_db_t for it, which refers to <b>data</b> without
+ * copying it. The table must be for <b>family</b>. On failure, set
+ * *<b>err_out</b> to a description of the problem and return NULL. */
+static geoip_db_t *
+geoip_db_new(const char *data, size_t len, sa_family_t family,
+             const char **err_out)
+{
+  const uint8_t *d = (const uint8_t *) data;
+  const size_t range_len = geoip_db_range_len(family);
+  geoip_db_t *db = NULL;
+  uint32_t n_countries, n_ranges;
+
+  if (len < GEOIP_DB_HEADER_LEN ||
+      fast_memneq(data, GEOIP_DB_MAGIC, strlen(GEOIP_DB_MAGIC))) {
+    *err_out = "not a binary GeoIP file";
+    return NULL;
+  }
+  if (tor_ntohl(get_uint32(d + 8)) != GEOIP_DB_VERSION) {
+    *err_out = "unsupported format version";
+    return NULL;
+  }
+  if (tor_ntohl(get_uint32(d + 12)) != (family == AF_INET ? 4 : 6)) {
+    *err_out = "wrong address family";
+    return NULL;
+  }
+  n_countries = tor_ntohl(get_uint32(d + 16));
+  n_ranges = tor_ntohl(get_uint32(d + 20));
+  if (n_countries == 0 || n_countries > INT16_MAX ||
+      geoip_db_expected_len(family, n_countries, n_ranges) != len) {
+    *err_out = "wrong length";
+    return NULL;
+  }
+
+  db = tor_malloc_zero(sizeof(geoip_db_t));
+  db->data = data;
+  db->len = len;
+  db->family = family;
+  db->n_countries = n_countries;
+  db->n_ranges = n_ranges;
+  d += GEOIP_DB_HEADER_LEN;
+  const char *codes = (const char *) d;
+  d += (2 * n_countries + 3) & ~3;
+  db->index = (const uint32_t *) d;
+  d += 4 * GEOIP_DB_INDEX_LEN;
+  db->ranges = d;
+  d += range_len * n_ranges;
+  db->range_countries = (const uint16_t *) d;
+
+  db->countries = tor_calloc(n_countries, sizeof(country_t));
+  for (uint32_t i = 0; i < n_countries; ++i) {
+    char cc[3] = { codes[2*i], codes[2*i+1], 0 };
+    if (!(TOR_ISALPHA(cc[0]) || cc[0] == '?') ||
+        !(TOR_ISALPHA(cc[1]) || cc[1] == '?')) {
+      *err_out = "bad country code";
+      goto err;
+    }
+    db->countries[i] = (country_t) geoip_intern_country(cc);
+  }
+
+  /* The ranges must be sorted and disjoint, and the index must be exactly
+   * the one we would compute, so that lookups never go astray. */
+  uint32_t i = 0;
+  for (uint32_t p = 0; p < GEOIP_DB_INDEX_LEN; ++p) {
+    while (i < n_ranges && (p == GEOIP_DB_INDEX_LEN - 1 ||
+           geoip_db_prefix(db->ranges + range_len*i + range_len/2) < p))
+      ++i;
+    if (tor_ntohl(db->index[p]) != i) {
+      *err_out = "bad index";
+      goto err;
+    }
+  }
+  for (i = 0; i < n_ranges; ++i) {
+    const uint8_t *range = db->ranges + range_len*i;
+    if (fast_memcmp(range, range + range_len/2, range_len/2) > 0 ||
+        (i && fast_memcmp(range - range_len/2, range, range_len/2) >= 0)) {
+      *err_out = "ranges not sorted";
+      goto err;
+    }
+    if (tor_ntohs(db->range_countries[i]) >= n_countries) {
+      *err_out = "bad country";
+      goto err;
+    }
+  }
+  return db;
+
+ err:
+  geoip_db_free(db);
+  return NULL;
+}
+
+/** Return a newly allocated binary GeoIP table for the sorted entries that
+ * we have for <b>family</b>, whose source file had the SHA1 digest
+ * <b>digest</b>, and set *<b>len_out</b> to its length. Return NULL if the
+ * entries overlap, since the binary format can't hold them. */
+static char *
+geoip_db_encode(sa_family_t family, const char *digest, size_t *len_out)
+{
+  const smartlist_t *entries =
+    family == AF_INET ? geoip_ipv4_entries : geoip_ipv6_entries;
+  const size_t range_len = geoip_db_range_len(family);
+  const uint32_t n_countries = smartlist_len(geoip_countries);
+  const uint32_t n_ranges = smartlist_len(entries);
+  const uint64_t len = geoip_db_expected_len(family, n_countries, n_ranges);
+  char *body, *out;
+
+  if (n_countries > INT16_MAX || len > SIZE_MAX)
+    return NULL;
+
+  body = tor_malloc_zero((size_t) len);
+  memcpy(body, GEOIP_DB_MAGIC, strlen(GEOIP_DB_MAGIC));
+  set_uint32(body + 8, tor_htonl(GEOIP_DB_VERSION));
+  set_uint32(body + 12, tor_htonl(family == AF_INET ? 4 : 6));
+  set_uint32(body + 16, tor_htonl(n_countries));
+  set_uint32(body + 20, tor_htonl(n_ranges));
+  memcpy(body + 24, digest, DIGEST_LEN);
+  out = body + GEOIP_DB_HEADER_LEN;
+
+  SMARTLIST_FOREACH_BEGIN(geoip_countries, const geoip_country_t *, c) {
+    memcpy(out + 2*c_sl_idx, c->countrycode, 2);
+  } SMARTLIST_FOREACH_END(c);
+  out += (2 * n_countries + 3) & ~3;
+
+  char *index = out;
+  char *ranges = index + 4 * GEOIP_DB_INDEX_LEN;
+  char *countries = ranges + range_len * n_ranges;
+  for (uint32_t i = 0; i < n_ranges; ++i) {
+    char *range = ranges + range_len*i;
+    if (family == AF_INET) {
+      const geoip_ipv4_entry_t *ent = smartlist_get(entries, i);
+      set_uint32(range, tor_htonl(ent->ip_low));
+      set_uint32(range + 4, tor_htonl(ent->ip_high));
+      set_uint16(countries + 2*i, tor_htons((uint16_t) ent->country));
+    } else {
+      const geoip_ipv6_entry_t *ent = smartlist_get(entries, i);
+      memcpy(range, ent->ip_low.s6_addr, 16);
+      memcpy(range + 16, ent->ip_high.s6_addr, 16);
+      set_uint16(countries + 2*i, tor_htons((uint16_t) ent->country));
+    }
+    if (i && fast_memcmp(range - range_len/2, range, range_len/2) >= 0) {
+      log_info(LD_GENERAL, "Overlapping GEOIP %s entries; not building a "
+               "compact table.", family == AF_INET ? "IPv4" : "IPv6");
+      tor_free(body);
+      return NULL;
+    }
+  }
+
+  uint32_t i = 0;
+  for (uint32_t p = 0; p < GEOIP_DB_INDEX_LEN - 1; ++p) {
+    while (i < n_ranges &&
+           geoip_db_prefix((const uint8_t *) ranges + range_len*i +
+                           range_len/2) < p)
+      ++i;
+    set_uint32(index + 4*p, tor_htonl(i));
+  }
+  set_uint32(index + 4*(GEOIP_DB_INDEX_LEN - 1), tor_htonl(n_ranges));
+
+  *len_out = (size_t) len;
+  return body;
+}
+
+/** Return the position in <b>db</b> of the range that holds the address at
+ * <b>addr</b>, which is in network order, or -1 if there is none. */
+static inline int64_t
+geoip_db_find_range(const geoip_db_t *db, const uint8_t *addr)
+{
+  const size_t range_len = geoip_db_range_len(db->family);
+  const size_t addr_len = range_len / 2;
+  const uint32_t prefix = geoip_db_prefix(addr);
+  uint32_t lo = tor_ntohl(db->index[prefix]);
+  uint32_t hi = tor_ntohl(db->index[prefix + 1]);
+
+  /* We want the first range that ends at or after addr. It can't come after
+   * the first range that ends with a higher prefix, so look up to there. */
+  if (hi < db->n_ranges)
+    ++hi;
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    if (fast_memcmp(db->ranges + range_len*mid + addr_len, addr,
+                    addr_len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < db->n_ranges &&
+      fast_memcmp(db->ranges + range_len*lo, addr, addr_len) <= 0)
+    return lo;
+  return -1;
+}
+
+/** Return the country in <b>db</b> of the address at <b>addr</b>, which is
+ * in network order, or 0 if it has none. */
+static int
+geoip_db_lookup(const geoip_db_t *db, const uint8_t *addr)
+{
+  const int64_t idx = geoip_db_find_range(db, addr);
+  if (idx < 0)
+    return 0;
+  return db->countries[tor_ntohs(db->range_countries[idx])];
+}
+
+/** Replace the table for <b>family</b> with <b>db</b>, and drop the
+ * entries we had for it. */
+static void
+geoip_db_set(sa_family_t family, geoip_db_t *db)
+{
+  smartlist_t **entriesp;
+  if (family == AF_INET) {
+    geoip_db_free(geoip_ipv4_db);
+    geoip_ipv4_db = db;
+    entriesp = &geoip_ipv4_entries;
+  } else {
+    geoip_db_free(geoip_ipv6_db);
+    geoip_ipv6_db = db;
+    entriesp = &geoip_ipv6_entries;
+  }
+  if (*entriesp) {
+    SMARTLIST_FOREACH(*entriesp, void *, e, tor_free(e));
+    smartlist_free(*entriesp);
+  }
+}
+
+/** Load the binary GeoIP table for <b>family</b> that we have mapped from
+ * <b>filename</b> into <b>map</b>, taking ownership of <b>map</b>. Return 0
+ * on success, -1 on failure. */
+static int
+geoip_load_db_map(sa_family_t family, const char *filename, tor_mmap_t *map,
+                  int severity)
+{
+  const char *err = NULL;
+  geoip_db_t *db;
+
+  if (!geoip_countries)
+    init_geoip_countries();
+  db = geoip_db_new(map->data, map->size, family, &err);
+  if (!db) {
+    log_fn(severity, LD_GENERAL, "Unable to use binary GEOIP %s file %s: %s.",
+           family == AF_INET ? "IPv4" : "IPv6", filename, err);
+    tor_munmap_file(map);
+    return -1;
+  }
+  db->map = map;
+  memcpy(family == AF_INET ? geoip_digest : geoip6_digest,
+         map->data + 24, DIGEST_LEN);
+  geoip_db_set(family, db);
+  log_notice(LD_GENERAL, "Mapped binary GEOIP %s file %s, with %u ranges.",
+             family == AF_INET ? "IPv4" : "IPv6", filename,
+             (unsigned) db->n_ranges);
+  return 0;
+}
+
+/** Write the GeoIP table that we have loaded for <b>family</b> to
+ * <b>filename</b> in the binary GeoIP format, so that geoip_load_file can
+ * map it later. Return 0 on success, -1 on failure. */
+int
+geoip_db_write_file(sa_family_t family, const char *filename)
+{
+  const geoip_db_t *db = family == AF_INET ? geoip_ipv4_db : geoip_ipv6_db;
+  tor_assert(family == AF_INET || family == AF_INET6);
+  if (!db) {
+    log_warn(LD_GENERAL, "No GEOIP %s table to write.",
+             family == AF_INET ? "IPv4" : "IPv6");
+    return -1;
+  }
+  return write_bytes_to_file(filename, db->data, db->len, 1);
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
@@ -313,12 +697,16 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If the file starts with GEOIP_DB_MAGIC instead, it is a binary GeoIP file,
+ * which we map into memory and use in place.
  */
 int
 geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
   FILE *f;
   crypto_digest_t *geoip_digest_env = NULL;
+  char magic[sizeof(GEOIP_DB_MAGIC)-1];
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
@@ -327,6 +715,17 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
            filename);
     return -1;
   }
+  if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+      fast_memeq(magic, GEOIP_DB_MAGIC, sizeof(magic))) {
+    fclose(f);
+    tor_mmap_t *map = tor_mmap_file(filename);
+    if (!map) {
+      log_fn(severity, LD_GENERAL, "Failed to map GEOIP file %s.", filename);
+      return -1;
+    }
+    return geoip_load_db_map(family, filename, map, severity);
+  }
+  rewind(f);
   if (!geoip_countries)
     init_geoip_countries();
 
@@ -345,6 +744,10 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
     }
     geoip_ipv6_entries = smartlist_new();
   }
+  if (family == AF_INET)
+    geoip_db_free(geoip_ipv4_db);
+  else
+    geoip_db_free(geoip_ipv6_db);
   geoip_digest_env = crypto_digest_new();
 
   log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
@@ -372,6 +775,24 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   }
   crypto_digest_free(geoip_digest_env);
 
+  /* Replace the entries with a compact table, if they fit in one. */
+  {
+    size_t len = 0;
+    const char *err = NULL;
+    char *body = geoip_db_encode(family, family == AF_INET ? geoip_digest
+                                                           : geoip6_digest,
+                                 &len);
+    geoip_db_t *db = body ? geoip_db_new(body, len, family, &err) : NULL;
+    if (db) {
+      db->body = body;
+      geoip_db_set(family, db);
+    } else {
+      if (BUG(body))
+        log_warn(LD_BUG, "Could not use our own GEOIP table: %s", err);
+      tor_free(body);
+    }
+  }
+
   return 0;
 }
 
@@ -385,6 +806,10 @@ int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
   geoip_ipv4_entry_t *ent;
+  if (geoip_ipv4_db) {
+    const uint32_t addr = tor_htonl(ipaddr);
+    return geoip_db_lookup(geoip_ipv4_db, (const uint8_t *) &addr);
+  }
   if (!geoip_ipv4_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
@@ -402,6 +827,8 @@ geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
   geoip_ipv6_entry_t *ent;
 
+  if (geoip_ipv6_db)
+    return geoip_db_lookup(geoip_ipv6_db, addr->s6_addr);
   if (!geoip_ipv6_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv6_entries, addr,
@@ -455,9 +882,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_entries != NULL || geoip_ipv4_db != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_entries != NULL || geoip_ipv6_db != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -493,6 +920,8 @@ clear_geoip_db(void)
                       tor_free(ent));
     smartlist_free(geoip_ipv6_entries);
   }
+  geoip_db_free(geoip_ipv4_db);
+  geoip_db_free(geoip_ipv6_db);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
   geoip_ipv4_entries = NULL;
@@ -37,7 +37,11 @@ typedef struct geoip_country_t {
 struct smartlist_t;
 const struct smartlist_t *geoip_get_countries(void);
 
+/** The first bytes of a binary GeoIP file. */
+#define GEOIP_DB_MAGIC "TORGEOIP"
+
 int geoip_load_file(sa_family_t family, const char *filename, int severity);
+int geoip_db_write_file(sa_family_t family, const char *filename);
 MOCK_DECL(int, geoip_get_country_by_addr, (const struct tor_addr_t *addr));
 MOCK_DECL(int, geoip_get_n_countries, (void));
 const char *geoip_get_country_name(country_t num);
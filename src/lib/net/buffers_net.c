@@ -12,6 +12,7 @@
 #define BUFFERS_PRIVATE
 #include "lib/net/buffers_net.h"
 #include "lib/buf/buffers.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/net/nettypes.h"
@@ -26,6 +27,47 @@
 #include <unistd.h>
 #endif
 
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+#define USE_IOVEC
+#include <sys/uio.h>
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#endif /* defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && ... */
+
+#ifdef USE_IOVEC
+/** Largest number of chunks that we try to flush with a single writev()
+ * call. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define MAX_FLUSH_IOVECS IOV_MAX
+#else
+#define MAX_FLUSH_IOVECS 64
+#endif
+/** If the tail chunk of a buffer has less than this much room left, and we
+ * want to read more than that, we read into it and into a new chunk with a
+ * single readv() call.  With more room than this, we guess that the read
+ * will probably fit in the tail, and don't allocate the new chunk. */
+#define MAX_READV_TAIL_SPACE 4096
+#endif /* defined(USE_IOVEC) */
+
+/** True iff we should read and write using readv() and writev() where we
+ * can, rather than one chunk at a time. */
+static bool use_scatter_gather = true;
+
+/** Enable or disable scatter-gather I/O on buffers, depending on
+ * <b>enabled</b>.  It is enabled by default, where the platform supports
+ * it.  Return true iff scatter-gather I/O is now in use. */
+bool
+buf_net_set_scatter_gather(bool enabled)
+{
+  use_scatter_gather = enabled;
+#ifdef USE_IOVEC
+  return use_scatter_gather;
+#else
+  return false;
+#endif
+}
+
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
  * <b>buf</b> is well-formed. */
@@ -81,6 +123,64 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_IOVEC
+/** As read_to_chunk(), but read up to <b>at_most</b> bytes into the
+ * remaining space in the tail chunk of <b>buf</b>, and then into a new
+ * chunk, with a single readv() call.  Set *<b>readlen_out</b> to the number
+ * of bytes we tried to read. */
+static inline int
+read_to_chunks_iov(buf_t *buf, int fd, size_t at_most,
+                   int *reached_eof, int *error, size_t *readlen_out)
+{
+  chunk_t *first = buf->tail;
+  const size_t first_len = CHUNK_REMAINING_CAPACITY(first);
+  chunk_t *second;
+  size_t second_len;
+  struct iovec iov[2];
+  ssize_t read_result;
+
+  tor_assert(first_len < at_most);
+  /* If we read too little to need this chunk, it will stay at the tail of
+   * the buffer, for the next read to use. */
+  second = buf_add_chunk_with_capacity(buf, at_most - first_len, 1);
+  second_len = MIN(second->memlen, at_most - first_len);
+
+  iov[0].iov_base = CHUNK_WRITE_PTR(first);
+  iov[0].iov_len = first_len;
+  iov[1].iov_base = CHUNK_WRITE_PTR(second);
+  iov[1].iov_len = second_len;
+  *readlen_out = first_len + second_len;
+
+  read_result = readv(fd, iov, 2);
+
+  if (read_result < 0) {
+    int e = errno;
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    buf->datalen += read_result;
+    if ((size_t)read_result <= first_len) {
+      first->datalen += read_result;
+    } else {
+      first->datalen += first_len;
+      second->datalen += read_result - first_len;
+    }
+    log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+              (int)buf->datalen);
+    tor_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif /* defined(USE_IOVEC) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -110,20 +210,29 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
+    size_t cap = buf->tail ? CHUNK_REMAINING_CAPACITY(buf->tail) : 0;
     chunk_t *chunk;
-    if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
-      if (readlen > chunk->memlen)
-        readlen = chunk->memlen;
-    } else {
-      size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
-      chunk = buf->tail;
-      if (cap < readlen)
-        readlen = cap;
-    }
+#ifdef USE_IOVEC
+    if (use_scatter_gather && cap >= MIN_READ_LEN && cap < readlen &&
+        cap < MAX_READV_TAIL_SPACE) {
+      r = read_to_chunks_iov(buf, fd, readlen,
+                             reached_eof, socket_error, &readlen);
+    } else
+#endif /* defined(USE_IOVEC) */
+    {
+      if (cap < MIN_READ_LEN) {
+        chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+        if (readlen > chunk->memlen)
+          readlen = chunk->memlen;
+      } else {
+        chunk = buf->tail;
+        if (cap < readlen)
+          readlen = cap;
+      }
 
-    r = read_to_chunk(buf, chunk, fd, readlen,
-                      reached_eof, socket_error, is_socket);
+      r = read_to_chunk(buf, chunk, fd, readlen,
+                        reached_eof, socket_error, is_socket);
+    }
     check();
     if (r < 0)
       return r; /* Error */
@@ -175,6 +284,50 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_IOVEC
+/** As flush_chunk(), but try to write up to <b>sz</b> bytes from as many
+ * chunks at the start of <b>buf</b> as we can, with a single writev() call.
+ * Set *<b>flushlen_out</b> to the number of bytes we tried to write. */
+static inline int
+flush_chunks_iov(int fd, buf_t *buf, size_t sz, size_t *buf_flushlen,
+                 size_t *flushlen_out)
+{
+  struct iovec iov[MAX_FLUSH_IOVECS];
+  int n_iov = 0;
+  size_t total = 0;
+  const chunk_t *chunk;
+  ssize_t write_result;
+
+  for (chunk = buf->head; chunk && total < sz && n_iov < MAX_FLUSH_IOVECS;
+       chunk = chunk->next) {
+    const size_t len = MIN(chunk->datalen, sz - total);
+    if (len == 0)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    total += len;
+  }
+  *flushlen_out = total;
+
+  write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = errno;
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_IOVEC) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -203,12 +356,20 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
-    if (buf->head->datalen >= sz)
-      flushlen0 = sz;
-    else
-      flushlen0 = buf->head->datalen;
+#ifdef USE_IOVEC
+    if (use_scatter_gather) {
+      r = flush_chunks_iov(fd, buf, sz, buf_flushlen, &flushlen0);
+    } else
+#endif
+    {
+      if (buf->head->datalen >= sz)
+        flushlen0 = sz;
+      else
+        flushlen0 = buf->head->datalen;
 
-    r = flush_chunk(fd, buf, buf->head, flushlen0, buf_flushlen, is_socket);
+      r = flush_chunk(fd, buf, buf->head, flushlen0, buf_flushlen,
+                      is_socket);
+    }
     check();
     if (r < 0)
       return r;
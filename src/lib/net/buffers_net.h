@@ -13,6 +13,7 @@
 #ifndef TOR_BUFFERS_NET_H
 #define TOR_BUFFERS_NET_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include "lib/net/socket.h"
 
@@ -31,4 +32,6 @@ int buf_read_from_pipe(struct buf_t *buf, int fd, size_t at_most,
 int buf_flush_to_pipe(struct buf_t *buf, int fd, size_t sz,
                       size_t *buf_flushlen);
 
+bool buf_net_set_scatter_gather(bool enabled);
+
 #endif /* !defined(TOR_BUFFERS_H) */
@@ -78,6 +78,9 @@
 #ifdef HAVE_LINUX_NETFILTER_IPV6_IP6_TABLES_H
 #include <linux/netfilter_ipv6/ip6_tables.h>
 #endif
+#ifdef HAVE_KIST_SOCK_DIAG
+#include <linux/netlink.h>
+#endif
 
 #if defined(HAVE_EXECINFO_H) && defined(HAVE_BACKTRACE) && \
   defined(HAVE_BACKTRACE_SYMBOLS_FD) && defined(HAVE_SIGACTION)
@@ -211,6 +214,7 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(prlimit64),
 #endif
     SCMP_SYS(read),
+    SCMP_SYS(readv),
     SCMP_SYS(rt_sigreturn),
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
@@ -660,7 +664,7 @@ sb_socket(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
 
   rc = seccomp_rule_add_2(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
       SCMP_CMP(0, SCMP_CMP_EQ, PF_FILE),
-      SCMP_CMP_MASKED(1, SOCK_CLOEXEC|SOCK_NONBLOCK, SOCK_STREAM));
+      SCMP_CMP_MASKED(1, SANDBOX_SOCKET_TYPE_FLAGS, SOCK_STREAM));
   if (rc)
     return rc;
 
@@ -674,7 +678,7 @@ sb_socket(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
                                       IPPROTO_UDP;
       rc = seccomp_rule_add_3(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
         SCMP_CMP(0, SCMP_CMP_EQ, pf),
-        SCMP_CMP_MASKED(1, SOCK_CLOEXEC|SOCK_NONBLOCK, type),
+        SCMP_CMP_MASKED(1, SANDBOX_SOCKET_TYPE_FLAGS, type),
         SCMP_CMP(2, SCMP_CMP_EQ, protocol));
       if (rc)
         return rc;
@@ -683,14 +687,14 @@ sb_socket(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
 
   rc = seccomp_rule_add_3(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
       SCMP_CMP(0, SCMP_CMP_EQ, PF_UNIX),
-      SCMP_CMP_MASKED(1, SOCK_CLOEXEC|SOCK_NONBLOCK, SOCK_STREAM),
+      SCMP_CMP_MASKED(1, SANDBOX_SOCKET_TYPE_FLAGS, SOCK_STREAM),
       SCMP_CMP(2, SCMP_CMP_EQ, 0));
   if (rc)
     return rc;
 
   rc = seccomp_rule_add_3(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
       SCMP_CMP(0, SCMP_CMP_EQ, PF_UNIX),
-      SCMP_CMP_MASKED(1, SOCK_CLOEXEC|SOCK_NONBLOCK, SOCK_DGRAM),
+      SCMP_CMP_MASKED(1, SANDBOX_SOCKET_TYPE_FLAGS, SOCK_DGRAM),
       SCMP_CMP(2, SCMP_CMP_EQ, 0));
   if (rc)
     return rc;
@@ -702,6 +706,16 @@ sb_socket(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
   if (rc)
     return rc;
 
+#ifdef HAVE_KIST_SOCK_DIAG
+  /* The KIST scheduler can ask for TCP information through sock_diag. */
+  rc = seccomp_rule_add_3(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
+      SCMP_CMP(0, SCMP_CMP_EQ, PF_NETLINK),
+      SCMP_CMP_MASKED(1, SANDBOX_SOCKET_TYPE_FLAGS, SOCK_RAW),
+      SCMP_CMP(2, SCMP_CMP_EQ, NETLINK_SOCK_DIAG));
+  if (rc)
+    return rc;
+#endif /* defined(HAVE_KIST_SOCK_DIAG) */
+
   return 0;
 }
 
@@ -112,6 +112,11 @@ const char* sandbox_intern_string(const char *param);
 #define sandbox_intern_string(s) (s)
 #endif /* defined(USE_LIBSECCOMP) */
 
+/** The flags that sb_socket() lets a caller add to the type of any socket
+ * that the sandbox allows.  Code that opens one of those sockets must not
+ * use any other flags, or the sandbox will kill us. */
+#define SANDBOX_SOCKET_TYPE_FLAGS (SOCK_CLOEXEC|SOCK_NONBLOCK)
+
 /** Creates an empty sandbox configuration file.*/
 sandbox_cfg_t * sandbox_cfg_new(void);
 
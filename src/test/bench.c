@@ -24,18 +24,28 @@
 #include <openssl/obj_mac.h>
 #endif
 
+#include "core/or/cell_pool.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
+#include "feature/hs_common/replaycache.h"
 #include "lib/compress/compress.h"
+#include "lib/buf/buffers.h"
+#include "lib/fs/files.h"
+#include "lib/net/buffers_net.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
@@ -44,6 +54,13 @@
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/microdesc.h"
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
 static inline uint64_t
@@ -238,6 +255,26 @@ bench_onion_ntor_impl(void)
   printf("Server-side: %f usec\n",
          NANOCOUNT(start, end, iters)/1e3);
 
+  {
+    const int batch_size = 16;
+    ntor_server_batch_item_t items[16];
+    uint8_t replies[16][NTOR_REPLY_LEN];
+    uint8_t keys_out[16][CPATH_KEY_MATERIAL_LEN];
+    for (i = 0; i < batch_size; ++i) {
+      items[i].onion_skin = os;
+      items[i].handshake_reply_out = replies[i];
+      items[i].key_out = keys_out[i];
+    }
+    start = perftime();
+    for (i = 0; i < iters; i += batch_size) {
+      onion_skin_ntor_server_handshake_batch(items, batch_size, keymap, NULL,
+                                             nodeid, CPATH_KEY_MATERIAL_LEN);
+    }
+    end = perftime();
+    printf("Server-side, batches of %d: %f usec\n", batch_size,
+           NANOCOUNT(start, end, iters)/1e3);
+  }
+
   start = perftime();
   for (i = 0; i < iters; ++i) {
     uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
@@ -304,6 +341,27 @@ bench_ed25519_impl(void)
   printf("Verify signature: %.2f usec\n",
          MICROCOUNT(start, end, iters));
 
+  {
+    const int n_batch = 64;
+    ed25519_checkable_t *check = tor_calloc(n_batch, sizeof(*check));
+    int *okay = tor_calloc(n_batch, sizeof(int));
+    for (i = 0; i < n_batch; ++i) {
+      memcpy(&check[i].signature, &sig, sizeof(sig));
+      check[i].pubkey = &kp.pubkey;
+      check[i].msg = msg;
+      check[i].len = sizeof(msg);
+    }
+    start = perftime();
+    for (i = 0; i < iters / n_batch; ++i) {
+      ed25519_checksig_batch(okay, check, n_batch);
+    }
+    end = perftime();
+    printf("Verify signature in batches of %d: %.2f usec\n", n_batch,
+           MICROCOUNT(start, end, iters));
+    tor_free(check);
+    tor_free(okay);
+  }
+
   curve25519_keypair_generate(&curve_kp, 0);
   start = perftime();
   for (i = 0; i < iters; ++i) {
@@ -425,6 +483,257 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** Compare crypting cell payloads one at a time with crypting them in
+ * batches. */
+static void
+bench_cell_aes_batch(void)
+{
+  uint64_t start, end;
+  const int len = CELL_PAYLOAD_SIZE;
+  const int n_cells = (1<<16);
+  const int batch_sizes[] = { 1, 4, 16, 64 };
+  char *b = tor_malloc(len * n_cells);
+  char *payloads[64];
+  crypto_cipher_t *c;
+  unsigned i;
+  int j, k;
+  char key[CIPHER_KEY_LEN];
+  crypto_rand(key, sizeof(key));
+  c = crypto_cipher_new(key);
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < n_cells; ++j) {
+    crypto_cipher_crypt_inplace(c, b + j*len, len);
+  }
+  end = perftime();
+  printf("One cell at a time: %.2f nsec per cell\n",
+         NANOCOUNT(start, end, n_cells));
+
+  for (i = 0; i < ARRAY_LENGTH(batch_sizes); ++i) {
+    const int batch = batch_sizes[i];
+    start = perftime();
+    for (j = 0; j < n_cells; j += batch) {
+      for (k = 0; k < batch; ++k)
+        payloads[k] = b + (j+k)*len;
+      crypto_cipher_crypt_inplace_multi(c, payloads, batch, len);
+    }
+    end = perftime();
+    printf("Batches of %d cells: %.2f nsec per cell\n", batch,
+           NANOCOUNT(start, end, n_cells));
+  }
+
+  crypto_cipher_free(c);
+  tor_free(b);
+}
+
+/** Set *<b>reads_out</b> and *<b>writes_out</b> to the number of read and
+ * write system calls that this process has made so far.  Return 0 on
+ * success, or -1 if we can't tell on this platform. */
+static int
+get_syscall_counts(uint64_t *reads_out, uint64_t *writes_out)
+{
+#ifdef __linux__
+  /* This file claims to be empty, so read_file_to_str() won't work. */
+  int fd = tor_open_cloexec("/proc/self/io", O_RDONLY, 0);
+  size_t sz = 0;
+  char *s = fd < 0 ? NULL : read_file_to_str_until_eof(fd, 4096, &sz);
+  const char *r, *w;
+  int ok1 = 0, ok2 = 0;
+  if (fd >= 0)
+    close(fd);
+  if (s && (r = strstr(s, "syscr: ")) && (w = strstr(s, "syscw: "))) {
+    char *next;
+    *reads_out = tor_parse_uint64(r+7, 10, 0, UINT64_MAX, &ok1, &next);
+    *writes_out = tor_parse_uint64(w+7, 10, 0, UINT64_MAX, &ok2, &next);
+  }
+  tor_free(s);
+  return (ok1 && ok2) ? 0 : -1;
+#else
+  (void) reads_out;
+  (void) writes_out;
+  return -1;
+#endif /* defined(__linux__) */
+}
+
+/** Time allocating and freeing packed cells in the order that a busy cell
+ * queue would, with tor_malloc_zero() and with the cell pool. */
+static void
+bench_cell_pool(void)
+{
+  uint64_t start, end;
+  const int queue_len = 4096;
+  const int iters = 1<<20;
+  packed_cell_t **queue = tor_calloc(queue_len, sizeof(packed_cell_t *));
+  int i;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const int idx = i % queue_len;
+    tor_free(queue[idx]);
+    queue[idx] = tor_malloc_zero(sizeof(packed_cell_t));
+  }
+  end = perftime();
+  for (i = 0; i < queue_len; ++i)
+    tor_free(queue[i]);
+  printf("tor_malloc_zero: %.2f nsec per cell\n",
+         NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const int idx = i % queue_len;
+    cell_pool_free(queue[idx]);
+    queue[idx] = cell_pool_alloc();
+  }
+  end = perftime();
+  for (i = 0; i < queue_len; ++i) {
+    cell_pool_free(queue[i]);
+    queue[i] = NULL;
+  }
+  printf("cell pool: %.2f nsec per cell\n", NANOCOUNT(start, end, iters));
+
+  cell_pool_free_all();
+  tor_free(queue);
+}
+
+/** Time attaching many circuits to one circuitmux, updating their cell
+ * counts the way the relay code does for every cell, and detaching them. */
+static void
+bench_cmux(void)
+{
+  uint64_t start, end;
+  const int n_circs = 10000;
+  const int iters = 100;
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  circuitmux_t *cmux = circuitmux_alloc();
+  or_circuit_t *circs = tor_calloc(n_circs, sizeof(or_circuit_t));
+  int i, j;
+
+  cmux_ewma_set_options(get_options(), NULL);
+  circuitmux_set_policy(cmux, &ewma_policy);
+  chan->global_identifier = 1;
+  for (i = 0; i < n_circs; ++i) {
+    circs[i].base_.magic = OR_CIRCUIT_MAGIC;
+    circs[i].base_.n_chan = chan;
+    circs[i].base_.n_circ_id = i + 1;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < n_circs; ++i)
+      circuitmux_attach_circuit(cmux, TO_CIRCUIT(&circs[i]),
+                                CELL_DIRECTION_OUT);
+    for (i = 0; i < n_circs; ++i)
+      circuitmux_detach_circuit(cmux, TO_CIRCUIT(&circs[i]));
+  }
+  end = perftime();
+  printf("attach and detach: %.2f nsec per circuit\n",
+         NANOCOUNT(start, end, iters * n_circs));
+
+  for (i = 0; i < n_circs; ++i)
+    circuitmux_attach_circuit(cmux, TO_CIRCUIT(&circs[i]),
+                              CELL_DIRECTION_OUT);
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < n_circs; ++i)
+      circuitmux_set_num_cells(cmux, TO_CIRCUIT(&circs[i]), 1);
+    for (i = 0; i < n_circs; ++i) {
+      destroy_cell_queue_t *dq = NULL;
+      circuit_t *circ = circuitmux_get_first_active_circuit(cmux, &dq);
+      circuitmux_notify_xmit_cells(cmux, circ, 1);
+    }
+  }
+  end = perftime();
+  printf("queue and send: %.2f nsec per cell\n",
+         NANOCOUNT(start, end, iters * n_circs));
+
+  /* The channel isn't registered, so circuitmux_detach_all_circuits() would
+   * be unable to find our circuits. */
+  for (i = 0; i < n_circs; ++i)
+    circuitmux_detach_circuit(cmux, TO_CIRCUIT(&circs[i]));
+  circuitmux_free(cmux);
+  tor_free(circs);
+  tor_free(chan);
+}
+
+/** Compare reading and writing buffers one chunk at a time with
+ * scatter-gather I/O, over a pipe. */
+static void
+bench_buf_net(void)
+{
+#ifdef HAVE_PIPE
+  const int iters = 1<<12;
+  const size_t per_iter = 32768;
+  /* Add data in pieces about the size of a relay cell's payload, as we do
+   * for exit streams. */
+  const size_t piece = 498;
+  char *data = tor_malloc_zero(per_iter);
+  buf_t *out = buf_new(), *in = buf_new();
+  int fds[2] = { -1, -1 };
+  int sg, i;
+
+  if (pipe(fds) < 0 ||
+      set_socket_nonblocking(fds[0]) < 0 ||
+      set_socket_nonblocking(fds[1]) < 0) {
+    puts("Couldn't make a pipe.");
+    goto done;
+  }
+
+  reset_perftime();
+  for (sg = 0; sg <= 1; ++sg) {
+    uint64_t start, end, r0 = 0, w0 = 0, r1 = 0, w1 = 0;
+    int have_counts;
+    if (buf_net_set_scatter_gather(sg) != !!sg) {
+      puts("Scatter-gather I/O is not supported here.");
+      continue;
+    }
+    have_counts = get_syscall_counts(&r0, &w0) == 0;
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      size_t added, flushlen;
+      int eof = 0, err = 0;
+      for (added = 0; added < per_iter; added += piece)
+        buf_add(out, data, MIN(piece, per_iter - added));
+      flushlen = buf_datalen(out);
+      while (buf_datalen(out) || buf_datalen(in) < per_iter) {
+        if (buf_datalen(out) &&
+            buf_flush_to_pipe(out, fds[1], flushlen, &flushlen) < 0)
+          goto done;
+        if (buf_read_from_pipe(in, fds[0], per_iter - buf_datalen(in),
+                               &eof, &err) < 0)
+          goto done;
+      }
+      buf_drain(in, buf_datalen(in));
+    }
+    end = perftime();
+    have_counts = have_counts && get_syscall_counts(&r1, &w1) == 0;
+    printf("%s: %.2f MB/s", sg ? "Scatter-gather" : "One chunk at a time",
+           (double)iters * per_iter / 1e6 /
+             (NANOCOUNT(start, end, 1) / 1e9));
+    if (have_counts) {
+      printf(", %.2f reads and %.2f writes per %d bytes",
+             (double)(r1 - r0) / iters, (double)(w1 - w0) / iters,
+             (int)per_iter);
+    }
+    puts("");
+  }
+
+ done:
+  buf_net_set_scatter_gather(true);
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  tor_free(data);
+#else /* !(defined(HAVE_PIPE)) */
+  puts("No pipes on this platform.");
+#endif /* defined(HAVE_PIPE) */
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -524,6 +833,47 @@ bench_siphash(void)
   }
 }
 
+static void
+bench_replaycache(void)
+{
+  const int n_entries = 1000000;
+  /* A flood of new items makes the cache forget all but its last full
+   * generation or so; replay only entries it is sure to remember. */
+  const int n_replays = REPLAYCACHE_MAX_GENERATION_ENTRIES;
+  uint8_t buf[256];
+  uint64_t start, pt2, end;
+  int i, n_new = 0, n_replayed = 0;
+  replaycache_t *rc = replaycache_new(REND_REPLAY_TIME_INTERVAL,
+                                      REND_REPLAY_TIME_INTERVAL);
+
+  /* Buffers about the size of an INTRODUCE2 encrypted section, all
+   * different. */
+  crypto_rand((char *) buf, sizeof(buf));
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < n_entries; ++i) {
+    set_uint32(buf, i);
+    n_new += replaycache_add_and_test(rc, buf, sizeof(buf));
+  }
+  pt2 = perftime();
+  printf("replaycache_add_and_test (new): %.2f ns per element\n",
+         NANOCOUNT(start, pt2, n_entries));
+
+  for (i = n_entries - n_replays; i < n_entries; ++i) {
+    set_uint32(buf, i);
+    n_replayed += replaycache_add_and_test(rc, buf, sizeof(buf));
+  }
+  end = perftime();
+  printf("replaycache_add_and_test (replay): %.2f ns per element\n",
+         NANOCOUNT(pt2, end, n_replays));
+  /* We need to use these, or else the whole loop gets optimized out. */
+  printf("Hits == %d of %d new, %d of %d replayed\n",
+         n_new, n_entries, n_replayed, n_replays);
+
+  replaycache_free(rc);
+}
+
 static void
 bench_digest(void)
 {
@@ -611,6 +961,53 @@ bench_cell_ops(void)
            NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
   }
 
+  /* Now time the running digest: first as the origin, setting the digest
+   * on cells that it packages, and then as the relay, recognizing those
+   * cells. */
+  const int n_recognized = 1<<13;
+  cell_t *cells = tor_calloc(n_recognized, sizeof(cell_t));
+  crypto_digest_t *origin_digest = crypto_digest_new();
+  crypto_cipher_t *origin_crypto = crypto_cipher_new(key1);
+  crypto_digest_t *relay_digest = crypto_digest_new();
+  crypto_cipher_t *relay_crypto = crypto_cipher_new(key1);
+  int n_ok = 0;
+
+  for (i = 0; i < n_recognized; ++i) {
+    crypto_rand((char*)cells[i].payload, CELL_PAYLOAD_SIZE);
+    /* Clear the recognized and integrity fields. */
+    memset(cells[i].payload + 1, 0, 2);
+    memset(cells[i].payload + 5, 0, 4);
+  }
+  start = perftime();
+  for (i = 0; i < n_recognized; ++i) {
+    relay_set_digest(origin_digest, &cells[i]);
+  }
+  end = perftime();
+  printf("Setting digest: %.2f ns per cell.\n",
+         NANOCOUNT(start,end,n_recognized));
+
+  for (i = 0; i < n_recognized; ++i) {
+    crypto_cipher_crypt_inplace(origin_crypto, (char*)cells[i].payload,
+                                CELL_PAYLOAD_SIZE);
+  }
+  start = perftime();
+  for (i = 0; i < n_recognized; ++i) {
+    char recognized = 0;
+    relay_crypt_cell_at_relay(relay_crypto, relay_digest,
+                              &cells[i], &recognized);
+    n_ok += recognized;
+  }
+  end = perftime();
+  printf("Recognizing cells: %.2f ns per cell.\n",
+         NANOCOUNT(start,end,n_recognized));
+  if (n_ok != n_recognized)
+    puts("WRONG.");
+
+  crypto_digest_free(origin_digest);
+  crypto_cipher_free(origin_crypto);
+  crypto_digest_free(relay_digest);
+  crypto_cipher_free(relay_crypto);
+  tor_free(cells);
   relay_crypto_clear(&or_circ->crypto);
   tor_free(or_circ);
   tor_free(cell);
@@ -738,6 +1135,148 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Append to <b>out</b> a made-up microdesc consensus that lists the routers
+ * whose entries in <b>present</b> are set, out of <b>n_routers</b>. The
+ * identity of each router sorts by its index, as in a real consensus; routers
+ * whose entry is 2 get a different identity than when it is 1. Use
+ * <b>rng</b> to decide on the bandwidths, flags and microdescriptors, and
+ * <b>hour</b> for the times in the header. */
+static void
+bench_consdiff_make_consensus(smartlist_t *out, int n_routers,
+                              const uint8_t *present, tor_weak_rng_t *rng,
+                              int hour)
+{
+  smartlist_add_asprintf(out,
+    "network-status-version 3 microdesc\n"
+    "vote-status consensus\n"
+    "consensus-method 28\n"
+    "valid-after 2019-05-01 %02d:00:00\n"
+    "fresh-until 2019-05-01 %02d:00:00\n"
+    "valid-until 2019-05-01 %02d:00:00\n"
+    "voting-delay 300 300\n"
+    "known-flags Authority BadExit Exit Fast Guard HSDir Running Stable "
+    "V2Dir Valid\n"
+    "params CircuitPriorityHalflifeMsec=30000 NumNTorsPerTAP=100 "
+    "UseOptimisticData=1 bwauthpid=1 cbttestfreq=10 pb_disablepct=0\n",
+    hour, hour + 1, hour + 3);
+  for (int i = 0; i < n_routers; ++i) {
+    char id[DIGEST_LEN], md[DIGEST256_LEN];
+    char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+    if (!present[i])
+      continue;
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(((uint32_t)i << 8) | (present[i] == 2)));
+    memset(md, 0, sizeof(md));
+    set_uint32(md, tor_weak_random(rng));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(out,
+      "r relay%d %s 2019-05-01 %02d:%02d:%02d 10.%d.%d.%d 9001 0\n"
+      "m %s\n"
+      "s Fast %sRunning Stable V2Dir Valid\n"
+      "v Tor 0.4.0.%d\n"
+      "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+      "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+      "w Bandwidth=%d\n",
+      i, id64, hour, i % 60, (i / 60) % 60,
+      (i >> 16) & 255, (i >> 8) & 255, i & 255,
+      md64,
+      tor_weak_random_one_in_n(rng, 3) ? "Guard " : "",
+      tor_weak_random_range(rng, 6),
+      1 + tor_weak_random_range(rng, 50000));
+  }
+  smartlist_add_asprintf(out,
+    "directory-footer\n"
+    "bandwidth-weights Wbd=0 Wbe=0 Wbg=4143 Wbm=10000 Wdb=10000 Web=10000\n"
+    "directory-signature sha256 0232AF901C31A04EE9848595AF9BB7620D4C5B2E "
+    "%d\n"
+    "-----BEGIN SIGNATURE-----\n"
+    "bm90IGEgcmVhbCBzaWduYXR1cmUsIGp1c3QgZm9yIHRoZSBiZW5jaG1hcms=\n"
+    "-----END SIGNATURE-----\n", hour);
+}
+
+/** Time consensus_diff_generate on two made-up consensuses of
+ * <b>n_routers</b> possible routers, where the second one lists about 1/30
+ * of the routers differently from the first, and replaces all the routers
+ * from <b>block_start</b> up to <b>block_end</b> with new ones. Describe the
+ * result as <b>what</b>. */
+static void
+bench_consdiff_one(const char *what, int n_routers, int block_start,
+                   int block_end)
+{
+  const int N = 10;
+  uint8_t *present = tor_malloc_zero(n_routers);
+  smartlist_t *parts = smartlist_new();
+  tor_weak_rng_t rng;
+  char *cons1, *cons2, *diff;
+  uint64_t start, end;
+
+  tor_init_weak_random(&rng, 1729);
+  for (int i = 0; i < n_routers; ++i)
+    present[i] = !tor_weak_random_one_in_n(&rng, 20);
+  tor_init_weak_random(&rng, 1);
+  bench_consdiff_make_consensus(parts, n_routers, present, &rng, 12);
+  cons1 = smartlist_join_strings(parts, "", 0, NULL);
+  SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+  smartlist_clear(parts);
+
+  /* An hour later, some routers are gone, some are new, and most of the
+   * others have new bandwidths. */
+  for (int i = 0; i < n_routers; ++i) {
+    if (i >= block_start && i < block_end)
+      present[i] = 2;
+    else if (tor_weak_random_one_in_n(&rng, 30))
+      present[i] = !present[i];
+  }
+  tor_init_weak_random(&rng, 2);
+  bench_consdiff_make_consensus(parts, n_routers, present, &rng, 13);
+  cons2 = smartlist_join_strings(parts, "", 0, NULL);
+  SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+  smartlist_free(parts);
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    diff = consensus_diff_generate(cons1, strlen(cons1),
+                                   cons2, strlen(cons2));
+    tor_assert(diff);
+    tor_free(diff);
+  }
+  end = perftime();
+  diff = consensus_diff_generate(cons1, strlen(cons1), cons2, strlen(cons2));
+  printf("Consensus diff, %s: %.2f msec each (%d-byte consensus, "
+         "%d-byte diff)\n", what, NANOCOUNT(start, end, N) / 1e6,
+         (int)strlen(cons2), diff ? (int)strlen(diff) : -1);
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    char *applied = consensus_diff_apply(cons1, strlen(cons1),
+                                         diff, strlen(diff));
+    tor_assert(applied);
+    tor_free(applied);
+  }
+  end = perftime();
+  printf("Consensus diff apply, %s: %.2f msec each\n", what,
+         NANOCOUNT(start, end, N) / 1e6);
+
+  tor_free(diff);
+  tor_free(cons1);
+  tor_free(cons2);
+  tor_free(present);
+}
+
+/** Benchmark consensus_diff_generate on two made-up consensuses with
+ * about as many routers, and about as many changes, as two consecutive
+ * real microdesc consensuses; and again when a block of routers changes all
+ * at once, so that we must compute the LCS of a large section. */
+static void
+bench_consdiff(void)
+{
+  bench_consdiff_one("typical", 7000, 0, 0);
+  bench_consdiff_one("1500 routers replaced", 7000, 3000, 4500);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -750,6 +1289,7 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(replaycache),
   ENT(siphash),
   ENT(digest),
   ENT(aes),
@@ -759,7 +1299,11 @@ static struct benchmark_t benchmarks[] = {
   ENT(rand),
 
   ENT(cell_aes),
+  ENT(cell_aes_batch),
   ENT(cell_ops),
+  ENT(cell_pool),
+  ENT(cmux),
+  ENT(buf_net),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,6 +1312,7 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(consdiff),
   {NULL,NULL,0}
 };
 
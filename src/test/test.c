@@ -271,6 +271,87 @@ test_ntor_handshake(void *arg)
   dimap_free(s_keymap, NULL);
 }
 
+static void
+test_ntor_handshake_batch(void *arg)
+{
+#define N_BATCH 5
+  ntor_handshake_state_t *c_state[N_BATCH];
+  uint8_t c_buf[N_BATCH][NTOR_ONIONSKIN_LEN];
+  uint8_t c_keys[400];
+
+  di_digest256_map_t *s_keymap=NULL;
+  curve25519_keypair_t s_keypair[2], s_junk_keypair, s_unknown_keypair;
+  uint8_t s_buf[N_BATCH][NTOR_REPLY_LEN];
+  uint8_t s_keys[N_BATCH][400];
+  ntor_server_batch_item_t items[N_BATCH];
+
+  uint8_t node_id[20] = "abcdefghijklmnopqrst";
+  uint8_t other_node_id[20] = "ABCDEFGHIJKLMNOPQRST";
+  int i;
+
+  (void) arg;
+  memset(c_state, 0, sizeof(c_state));
+
+  /* Make the server two onion keys, and some junk keys. */
+  for (i = 0; i < 2; ++i) {
+    curve25519_keypair_generate(&s_keypair[i], 0);
+    dimap_add_entry(&s_keymap, s_keypair[i].pubkey.public_key,
+                    &s_keypair[i]);
+  }
+  curve25519_keypair_generate(&s_junk_keypair, 0);
+  curve25519_keypair_generate(&s_unknown_keypair, 0);
+
+  /* Handshakes 0, 1 and 2 should work, with different keys.  Handshake 3 is
+   * for another relay, and handshake 4 uses a key we don't have. */
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id, &s_keypair[0].pubkey,
+                                             &c_state[0], c_buf[0]));
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id, &s_keypair[1].pubkey,
+                                             &c_state[1], c_buf[1]));
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id, &s_keypair[0].pubkey,
+                                             &c_state[2], c_buf[2]));
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create(other_node_id,
+                                             &s_keypair[0].pubkey,
+                                             &c_state[3], c_buf[3]));
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id,
+                                             &s_unknown_keypair.pubkey,
+                                             &c_state[4], c_buf[4]));
+
+  memset(items, 0, sizeof(items));
+  for (i = 0; i < N_BATCH; ++i) {
+    items[i].onion_skin = c_buf[i];
+    items[i].handshake_reply_out = s_buf[i];
+    items[i].key_out = s_keys[i];
+    items[i].result = 1;
+  }
+  onion_skin_ntor_server_handshake_batch(items, N_BATCH, s_keymap,
+                                         &s_junk_keypair, node_id, 400);
+
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(items[i].result, OP_EQ, 0);
+    memset(c_keys, 0, sizeof(c_keys));
+    tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_state[i],
+                                                         s_buf[i],
+                                                         c_keys, 400, NULL));
+    tt_mem_op(c_keys, OP_EQ, s_keys[i], 400);
+  }
+  /* Every handshake got its own short-lived key. */
+  tt_mem_op(s_buf[0], OP_NE, s_buf[2], CURVE25519_PUBKEY_LEN);
+
+  tt_int_op(items[3].result, OP_EQ, -1);
+  /* With the junk keys, the handshake goes ahead, but the client won't
+   * accept the reply. */
+  tt_int_op(items[4].result, OP_EQ, 0);
+  tt_int_op(-1, OP_EQ, onion_skin_ntor_client_handshake(c_state[4],
+                                                        s_buf[4],
+                                                        c_keys, 400, NULL));
+
+ done:
+  for (i = 0; i < N_BATCH; ++i)
+    ntor_handshake_state_free(c_state[i]);
+  dimap_free(s_keymap, NULL);
+#undef N_BATCH
+}
+
 static void
 test_fast_handshake(void *arg)
 {
@@ -809,6 +890,7 @@ static struct testcase_t test_array[] = {
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
+  { "ntor_handshake_batch", test_ntor_handshake_batch, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
   FORK(rend_fns),
@@ -849,6 +931,7 @@ struct testgroup_t testgroups[] = {
   { "control/", controller_tests },
   { "control/btrack/", btrack_tests },
   { "control/event/", controller_event_tests },
+  { "cpuworker/", cpuworker_tests },
   { "crypto/", crypto_tests },
   { "crypto/ope/", crypto_ope_tests },
 #ifdef ENABLE_OPENSSL
@@ -863,6 +946,7 @@ struct testgroup_t testgroups[] = {
   { "dir_handle_get/", dir_handle_get_tests },
   { "dispatch/", dispatch_tests, },
   { "dns/", dns_tests },
+  { "dns_threaded/", dns_threaded_tests },
   { "dos/", dos_tests },
   { "entryconn/", entryconn_tests },
   { "entrynodes/", entrynodes_tests },
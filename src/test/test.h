@@ -204,6 +204,7 @@ extern struct testcase_t consdiffmgr_tests[];
 extern struct testcase_t container_tests[];
 extern struct testcase_t controller_event_tests[];
 extern struct testcase_t controller_tests[];
+extern struct testcase_t cpuworker_tests[];
 extern struct testcase_t crypto_ope_tests[];
 extern struct testcase_t crypto_openssl_tests[];
 extern struct testcase_t crypto_rng_tests[];
@@ -212,6 +213,7 @@ extern struct testcase_t dir_handle_get_tests[];
 extern struct testcase_t dir_tests[];
 extern struct testcase_t dispatch_tests[];
 extern struct testcase_t dns_tests[];
+extern struct testcase_t dns_threaded_tests[];
 extern struct testcase_t dos_tests[];
 extern struct testcase_t entryconn_tests[];
 extern struct testcase_t entrynodes_tests[];
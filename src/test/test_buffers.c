@@ -11,6 +11,8 @@
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/socketpair.h"
 #include "core/proto/proto_http.h"
 #include "core/proto/proto_socks.h"
 #include "test/test.h"
@@ -435,6 +437,58 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc(4000);
+  buf_t *buf = NULL;
+  int i;
+
+  (void)arg;
+
+  crypto_rand(junk, 4000);
+  buf_shrink_freelists(1);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Freed chunks go on the freelist, and don't count as in use. */
+  buf = buf_new();
+  for (i = 0; i < 4; ++i)
+    buf_add(buf, junk, 4000);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4*4096);
+  buf_free(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4*4096);
+
+  /* New chunks come from the freelist. */
+  buf = buf_new();
+  buf_add(buf, junk, 4000);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 3*4096);
+
+  /* The freelist never grows past its high-water mark. */
+  for (i = 0; i < 299; ++i)
+    buf_add(buf, junk, 4000);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+  buf_free(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 256*4096);
+
+  /* Nothing has been unused for a whole interval yet... */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 256*4096);
+  /* ... but now it has, so we trim down to the low-water mark. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 240*4096);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 16*4096);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+
+  tt_int_op(buf_shrink_freelists(1), OP_EQ, 16*4096);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -795,17 +849,194 @@ test_buffer_peek_startswith(void *arg)
   buf_free(buf);
 }
 
+/** Number of times that count_release() has been called. */
+static int n_released = 0;
+/** Helper for test_buffer_borrowed: count calls, and check the argument. */
+static void
+count_release(void *arg)
+{
+  tt_ptr_op(arg, OP_EQ, &n_released);
+  ++n_released;
+ done:
+  ;
+}
+
+static void
+test_buffer_borrowed(void *arg)
+{
+  (void)arg;
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *mem = tor_malloc(8192);
+  char *orig = NULL;
+  char *out = tor_malloc(8192+16);
+  const char *head;
+  size_t headlen;
+  int i;
+
+  for (i = 0; i < 8192; ++i)
+    mem[i] = (char)(i * 7);
+  orig = tor_memdup(mem, 8192);
+  n_released = 0;
+
+  /* Small amounts just get copied. */
+  buf = buf_new();
+  tt_int_op(buf_add_borrowed(buf, mem, 100, count_release, &n_released),
+            OP_EQ, 100);
+  tt_int_op(n_released, OP_EQ, 1);
+  tt_int_op(buf_allocation(buf), OP_GE, 100);
+  buf_clear(buf);
+
+  /* Borrowing: an empty tail chunk gets removed, and the borrowed data
+   * isn't counted in our allocation. */
+  buf_add_chunk_with_capacity(buf, 100, 1);
+  tt_int_op(buf_add_borrowed(buf, mem, 8192, count_release, &n_released),
+            OP_EQ, 8192);
+  tt_int_op(n_released, OP_EQ, 1);
+  tt_ptr_op(buf->head, OP_EQ, buf->tail);
+  tt_ptr_op(buf->head->data, OP_EQ, mem);
+  tt_int_op(buf_allocation(buf), OP_LT, 1024);
+  buf_assert_ok(buf);
+
+  /* New data doesn't go into the borrowed memory. */
+  buf_add(buf, "Hello world", 11);
+  tt_ptr_op(buf->head, OP_NE, buf->tail);
+  tt_mem_op(mem, OP_EQ, orig, 8192);
+  tt_int_op(buf_datalen(buf), OP_EQ, 8192+11);
+  buf_assert_ok(buf);
+
+  /* Copies get their own memory. */
+  buf2 = buf_copy(buf);
+  buf_assert_ok(buf2);
+  tt_ptr_op(buf2->head->data, OP_NE, mem);
+  buf_get_bytes(buf2, out, 8192+11);
+  tt_mem_op(out, OP_EQ, orig, 8192);
+  tt_mem_op(out+8192, OP_EQ, "Hello world", 11);
+  buf_free(buf2);
+  tt_int_op(n_released, OP_EQ, 1);
+
+  /* Draining part of the borrowed chunk keeps it. */
+  buf_drain(buf, 1000);
+  tt_int_op(n_released, OP_EQ, 1);
+  buf_peek(buf, out, 100);
+  tt_mem_op(out, OP_EQ, orig+1000, 100);
+
+  /* Pulling up past the end of the borrowed chunk makes a copy. */
+  buf_pullup(buf, 8000, &head, &headlen);
+  tt_int_op(n_released, OP_EQ, 2);
+  tt_int_op(headlen, OP_EQ, 7192+11);
+  tt_mem_op(head, OP_EQ, orig+1000, 7192);
+  tt_mem_op(head+7192, OP_EQ, "Hello world", 11);
+  buf_assert_ok(buf);
+  buf_clear(buf);
+
+  /* Draining or freeing the buffer releases the memory. */
+  buf_add_borrowed(buf, mem, 4096, count_release, &n_released);
+  buf_add_borrowed(buf, mem+4096, 4096, count_release, &n_released);
+  buf_add(buf, "x", 1);
+  tt_int_op(n_released, OP_EQ, 2);
+  buf_drain(buf, 4097);
+  tt_int_op(n_released, OP_EQ, 3);
+  buf_free(buf);
+  buf = NULL;
+  tt_int_op(n_released, OP_EQ, 4);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  tor_free(mem);
+  tor_free(orig);
+  tor_free(out);
+}
+
+/** Check reading and writing buffers on a socket, with scatter-gather I/O
+ * or without it, depending on <b>arg</b>. */
+static void
+test_buffers_net_io(void *arg)
+{
+  const bool sg = !strcmp(arg, "scatter_gather");
+  const size_t len = 40000;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *out = buf_new(), *in = buf_new();
+  char *data = tor_malloc(len), *got = tor_malloc(len);
+  size_t i, flushlen;
+  int eof = 0, err = 0;
+
+  buf_net_set_scatter_gather(sg);
+  crypto_rand(data, len);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* Nothing to read yet. */
+  tt_int_op(buf_read_from_socket(in, fds[1], 100, &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+
+  /* Spread the data over lots of chunks. */
+  for (i = 0; i < len; i += 500)
+    buf_add(out, data + i, 500);
+  flushlen = len;
+  tt_int_op(buf_flush_to_socket(out, fds[0], 30000, &flushlen),
+            OP_EQ, 30000);
+  tt_int_op(flushlen, OP_EQ, len - 30000);
+  tt_int_op(buf_datalen(out), OP_EQ, len - 30000);
+
+  /* Leave a little room at the end of the first chunk, so that the next
+   * read has to use two chunks. */
+  tt_int_op(buf_read_from_socket(in, fds[1], 4000, &eof, &err),
+            OP_EQ, 4000);
+  tt_int_op(buf_read_from_socket(in, fds[1], 26000, &eof, &err),
+            OP_EQ, 26000);
+  tt_int_op(buf_datalen(in), OP_EQ, 30000);
+  buf_assert_ok(in);
+
+  tt_int_op(buf_flush_to_socket(out, fds[0], flushlen, &flushlen),
+            OP_EQ, len - 30000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+  tt_int_op(buf_read_from_socket(in, fds[1], len, &eof, &err),
+            OP_EQ, len - 30000);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_assert_ok(in);
+
+  buf_get_bytes(in, got, len);
+  tt_mem_op(got, OP_EQ, data, len);
+
+  /* Now check for EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  tt_int_op(buf_read_from_socket(in, fds[1], 100, &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+
+ done:
+  buf_net_set_scatter_gather(true);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  tor_free(data);
+  tor_free(got);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
+  { "borrowed", test_buffer_borrowed, TT_FORK, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
+  { "net_io/chunked", test_buffers_net_io, TT_FORK, &passthrough_setup,
+    (void*)"chunked" },
+  { "net_io/scatter_gather", test_buffers_net_io, TT_FORK,
+    &passthrough_setup, (void*)"scatter_gather" },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
   { "compress/zlib", test_buffers_compress, TT_FORK,
@@ -1,9 +1,11 @@
 /* Copyright (c) 2013-2019, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define CELL_POOL_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define RELAY_PRIVATE
 #include "core/or/or.h"
+#include "core/or/cell_pool.h"
 #include "core/or/circuitlist.h"
 #include "core/or/relay.h"
 #include "test/test.h"
@@ -139,9 +141,75 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cell_pool(void *arg)
+{
+  packed_cell_t **cells = NULL;
+  const cell_pool_stats_t *stats = cell_pool_get_stats();
+  const int n = CELLS_PER_SLAB * (CELL_POOL_MAX_EMPTY_SLABS + 2);
+  int i;
+  (void) arg;
+
+  cells = tor_calloc(n, sizeof(packed_cell_t *));
+  tt_int_op(cell_pool_get_total_allocation(), OP_EQ, 0);
+
+  for (i = 0; i < n; ++i) {
+    cells[i] = packed_cell_new();
+    tt_ptr_op(TOR_SIMPLEQ_NEXT(cells[i], next), OP_EQ, NULL);
+    tt_int_op(cells[i]->inserted_timestamp, OP_EQ, 0);
+    memset(cells[i]->body, 'x', sizeof(cells[i]->body));
+  }
+  tt_int_op(stats->n_full, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS + 2);
+  tt_int_op(stats->n_used, OP_EQ, 0);
+  tt_int_op(stats->n_empty, OP_EQ, 0);
+  tt_int_op(stats->peak_slabs, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS + 2);
+  tt_int_op(cell_pool_get_total_allocation(), OP_EQ,
+            (CELL_POOL_MAX_EMPTY_SLABS + 2) * sizeof(cell_slab_t));
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            n * packed_cell_mem_cost());
+
+  /* Freeing a cell makes its slab partly used, and the next cell comes from
+   * that slab. */
+  packed_cell_free(cells[5]);
+  tt_int_op(stats->n_full, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS + 1);
+  tt_int_op(stats->n_used, OP_EQ, 1);
+  cells[5] = packed_cell_new();
+  tt_int_op(stats->n_full, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS + 2);
+  tt_int_op(stats->n_used, OP_EQ, 0);
+  tt_int_op(stats->n_slabs_allocated, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS + 2);
+
+  /* Free everything: we keep a few empty slabs, but no more. */
+  for (i = 0; i < n; ++i) {
+    packed_cell_free(cells[i]);
+  }
+  tt_int_op(stats->n_full, OP_EQ, 0);
+  tt_int_op(stats->n_used, OP_EQ, 0);
+  tt_int_op(stats->n_empty, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS);
+  tt_int_op(stats->n_slabs_freed, OP_EQ, 2);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+  /* Empty slabs get reused. */
+  cells[0] = packed_cell_new();
+  tt_int_op(stats->n_used, OP_EQ, 1);
+  tt_int_op(stats->n_empty, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS - 1);
+  tt_int_op(stats->n_slabs_allocated, OP_EQ, CELL_POOL_MAX_EMPTY_SLABS + 2);
+  packed_cell_free(cells[0]);
+
+  /* Trimming frees the empty slabs. */
+  tt_int_op(cell_pool_trim(2), OP_EQ,
+            (CELL_POOL_MAX_EMPTY_SLABS - 2) * sizeof(cell_slab_t));
+  tt_int_op(stats->n_empty, OP_EQ, 2);
+  tt_int_op(cell_pool_trim(0), OP_EQ, 2 * sizeof(cell_slab_t));
+  tt_int_op(cell_pool_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  tor_free(cells);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "pool", test_cell_pool, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
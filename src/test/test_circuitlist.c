@@ -464,8 +464,61 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+/** Check the circuit ID table of a channel as it grows and as we remove
+ * entries from it in an arbitrary order. */
+static void
+test_clist_circid_table(void *arg)
+{
+  channel_t *chan = new_fake_channel();
+  const int n = 1000;
+  circid_t id;
+  int i;
+
+  (void) arg;
+
+  /* Ask for wide IDs that all land near each other, and some narrow ones. */
+  for (i = 0; i < n; ++i) {
+    id = (i % 2) ? 0x80000000u + i : (circid_t) i + 1;
+    channel_mark_circid_unusable(chan, id);
+  }
+  tt_uint_op(chan->circid_table_n, OP_EQ, n);
+  tt_uint_op(chan->circid_table_capacity, OP_GE, 2 * n);
+  for (i = 0; i < n; ++i) {
+    id = (i % 2) ? 0x80000000u + i : (circid_t) i + 1;
+    tt_int_op(circuit_id_in_use_on_channel(id, chan), OP_EQ, 2);
+    tt_int_op(circuit_id_in_use_on_channel(id + 0x40000000u, chan), OP_EQ,
+              0);
+  }
+
+  /* Remove every third one, and make sure we can still find the rest. */
+  for (i = 0; i < n; i += 3) {
+    id = (i % 2) ? 0x80000000u + i : (circid_t) i + 1;
+    channel_mark_circid_usable(chan, id);
+  }
+  for (i = 0; i < n; ++i) {
+    id = (i % 2) ? 0x80000000u + i : (circid_t) i + 1;
+    tt_int_op(circuit_id_in_use_on_channel(id, chan), OP_EQ,
+              (i % 3) ? 2 : 0);
+  }
+
+  for (i = 0; i < n; ++i) {
+    id = (i % 2) ? 0x80000000u + i : (circid_t) i + 1;
+    channel_mark_circid_usable(chan, id);
+  }
+  tt_uint_op(chan->circid_table_n, OP_EQ, 0);
+  for (i = 0; i < n; ++i) {
+    id = (i % 2) ? 0x80000000u + i : (circid_t) i + 1;
+    tt_int_op(circuit_id_in_use_on_channel(id, chan), OP_EQ, 0);
+  }
+
+ done:
+  channel_free_circid_table(chan);
+  tor_free(chan);
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "circid_table", test_clist_circid_table, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
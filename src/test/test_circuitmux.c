@@ -13,7 +13,10 @@
 #include "core/or/scheduler.h"
 #include "test/test.h"
 
+#include "app/config/or_options_st.h"
+#include "core/or/circuit_st.h"
 #include "core/or/destroy_cell_queue_st.h"
+#include "core/or/or_circuit_st.h"
 
 #include <math.h>
 
@@ -125,9 +128,237 @@ test_cmux_compute_ticks(void *arg)
   ;
 }
 
+/* Number of circuits in the ewma_heap test. */
+#define N_HEAP_CIRCS 257
+
+static void
+test_cmux_ewma_heap(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol = NULL;
+  circuitmux_policy_circ_data_t *cdata[N_HEAP_CIRCS];
+  circuit_t *circs[N_HEAP_CIRCS];
+  int n_sent[N_HEAP_CIRCS];
+  int active[N_HEAP_CIRCS];
+  or_options_t options;
+  int i, round;
+  (void)arg;
+
+  memset(cdata, 0, sizeof(cdata));
+  memset(circs, 0, sizeof(circs));
+  memset(n_sent, 0, sizeof(n_sent));
+  memset(&options, 0, sizeof(options));
+
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  options.CircuitPriorityHalflife = 30.0;
+  cmux_ewma_set_options(&options, NULL);
+
+  pol = ewma_policy.alloc_cmux_data(cmux);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, NULL);
+  for (i = 0; i < N_HEAP_CIRCS; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol, circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+    ewma_policy.notify_circ_active(cmux, pol, circs[i], cdata[i]);
+    active[i] = 1;
+  }
+
+  /* Every transmission happens at the same time, so they all weigh the
+   * same: the circuits must take turns. */
+  for (round = 0; round < 3; ++round) {
+    for (i = 0; i < N_HEAP_CIRCS; ++i) {
+      circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol);
+      int idx;
+      tt_assert(circ);
+      for (idx = 0; circs[idx] != circ; ++idx)
+        ;
+      tt_int_op(n_sent[idx], OP_EQ, round);
+      ++n_sent[idx];
+      ewma_policy.notify_xmit_cells(cmux, pol, circ, cdata[idx], 1);
+    }
+  }
+
+  /* Take every third circuit out of the heap, and move time on by a few
+   * hours so that the counts get rescaled: the circuits left must still
+   * take turns, and the inactive ones must never come up. */
+  for (i = 0; i < N_HEAP_CIRCS; i += 3) {
+    ewma_policy.notify_circ_inactive(cmux, pol, circs[i], cdata[i]);
+    active[i] = 0;
+  }
+  for (int hour = 1; hour <= 5; ++hour) {
+    monotime_coarse_set_mock_time_nsec(START_NS + hour * 3600 * NS_PER_S);
+    for (i = 0; i < N_HEAP_CIRCS; ++i) {
+      if (!active[i])
+        continue;
+      circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol);
+      int idx;
+      for (idx = 0; circs[idx] != circ; ++idx)
+        ;
+      tt_assert(active[idx]);
+      tt_int_op(n_sent[idx], OP_EQ, 2 + hour);
+      ++n_sent[idx];
+      ewma_policy.notify_xmit_cells(cmux, pol, circ, cdata[idx], 1);
+    }
+  }
+
+  /* A circuit that comes back after all that time is the quietest one. */
+  ewma_policy.notify_circ_active(cmux, pol, circs[0], cdata[0]);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux, pol), OP_EQ, circs[0]);
+
+ done:
+  for (i = 0; i < N_HEAP_CIRCS; ++i) {
+    if (cdata[i]) {
+      ewma_policy.free_circ_data(cmux, pol, circs[i], cdata[i]);
+    }
+    tor_free(circs[i]);
+  }
+  ewma_policy.free_cmux_data(cmux, pol);
+  circuitmux_free(cmux);
+  monotime_disable_test_mocking();
+}
+
+static void
+test_cmux_ewma_compare_rescaled(void *arg)
+{
+  const int64_t NS_PER_S = 1000 * 1000 * 1000;
+  const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  circuitmux_t *cmux1 = circuitmux_alloc(), *cmux2 = circuitmux_alloc();
+  circuitmux_policy_data_t *pol1 = NULL, *pol2 = NULL;
+  circuitmux_policy_circ_data_t *cdata1 = NULL, *cdata2 = NULL;
+  circuit_t *circ1 = tor_malloc_zero(sizeof(circuit_t));
+  circuit_t *circ2 = tor_malloc_zero(sizeof(circuit_t));
+  or_options_t options;
+  (void)arg;
+
+  memset(&options, 0, sizeof(options));
+  circuitmux_ewma_free_all();
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NS);
+  /* One tick of halflife: counts get rescaled every 64 ticks. */
+  options.CircuitPriorityHalflife = 10.0;
+  cmux_ewma_set_options(&options, NULL);
+
+  pol1 = ewma_policy.alloc_cmux_data(cmux1);
+  pol2 = ewma_policy.alloc_cmux_data(cmux2);
+  cdata1 = ewma_policy.alloc_circ_data(cmux1, pol1, circ1,
+                                       CELL_DIRECTION_OUT, 0);
+  cdata2 = ewma_policy.alloc_circ_data(cmux2, pol2, circ2,
+                                       CELL_DIRECTION_OUT, 0);
+  ewma_policy.notify_circ_active(cmux1, pol1, circ1, cdata1);
+  ewma_policy.notify_circ_active(cmux2, pol2, circ2, cdata2);
+
+  /* The first circuit sends a lot now... */
+  ewma_policy.notify_xmit_cells(cmux1, pol1, circ1, cdata1, 100);
+  tt_int_op(ewma_policy.cmp_cmux(cmux1, pol1, cmux2, pol2), OP_EQ, 1);
+
+  /* ...and the second one a little, 100 ticks later. The second cmux has
+   * been rescaled since, the first one not, but the first circuit's cells
+   * are long forgotten. */
+  monotime_coarse_set_mock_time_nsec(START_NS + 1000 * NS_PER_S);
+  ewma_policy.notify_xmit_cells(cmux2, pol2, circ2, cdata2, 10);
+  tt_int_op(ewma_policy.cmp_cmux(cmux1, pol1, cmux2, pol2), OP_EQ, -1);
+  tt_int_op(ewma_policy.cmp_cmux(cmux2, pol2, cmux1, pol1), OP_EQ, 1);
+
+ done:
+  ewma_policy.free_circ_data(cmux1, pol1, circ1, cdata1);
+  ewma_policy.free_circ_data(cmux2, pol2, circ2, cdata2);
+  ewma_policy.free_cmux_data(cmux1, pol1);
+  ewma_policy.free_cmux_data(cmux2, pol2);
+  circuitmux_free(cmux1);
+  circuitmux_free(cmux2);
+  tor_free(circ1);
+  tor_free(circ2);
+  monotime_disable_test_mocking();
+}
+
+/** Check that we find attached circuits whether or not the slot hints they
+ * keep are right. */
+static void
+test_cmux_slot_hints(void *arg)
+{
+  circuitmux_t *cmux1 = NULL, *cmux2 = NULL;
+  channel_t *chan = NULL;
+  or_circuit_t *circs[4] = { NULL };
+  int i;
+
+  (void) arg;
+
+  scheduler_init();
+
+  cmux1 = circuitmux_alloc();
+  cmux2 = circuitmux_alloc();
+  circuitmux_set_policy(cmux1, &ewma_policy);
+  circuitmux_set_policy(cmux2, &ewma_policy);
+  chan = new_fake_channel();
+  for (i = 0; i < 4; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->base_.magic = OR_CIRCUIT_MAGIC;
+    circs[i]->base_.n_chan = chan;
+    circs[i]->base_.n_circ_id = 10 + i;
+  }
+
+  for (i = 0; i < 3; ++i)
+    circuitmux_attach_circuit(cmux1, TO_CIRCUIT(circs[i]),
+                              CELL_DIRECTION_OUT);
+  tt_int_op(circs[0]->base_.n_mux_slot, OP_EQ, 0);
+  tt_int_op(circs[2]->base_.n_mux_slot, OP_EQ, 2);
+
+  /* A detached circuit's slot gets reused. */
+  circuitmux_detach_circuit(cmux1, TO_CIRCUIT(circs[1]));
+  tt_assert(!circuitmux_is_circuit_attached(cmux1, TO_CIRCUIT(circs[1])));
+  circuitmux_attach_circuit(cmux1, TO_CIRCUIT(circs[3]),
+                            CELL_DIRECTION_OUT);
+  tt_int_op(circs[3]->base_.n_mux_slot, OP_EQ, 1);
+  /* The old hint of circs[1] now points at circs[3]'s entry. */
+  tt_int_op(circs[1]->base_.n_mux_slot, OP_EQ, 1);
+  tt_assert(!circuitmux_is_circuit_attached(cmux1, TO_CIRCUIT(circs[1])));
+
+  /* Wrong hints are ignored, and fixed when we find the circuit. */
+  circs[0]->base_.n_mux_slot = 2;
+  circs[2]->base_.n_mux_slot = 1000;
+  circuitmux_set_num_cells(cmux1, TO_CIRCUIT(circs[0]), 3);
+  circuitmux_set_num_cells(cmux1, TO_CIRCUIT(circs[2]), 5);
+  tt_int_op(circs[0]->base_.n_mux_slot, OP_EQ, 0);
+  tt_int_op(circs[2]->base_.n_mux_slot, OP_EQ, 2);
+  tt_uint_op(circuitmux_num_cells_for_circuit(cmux1, TO_CIRCUIT(circs[0])),
+             OP_EQ, 3);
+  tt_uint_op(circuitmux_num_cells_for_circuit(cmux1, TO_CIRCUIT(circs[2])),
+             OP_EQ, 5);
+  tt_uint_op(circuitmux_num_cells(cmux1), OP_EQ, 8);
+  tt_uint_op(circuitmux_num_active_circuits(cmux1), OP_EQ, 2);
+
+  /* A hint from another circuitmux finds nothing there. */
+  circuitmux_attach_circuit(cmux2, TO_CIRCUIT(circs[1]),
+                            CELL_DIRECTION_OUT);
+  tt_int_op(circs[1]->base_.n_mux_slot, OP_EQ, 0);
+  tt_assert(!circuitmux_is_circuit_attached(cmux2, TO_CIRCUIT(circs[0])));
+  tt_assert(!circuitmux_is_circuit_attached(cmux1, TO_CIRCUIT(circs[1])));
+  tt_assert(circuitmux_is_circuit_attached(cmux2, TO_CIRCUIT(circs[1])));
+
+ done:
+  for (i = 0; i < 4; ++i) {
+    if (!circs[i])
+      continue;
+    circuitmux_detach_circuit(cmux1, TO_CIRCUIT(circs[i]));
+    circuitmux_detach_circuit(cmux2, TO_CIRCUIT(circs[i]));
+    tor_free(circs[i]);
+  }
+  circuitmux_free(cmux1);
+  circuitmux_free(cmux2);
+  channel_free(chan);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
   { "compute_ticks", test_cmux_compute_ticks, TT_FORK, NULL, NULL },
+  { "ewma_heap", test_cmux_ewma_heap, TT_FORK, NULL, NULL },
+  { "ewma_compare_rescaled", test_cmux_ewma_compare_rescaled, TT_FORK,
+    NULL, NULL },
+  { "slot_hints", test_cmux_slot_hints, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
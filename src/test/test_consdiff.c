@@ -95,9 +95,9 @@ test_consdiff_smartlist_slice_string_pos(void *arg)
 
   /* See that smartlist_slice_string_pos respects the bounds of the slice. */
   sls = smartlist_slice(sl, 2, 5);
-  cdline_t a_line = { "a", 1 };
+  cdline_t a_line = { "a", 1, 0 };
   tt_int_op(3, OP_EQ, smartlist_slice_string_pos(sls, &a_line));
-  cdline_t d_line = { "d", 1 };
+  cdline_t d_line = { "d", 1, 0 };
   tt_int_op(-1, OP_EQ, smartlist_slice_string_pos(sls, &d_line));
 
  done:
@@ -141,6 +141,60 @@ test_consdiff_lcs_lengths(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_line_ids(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  int *lengths1 = NULL, *lengths2 = NULL;
+  memarea_t *area = memarea_new();
+  int e_lengths1[] = { 0, 1, 2, 3, 3, 4 };
+  int e_lengths2[] = { 0, 1, 1, 2, 3, 4 };
+
+  (void)arg;
+  consensus_split_lines_(sl1, "a\nb\nc\nd\ne\n", area);
+  consensus_split_lines_(sl2, "a\nc\nd\ni\ne\n", area);
+  SMARTLIST_FOREACH(sl1, cdline_t *, line, tt_int_op(line->id, OP_EQ, 0));
+
+  /* Lines with the same contents get the same id, and only those. */
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  assign_line_ids(sls1, sls2, area);
+  SMARTLIST_FOREACH(sl1, cdline_t *, line, tt_int_op(line->id, OP_NE, 0));
+  SMARTLIST_FOREACH(sl2, cdline_t *, line, tt_int_op(line->id, OP_NE, 0));
+  tt_int_op(((cdline_t *)smartlist_get(sl1, 0))->id, OP_EQ,
+            ((cdline_t *)smartlist_get(sl2, 0))->id);
+  tt_int_op(((cdline_t *)smartlist_get(sl1, 4))->id, OP_EQ,
+            ((cdline_t *)smartlist_get(sl2, 4))->id);
+  tt_int_op(((cdline_t *)smartlist_get(sl1, 1))->id, OP_NE,
+            ((cdline_t *)smartlist_get(sl2, 3))->id);
+  tt_int_op(((cdline_t *)smartlist_get(sl1, 0))->id, OP_NE,
+            ((cdline_t *)smartlist_get(sl1, 1))->id);
+  tt_assert(lines_eq(smartlist_get(sl1, 2), smartlist_get(sl2, 1)));
+  tt_assert(!lines_eq(smartlist_get(sl1, 2), smartlist_get(sl2, 2)));
+  tt_str_eq_line("c", smartlist_get(sl2, 1));
+
+  /* The LCS is the same as when we compare contents. */
+  lengths1 = lcs_lengths(sls1, sls2, 1);
+  lengths2 = lcs_lengths(sls1, sls2, -1);
+  tt_mem_op(e_lengths1, OP_EQ, lengths1, sizeof(int) * 6);
+  tt_mem_op(e_lengths2, OP_EQ, lengths2, sizeof(int) * 6);
+
+  clear_line_ids(sls1);
+  clear_line_ids(sls2);
+  SMARTLIST_FOREACH(sl2, cdline_t *, line, tt_int_op(line->id, OP_EQ, 0));
+
+ done:
+  tor_free(lengths1);
+  tor_free(lengths2);
+  tor_free(sls1);
+  tor_free(sls2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_trim_slices(void *arg)
 {
@@ -348,9 +402,9 @@ test_consdiff_get_id_hash(void *arg)
 {
   (void)arg;
 
-  cdline_t line1 = { "r name", 6 };
-  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28 };
-  cdline_t line3 = { "r name hash+valid+base64 etc", 28 };
+  cdline_t line1 = { "r name", 6, 0 };
+  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28, 0 };
+  cdline_t line3 = { "r name hash+valid+base64 etc", 28, 0 };
   cdline_t tmp;
 
   /* No hash. */
@@ -372,15 +426,15 @@ test_consdiff_is_valid_router_entry(void *arg)
 {
   /* Doesn't start with "r ". */
   (void)arg;
-  cdline_t line0 = { "foo", 3 };
+  cdline_t line0 = { "foo", 3, 0 };
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line0));
 
   /* These are already tested with get_id_hash, but make sure it's run
    * properly. */
 
-  cdline_t line1 = { "r name", 6 };
-  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28 };
-  cdline_t line3 = { "r name hash+valid+base64 etc", 28 };
+  cdline_t line1 = { "r name", 6, 0 };
+  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28, 0 };
+  cdline_t line3 = { "r name hash+valid+base64 etc", 28, 0 };
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line1));
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line2));
   tt_int_op(1, OP_EQ, is_valid_router_entry(&line3));
@@ -423,8 +477,8 @@ test_consdiff_next_router(void *arg)
 static int
 base64cmp_wrapper(const char *a, const char *b)
 {
-  cdline_t aa = { a, a ? (uint32_t) strlen(a) : 0 };
-  cdline_t bb = { b, b ? (uint32_t) strlen(b) : 0 };
+  cdline_t aa = { a, a ? (uint32_t) strlen(a) : 0, 0 };
+  cdline_t bb = { b, b ? (uint32_t) strlen(b) : 0, 0 };
   return base64cmp(&aa, &bb);
 }
 
@@ -923,6 +977,74 @@ test_consdiff_apply_ed_diff(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_apply_ed_diff_to_string(void *arg)
+{
+  const char *cons1 = "A\nB\nC\nD\nE\n";
+  const size_t cons1_len = strlen(cons1);
+  smartlist_t *diff=NULL;
+  char *cons2=NULL;
+  uint8_t digest[DIGEST256_LEN], e_digest[DIGEST256_LEN];
+  memarea_t *area = memarea_new();
+  (void)arg;
+  diff = smartlist_new();
+  setup_capture_of_logs(LOG_WARN);
+
+  /* Bad ed diffs are refused, as with apply_ed_diff. */
+  smartlist_add_linecpy(diff, area, "1d");
+  smartlist_add_linecpy(diff, area, "3d");
+  cons2 = apply_ed_diff_to_string(cons1, cons1_len, diff, 0, NULL);
+  tt_ptr_op(NULL, OP_EQ, cons2);
+  expect_single_log_msg_containing("its commands are not properly sorted");
+
+  smartlist_clear(diff);
+
+  /* So are commands past the end of the consensus. */
+  smartlist_add_linecpy(diff, area, "6d");
+  mock_clean_saved_logs();
+  cons2 = apply_ed_diff_to_string(cons1, cons1_len, diff, 0, NULL);
+  tt_ptr_op(NULL, OP_EQ, cons2);
+  expect_single_log_msg_containing("its commands are not properly sorted");
+
+  smartlist_clear(diff);
+
+  /* 'a', 'd' and 'c' together. */
+  consensus_split_lines_(diff, "4c\nT\nX\n.\n2d\n0a\nM\n.\n", area);
+  cons2 = apply_ed_diff_to_string(cons1, cons1_len, diff, 0, NULL);
+  tt_str_op(cons2, OP_EQ, "M\nA\nC\nT\nX\nE\n");
+
+  smartlist_clear(diff);
+  tor_free(cons2);
+
+  /* Two additions after the same line, and a deletion up to the end. The
+   * digest is the one of the result. */
+  consensus_split_lines_(diff, "4,$d\n3a\nY\n.\n3a\nZ\n.\n", area);
+  cons2 = apply_ed_diff_to_string(cons1, cons1_len, diff, 0, digest);
+  tt_str_op(cons2, OP_EQ, "A\nB\nC\nZ\nY\n");
+  crypto_digest256((char *)e_digest, cons2, strlen(cons2), DIGEST_SHA3_256);
+  tt_mem_op(digest, OP_EQ, e_digest, DIGEST256_LEN);
+
+  smartlist_clear(diff);
+  tor_free(cons2);
+
+  /* An empty ed diff gives back the same consensus. */
+  cons2 = apply_ed_diff_to_string(cons1, cons1_len, diff, 0, NULL);
+  tt_str_op(cons2, OP_EQ, cons1);
+  tor_free(cons2);
+
+  /* A base consensus that doesn't end with a newline is refused. */
+  mock_clean_saved_logs();
+  cons2 = apply_ed_diff_to_string(cons1, cons1_len - 1, diff, 0, NULL);
+  tt_ptr_op(NULL, OP_EQ, cons2);
+  expect_single_log_msg_containing("not made of lines");
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(cons2);
+  smartlist_free(diff);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_gen_diff(void *arg)
 {
@@ -1008,12 +1130,11 @@ test_consdiff_gen_diff(void *arg)
 static void
 test_consdiff_apply_diff(void *arg)
 {
-  smartlist_t *cons1=NULL, *diff=NULL;
+  smartlist_t *diff=NULL;
   char *cons1_str=NULL, *cons2 = NULL;
   consensus_digest_t digests1;
   (void)arg;
   memarea_t *area = memarea_new();
-  cons1 = smartlist_new();
   diff = smartlist_new();
   setup_capture_of_logs(LOG_INFO);
 
@@ -1025,10 +1146,10 @@ test_consdiff_apply_diff(void *arg)
       );
   tt_int_op(0, OP_EQ,
       consensus_compute_digest_(cons1_str, &digests1));
-  consensus_split_lines_(cons1, cons1_str, area);
 
   /* diff doesn't have enough lines. */
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("too short")
 
@@ -1036,7 +1157,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "foo-bar");
   smartlist_add_linecpy(diff, area, "header-line");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("format is not known")
 
@@ -1046,7 +1168,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "word a b");
   smartlist_add_linecpy(diff, area, "x");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests")
 
@@ -1055,7 +1178,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash a b c");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("does not include the necessary digests")
 
@@ -1064,7 +1188,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "network-status-diff-version 1");
   smartlist_add_linecpy(diff, area, "hash aaa bbb");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes base16-encoded digests of "
                                    "incorrect size")
@@ -1076,7 +1201,8 @@ test_consdiff_apply_diff(void *arg)
       " ????????????????????????????????????????????????????????????????"
       " ----------------------------------------------------------------");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("includes malformed digests")
 
@@ -1092,7 +1218,8 @@ test_consdiff_apply_diff(void *arg)
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   smartlist_add_linecpy(diff, area, "foobar");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_single_log_msg_containing("because an ed command was missing a line "
                                    "number")
@@ -1106,7 +1233,8 @@ test_consdiff_apply_diff(void *arg)
       /* sha256 of cons2. */
       " 635D34593020C08E5ECD865F9986E29D50028EFA62843766A8197AD228A7F6AA");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("base consensus doesn't match the digest "
                             "as found");
@@ -1120,7 +1248,8 @@ test_consdiff_apply_diff(void *arg)
       /* bogus sha3. */
       " 3333333333333333333333333333333333333333333333333333333333333333");
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("resulting consensus doesn't match the "
                             "digest as found");
@@ -1137,7 +1266,8 @@ test_consdiff_apply_diff(void *arg)
       " 3333333333333333333333333333333333333333333333333333333333333333");
   smartlist_add_linecpy(diff, area, "1,2d"); // remove starting line
   mock_clean_saved_logs();
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_EQ, cons2);
   expect_log_msg_containing("Could not compute digests of the consensus "
                             "resulting from applying a consensus diff.");
@@ -1154,7 +1284,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1175,7 +1306,8 @@ test_consdiff_apply_diff(void *arg)
   smartlist_add_linecpy(diff, area, "3c");
   smartlist_add_linecpy(diff, area, "sample");
   smartlist_add_linecpy(diff, area, ".");
-  cons2 = consdiff_apply_diff(cons1, diff, &digests1);
+  cons2 = consdiff_apply_diff(cons1_str, strlen(cons1_str), diff,
+                              &digests1);
   tt_ptr_op(NULL, OP_NE, cons2);
   tt_str_op(
       "network-status-version foo\n"
@@ -1190,7 +1322,6 @@ test_consdiff_apply_diff(void *arg)
  done:
   teardown_capture_of_logs();
   tor_free(cons1_str);
-  smartlist_free(cons1);
   smartlist_free(diff);
   memarea_drop_all(area);
 }
@@ -1202,6 +1333,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(smartlist_slice),
   CONSDIFF_LEGACY(smartlist_slice_string_pos),
   CONSDIFF_LEGACY(lcs_lengths),
+  CONSDIFF_LEGACY(line_ids),
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
@@ -1211,6 +1343,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(base64cmp),
   CONSDIFF_LEGACY(gen_ed_diff),
   CONSDIFF_LEGACY(apply_ed_diff),
+  CONSDIFF_LEGACY(apply_ed_diff_to_string),
   CONSDIFF_LEGACY(gen_diff),
   CONSDIFF_LEGACY(apply_diff),
   END_OF_TESTCASES
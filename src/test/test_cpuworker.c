@@ -0,0 +1,170 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/onion_ntor.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/onion.h"
+#include "feature/relay/onion_queue.h"
+#include "feature/relay/router.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
+
+#include "core/or/or_circuit_st.h"
+
+#include "test/test.h"
+#include "test/fakechans.h"
+
+/* Lets the test hold every worker thread busy, so that the onionskins it
+ * queues stay pending. */
+static tor_mutex_t blocker_lock;
+static tor_cond_t blocker_cond;
+static int n_blockers_running = 0;
+static int blockers_released = 0;
+
+static workqueue_reply_t
+blocker_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  (void) work_;
+  tor_mutex_acquire(&blocker_lock);
+  ++n_blockers_running;
+  tor_cond_signal_all(&blocker_cond);
+  while (!blockers_released)
+    tor_cond_wait(&blocker_cond, &blocker_lock, NULL);
+  tor_mutex_release(&blocker_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+blocker_replyfn(void *work_)
+{
+  (void) work_;
+}
+
+static int n_marked = 0;
+
+static void
+mock_circuit_mark_for_close_(circuit_t *circ, int reason, int line,
+                             const char *file)
+{
+  (void) line;
+  (void) file;
+  circ->marked_for_close_reason = reason;
+  ++n_marked;
+}
+
+static void
+release_blockers(void)
+{
+  tor_mutex_acquire(&blocker_lock);
+  blockers_released = 1;
+  tor_cond_signal_all(&blocker_cond);
+  tor_mutex_release(&blocker_lock);
+}
+
+/* Free a circuit while its onionskin waits in a batch with others, and make
+ * sure that the rest of the batch still gets answered. */
+static void
+test_cpuworker_cancel_in_batch(void *arg)
+{
+  const int n_threads = 2;
+  channel_t *chan = NULL;
+  or_circuit_t *circ[4];
+  workqueue_entry_t *other_batch;
+  uint8_t buf[NTOR_ONIONSKIN_LEN];
+  int i;
+  (void) arg;
+
+  memset(circ, 0, sizeof(circ));
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_);
+  tor_mutex_init_for_cond(&blocker_lock);
+  tor_cond_init(&blocker_cond);
+
+  /* One CPU gives us two worker threads. */
+  get_options_mutable()->NumCPUs = n_threads - 1;
+  tt_int_op(init_keys_client(), OP_EQ, 0);
+  cpu_init();
+
+  for (i = 0; i < n_threads; ++i) {
+    tt_assert(cpuworker_queue_work(WQ_PRI_HIGH, blocker_threadfn,
+                                   blocker_replyfn, NULL));
+  }
+  tor_mutex_acquire(&blocker_lock);
+  while (n_blockers_running < n_threads)
+    tor_cond_wait(&blocker_cond, &blocker_lock, NULL);
+  tor_mutex_release(&blocker_lock);
+
+  /* These onionskins are for some other relay, so the workers will refuse
+   * them once they get to them. */
+  memset(buf, 'x', sizeof(buf));
+  chan = new_fake_channel();
+  for (i = 0; i < 4; ++i) {
+    create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    circ[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(circ[i])->purpose = CIRCUIT_PURPOSE_OR;
+    TO_CIRCUIT(circ[i])->state = CIRCUIT_STATE_ONIONSKIN_PENDING;
+    circ[i]->p_chan = chan;
+    tt_int_op(onion_pending_add(circ[i], cc), OP_EQ, 0);
+  }
+
+  /* Four waiting onionskins for two threads make two batches of two. */
+  queue_pending_tasks();
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 0);
+  for (i = 0; i < 4; ++i) {
+    tt_assert(circ[i]->workqueue_entry);
+    circ[i]->p_chan = NULL;
+  }
+  tt_ptr_op(circ[0]->workqueue_entry, OP_EQ, circ[1]->workqueue_entry);
+  tt_ptr_op(circ[2]->workqueue_entry, OP_EQ, circ[3]->workqueue_entry);
+  tt_ptr_op(circ[0]->workqueue_entry, OP_NE, circ[2]->workqueue_entry);
+  other_batch = circ[2]->workqueue_entry;
+
+  /* This is what circuit_about_to_free() does for a circuit that's waiting
+   * for its onionskin.  The rest of its batch goes back to the workers. */
+  onion_pending_remove(circ[0]);
+  tt_ptr_op(circ[0]->workqueue_entry, OP_EQ, NULL);
+  circuit_free_(TO_CIRCUIT(circ[0]));
+  circ[0] = NULL;
+  tt_assert(circ[1]->workqueue_entry);
+  tt_ptr_op(circ[2]->workqueue_entry, OP_EQ, other_batch);
+  tt_ptr_op(circ[3]->workqueue_entry, OP_EQ, other_batch);
+
+  /* Every other circuit gets its answer. */
+  release_blockers();
+  for (i = 0; i < 100; ++i) {
+    if (!circ[1]->workqueue_entry && !circ[2]->workqueue_entry &&
+        !circ[3]->workqueue_entry)
+      break;
+    tor_libevent_run_event_loop(tor_libevent_get_base(), 1);
+  }
+  tt_int_op(n_marked, OP_EQ, 3);
+  for (i = 1; i < 4; ++i) {
+    tt_ptr_op(circ[i]->workqueue_entry, OP_EQ, NULL);
+    tt_int_op(TO_CIRCUIT(circ[i])->marked_for_close_reason, OP_EQ,
+              END_CIRC_REASON_TORPROTOCOL);
+  }
+
+ done:
+  UNMOCK(circuit_mark_for_close_);
+  release_blockers();
+  for (i = 0; i < 4; ++i) {
+    if (circ[i])
+      circ[i]->p_chan = NULL;
+  }
+  circuit_free_all();
+  free_fake_channel(chan);
+}
+
+struct testcase_t cpuworker_tests[] = {
+  { "cancel_in_batch", test_cpuworker_cancel_in_batch, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -468,6 +468,106 @@ test_crypto_aes_ctr_testvec(void *arg)
   crypto_cipher_free(c);
 }
 
+/** Check that crypto_cipher_crypt_inplace_multi() gives the same result as
+ * calling crypto_cipher_crypt_inplace() on each buffer in turn. */
+static void
+test_crypto_aes_multi(void *arg)
+{
+  crypto_cipher_t *c1 = NULL, *c2 = NULL;
+  char key[CIPHER_KEY_LEN];
+  char *bufs1[32], *bufs2[32];
+  /* Buffer lengths: less than a block, not a multiple of the block size,
+   * and cell-sized; with enough buffers to need more than one round of
+   * keystream. */
+  const size_t lens[] = { 7, 16, 509, 4096 };
+  unsigned i, j;
+  (void)arg;
+
+  memset(bufs1, 0, sizeof(bufs1));
+  memset(bufs2, 0, sizeof(bufs2));
+  crypto_rand(key, sizeof(key));
+  c1 = crypto_cipher_new(key);
+  c2 = crypto_cipher_new(key);
+
+  for (i = 0; i < ARRAY_LENGTH(lens); ++i) {
+    const size_t len = lens[i];
+    for (j = 0; j < ARRAY_LENGTH(bufs1); ++j) {
+      bufs1[j] = tor_malloc(len);
+      crypto_rand(bufs1[j], len);
+      bufs2[j] = tor_memdup(bufs1[j], len);
+    }
+
+    /* Don't always start at a block boundary. */
+    crypto_cipher_crypt_inplace(c1, bufs1[0], 3);
+    crypto_cipher_crypt_inplace(c2, bufs2[0], 3);
+
+    for (j = 0; j < ARRAY_LENGTH(bufs1); ++j)
+      crypto_cipher_crypt_inplace(c1, bufs1[j], len);
+    crypto_cipher_crypt_inplace_multi(c2, bufs2, 1, len);
+    crypto_cipher_crypt_inplace_multi(c2, bufs2+1, ARRAY_LENGTH(bufs2)-1,
+                                      len);
+    /* An empty batch is fine, and doesn't use any keystream. */
+    crypto_cipher_crypt_inplace_multi(c2, bufs2, 0, len);
+
+    for (j = 0; j < ARRAY_LENGTH(bufs1); ++j) {
+      tt_mem_op(bufs1[j], OP_EQ, bufs2[j], len);
+      tor_free(bufs1[j]);
+      tor_free(bufs2[j]);
+    }
+  }
+
+ done:
+  for (j = 0; j < ARRAY_LENGTH(bufs1); ++j) {
+    tor_free(bufs1[j]);
+    tor_free(bufs2[j]);
+  }
+  crypto_cipher_free(c1);
+  crypto_cipher_free(c2);
+}
+
+/** Check that we can save and restore the state of a digest with a
+ * crypto_digest_checkpoint_t. */
+static void
+test_crypto_digest_checkpoint(void *arg)
+{
+  crypto_digest_t *d1 = NULL, *d2 = NULL;
+  crypto_digest_checkpoint_t ckpt;
+  char out1[DIGEST_LEN], out2[DIGEST_LEN];
+  (void)arg;
+
+  d1 = crypto_digest_new();
+  d2 = crypto_digest_new();
+  crypto_digest_add_bytes(d1, "abc", 3);
+  crypto_digest_add_bytes(d2, "abc", 3);
+
+  crypto_digest_checkpoint(&ckpt, d1);
+  tt_uint_op(ckpt.bytes_used, OP_GT, 0);
+  tt_uint_op(ckpt.bytes_used, OP_LE, sizeof(ckpt.mem));
+  crypto_digest_add_bytes(d1, "xyzzy", 5);
+  crypto_digest_get_digest(d1, out1, sizeof(out1));
+  crypto_digest_get_digest(d2, out2, sizeof(out2));
+  tt_mem_op(out1, OP_NE, out2, DIGEST_LEN);
+
+  crypto_digest_restore(d1, &ckpt);
+  crypto_digest_get_digest(d1, out1, sizeof(out1));
+  tt_mem_op(out1, OP_EQ, out2, DIGEST_LEN);
+
+  /* The digest keeps working after a restore. */
+  crypto_digest_add_bytes(d1, "def", 3);
+  crypto_digest_add_bytes(d2, "def", 3);
+  crypto_digest_get_digest(d1, out1, sizeof(out1));
+  crypto_digest_get_digest(d2, out2, sizeof(out2));
+  tt_mem_op(out1, OP_EQ, out2, DIGEST_LEN);
+
+  crypto_digest_checkpoint_clear(&ckpt);
+  tt_uint_op(ckpt.bytes_used, OP_EQ, 0);
+  tt_assert(fast_mem_is_zero((char*)ckpt.mem, sizeof(out1)));
+
+ done:
+  crypto_digest_free(d1);
+  crypto_digest_free(d2);
+}
+
 /** Run unit tests for our SHA-1 functionality */
 static void
 test_crypto_sha(void *arg)
@@ -2993,7 +3093,9 @@ struct testcase_t crypto_tests[] = {
     &passthrough_setup, (void*)"192" },
   { "aes256_ctr_testvec", test_crypto_aes_ctr_testvec, 0,
     &passthrough_setup, (void*)"256" },
+  { "aes_multi", test_crypto_aes_multi, 0, NULL, NULL },
   CRYPTO_LEGACY(sha),
+  { "digest_checkpoint", test_crypto_digest_checkpoint, 0, NULL, NULL },
   CRYPTO_LEGACY(pk),
   { "pk_fingerprints", test_crypto_pk_fingerprints, TT_FORK, NULL, NULL },
   { "pk_base64", test_crypto_pk_base64, TT_FORK, NULL, NULL },
@@ -1521,6 +1521,61 @@ test_dir_parse_router_list(void *arg)
 #undef ADD
 }
 
+static void
+test_dir_parse_router_list_ed_batch(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+  char d[DIGEST_LEN];
+  int i;
+
+  /* Enough good documents that their signatures really get checked as a
+   * batch, with bad ones in among them. */
+  smartlist_add_strdup(chunks, EX_EI_GOOD_ED_EI);  // ei 0
+  smartlist_add_strdup(chunks, EX_EI_ED_BAD_SIG1); // bad ei --
+  smartlist_add_strdup(chunks, EX_EI_GOOD_ED_EI);  // ei 1
+  smartlist_add_strdup(chunks, EX_EI_MINIMAL);     // ei 2
+  smartlist_add_strdup(chunks, EX_EI_GOOD_ED_EI);  // ei 3
+  smartlist_add_strdup(chunks, EX_EI_ED_BAD_SIG2); // bad ei --
+  smartlist_add_strdup(chunks, EX_EI_GOOD_ED_EI);  // ei 4
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          1, 0, NULL, invalid));
+
+  /* The good ones survive, in order. */
+  tt_int_op(5, OP_EQ, smartlist_len(dest));
+  for (i = 0; i < 5; ++i) {
+    const char *expected = (i == 2) ? EX_EI_MINIMAL : EX_EI_GOOD_ED_EI;
+    extrainfo_t *e = smartlist_get(dest, i);
+    tt_assert(!strcmpstart(expected, e->cache_info.signed_descriptor_body));
+  }
+
+  /* The bad ones are reported as invalid. */
+  tt_int_op(2, OP_EQ, smartlist_len(invalid));
+  tt_int_op(0, OP_EQ, router_get_extrainfo_hash(EX_EI_ED_BAD_SIG1,
+                                       strlen(EX_EI_ED_BAD_SIG1), d));
+  tt_mem_op(smartlist_get(invalid, 0), OP_EQ, d, DIGEST_LEN);
+  tt_int_op(0, OP_EQ, router_get_extrainfo_hash(EX_EI_ED_BAD_SIG2,
+                                       strlen(EX_EI_ED_BAD_SIG2), d));
+  tt_mem_op(smartlist_get(invalid, 1), OP_EQ, d, DIGEST_LEN);
+
+ done:
+  tor_free(list);
+  SMARTLIST_FOREACH(dest, extrainfo_t *, ei, extrainfo_free(ei));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(chunks, char *, chunk, tor_free(chunk));
+  smartlist_free(chunks);
+}
+
 static download_status_t dls_minimal;
 static download_status_t dls_maximal;
 static download_status_t dls_bad_fingerprint;
@@ -7241,6 +7296,7 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_ed_batch, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR(getinfo_extra, 0),
@@ -798,6 +798,249 @@ NS(test_main)(void *arg)
 
 #undef NS_SUBMODULE
 
+/* Put a PENDING resolve for <b>address</b>, waiting for an IPv4 answer, in
+ * the DNS cache, and add it to <b>pending</b> so that the test can free it
+ * once it is DONE. */
+static void
+add_pending_resolve(const char *address, smartlist_t *pending)
+{
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_PENDING;
+  resolve->minheap_idx = -1;
+  resolve->clock_idx = -1;
+  resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+  strlcpy(resolve->address, address, sizeof(resolve->address));
+  dns_insert_cache_entry(resolve);
+  smartlist_add(pending, resolve);
+}
+
+/* Return the cache entry for <b>address</b>, or NULL if there is none. */
+static cached_resolve_t *
+get_cache_entry(const char *address)
+{
+  cached_resolve_t query;
+  strlcpy(query.address, address, sizeof(query.address));
+  return dns_get_cache_entry(&query);
+}
+
+/* Resolve <b>address</b> to the IPv4 address <b>ip</b> with <b>ttl</b>. */
+static void
+answer_ipv4(const char *address, const char *ip, uint32_t ttl)
+{
+  tor_addr_t addr;
+  tor_addr_parse(&addr, ip);
+  dns_found_answer(address, DNS_IPv4_A, DNS_ERR_NONE, &addr, NULL, ttl);
+}
+
+/* Return the answer to the GETINFO question <b>question</b>, as a number. */
+static uint64_t
+getinfo_dns_number(const char *question)
+{
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  uint64_t n;
+  tt_int_op(getinfo_helper_dns(NULL, question, &answer, &errmsg), OP_EQ, 0);
+  tt_assert(answer);
+  n = tor_parse_uint64(answer, 10, 0, UINT64_MAX, NULL, NULL);
+  tor_free(answer);
+  return n;
+ done:
+  tor_free(answer);
+  return UINT64_MAX;
+}
+
+static void
+test_dns_cache_eviction(void *arg)
+{
+  smartlist_t *pending = smartlist_new();
+  const size_t entry_size = sizeof(cached_resolve_t);
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  (void)arg;
+
+  dns_init();
+  get_options_mutable()->ServerDNSCacheMaxSize = 3 * entry_size;
+
+  add_pending_resolve("a.example", pending);
+  answer_ipv4("a.example", "10.0.0.1", 60);
+  add_pending_resolve("b.example", pending);
+  answer_ipv4("b.example", "10.0.0.2", 60);
+  add_pending_resolve("c.example", pending);
+  answer_ipv4("c.example", "10.0.0.3", 60);
+  tt_assert(get_cache_entry("a.example"));
+  tt_int_op(get_cache_entry("a.example")->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(cached_resolve_size(get_cache_entry("a.example")), OP_EQ,
+            entry_size);
+  tt_u64_op(getinfo_dns_number("dns/cache/entries"), OP_EQ, 3);
+  tt_u64_op(getinfo_dns_number("dns/cache/evictions"), OP_EQ, 0);
+
+  /* A stream uses a.example, so it gets a second chance, and b.example goes
+   * first. */
+  dns_cache_note_hit(get_cache_entry("a.example"), time(NULL));
+  add_pending_resolve("d.example", pending);
+  answer_ipv4("d.example", "10.0.0.4", 60);
+  tt_assert(get_cache_entry("a.example"));
+  tt_assert(! get_cache_entry("b.example"));
+  tt_assert(get_cache_entry("c.example"));
+  tt_assert(get_cache_entry("d.example"));
+  tt_assert(! get_cache_entry("a.example")->referenced);
+  tt_u64_op(getinfo_dns_number("dns/cache/entries"), OP_EQ, 3);
+  tt_u64_op(getinfo_dns_number("dns/cache/evictions"), OP_EQ, 1);
+  tt_u64_op(getinfo_dns_number("dns/cache/hits"), OP_EQ, 1);
+  tt_u64_op(getinfo_dns_number("dns/cache/bytes"), OP_GE, 3 * entry_size);
+
+  /* Lowering the limit evicts as much as it takes. */
+  get_options_mutable()->ServerDNSCacheMaxSize = entry_size;
+  dns_cache_enforce_limit();
+  tt_u64_op(getinfo_dns_number("dns/cache/entries"), OP_EQ, 1);
+  tt_u64_op(getinfo_dns_number("dns/cache/evictions"), OP_EQ, 3);
+
+  /* No limit. */
+  get_options_mutable()->ServerDNSCacheMaxSize = 0;
+  add_pending_resolve("e.example", pending);
+  answer_ipv4("e.example", "10.0.0.5", 60);
+  tt_u64_op(getinfo_dns_number("dns/cache/entries"), OP_EQ, 2);
+
+  tt_int_op(getinfo_helper_dns(NULL, "dns/cache/nonesuch", &answer, &errmsg),
+            OP_EQ, 0);
+  tt_ptr_op(answer, OP_EQ, NULL);
+
+ done:
+  dns_free_all();
+  SMARTLIST_FOREACH(pending, cached_resolve_t *, r, tor_free(r));
+  smartlist_free(pending);
+}
+
+static void
+test_dns_cache_negative(void *arg)
+{
+  smartlist_t *pending = smartlist_new();
+  cached_resolve_t *entry;
+  time_t now = time(NULL);
+  (void)arg;
+
+  dns_init();
+
+  /* A timeout is only cached for a little while. */
+  add_pending_resolve("slow.example", pending);
+  dns_found_answer("slow.example", DNS_IPv4_A, DNS_ERR_TIMEOUT, NULL, NULL,
+                   0);
+  entry = get_cache_entry("slow.example");
+  tt_assert(entry);
+  tt_int_op(entry->res_status_ipv4, OP_EQ, RES_STATUS_DONE_ERR);
+  tt_i64_op(entry->expire - now, OP_GE, DNS_TRANSIENT_ERR_CACHE_TIME);
+  tt_i64_op(entry->expire - now, OP_LE, DNS_TRANSIENT_ERR_CACHE_TIME + 1);
+
+  /* A name that doesn't exist is cached like an address. */
+  add_pending_resolve("nonesuch.example", pending);
+  dns_found_answer("nonesuch.example", DNS_IPv4_A, DNS_ERR_NOTEXIST, NULL,
+                   NULL, 0);
+  entry = get_cache_entry("nonesuch.example");
+  tt_assert(entry);
+  tt_i64_op(entry->expire - now, OP_GE, MIN_DNS_TTL_AT_EXIT);
+  tt_i64_op(entry->expire - now, OP_LE, MIN_DNS_TTL_AT_EXIT + 1);
+  tt_int_op(cached_resolve_get_cache_time(entry), OP_EQ,
+            MIN_DNS_TTL_AT_EXIT);
+  entry->ttl_ipv4 = 7200;
+  tt_int_op(cached_resolve_get_cache_time(entry), OP_EQ,
+            MAX_DNS_TTL_AT_EXIT);
+
+  /* An address and a transient failure: cache the address. */
+  entry->res_status_ipv4 = RES_STATUS_DONE_OK;
+  entry->res_status_ipv6 = RES_STATUS_DONE_ERR;
+  entry->result_ipv6.err_ipv6 = DNS_ERR_SERVERFAILED;
+  entry->ttl_ipv6 = 0;
+  tt_int_op(cached_resolve_get_cache_time(entry), OP_EQ,
+            MIN_DNS_TTL_AT_EXIT);
+  entry->res_status_ipv4 = RES_STATUS_DONE_ERR;
+  entry->result_ipv4.err_ipv4 = DNS_ERR_TIMEOUT;
+  tt_int_op(cached_resolve_get_cache_time(entry), OP_EQ,
+            DNS_TRANSIENT_ERR_CACHE_TIME);
+  entry->res_status_ipv4 = entry->res_status_ipv6 = RES_STATUS_DONE_ERR;
+
+ done:
+  dns_free_all();
+  SMARTLIST_FOREACH(pending, cached_resolve_t *, r, tor_free(r));
+  smartlist_free(pending);
+}
+
+static int n_prefetch_launches = 0;
+
+static int
+prefetch_launch_resolve(cached_resolve_t *resolve)
+{
+  ++n_prefetch_launches;
+  resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+  return 0;
+}
+
+static void
+test_dns_cache_prefetch(void *arg)
+{
+  smartlist_t *pending = smartlist_new();
+  cached_resolve_t *entry, *old_entry;
+  time_t expire;
+  (void)arg;
+
+  MOCK(launch_resolve, prefetch_launch_resolve);
+  dns_init();
+
+  add_pending_resolve("hot.example", pending);
+  answer_ipv4("hot.example", "10.0.0.1", 60);
+  old_entry = entry = get_cache_entry("hot.example");
+  tt_assert(entry);
+  expire = entry->expire;
+
+  /* Unpopular answers, or answers far from expiring, don't get
+   * refreshed. */
+  dns_cache_note_hit(entry, expire - DNS_PREFETCH_WINDOW);
+  dns_cache_note_hit(entry, expire - DNS_PREFETCH_WINDOW - 1);
+  dns_cache_note_hit(entry, expire - DNS_PREFETCH_WINDOW - 1);
+  tt_int_op(n_prefetch_launches, OP_EQ, 0);
+  tt_int_op(entry->n_hits, OP_EQ, 3);
+
+  /* Popular answers that are about to expire do, only once. */
+  dns_cache_note_hit(entry, expire - DNS_PREFETCH_WINDOW);
+  tt_int_op(n_prefetch_launches, OP_EQ, 1);
+  tt_assert(entry->is_prefetching);
+  dns_cache_note_hit(entry, expire - 1);
+  tt_int_op(n_prefetch_launches, OP_EQ, 1);
+  tt_u64_op(getinfo_dns_number("dns/cache/prefetches"), OP_EQ, 1);
+
+  /* The refresh answer replaces the cached one. */
+  answer_ipv4("hot.example", "10.0.0.2", 7200);
+  entry = get_cache_entry("hot.example");
+  tt_assert(entry);
+  tt_ptr_op(entry, OP_NE, old_entry);
+  tt_int_op(entry->state, OP_EQ, CACHE_STATE_CACHED);
+  tt_int_op(entry->result_ipv4.addr_ipv4, OP_EQ, 0x0a000002);
+  tt_assert(entry->referenced);
+  tt_assert(! entry->is_prefetching);
+  tt_i64_op(entry->expire, OP_GE, time(NULL) + MAX_DNS_TTL_AT_EXIT - 1);
+  tt_u64_op(getinfo_dns_number("dns/cache/entries"), OP_EQ, 1);
+
+  /* A failed refresh leaves the old answer alone. */
+  old_entry = entry;
+  expire = entry->expire;
+  dns_cache_note_hit(entry, expire - 1);
+  dns_cache_note_hit(entry, expire - 1);
+  dns_cache_note_hit(entry, expire - 1);
+  tt_int_op(n_prefetch_launches, OP_EQ, 2);
+  dns_found_answer("hot.example", DNS_IPv4_A, DNS_ERR_TIMEOUT, NULL, NULL,
+                   0);
+  entry = get_cache_entry("hot.example");
+  tt_ptr_op(entry, OP_EQ, old_entry);
+  tt_int_op(entry->result_ipv4.addr_ipv4, OP_EQ, 0x0a000002);
+  tt_i64_op(entry->expire, OP_EQ, expire);
+
+ done:
+  UNMOCK(launch_resolve);
+  dns_free_all();
+  SMARTLIST_FOREACH(pending, cached_resolve_t *, r, tor_free(r));
+  smartlist_free(pending);
+}
+
 struct testcase_t dns_tests[] = {
 #ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
    TEST_CASE(configure_nameservers_fallback),
@@ -811,6 +1054,9 @@ struct testcase_t dns_tests[] = {
    TEST_CASE_ASPECT(resolve_impl, cache_hit_pending),
    TEST_CASE_ASPECT(resolve_impl, cache_hit_cached),
    TEST_CASE_ASPECT(resolve_impl, cache_miss),
+   { "cache_eviction", test_dns_cache_eviction, TT_FORK, NULL, NULL },
+   { "cache_negative", test_dns_cache_negative, TT_FORK, NULL, NULL },
+   { "cache_prefetch", test_dns_cache_prefetch, TT_FORK, NULL, NULL },
    END_OF_TESTCASES
 };
 
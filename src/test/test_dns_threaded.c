@@ -0,0 +1,414 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define DNS_THREADED_PRIVATE
+
+#include "orconfig.h"
+#include "core/or/or.h"
+#include "feature/relay/dns_threaded.h"
+#include "lib/net/socket.h"
+#include "lib/time/compat_time.h"
+
+#include "test/test.h"
+
+#include <event2/dns.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+/* A reply for the A records of "www.Example.com", with ID 0x1234: the
+ * question, a CNAME with a compressed owner name, and two A records for the
+ * CNAME target. */
+static const uint8_t example_reply[] = {
+  0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,
+  /* Question, at offset 12. */
+  3, 'w', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+  0x00, 0x01, 0x00, 0x01,
+  /* CNAME www.Example.com -> web.Example.com, at offset 33. */
+  0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x06,
+  3, 'w', 'e', 'b', 0xc0, 0x10,
+  /* Two A records for web.Example.com, at offset 51. */
+  0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x00, 0x04,
+  1, 2, 3, 4,
+  0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x30, 0x00, 0x04,
+  5, 6, 7, 8,
+};
+
+static void
+test_dns_threaded_encode(void *arg)
+{
+  uint8_t buf[512];
+  char long_label[80];
+  (void)arg;
+
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 0x1234,
+                                      "www.Example.com", 1), OP_EQ, 33);
+  tt_mem_op(buf, OP_EQ, "\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00",
+            12);
+  tt_mem_op(buf+12, OP_EQ, example_reply+12, 21);
+
+  /* One trailing dot is fine. */
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1,
+                                      "www.Example.com.", 1), OP_EQ, 33);
+  tt_mem_op(buf+12, OP_EQ, example_reply+12, 21);
+
+  /* Empty names and labels are not. */
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, "", 1),
+            OP_EQ, -1);
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, ".", 1),
+            OP_EQ, -1);
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, "a..b", 1),
+            OP_EQ, -1);
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, ".a", 1),
+            OP_EQ, -1);
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, "a..", 1),
+            OP_EQ, -1);
+
+  /* Neither are long labels, or a buffer that is too short. */
+  memset(long_label, 'x', 64);
+  long_label[64] = '\0';
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, long_label, 1),
+            OP_EQ, -1);
+  long_label[63] = '\0';
+  tt_int_op(dns_threaded_encode_query(buf, sizeof(buf), 1, long_label, 1),
+            OP_EQ, 12 + 65 + 4);
+  tt_int_op(dns_threaded_encode_query(buf, 12 + 65 + 3, 1, long_label, 1),
+            OP_EQ, -1);
+
+ done:
+  ;
+}
+
+static void
+test_dns_threaded_read_name(void *arg)
+{
+  uint8_t msg[64];
+  char name[256];
+  size_t offset;
+  (void)arg;
+
+  offset = 12;
+  tt_int_op(dns_threaded_read_name(example_reply, sizeof(example_reply),
+                                   &offset, name, sizeof(name)), OP_EQ, 0);
+  tt_str_op(name, OP_EQ, "www.Example.com");
+  tt_int_op(offset, OP_EQ, 29);
+
+  /* Compressed names: we stop after the first pointer. */
+  offset = 33;
+  tt_int_op(dns_threaded_read_name(example_reply, sizeof(example_reply),
+                                   &offset, name, sizeof(name)), OP_EQ, 0);
+  tt_str_op(name, OP_EQ, "www.Example.com");
+  tt_int_op(offset, OP_EQ, 35);
+  offset = 51;
+  tt_int_op(dns_threaded_read_name(example_reply, sizeof(example_reply),
+                                   &offset, name, sizeof(name)), OP_EQ, 0);
+  tt_str_op(name, OP_EQ, "web.Example.com");
+  tt_int_op(offset, OP_EQ, 53);
+
+  /* Too small a buffer. */
+  offset = 12;
+  tt_int_op(dns_threaded_read_name(example_reply, sizeof(example_reply),
+                                   &offset, name, 15), OP_EQ, -1);
+  offset = 12;
+  tt_int_op(dns_threaded_read_name(example_reply, sizeof(example_reply),
+                                   &offset, name, 16), OP_EQ, 0);
+
+  /* Pointer loops, truncated names, and reserved label types. */
+  memset(msg, 0, sizeof(msg));
+  msg[0] = 0xc0; msg[1] = 0x02; msg[2] = 0xc0; msg[3] = 0x00;
+  offset = 0;
+  tt_int_op(dns_threaded_read_name(msg, 4, &offset, name, sizeof(name)),
+            OP_EQ, -1);
+  msg[0] = 5; msg[1] = 'a';
+  offset = 0;
+  tt_int_op(dns_threaded_read_name(msg, 2, &offset, name, sizeof(name)),
+            OP_EQ, -1);
+  msg[0] = 0x40;
+  offset = 0;
+  tt_int_op(dns_threaded_read_name(msg, 4, &offset, NULL, 0), OP_EQ, -1);
+
+ done:
+  ;
+}
+
+static void
+test_dns_threaded_parse(void *arg)
+{
+  dns_threaded_query_t *q = tor_malloc_zero(sizeof(*q));
+  uint8_t msg[sizeof(example_reply)];
+  static const uint8_t ptr_reply[] = {
+    0x00, 0x07, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    1, '4', 1, '3', 1, '2', 1, '1', 7, 'i', 'n', '-', 'a', 'd', 'd', 'r',
+    4, 'a', 'r', 'p', 'a', 0, 0x00, 0x0c, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x0c, 0x00, 0x01, 0x00, 0x00, 0x00, 0x10, 0x00, 0x0d,
+    3, 'f', 'o', 'o', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0,
+  };
+  (void)arg;
+
+  q->query_type = DNS_IPv4_A;
+  q->name = tor_strdup("www.example.com");
+  q->id = 0x1234;
+
+  tt_int_op(dns_threaded_parse_reply(example_reply, sizeof(example_reply), q),
+            OP_EQ, 0);
+  tt_int_op(q->result, OP_EQ, DNS_ERR_NONE);
+  tt_int_op(q->count, OP_EQ, 2);
+  tt_int_op(q->ttl, OP_EQ, 0x30);
+  tt_mem_op(&q->ipv4[0], OP_EQ, "\x01\x02\x03\x04", 4);
+  tt_mem_op(&q->ipv4[1], OP_EQ, "\x05\x06\x07\x08", 4);
+
+  /* Wrong ID, wrong type, or an answer that is cut short. */
+  q->id = 0x1235;
+  tt_int_op(dns_threaded_parse_reply(example_reply, sizeof(example_reply), q),
+            OP_EQ, -1);
+  q->id = 0x1234;
+  q->query_type = DNS_IPv6_AAAA;
+  tt_int_op(dns_threaded_parse_reply(example_reply, sizeof(example_reply), q),
+            OP_EQ, -1);
+  q->query_type = DNS_IPv4_A;
+  tt_int_op(dns_threaded_parse_reply(example_reply,
+                                     sizeof(example_reply) - 1, q),
+            OP_EQ, -1);
+
+  /* With the 0x20 hack, the case must match. */
+  q->randomized_case = 1;
+  tt_int_op(dns_threaded_parse_reply(example_reply, sizeof(example_reply), q),
+            OP_EQ, -1);
+  strlcpy(q->name, "www.Example.com", strlen(q->name) + 1);
+  tt_int_op(dns_threaded_parse_reply(example_reply, sizeof(example_reply), q),
+            OP_EQ, 0);
+
+  /* Errors, and answers without the records we want. */
+  memcpy(msg, example_reply, sizeof(msg));
+  msg[3] = 0x83; /* NXDOMAIN */
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg), q), OP_EQ, 0);
+  tt_int_op(q->result, OP_EQ, DNS_ERR_NOTEXIST);
+  tt_int_op(q->count, OP_EQ, 0);
+  msg[3] = 0x80;
+  msg[7] = 1; /* Only the CNAME. */
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg), q), OP_EQ, 0);
+  tt_int_op(q->result, OP_NE, DNS_ERR_NONE);
+  tt_int_op(q->count, OP_EQ, 0);
+
+  /* PTR answers. */
+  tor_free(q->name);
+  q->name = tor_strdup("4.3.2.1.in-addr.arpa");
+  q->randomized_case = 0;
+  q->query_type = DNS_PTR;
+  q->id = 7;
+  tt_int_op(dns_threaded_parse_reply(ptr_reply, sizeof(ptr_reply), q),
+            OP_EQ, 0);
+  tt_int_op(q->result, OP_EQ, DNS_ERR_NONE);
+  tt_int_op(q->count, OP_EQ, 1);
+  tt_int_op(q->ttl, OP_EQ, 16);
+  tt_str_op(q->hostname, OP_EQ, "foo.example");
+
+ done:
+  dns_threaded_query_free(q);
+}
+
+static void
+test_dns_threaded_negative_ttl(void *arg)
+{
+  dns_threaded_query_t *q = tor_malloc_zero(sizeof(*q));
+  /* An NXDOMAIN for the A records of "www.Example.com", with an SOA record
+   * for Example.com whose TTL is 3600 and whose MINIMUM is 300. */
+  uint8_t msg[] = {
+    0x12, 0x34, 0x81, 0x83, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+    3, 'w', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm',
+    0,
+    0x00, 0x01, 0x00, 0x01,
+    /* SOA, at offset 33: MNAME ns.Example.com, RNAME Example.com. */
+    0xc0, 0x10, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x1b,
+    2, 'n', 's', 0xc0, 0x10, 0xc0, 0x10,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x1c, 0x20, 0x00, 0x00, 0x0e, 0x10,
+    0x00, 0x12, 0x75, 0x00, 0x00, 0x00, 0x01, 0x2c,
+  };
+  (void)arg;
+
+  q->query_type = DNS_IPv4_A;
+  q->name = tor_strdup("www.example.com");
+  q->id = 0x1234;
+
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg), q), OP_EQ, 0);
+  tt_int_op(q->result, OP_EQ, DNS_ERR_NOTEXIST);
+  tt_int_op(q->ttl, OP_EQ, 300);
+
+  /* The TTL of the SOA record wins if it is smaller. */
+  msg[41] = 0x00; msg[42] = 0x3c;
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg), q), OP_EQ, 0);
+  tt_int_op(q->ttl, OP_EQ, 60);
+
+  /* No records at all works the same way. */
+  msg[3] = 0x80;
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg), q), OP_EQ, 0);
+  tt_int_op(q->result, OP_NE, DNS_ERR_NONE);
+  tt_int_op(q->result, OP_NE, DNS_ERR_NOTEXIST);
+  tt_int_op(q->count, OP_EQ, 0);
+  tt_int_op(q->ttl, OP_EQ, 60);
+
+  /* A cut short SOA record, or none at all, gives no TTL. */
+  msg[3] = 0x83;
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg) - 1, q), OP_EQ, 0);
+  tt_int_op(q->ttl, OP_EQ, 0);
+  msg[9] = 0;
+  tt_int_op(dns_threaded_parse_reply(msg, sizeof(msg), q), OP_EQ, 0);
+  tt_int_op(q->ttl, OP_EQ, 0);
+
+ done:
+  dns_threaded_query_free(q);
+}
+
+#ifndef _WIN32
+
+/* What the resolver threads told us about the queries we launched. */
+static int n_answers = 0;
+static int last_result = -1;
+static int last_count = 0;
+static uint32_t last_ipv4 = 0;
+
+static void
+test_answer_cb(int result, char type, int count, int ttl, void *addresses,
+               void *arg)
+{
+  (void)ttl;
+  tt_int_op(type, OP_EQ, DNS_IPv4_A);
+  tt_ptr_op(arg, OP_EQ, &n_answers);
+  ++n_answers;
+  last_result = result;
+  last_count = count;
+  if (result == DNS_ERR_NONE && count)
+    memcpy(&last_ipv4, addresses, 4);
+ done:
+  ;
+}
+
+/* Wait for a query on the stub nameserver <b>s</b>, and return its length,
+ * or -1 if none comes. */
+static int
+stub_read_query(tor_socket_t s, uint8_t *buf, size_t buf_len,
+                struct sockaddr_storage *from, socklen_t *from_len)
+{
+  struct pollfd pfd;
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 5000) != 1)
+    return -1;
+  *from_len = sizeof(*from);
+  return (int) recvfrom(s, (char *)buf, buf_len, 0,
+                        (struct sockaddr *) from, from_len);
+}
+
+/* Wait for the resolver threads to hand us <b>n</b> answers in all. */
+static int
+wait_for_answers(int n)
+{
+  int i;
+  for (i = 0; i < 500 && n_answers < n; ++i) {
+    tor_sleep_msec(10);
+    dns_threaded_process_replies();
+  }
+  return n_answers;
+}
+
+/* Send queries to a stub nameserver on loopback, with real threads. */
+static void
+test_dns_threaded_loopback(void *arg)
+{
+  dns_threaded_config_t cfg;
+  const dns_backend_t *backend = dns_threaded_get_backend();
+  tor_socket_t stub = TOR_INVALID_SOCKET;
+  struct sockaddr_in sin;
+  struct sockaddr_storage from;
+  socklen_t from_len, sin_len = sizeof(sin);
+  uint8_t buf[512];
+  char name[256];
+  size_t offset;
+  int len;
+  (void)arg;
+
+  n_answers = 0;
+  stub = tor_open_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  tt_assert(SOCKET_OK(stub));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(bind(stub, (struct sockaddr *) &sin, sizeof(sin)), OP_EQ, 0);
+  tt_int_op(getsockname(stub, (struct sockaddr *) &sin, &sin_len), OP_EQ, 0);
+
+  /* Nothing works until we're configured. */
+  tt_int_op(backend->launch(DNS_IPv4_A, "example.com", NULL,
+                            test_answer_cb, &n_answers), OP_EQ, -1);
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.n_threads = 2;
+  cfg.max_inflight = 4;
+  cfg.timeout_msec = 100;
+  cfg.max_attempts = 2;
+  cfg.randomize_case = 1;
+  cfg.n_nameservers = 1;
+  tor_addr_from_ipv4h(&cfg.nameservers[0].addr, 0x7f000001);
+  cfg.nameservers[0].port = ntohs(sin.sin_port);
+  tt_int_op(dns_threaded_configure(&cfg), OP_EQ, 0);
+
+  /* A query that we answer. */
+  tt_int_op(backend->launch(DNS_IPv4_A, "www.example.com", NULL,
+                            test_answer_cb, &n_answers), OP_EQ, 0);
+  len = stub_read_query(stub, buf, sizeof(buf) - 16, &from, &from_len);
+  tt_int_op(len, OP_EQ, 33);
+  offset = 12;
+  tt_int_op(dns_threaded_read_name(buf, len, &offset, name, sizeof(name)),
+            OP_EQ, 0);
+  tt_assert(!strcasecmp(name, "www.example.com"));
+  buf[2] |= 0x80; /* It's an answer. */
+  buf[7] = 1;
+  memcpy(buf + len, "\xc0\x0c\x00\x01\x00\x01\x00\x00\x01\x00\x00\x04"
+         "\x0a\x0b\x0c\x0d", 16);
+  tt_int_op(sendto(stub, (const char *) buf, len + 16, 0,
+                   (struct sockaddr *) &from, from_len), OP_EQ, len + 16);
+  tt_int_op(wait_for_answers(1), OP_EQ, 1);
+  tt_int_op(last_result, OP_EQ, DNS_ERR_NONE);
+  tt_int_op(last_count, OP_EQ, 1);
+  tt_int_op(ntohl(last_ipv4), OP_EQ, 0x0a0b0c0d);
+
+  /* A query that we never answer gets sent twice, then times out. */
+  tt_int_op(backend->launch(DNS_IPv4_A, "slow.example.com", NULL,
+                            test_answer_cb, &n_answers), OP_EQ, 0);
+  tt_int_op(stub_read_query(stub, buf, sizeof(buf), &from, &from_len),
+            OP_GT, 0);
+  tt_int_op(stub_read_query(stub, buf, sizeof(buf), &from, &from_len),
+            OP_GT, 0);
+  tt_int_op(wait_for_answers(2), OP_EQ, 2);
+  tt_int_op(last_result, OP_EQ, DNS_ERR_TIMEOUT);
+
+  /* Queries still in flight when we shut down get answered too. */
+  tt_int_op(backend->launch(DNS_IPv4_A, "late.example.com", NULL,
+                            test_answer_cb, &n_answers), OP_EQ, 0);
+  tt_int_op(stub_read_query(stub, buf, sizeof(buf), &from, &from_len),
+            OP_GT, 0);
+  dns_threaded_free_all();
+  tt_int_op(n_answers, OP_EQ, 3);
+  tt_int_op(last_result, OP_EQ, DNS_ERR_SHUTDOWN);
+
+ done:
+  dns_threaded_free_all();
+  if (SOCKET_OK(stub))
+    tor_close_socket(stub);
+}
+
+#endif /* !defined(_WIN32) */
+
+#define T(name, flags) \
+  { #name, test_dns_threaded_ ## name, (flags), NULL, NULL }
+
+struct testcase_t dns_threaded_tests[] = {
+  T(encode, 0),
+  T(read_name, 0),
+  T(parse, 0),
+  T(negative_ttl, 0),
+#ifndef _WIN32
+  T(loopback, TT_FORK),
+#endif
+  END_OF_TESTCASES
+};
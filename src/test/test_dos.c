@@ -106,6 +106,52 @@ test_dos_conn_creation(void *arg)
   dos_free_all();
 }
 
+/** Test that connection counts stay right when we stop and start being a
+ *  relay while a tracked connection is open. */
+static void
+test_dos_conn_disable_reenable(void *arg)
+{
+  (void) arg;
+  or_connection_t or_conn1, or_conn2;
+  dos_client_stats_t *stats;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+
+  memset(&or_conn1, 0, sizeof(or_conn1));
+  memset(&or_conn2, 0, sizeof(or_conn2));
+  tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&or_conn1.real_addr, "18.0.0.1"));
+  tor_addr_copy(&or_conn2.real_addr, &or_conn1.real_addr);
+
+  dos_init();
+  dos_new_client_conn(&or_conn1);
+  tt_assert(or_conn1.tracked_for_dos_mitigation);
+
+  /* Stop being a relay, then become one again, as a HUP would do. */
+  dos_free_mitigations();
+  dos_init();
+
+  /* The count from the first connection is still there. */
+  dos_new_client_conn(&or_conn2);
+  tt_assert(or_conn2.tracked_for_dos_mitigation);
+  stats = dos_addrmap_lookup(&or_conn1.real_addr, or_conn1.dos_addr_hash, 0);
+  tt_assert(stats);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 2);
+
+  /* Closing the first connection gives back exactly its count. */
+  setup_full_capture_of_logs(LOG_WARN);
+  dos_close_client_conn(&or_conn1);
+  expect_no_log_entry();
+  tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+  dos_close_client_conn(&or_conn2);
+  expect_no_log_entry();
+  tt_uint_op(stats->concurrent_count, OP_EQ, 0);
+
+ done:
+  teardown_capture_of_logs();
+  dos_free_all();
+}
+
 /** Helper mock: Place a fake IP addr for this channel in <b>addr_out</b> */
 static int
 mock_channel_get_addr_if_possible(channel_t *chan, tor_addr_t *addr_out)
@@ -219,11 +265,10 @@ test_dos_bucket_refill(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, addr, NULL, now);
   dos_new_client_conn(&or_conn);
 
-  /* Fetch this client from the geoip cache and get its DoS structs */
-  clientmap_entry_t *entry = geoip_lookup_client(addr, NULL,
-                                                 GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  dos_client_stats_t* dos_stats = &entry->dos_stats;
+  /* Fetch this client from the DoS address table */
+  dos_client_stats_t* dos_stats = dos_addrmap_lookup(addr, dos_addr_hash(addr),
+                                                     0);
+  tt_assert(dos_stats);
   /* Check that the circuit bucket is still uninitialized */
   tt_uint_op(dos_stats->cc_stats.circuit_bucket, OP_EQ, 0);
 
@@ -422,7 +467,7 @@ test_dos_bucket_refill(void *arg)
 static void
 test_known_relay(void *arg)
 {
-  clientmap_entry_t *entry = NULL;
+  dos_client_stats_t *stats = NULL;
   routerstatus_t *rs = NULL; microdesc_t *md = NULL; routerinfo_t *ri = NULL;
 
   (void) arg;
@@ -465,10 +510,10 @@ test_known_relay(void *arg)
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  /* We should have a count of 0. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 0);
+  /* We should not be tracking it at all. */
+  stats = dos_addrmap_lookup(&or_conn.real_addr,
+                             dos_addr_hash(&or_conn.real_addr), 0);
+  tt_ptr_op(stats, OP_EQ, NULL);
 
   /* To make sure that his is working properly, make a unknown client
    * connection and see if we do get it. */
@@ -476,10 +521,11 @@ test_known_relay(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &or_conn.real_addr, NULL, 0);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
+  stats = dos_addrmap_lookup(&or_conn.real_addr,
+                             dos_addr_hash(&or_conn.real_addr), 0);
+  tt_assert(stats);
   /* We should have a count of 2. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 2);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 2);
 
  done:
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
@@ -492,11 +538,72 @@ test_known_relay(void *arg)
   UNMOCK(get_param_cc_enabled);
 }
 
+/* Test that the DoS address table stays bounded, and only evicts addresses
+ * that aren't in use. */
+static void
+test_dos_addrmap(void *arg)
+{
+  tor_addr_t addr;
+  dos_client_stats_t *stats;
+  unsigned int i, n_found;
+
+  (void) arg;
+
+  /* A table of 16 slots holds at most 12 addresses. */
+  dos_addrmap_max_capacity = 16;
+
+  for (i = 0; i < 12; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    stats = dos_addrmap_lookup(&addr, dos_addr_hash(&addr), 1);
+    tt_assert(stats);
+    /* Every other address has an open connection. */
+    stats->concurrent_count = (i % 2 == 0);
+  }
+  tt_uint_op(dos_addrmap_size(), OP_EQ, 12);
+
+  /* IPv4 and IPv6 addresses with the same bytes are different. */
+  tor_addr_parse(&addr, "[a00::]");
+  tt_ptr_op(dos_addrmap_lookup(&addr, dos_addr_hash(&addr), 0), OP_EQ, NULL);
+
+  /* Adding more addresses evicts the ones without connections. */
+  for (i = 12; i < 100; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    tt_assert(dos_addrmap_lookup(&addr, dos_addr_hash(&addr), 1));
+    tt_uint_op(dos_addrmap_size(), OP_EQ, 12);
+  }
+  n_found = 0;
+  for (i = 0; i < 100; i++) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    stats = dos_addrmap_lookup(&addr, dos_addr_hash(&addr), 0);
+    if (i < 12 && i % 2 == 0) {
+      tt_assert(stats);
+      tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+    }
+    if (stats) {
+      n_found++;
+      stats->concurrent_count = 1;
+    }
+  }
+  /* Nothing got lost while entries moved around. */
+  tt_uint_op(n_found, OP_EQ, 12);
+
+  /* Once every address is in use, we can't add any more. */
+  tor_addr_from_ipv4h(&addr, 0x0b000000);
+  tt_ptr_op(dos_addrmap_lookup(&addr, dos_addr_hash(&addr), 1), OP_EQ, NULL);
+  tt_uint_op(dos_addrmap_size(), OP_EQ, 12);
+
+ done:
+  dos_free_all();
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
+  { "conn_disable_reenable", test_dos_conn_disable_reenable, TT_FORK,
+    NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "addrmap", test_dos_addrmap, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
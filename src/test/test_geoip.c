@@ -14,6 +14,10 @@
 #include "feature/stats/geoip_stats.h"
 #include "test/test.h"
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
    * using ipv4.  Since our fake geoip database is the same between
    * ipv4 and ipv6, we should get the same result no matter which
@@ -564,6 +568,143 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+/** Check the lookups that matter for the IPv4 GeoIP table in <b>content</b>
+ * against the table that we have loaded: the ends of each range, the
+ * addresses just outside it, and one in its middle. */
+static void
+check_ipv4_lookups(const char *content)
+{
+  smartlist_t *lines = smartlist_new();
+  smartlist_split_string(lines, content, "\n",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    unsigned low, high;
+    char cc[3];
+    tt_int_op(3, OP_EQ, tor_sscanf(line, "%u,%u,%2s", &low, &high, cc));
+    const uint32_t probes[] = { low, high, low - 1, high + 1,
+                                low + (high - low) / 2 };
+    for (unsigned i = 0; i < ARRAY_LENGTH(probes); ++i) {
+      char expected[3] = "??";
+      SMARTLIST_FOREACH_BEGIN(lines, const char *, other) {
+        unsigned olow, ohigh;
+        tor_sscanf(other, "%u,%u,%2s", &olow, &ohigh, cc);
+        if (olow <= probes[i] && probes[i] <= ohigh) {
+          strlcpy(expected, cc, sizeof(expected));
+          tor_strlower(expected);
+          break;
+        }
+      } SMARTLIST_FOREACH_END(other);
+      tt_str_op(expected, OP_EQ,
+                geoip_get_country_name(geoip_get_country_by_ipv4(probes[i])));
+    }
+  } SMARTLIST_FOREACH_END(line);
+ done:
+  SMARTLIST_FOREACH(lines, char *, s, tor_free(s));
+  smartlist_free(lines);
+}
+
+static void
+test_geoip_binary_file(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip_text"));
+  char *fname_bin = tor_strdup(get_fname("geoip_bin"));
+  char *fname_bad = tor_strdup(get_fname("geoip_bad"));
+  char *digest = NULL;
+  char *body = NULL;
+  struct stat st;
+
+  /* Tables loaded from text are looked up just like binary ones. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, GEOIP_CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  check_ipv4_lookups(GEOIP_CONTENT);
+  digest = tor_strdup(geoip_db_digest(AF_INET));
+
+  /* Write the table out, and map it back in. */
+  tt_int_op(0, OP_EQ, geoip_db_write_file(AF_INET, fname_bin));
+  geoip_free_all();
+  tt_assert(!geoip_is_loaded(AF_INET));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname_bin, LOG_WARN));
+  tt_assert(geoip_is_loaded(AF_INET));
+  check_ipv4_lookups(GEOIP_CONTENT);
+  /* We still report the digest of the text file. */
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+  /* It holds no IPv6 table. */
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, fname_bin, LOG_INFO));
+  tt_assert(!geoip_is_loaded(AF_INET6));
+
+  /* Damaged files are refused, and leave the current table alone. */
+  body = read_file_to_str(fname_bin, RFTS_BIN, &st);
+  tt_assert(body);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname_bad, body, st.st_size - 2,
+                                          1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname_bad, LOG_INFO));
+  /* The index entry for 8.8.0.0/16 comes after the header and the six
+   * country codes, counting "??". */
+  body[48 + 12 + 4*0x0808 + 3] ^= 1;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname_bad, body, st.st_size, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname_bad, LOG_INFO));
+  body[48 + 12 + 4*0x0808 + 3] ^= 1;
+  body[8 + 3] = 2; /* format version */
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname_bad, body, st.st_size, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname_bad, LOG_INFO));
+  check_ipv4_lookups(GEOIP_CONTENT);
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+
+ done:
+  tor_free(fname);
+  tor_free(fname_bin);
+  tor_free(fname_bad);
+  tor_free(digest);
+  tor_free(body);
+}
+
+static void
+test_geoip6_binary_file(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip6_text"));
+  char *fname_bin = tor_strdup(get_fname("geoip6_bin"));
+  struct in6_addr iaddr6;
+  /* The last range covers more than one value of the first 16 bits. */
+  const char CONTENT[] =
+    "2001:4830:6010::,2001:4830:601f:ffff:ffff:ffff:ffff:ffff,GB\n"
+    "2001:4838::,2001:4838:ffff:ffff:ffff:ffff:ffff:ffff,US\n"
+    "2001:4878:204::,2001:4878:204:ffff:ffff:ffff:ffff:ffff,DE\n"
+    "2002:1::,2005:ffff:ffff:ffff:ffff:ffff:ffff:ffff,FR\n";
+
+#define CHECK_COUNTRY6(country, a) do {                                 \
+    tor_inet_pton(AF_INET6, (a), &iaddr6);                              \
+    tt_str_op((country), OP_EQ,                                         \
+              geoip_get_country_name(geoip_get_country_by_ipv6(&iaddr6))); \
+  } while (0)
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname, LOG_WARN));
+  tt_int_op(0, OP_EQ, geoip_db_write_file(AF_INET6, fname_bin));
+  geoip_free_all();
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname_bin, LOG_WARN));
+
+  CHECK_COUNTRY6("gb", "2001:4830:6010::");
+  CHECK_COUNTRY6("gb", "2001:4830:601f:ffff:ffff:ffff:ffff:ffff");
+  CHECK_COUNTRY6("??", "2001:4830:6020::");
+  CHECK_COUNTRY6("us", "2001:4838:1234::1");
+  CHECK_COUNTRY6("de", "2001:4878:204::8888");
+  CHECK_COUNTRY6("??", "2001:4878:205::");
+  CHECK_COUNTRY6("??", "2002::1");
+  CHECK_COUNTRY6("fr", "2002:1::");
+  CHECK_COUNTRY6("fr", "2003::");
+  CHECK_COUNTRY6("fr", "2005:ffff:ffff:ffff:ffff:ffff:ffff:ffff");
+  CHECK_COUNTRY6("??", "2006::");
+  CHECK_COUNTRY6("??", "::1");
+  CHECK_COUNTRY6("??", "ffff::1");
+#undef CHECK_COUNTRY6
+
+ done:
+  tor_free(fname);
+  tor_free(fname_bin);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +716,8 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "binary_file", test_geoip_binary_file, TT_FORK, NULL, NULL },
+  { "binary_file6", test_geoip6_binary_file, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
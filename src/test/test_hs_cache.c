@@ -220,6 +220,82 @@ test_clean_as_dir(void *arg)
   tor_free(desc1_str);
 }
 
+/* Test that the directory cache accounts for exactly the memory it holds,
+ * expires entries by their lifetime, and evicts the least recently used
+ * ones first under memory pressure. */
+static void
+test_expire_and_evict_as_dir(void *arg)
+{
+  int ret;
+  size_t removed, alloc_before;
+  time_t now = time(NULL);
+  char *str_a = NULL, *str_b = NULL, *str_z = NULL;
+  hs_descriptor_t *desc_a = NULL, *desc_b = NULL, *desc_z = NULL;
+  ed25519_keypair_t kp_a, kp_b, kp_z;
+  const size_t entry_overhead = offsetof(hs_cache_dir_descriptor_t,
+                                         encoded_desc) + 1;
+
+  (void) arg;
+
+  init_test();
+
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp_a, 0));
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp_b, 0));
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp_z, 0));
+  desc_a = hs_helper_build_hs_desc_with_ip(&kp_a);
+  desc_b = hs_helper_build_hs_desc_with_ip(&kp_b);
+  desc_z = hs_helper_build_hs_desc_with_ip(&kp_z);
+  desc_z->plaintext_data.lifetime_sec = 0;
+  tt_int_op(0, OP_EQ, hs_desc_encode_descriptor(desc_a, &kp_a, NULL, &str_a));
+  tt_int_op(0, OP_EQ, hs_desc_encode_descriptor(desc_b, &kp_b, NULL, &str_b));
+  tt_int_op(0, OP_EQ, hs_desc_encode_descriptor(desc_z, &kp_z, NULL, &str_z));
+
+  /* Store A, then B, then the zero-lifetime Z, then fetch A again. */
+  alloc_before = rend_cache_get_total_allocation();
+  update_approx_time(now - 1000);
+  tt_int_op(0, OP_EQ, hs_cache_store_as_dir(str_a));
+  update_approx_time(now - 500);
+  tt_int_op(0, OP_EQ, hs_cache_store_as_dir(str_b));
+  tt_int_op(0, OP_EQ, hs_cache_store_as_dir(str_z));
+  update_approx_time(now - 100);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc_a), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  /* The allocation is exactly what the three entries hold. */
+  tt_u64_op(rend_cache_get_total_allocation() - alloc_before, OP_EQ,
+            3 * entry_overhead + strlen(str_a) + strlen(str_b) +
+            strlen(str_z));
+
+  /* Normal cleanup expires Z, and only Z. (Leave some slack, since entries
+   * are timestamped with the real time when they are created.) */
+  removed = cache_clean_v3_as_dir(time(NULL) + 10, 0);
+  tt_u64_op(removed, OP_EQ, entry_overhead + strlen(str_z));
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc_z), NULL);
+  tt_int_op(ret, OP_EQ, 0);
+
+  /* With a cutoff between the last uses of B and A, only B goes, even
+   * though A was stored first. */
+  removed = cache_clean_v3_as_dir(now, now - 200);
+  tt_u64_op(removed, OP_EQ, entry_overhead + strlen(str_b));
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc_b), NULL);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc_a), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  /* The OOM handler takes what's left. */
+  removed = hs_cache_handle_oom(now, 1);
+  tt_u64_op(removed, OP_EQ, entry_overhead + strlen(str_a));
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, alloc_before);
+
+ done:
+  hs_descriptor_free(desc_a);
+  hs_descriptor_free(desc_b);
+  hs_descriptor_free(desc_z);
+  tor_free(str_a);
+  tor_free(str_b);
+  tor_free(str_z);
+}
+
 /* Test helper: Fetch an HS descriptor from an HSDir (for the hidden service
    with <b>blinded_key</b>. Return the received descriptor string. */
 static char *
@@ -554,6 +630,8 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "clean_as_dir", test_clean_as_dir, TT_FORK,
     NULL, NULL },
+  { "expire_and_evict_as_dir", test_expire_and_evict_as_dir, TT_FORK,
+    NULL, NULL },
   { "hsdir_revision_counter_check", test_hsdir_revision_counter_check, TT_FORK,
     NULL, NULL },
   { "upload_and_download_hs_desc", test_upload_and_download_hs_desc, TT_FORK,
@@ -9,6 +9,7 @@
 #define CONNECTION_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "core/or/cell_pool.h"
 #include "core/or/circuitlist.h"
 #include "lib/evloop/compat_libevent.h"
 #include "core/mainloop/connection.h"
@@ -144,6 +145,8 @@ test_oom_circbuf(void *arg)
   c2 = dummy_or_circuit_new(20, 20);
 
   tt_int_op(packed_cell_mem_cost(), OP_EQ,
+            cell_pool_item_size());
+  tt_int_op(packed_cell_mem_cost(), OP_GE,
             sizeof(packed_cell_t));
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
             packed_cell_mem_cost() * 70);
@@ -4,6 +4,7 @@
 /* See LICENSE for licensing information */
 
 #define CRYPT_PATH_PRIVATE
+#define RELAY_CRYPTO_PIPELINE_PRIVATE
 
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
@@ -12,6 +13,8 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/crypt_path.h"
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
@@ -181,12 +184,281 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+static smartlist_t *pipeline_jobs = NULL;
+static smartlist_t *pipeline_delivered = NULL;
+/* If positive, mark the circuit once we've delivered this many cells. */
+static int mark_circ_after_n_delivered = 0;
+
+static int
+mock_relay_crypto_pipeline_is_enabled(void)
+{
+  return 1;
+}
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  tt_ptr_op(fn, OP_EQ, relay_crypto_job_threadfn);
+  tt_ptr_op(reply_fn, OP_EQ, relay_crypto_job_replyfn);
+  smartlist_add(pipeline_jobs, arg);
+ done:
+  /* Never dereferenced, since we never cancel these. */
+  return (workqueue_entry_t *)arg;
+}
+
+static int
+mock_circuit_receive_decrypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                          cell_direction_t cell_direction,
+                                          crypt_path_t *layer_hint,
+                                          char recognized)
+{
+  (void)cell_direction;
+  (void)layer_hint;
+  pipelined_cell_t *pc = tor_malloc_zero(sizeof(pipelined_cell_t));
+  memcpy(&pc->cell, cell, sizeof(cell_t));
+  pc->recognized = recognized;
+  smartlist_add(pipeline_delivered, pc);
+  if (smartlist_len(pipeline_delivered) == mark_circ_after_n_delivered)
+    circ->marked_for_close = __LINE__;
+  return 0;
+}
+
+/* Run the first job that was handed to the (mock) worker threads, and
+ * deliver its reply. */
+static void
+run_pipeline_job(void)
+{
+  relay_crypto_job_t *job = smartlist_get(pipeline_jobs, 0);
+  smartlist_del_keeporder(pipeline_jobs, 0);
+  tt_int_op(relay_crypto_job_threadfn(NULL, job), OP_EQ, WQ_RPL_REPLY);
+  relay_crypto_job_replyfn(job);
+ done:
+  ;
+}
+
+/* Send cells outbound through the threaded pipeline at the first hop, and
+ * make sure that they come out in order, crypted just as they would have
+ * been in the main thread. */
+static void
+test_relaycrypt_pipeline(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  or_circuit_t *twin = NULL;
+  cell_t *orig = NULL, *encrypted = NULL;
+  relay_header_t rh;
+  const int n_cells = 100;
+  uint32_t now_ts;
+  int i;
+
+  tt_assert(cs);
+  pipeline_jobs = smartlist_new();
+  pipeline_delivered = smartlist_new();
+  MOCK(relay_crypto_pipeline_is_enabled,
+       mock_relay_crypto_pipeline_is_enabled);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(circuit_receive_decrypted_relay_cell,
+       mock_circuit_receive_decrypted_relay_cell);
+
+  /* This circuit does its crypto in the main thread, for comparison. */
+  twin = or_circuit_new(0, NULL);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&twin->crypto, KEY_MATERIAL[0],
+                              sizeof(KEY_MATERIAL[0]), 0, 0));
+
+  orig = tor_calloc(n_cells, sizeof(cell_t));
+  encrypted = tor_calloc(n_cells, sizeof(cell_t));
+  for (i = 0; i < n_cells; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(cell_t));
+    orig[i].command = CELL_RELAY;
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+    memcpy(&encrypted[i], &orig[i], sizeof(cell_t));
+    /* Every third cell is for the first hop. */
+    relay_encrypt_cell_outbound(&encrypted[i], cs->origin_circ,
+                                (i % 3) ? cs->origin_circ->cpath->prev
+                                        : cs->origin_circ->cpath);
+  }
+
+  /* Nothing goes to the workers until we flush. */
+  for (i = 0; i < 70; ++i) {
+    cell_t c;
+    memcpy(&c, &encrypted[i], sizeof(c));
+    tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&c,
+                                                   TO_CIRCUIT(cs->or_circ[0]),
+                                                   CELL_DIRECTION_OUT));
+  }
+  tt_int_op(smartlist_len(pipeline_jobs), OP_EQ, 0);
+  tt_u64_op(relay_crypto_pipeline_get_total_allocation(), OP_EQ,
+            70 * sizeof(pipelined_cell_t));
+  /* The OOM handler counts these cells against their circuit. */
+  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(cs->or_circ[0])), OP_EQ, 70);
+  now_ts = monotime_coarse_get_stamp() + 1000;
+  tt_uint_op(circuit_max_queued_cell_age(TO_CIRCUIT(cs->or_circ[0]), now_ts),
+             OP_GE, 1000);
+
+  /* Only one job per circuit and direction is in flight at once. */
+  relay_crypto_pipeline_flush();
+  tt_int_op(smartlist_len(pipeline_jobs), OP_EQ, 1);
+  for (i = 70; i < n_cells; ++i) {
+    cell_t c;
+    memcpy(&c, &encrypted[i], sizeof(c));
+    tt_int_op(0, OP_EQ, circuit_receive_relay_cell(&c,
+                                                   TO_CIRCUIT(cs->or_circ[0]),
+                                                   CELL_DIRECTION_OUT));
+  }
+  relay_crypto_pipeline_flush();
+  tt_int_op(smartlist_len(pipeline_jobs), OP_EQ, 1);
+  tt_int_op(((relay_crypto_job_t *)smartlist_get(pipeline_jobs, 0))->n_cells,
+            OP_EQ, RELAY_CRYPTO_JOB_MAX_CELLS);
+  /* That includes the cells that a worker thread has. */
+  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(cs->or_circ[0])), OP_EQ,
+            n_cells);
+
+  /* The reply launches the next job. */
+  run_pipeline_job();
+  tt_int_op(smartlist_len(pipeline_delivered), OP_EQ,
+            RELAY_CRYPTO_JOB_MAX_CELLS);
+  tt_int_op(smartlist_len(pipeline_jobs), OP_EQ, 1);
+  run_pipeline_job();
+  tt_int_op(smartlist_len(pipeline_jobs), OP_EQ, 0);
+  tt_int_op(smartlist_len(pipeline_delivered), OP_EQ, n_cells);
+  tt_u64_op(relay_crypto_pipeline_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(cs->or_circ[0])), OP_EQ, 0);
+  tt_uint_op(circuit_max_queued_cell_age(TO_CIRCUIT(cs->or_circ[0]), now_ts),
+             OP_EQ, 0);
+
+  for (i = 0; i < n_cells; ++i) {
+    const pipelined_cell_t *pc = smartlist_get(pipeline_delivered, i);
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(twin), &encrypted[i],
+                                           CELL_DIRECTION_OUT,
+                                           &layer_hint, &recognized));
+    tt_int_op(pc->recognized, OP_EQ, recognized);
+    tt_int_op(!!pc->recognized, OP_EQ, (i % 3) == 0);
+    tt_mem_op(pc->cell.payload, OP_EQ, encrypted[i].payload,
+              CELL_PAYLOAD_SIZE);
+    if (recognized)
+      tt_mem_op(pc->cell.payload, OP_EQ, orig[i].payload, CELL_PAYLOAD_SIZE);
+  }
+
+  /* Once the pipeline is empty, we only use it if it's enabled. */
+  UNMOCK(relay_crypto_pipeline_is_enabled);
+  tt_assert(!relay_crypto_pipeline_should_use(TO_CIRCUIT(cs->or_circ[0]),
+                                              CELL_DIRECTION_OUT));
+
+ done:
+  UNMOCK(relay_crypto_pipeline_is_enabled);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(circuit_receive_decrypted_relay_cell);
+  circuit_free_(TO_CIRCUIT(twin));
+  tor_free(orig);
+  tor_free(encrypted);
+  SMARTLIST_FOREACH(pipeline_delivered, pipelined_cell_t *, pc, tor_free(pc));
+  smartlist_free(pipeline_delivered);
+  smartlist_free(pipeline_jobs);
+}
+
+/* Receive a run of cells at once, and make sure that they come out just as
+ * if we had received them one by one. */
+static void
+test_relaycrypt_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  or_circuit_t *twin = NULL;
+  cell_t *orig = NULL, *encrypted = NULL, *batch = NULL;
+  relay_header_t rh;
+  const int n_cells = 75;
+  int i, n_received = -1;
+
+  tt_assert(cs);
+  pipeline_delivered = smartlist_new();
+  MOCK(circuit_receive_decrypted_relay_cell,
+       mock_circuit_receive_decrypted_relay_cell);
+
+  twin = or_circuit_new(0, NULL);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&twin->crypto, KEY_MATERIAL[0],
+                              sizeof(KEY_MATERIAL[0]), 0, 0));
+
+  orig = tor_calloc(n_cells, sizeof(cell_t));
+  encrypted = tor_calloc(n_cells, sizeof(cell_t));
+  batch = tor_calloc(n_cells, sizeof(cell_t));
+  for (i = 0; i < n_cells; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(cell_t));
+    orig[i].command = CELL_RELAY;
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+    memcpy(&encrypted[i], &orig[i], sizeof(cell_t));
+    /* Every other cell is for the first hop. */
+    relay_encrypt_cell_outbound(&encrypted[i], cs->origin_circ,
+                                (i % 2) ? cs->origin_circ->cpath->prev
+                                        : cs->origin_circ->cpath);
+  }
+  memcpy(batch, encrypted, n_cells * sizeof(cell_t));
+
+  tt_int_op(0, OP_EQ, circuit_receive_relay_cells(batch, n_cells,
+                                                  TO_CIRCUIT(cs->or_circ[0]),
+                                                  CELL_DIRECTION_OUT,
+                                                  &n_received));
+  tt_int_op(n_received, OP_EQ, n_cells);
+  tt_int_op(smartlist_len(pipeline_delivered), OP_EQ, n_cells);
+
+  for (i = 0; i < n_cells; ++i) {
+    const pipelined_cell_t *pc = smartlist_get(pipeline_delivered, i);
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(twin), &encrypted[i],
+                                           CELL_DIRECTION_OUT,
+                                           &layer_hint, &recognized));
+    tt_int_op(pc->recognized, OP_EQ, recognized);
+    tt_int_op(!!pc->recognized, OP_EQ, (i % 2) == 0);
+    tt_mem_op(pc->cell.payload, OP_EQ, encrypted[i].payload,
+              CELL_PAYLOAD_SIZE);
+    if (recognized)
+      tt_mem_op(pc->cell.payload, OP_EQ, orig[i].payload, CELL_PAYLOAD_SIZE);
+  }
+
+  /* We stop as soon as the circuit gets marked. */
+  SMARTLIST_FOREACH(pipeline_delivered, pipelined_cell_t *, pc, tor_free(pc));
+  smartlist_clear(pipeline_delivered);
+  mark_circ_after_n_delivered = 3;
+  tt_int_op(0, OP_EQ, circuit_receive_relay_cells(batch, n_cells,
+                                                  TO_CIRCUIT(cs->or_circ[1]),
+                                                  CELL_DIRECTION_IN,
+                                                  &n_received));
+  tt_int_op(n_received, OP_EQ, 3);
+  tt_int_op(smartlist_len(pipeline_delivered), OP_EQ, 3);
+
+ done:
+  mark_circ_after_n_delivered = 0;
+  if (cs)
+    TO_CIRCUIT(cs->or_circ[1])->marked_for_close = 0;
+  UNMOCK(circuit_receive_decrypted_relay_cell);
+  circuit_free_(TO_CIRCUIT(twin));
+  tor_free(orig);
+  tor_free(encrypted);
+  tor_free(batch);
+  SMARTLIST_FOREACH(pipeline_delivered, pipelined_cell_t *, pc, tor_free(pc));
+  smartlist_free(pipeline_delivered);
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(pipeline),
+  TEST(batch),
   END_OF_TESTCASES
 };
 
@@ -277,7 +277,7 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digest256map_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(replaycache_size(r),OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -371,6 +371,104 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_generations(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result, i;
+
+  (void)arg;
+  /* A generation every 300 seconds; three of them cover the horizon. */
+  r = replaycache_new(600, 300);
+  tt_ptr_op(r, OP_NE, NULL);
+  tt_int_op(r->n_generations,OP_EQ, 3);
+
+  /* Entries last exactly as long as the horizon, even though their
+   * generation lives longer. */
+  result =
+    replaycache_add_and_test_internal(1000, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(1000, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(1600, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 1);
+  result =
+    replaycache_add_and_test_internal(1601, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result,OP_EQ, 0);
+
+  /* A hit moves the entry forward, so it outlives its first generation. */
+  result =
+    replaycache_add_and_test_internal(2150, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 1);
+
+  /* Lots of entries go away once their generations are over. */
+  for (i = 0; i < 1000; ++i) {
+    result = replaycache_add_and_test_internal(2200, r, &i, sizeof(i), NULL);
+    tt_int_op(result,OP_EQ, 0);
+  }
+  for (i = 0; i < 1000; ++i) {
+    result = replaycache_add_and_test_internal(2300, r, &i, sizeof(i), NULL);
+    tt_int_op(result,OP_EQ, 1);
+  }
+  tt_int_op(replaycache_size(r),OP_GE, 1000);
+  replaycache_scrub_if_needed_internal(3200, r);
+  tt_int_op(replaycache_size(r),OP_EQ, 0);
+
+ done:
+  if (r) replaycache_free(r);
+  return;
+}
+
+static void
+test_replaycache_bounded(void *arg)
+{
+  replaycache_t *r = NULL;
+  const int cap = REPLAYCACHE_MAX_GENERATION_ENTRIES;
+  int result, i;
+
+  (void)arg;
+  /* A flood of distinct items can't grow a cache that never expires
+   * anything past its generations' worth of entries... */
+  r = replaycache_new(0, 0);
+  tt_ptr_op(r, OP_NE, NULL);
+  for (i = 0; i < 3 * cap; ++i) {
+    result = replaycache_add_and_test_internal(1000, r, &i, sizeof(i), NULL);
+    tt_int_op(result,OP_EQ, 0);
+  }
+  tt_int_op(replaycache_size(r),OP_LE,
+            REPLAYCACHE_NOEXPIRE_GENERATIONS * cap);
+  /* ...and still remembers the most recent full generation of them. */
+  for (i = 2 * cap; i < 3 * cap; i += 1000) {
+    result = replaycache_add_and_test_internal(1001, r, &i, sizeof(i), NULL);
+    tt_int_op(result,OP_EQ, 1);
+  }
+  replaycache_free(r);
+
+  /* The same goes for a cache whose flood happens within one span. */
+  r = replaycache_new(600, 300);
+  tt_ptr_op(r, OP_NE, NULL);
+  for (i = 0; i < 4 * cap; ++i) {
+    result = replaycache_add_and_test_internal(1000, r, &i, sizeof(i), NULL);
+    tt_int_op(result,OP_EQ, 0);
+  }
+  tt_int_op(replaycache_size(r),OP_LE, r->n_generations * cap);
+  for (i = 3 * cap; i < 4 * cap; i += 1000) {
+    result = replaycache_add_and_test_internal(1001, r, &i, sizeof(i), NULL);
+    tt_int_op(result,OP_EQ, 1);
+  }
+
+ done:
+  if (r) replaycache_free(r);
+  return;
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +484,8 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(generations),
+  REPLAYCACHE_LEGACY(bounded),
   END_OF_TESTCASES
 };
 
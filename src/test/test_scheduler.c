@@ -4,6 +4,9 @@
 #include "orconfig.h"
 
 #include <math.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 #define SCHEDULER_KIST_PRIVATE
 #define TOR_CHANNEL_INTERNAL_
@@ -15,6 +18,7 @@
 #include "core/or/channeltls.h"
 #include "core/mainloop/connection.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/net/socketpair.h"
 #define SCHEDULER_PRIVATE_
 #include "core/or/scheduler.h"
 
@@ -832,6 +836,175 @@ test_scheduler_loop_kist(void *arg)
   return;
 }
 
+static tor_mutex_t *update_socket_info_sharded_lock = NULL;
+static int update_socket_info_sharded_calls = 0;
+static int update_socket_info_sharded_off_main = 0;
+
+static void
+update_socket_info_impl_sharded_mock(socket_table_ent_t *ent)
+{
+  update_socket_info_impl_mock(ent);
+  tor_mutex_acquire(update_socket_info_sharded_lock);
+  ++update_socket_info_sharded_calls;
+  if (!in_main_thread())
+    ++update_socket_info_sharded_off_main;
+  tor_mutex_release(update_socket_info_sharded_lock);
+}
+
+static void
+test_scheduler_loop_kist_shards(void *arg)
+{
+  (void) arg;
+  channel_t *chans[8];
+  const int n_chans = (int) ARRAY_LENGTH(chans);
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  memset(chans, 0, sizeof(chans));
+  update_socket_info_sharded_lock = tor_mutex_new();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_sharded_mock);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 11;
+  mocked_options.KISTSchedShards = 4;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  tt_int_op(kist_scheduler_n_shards(), OP_EQ, 4);
+
+  for (int i = 0; i < n_chans; ++i) {
+    chans[i] = new_fake_channel();
+    tt_assert(chans[i]);
+    chans[i]->magic = TLS_CHAN_MAGIC;
+    chans[i]->state = CHANNEL_STATE_OPENING;
+    channel_register(chans[i]);
+    tt_assert(chans[i]->registered);
+    channel_change_state_open(chans[i]);
+    scheduler_channel_has_waiting_cells(chans[i]);
+    scheduler_channel_wants_writes(chans[i]);
+    channel_flush_some_cells_mock_set(chans[i], 5);
+  }
+  tt_int_op(smartlist_len(get_channels_pending()), OP_EQ, n_chans);
+
+  /* Every channel gets its socket information refreshed exactly once, and
+   * the channels that don't hash to shard 0 are handled off the main
+   * thread. Channels are given consecutive global identifiers, so all four
+   * shards have work. */
+  the_scheduler->run();
+  tt_int_op(update_socket_info_sharded_calls, OP_EQ, n_chans);
+  tt_int_op(update_socket_info_sharded_off_main, OP_EQ, n_chans * 3 / 4);
+  tt_int_op(smartlist_len(get_channels_pending()), OP_EQ, 0);
+  for (int i = 0; i < n_chans; ++i) {
+    tt_int_op(chans[i]->scheduler_state, OP_EQ,
+              SCHED_CHAN_WAITING_FOR_CELLS);
+  }
+
+  /* Going down to a single shard moves all the work to the main thread. */
+  mocked_options.KISTSchedShards = 1;
+  the_scheduler->on_new_options();
+  tt_int_op(kist_scheduler_n_shards(), OP_EQ, 1);
+  update_socket_info_sharded_calls = update_socket_info_sharded_off_main = 0;
+  for (int i = 0; i < n_chans; ++i) {
+    scheduler_channel_has_waiting_cells(chans[i]);
+    channel_flush_some_cells_mock_set(chans[i], 5);
+  }
+  the_scheduler->run();
+  tt_int_op(update_socket_info_sharded_calls, OP_EQ, n_chans);
+  tt_int_op(update_socket_info_sharded_off_main, OP_EQ, 0);
+
+  /* Going back up reuses the threads we already have. */
+  mocked_options.KISTSchedShards = 2;
+  the_scheduler->on_new_options();
+  tt_int_op(kist_scheduler_n_shards(), OP_EQ, 2);
+  update_socket_info_sharded_calls = update_socket_info_sharded_off_main = 0;
+  for (int i = 0; i < n_chans; ++i) {
+    scheduler_channel_has_waiting_cells(chans[i]);
+    channel_flush_some_cells_mock_set(chans[i], 5);
+  }
+  the_scheduler->run();
+  tt_int_op(update_socket_info_sharded_calls, OP_EQ, n_chans);
+  tt_int_op(update_socket_info_sharded_off_main, OP_EQ, n_chans / 2);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  for (int i = 0; i < n_chans; ++i) {
+    if (!chans[i])
+      continue;
+    chans[i]->state = CHANNEL_STATE_CLOSED;
+    chans[i]->registered = 0;
+    channel_free(chans[i]);
+  }
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+  tor_mutex_free(update_socket_info_sharded_lock);
+}
+
+static void
+test_scheduler_kist_sock_diag(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  socket_table_ent_t ent, other, *ents[2];
+  struct stat st;
+  int r;
+  (void) arg;
+
+#ifndef HAVE_KIST_SOCK_DIAG
+  tt_skip();
+#endif
+
+  memset(&ent, 0, sizeof(ent));
+  memset(&other, 0, sizeof(other));
+
+  /* The ersatz socketpair is a connected loopback TCP socket pair. */
+  if (tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    tt_skip();
+  }
+  tt_int_op(fstat(fds[0], &st), OP_EQ, 0);
+  ent.inode = (uint64_t) st.st_ino;
+  ent.cwnd = ent.mss = UINT32_MAX;
+  /* An entry we don't know the inode of is never filled, and the stale flag
+   * gets cleared. */
+  other.have_diag_info = 1;
+  ents[0] = &other;
+  ents[1] = &ent;
+
+  r = kist_sock_diag_update(ents, 2);
+  if (r < 0) {
+    /* No netlink in this environment. */
+    tt_skip();
+  }
+  tt_int_op(r, OP_EQ, 1);
+  tt_uint_op(ent.have_diag_info, OP_EQ, 1);
+  tt_uint_op(other.have_diag_info, OP_EQ, 0);
+  tt_uint_op(ent.cwnd, OP_GT, 0);
+  tt_uint_op(ent.cwnd, OP_LT, UINT32_MAX);
+  tt_uint_op(ent.mss, OP_GT, 0);
+  tt_uint_op(ent.mss, OP_LT, UINT32_MAX);
+  tt_uint_op(ent.unacked, OP_EQ, 0);
+  tt_uint_op(ent.notsent, OP_EQ, 0);
+
+  /* Nothing to look up is fine too. */
+  tt_int_op(kist_sock_diag_update(NULL, 0), OP_EQ, 0);
+
+ done:
+  kist_sock_diag_free_all();
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket_simple(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket_simple(fds[1]);
+}
+
 static void
 test_scheduler_channel_states(void *arg)
 {
@@ -1272,6 +1445,9 @@ struct testcase_t scheduler_tests[] = {
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
   { "loop_vanilla", test_scheduler_loop_vanilla, TT_FORK, NULL, NULL },
   { "loop_kist", test_scheduler_loop_kist, TT_FORK, NULL, NULL },
+  { "loop_kist_shards", test_scheduler_loop_kist_shards, TT_FORK,
+    NULL, NULL },
+  { "kist_sock_diag", test_scheduler_kist_sock_diag, TT_FORK, NULL, NULL },
   { "ns_changed", test_scheduler_ns_changed, TT_FORK, NULL, NULL},
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
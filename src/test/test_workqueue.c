@@ -330,7 +330,9 @@ help(void)
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
-     "                Disable one of the alert_socket backends.");
+     "                Disable one of the alert_socket backends.\n"
+     "  --locked-replies\n"
+     "                Protect the reply queue with a mutex.");
 }
 
 int
@@ -367,6 +369,8 @@ main(int argc, char **argv)
       as_flags |= ASOCKS_NOPIPE;
     } else if (!strcmp(argv[i], "--no-socketpair")) {
       as_flags |= ASOCKS_NOSOCKETPAIR;
+    } else if (!strcmp(argv[i], "--locked-replies")) {
+      as_flags |= REPLYQUEUE_LOCKED;
     } else if (!strcmp(argv[i], "-h")) {
       help();
       return 0;
@@ -400,7 +404,7 @@ main(int argc, char **argv)
   }
 
   rq = replyqueue_new(as_flags);
-  if (as_flags && rq == NULL)
+  if ((as_flags & ~REPLYQUEUE_LOCKED) && rq == NULL)
     return 77; // 77 means "skipped".
 
   tor_assert(rq);
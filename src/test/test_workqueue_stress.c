@@ -0,0 +1,225 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_workqueue_stress.c
+ * \brief Measure how many small jobs per second a threadpool can handle,
+ * with the lock-free reply queue and with the locked one.
+ *
+ * The jobs do almost nothing, so the numbers mostly reflect the cost of
+ * passing work to the threads and passing replies back.
+ **/
+
+#include "orconfig.h"
+#include "lib/cc/compat_compiler.h"
+#include "lib/crypt_ops/crypto_init.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/socket.h"
+#include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int opt_max_threads = 8;
+static int opt_n_jobs = 200000;
+static int opt_n_inflight = 4096;
+static int opt_work = 100;
+static int opt_locked_only = 0;
+static int opt_lockfree_only = 0;
+
+/** A job for a worker thread. */
+typedef struct stress_job_t {
+  uint64_t value;
+} stress_job_t;
+
+static int n_sent = 0;
+static int n_received = 0;
+static threadpool_t *cur_pool = NULL;
+
+static void *
+new_state(void *arg)
+{
+  (void)arg;
+  /* We don't need any state, but threadpool_new() wants non-NULL. */
+  return tor_malloc_zero(1);
+}
+
+static void
+free_state(void *arg)
+{
+  tor_free(arg);
+}
+
+/** Work function: spin for a little while, to look a bit like a real
+ * job. */
+static workqueue_reply_t
+stress_job_fn(void *state, void *arg)
+{
+  stress_job_t *job = arg;
+  uint64_t v = job->value;
+  int i;
+  (void)state;
+  for (i = 0; i < opt_work; ++i)
+    v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+  job->value = v;
+  return WQ_RPL_REPLY;
+}
+
+static void stress_job_reply(void *arg);
+
+/** Queue one more job on the current pool. */
+static void
+send_job(void)
+{
+  stress_job_t *job = tor_malloc_zero(sizeof(stress_job_t));
+  job->value = n_sent++;
+  tor_assert(threadpool_queue_work(cur_pool, stress_job_fn,
+                                   stress_job_reply, job));
+}
+
+/** Reply function: keep the pool busy until we have sent every job. */
+static void
+stress_job_reply(void *arg)
+{
+  tor_free(arg);
+  ++n_received;
+  if (n_sent < opt_n_jobs)
+    send_job();
+}
+
+/** Called after we handle a batch of replies: stop once we have them
+ * all. */
+static void
+replies_done_cb(threadpool_t *tp)
+{
+  (void)tp;
+  if (n_received == opt_n_jobs)
+    tor_libevent_exit_loop_after_callback(tor_libevent_get_base());
+}
+
+/** Run opt_n_jobs jobs on a new pool with <b>n_threads</b> threads, using
+ * the replyqueue flags <b>flags</b>.  Return the number of jobs per second,
+ * or -1 on failure. */
+static double
+run_stress(int n_threads, uint32_t flags)
+{
+  replyqueue_t *rq;
+  monotime_t start, end;
+  int i;
+
+  /* We have no way to free a threadpool, so each run leaves its threads
+   * waiting for work that never comes.  They don't get in the way. */
+  rq = replyqueue_new(flags);
+  if (!rq)
+    return -1;
+  cur_pool = threadpool_new(n_threads, rq, new_state, free_state, NULL);
+  if (!cur_pool)
+    return -1;
+  if (threadpool_register_reply_event(cur_pool, replies_done_cb) < 0)
+    return -1;
+
+  n_sent = n_received = 0;
+  monotime_get(&start);
+  for (i = 0; i < opt_n_inflight && n_sent < opt_n_jobs; ++i)
+    send_job();
+  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+  monotime_get(&end);
+
+  if (n_received != opt_n_jobs)
+    return -1;
+  return opt_n_jobs / (monotime_diff_usec(&start, &end) / 1e6);
+}
+
+static void
+help(void)
+{
+  puts(
+     "Options:\n"
+     "  -h            Display this information\n"
+     "  -T <threads>  Try from 1 up to this many threads\n"
+     "  -N <jobs>     Run this many jobs for each number of threads\n"
+     "  -I <inflight> Keep this many jobs queued at once\n"
+     "  -W <work>     Make each job do this much work\n"
+     "  --locked      Only try the locked reply queue\n"
+     "  --lock-free   Only try the lock-free reply queue");
+}
+
+int
+main(int argc, char **argv)
+{
+  tor_libevent_cfg evcfg;
+  int i, n_threads;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-T") && i+1<argc) {
+      opt_max_threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-N") && i+1<argc) {
+      opt_n_jobs = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-I") && i+1<argc) {
+      opt_n_inflight = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-W") && i+1<argc) {
+      opt_work = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--locked")) {
+      opt_locked_only = 1;
+    } else if (!strcmp(argv[i], "--lock-free")) {
+      opt_lockfree_only = 1;
+    } else if (!strcmp(argv[i], "-h")) {
+      help();
+      return 0;
+    } else {
+      help();
+      return 1;
+    }
+  }
+  if (opt_max_threads < 1 || opt_n_jobs < 1 || opt_n_inflight < 1 ||
+      opt_work < 0 || (opt_locked_only && opt_lockfree_only)) {
+    help();
+    return 1;
+  }
+
+  init_logging(1);
+  network_init();
+  if (crypto_global_init(1, NULL, NULL) < 0) {
+    printf("Couldn't initialize crypto subsystem; exiting.\n");
+    return 1;
+  }
+  if (crypto_seed_rng() < 0) {
+    printf("Couldn't seed RNG; exiting.\n");
+    return 1;
+  }
+  memset(&evcfg, 0, sizeof(evcfg));
+  tor_libevent_initialize(&evcfg);
+  monotime_init();
+
+  printf("%d jobs, %d in flight, work %d\n",
+         opt_n_jobs, opt_n_inflight, opt_work);
+  for (n_threads = 1; n_threads <= opt_max_threads; ++n_threads) {
+    printf("%3d threads:", n_threads);
+    if (!opt_locked_only) {
+      double rate = run_stress(n_threads, 0);
+      if (rate < 0) {
+        puts(" FAIL");
+        return 1;
+      }
+      printf("  lock-free %10.0f jobs/sec", rate);
+    }
+    if (!opt_lockfree_only) {
+      double rate = run_stress(n_threads, REPLYQUEUE_LOCKED);
+      if (rate < 0) {
+        puts(" FAIL");
+        return 1;
+      }
+      printf("  locked %10.0f jobs/sec", rate);
+    }
+    puts("");
+    fflush(stdout);
+  }
+  return 0;
+}
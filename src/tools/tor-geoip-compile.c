@@ -0,0 +1,68 @@
+/* Copyright (c) 2019, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tor-geoip-compile.c
+ * \brief Turn a GeoIP text file into a binary GeoIP file, which Tor can map
+ * into memory instead of parsing.
+ */
+
+#include "orconfig.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/crypt_ops/crypto_init.h"
+#include "lib/geoip/geoip.h"
+#include "lib/log/log.h"
+
+static void
+show_help(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [-6] <geoip file> <output file>\n"
+          "Compile a GeoIP (or, with -6, GeoIPv6) text file into the "
+          "binary format\nthat GeoIPFile and GeoIPv6File also accept.\n",
+          progname);
+}
+
+/** Entry point to tor-geoip-compile */
+int
+main(int argc, char **argv)
+{
+  sa_family_t family = AF_INET;
+  log_severity_list_t s;
+  int i = 1;
+  int r = 1;
+
+  if (argc > 1 && !strcmp(argv[1], "-6")) {
+    family = AF_INET6;
+    ++i;
+  }
+  if (argc - i != 2) {
+    show_help(argv[0]);
+    return 1;
+  }
+
+  init_logging(1);
+  memset(&s, 0, sizeof(s));
+  set_log_severity_config(LOG_WARN, LOG_ERR, &s);
+  add_stream_log(&s, "<stderr>", fileno(stderr));
+
+  if (crypto_global_init(0, NULL, NULL)) {
+    fprintf(stderr, "Couldn't initialize crypto library.\n");
+    return 1;
+  }
+
+  if (geoip_load_file(family, argv[i], LOG_WARN) < 0)
+    goto done;
+  if (geoip_db_write_file(family, argv[i+1]) < 0) {
+    fprintf(stderr, "Couldn't write %s.\n", argv[i+1]);
+    goto done;
+  }
+  r = 0;
+
+ done:
+  geoip_free_all();
+  crypto_global_cleanup();
+  return r;
+}